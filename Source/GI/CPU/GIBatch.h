@@ -0,0 +1,415 @@
+#pragma once
+
+// Batch of 8 versions of the GICommon.h math, for tools that run the surfel lookups and the estimator over many
+// surfels at once. Every lane computes what the scalar function computes; the sums over lanes are reduced in lane
+// order, so the results stay within float rounding of the scalar ones and do not depend on the instruction set.
+// AVX2 when the compiler targets it, two SSE2 or NEON halves otherwise, plain arrays as the fallback.
+// Renderer.vcxproj builds with /arch:AVX2 unless built with /p:GIBatchSSE2=true for CPUs without it.
+// Define GI_BATCH_SCALAR to force the fallback.
+
+#include "GICommon.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(GI_BATCH_SCALAR)
+#elif defined(__AVX2__)
+#define GI_BATCH_AVX2
+#include <immintrin.h>
+#elif defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define GI_BATCH_SSE
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define GI_BATCH_NEON
+#include <arm_neon.h>
+#endif
+
+namespace GICPU
+{
+	static const uint BATCH_SIZE = 8;
+
+	inline const char* GetBatchInstructionSet()
+	{
+#if defined(GI_BATCH_AVX2)
+		return "AVX2";
+#elif defined(GI_BATCH_SSE)
+		return "SSE2";
+#elif defined(GI_BATCH_NEON)
+		return "NEON";
+#else
+		return "Scalar";
+#endif
+	}
+
+	// Eight floats, comparisons return all bits set lanes for Select
+	struct float8
+	{
+#if defined(GI_BATCH_AVX2)
+		__m256 V;
+#elif defined(GI_BATCH_SSE)
+		__m128 Lo, Hi;
+#elif defined(GI_BATCH_NEON)
+		float32x4_t Lo, Hi;
+#else
+		float V[BATCH_SIZE];
+#endif
+	};
+
+#if defined(GI_BATCH_AVX2)
+	inline float8 Load8(const float* values) { return { _mm256_loadu_ps(values) }; }
+	inline void Store8(float* values, const float8& a) { _mm256_storeu_ps(values, a.V); }
+	inline float8 Set8(float value) { return { _mm256_set1_ps(value) }; }
+	inline float8 operator+(const float8& a, const float8& b) { return { _mm256_add_ps(a.V, b.V) }; }
+	inline float8 operator-(const float8& a, const float8& b) { return { _mm256_sub_ps(a.V, b.V) }; }
+	inline float8 operator*(const float8& a, const float8& b) { return { _mm256_mul_ps(a.V, b.V) }; }
+	inline float8 operator/(const float8& a, const float8& b) { return { _mm256_div_ps(a.V, b.V) }; }
+	inline float8 Min8(const float8& a, const float8& b) { return { _mm256_min_ps(a.V, b.V) }; }
+	inline float8 Max8(const float8& a, const float8& b) { return { _mm256_max_ps(a.V, b.V) }; }
+	inline float8 Sqrt8(const float8& a) { return { _mm256_sqrt_ps(a.V) }; }
+	inline float8 Greater8(const float8& a, const float8& b) { return { _mm256_cmp_ps(a.V, b.V, _CMP_GT_OQ) }; }
+	inline float8 Select8(const float8& mask, const float8& a, const float8& b) { return { _mm256_blendv_ps(b.V, a.V, mask.V) }; }
+#elif defined(GI_BATCH_SSE)
+	inline float8 Load8(const float* values) { return { _mm_loadu_ps(values), _mm_loadu_ps(values + 4) }; }
+	inline void Store8(float* values, const float8& a) { _mm_storeu_ps(values, a.Lo); _mm_storeu_ps(values + 4, a.Hi); }
+	inline float8 Set8(float value) { return { _mm_set1_ps(value), _mm_set1_ps(value) }; }
+	inline float8 operator+(const float8& a, const float8& b) { return { _mm_add_ps(a.Lo, b.Lo), _mm_add_ps(a.Hi, b.Hi) }; }
+	inline float8 operator-(const float8& a, const float8& b) { return { _mm_sub_ps(a.Lo, b.Lo), _mm_sub_ps(a.Hi, b.Hi) }; }
+	inline float8 operator*(const float8& a, const float8& b) { return { _mm_mul_ps(a.Lo, b.Lo), _mm_mul_ps(a.Hi, b.Hi) }; }
+	inline float8 operator/(const float8& a, const float8& b) { return { _mm_div_ps(a.Lo, b.Lo), _mm_div_ps(a.Hi, b.Hi) }; }
+	inline float8 Min8(const float8& a, const float8& b) { return { _mm_min_ps(a.Lo, b.Lo), _mm_min_ps(a.Hi, b.Hi) }; }
+	inline float8 Max8(const float8& a, const float8& b) { return { _mm_max_ps(a.Lo, b.Lo), _mm_max_ps(a.Hi, b.Hi) }; }
+	inline float8 Sqrt8(const float8& a) { return { _mm_sqrt_ps(a.Lo), _mm_sqrt_ps(a.Hi) }; }
+	inline float8 Greater8(const float8& a, const float8& b) { return { _mm_cmpgt_ps(a.Lo, b.Lo), _mm_cmpgt_ps(a.Hi, b.Hi) }; }
+	inline float8 Select8(const float8& mask, const float8& a, const float8& b)
+	{
+		return { _mm_or_ps(_mm_and_ps(mask.Lo, a.Lo), _mm_andnot_ps(mask.Lo, b.Lo)), _mm_or_ps(_mm_and_ps(mask.Hi, a.Hi), _mm_andnot_ps(mask.Hi, b.Hi)) };
+	}
+#elif defined(GI_BATCH_NEON)
+	inline float8 Load8(const float* values) { return { vld1q_f32(values), vld1q_f32(values + 4) }; }
+	inline void Store8(float* values, const float8& a) { vst1q_f32(values, a.Lo); vst1q_f32(values + 4, a.Hi); }
+	inline float8 Set8(float value) { return { vdupq_n_f32(value), vdupq_n_f32(value) }; }
+	inline float8 operator+(const float8& a, const float8& b) { return { vaddq_f32(a.Lo, b.Lo), vaddq_f32(a.Hi, b.Hi) }; }
+	inline float8 operator-(const float8& a, const float8& b) { return { vsubq_f32(a.Lo, b.Lo), vsubq_f32(a.Hi, b.Hi) }; }
+	inline float8 operator*(const float8& a, const float8& b) { return { vmulq_f32(a.Lo, b.Lo), vmulq_f32(a.Hi, b.Hi) }; }
+	inline float8 operator/(const float8& a, const float8& b) { return { vdivq_f32(a.Lo, b.Lo), vdivq_f32(a.Hi, b.Hi) }; }
+	inline float8 Min8(const float8& a, const float8& b) { return { vminq_f32(a.Lo, b.Lo), vminq_f32(a.Hi, b.Hi) }; }
+	inline float8 Max8(const float8& a, const float8& b) { return { vmaxq_f32(a.Lo, b.Lo), vmaxq_f32(a.Hi, b.Hi) }; }
+	inline float8 Sqrt8(const float8& a) { return { vsqrtq_f32(a.Lo), vsqrtq_f32(a.Hi) }; }
+	inline float8 Greater8(const float8& a, const float8& b)
+	{
+		return { vreinterpretq_f32_u32(vcgtq_f32(a.Lo, b.Lo)), vreinterpretq_f32_u32(vcgtq_f32(a.Hi, b.Hi)) };
+	}
+	inline float8 Select8(const float8& mask, const float8& a, const float8& b)
+	{
+		return { vbslq_f32(vreinterpretq_u32_f32(mask.Lo), a.Lo, b.Lo), vbslq_f32(vreinterpretq_u32_f32(mask.Hi), a.Hi, b.Hi) };
+	}
+#else
+	template<typename Func>
+	inline float8 Map8(Func&& func)
+	{
+		float8 result;
+		for (uint lane = 0; lane < BATCH_SIZE; ++lane)
+		{
+			result.V[lane] = func(lane);
+		}
+		return result;
+	}
+
+	inline float8 Load8(const float* values) { return Map8([&](uint lane) { return values[lane]; }); }
+	inline void Store8(float* values, const float8& a) { std::copy(a.V, a.V + BATCH_SIZE, values); }
+	inline float8 Set8(float value) { return Map8([&](uint) { return value; }); }
+	inline float8 operator+(const float8& a, const float8& b) { return Map8([&](uint lane) { return a.V[lane] + b.V[lane]; }); }
+	inline float8 operator-(const float8& a, const float8& b) { return Map8([&](uint lane) { return a.V[lane] - b.V[lane]; }); }
+	inline float8 operator*(const float8& a, const float8& b) { return Map8([&](uint lane) { return a.V[lane] * b.V[lane]; }); }
+	inline float8 operator/(const float8& a, const float8& b) { return Map8([&](uint lane) { return a.V[lane] / b.V[lane]; }); }
+	inline float8 Min8(const float8& a, const float8& b) { return Map8([&](uint lane) { return std::min(a.V[lane], b.V[lane]); }); }
+	inline float8 Max8(const float8& a, const float8& b) { return Map8([&](uint lane) { return std::max(a.V[lane], b.V[lane]); }); }
+	inline float8 Sqrt8(const float8& a) { return Map8([&](uint lane) { return std::sqrt(a.V[lane]); }); }
+	inline float8 Greater8(const float8& a, const float8& b)
+	{
+		uint bits[BATCH_SIZE];
+		for (uint lane = 0; lane < BATCH_SIZE; ++lane)
+		{
+			bits[lane] = a.V[lane] > b.V[lane] ? ~0u : 0u;
+		}
+		float8 result;
+		std::memcpy(result.V, bits, sizeof(bits));
+		return result;
+	}
+	inline float8 Select8(const float8& mask, const float8& a, const float8& b)
+	{
+		uint bits[BATCH_SIZE];
+		std::memcpy(bits, mask.V, sizeof(bits));
+		return Map8([&](uint lane) { return bits[lane] != 0 ? a.V[lane] : b.V[lane]; });
+	}
+#endif
+
+	inline float8 Clamp8(const float8& a, float low, float high) { return Min8(Max8(a, Set8(low)), Set8(high)); }
+	inline float8 Abs8(const float8& a) { return Max8(a, Set8(0.0f) - a); }
+	// glm::mix
+	inline float8 Mix8(const float8& x, const float8& y, const float8& a) { return x * (Set8(1.0f) - a) + y * a; }
+
+	// Sum of the lanes in lane order, the same for every instruction set
+	inline float ReduceAdd8(const float8& a)
+	{
+		float lanes[BATCH_SIZE];
+		Store8(lanes, a);
+		float sum = lanes[0];
+		for (uint lane = 1; lane < BATCH_SIZE; ++lane)
+		{
+			sum += lanes[lane];
+		}
+		return sum;
+	}
+
+	struct float3x8
+	{
+		float8 X, Y, Z;
+	};
+
+	inline float3x8 Set3x8(const float3& value) { return { Set8(value.x), Set8(value.y), Set8(value.z) }; }
+	inline float3x8 operator+(const float3x8& a, const float3x8& b) { return { a.X + b.X, a.Y + b.Y, a.Z + b.Z }; }
+	inline float3x8 operator-(const float3x8& a, const float3x8& b) { return { a.X - b.X, a.Y - b.Y, a.Z - b.Z }; }
+	inline float3x8 operator*(const float8& a, const float3x8& b) { return { a * b.X, a * b.Y, a * b.Z }; }
+	inline float8 Dot8(const float3x8& a, const float3x8& b) { return a.X * b.X + a.Y * b.Y + a.Z * b.Z; }
+
+	inline float8 Smoothstep8(float edge0, float edge1, const float8& x)
+	{
+		float8 t = Clamp8((x - Set8(edge0)) / Set8(edge1 - edge0), 0.0f, 1.0f);
+		return t * t * (Set8(3.0f) - Set8(2.0f) * t);
+	}
+
+	inline float8 K8(const float8& dist)
+	{
+		float8 k = Set8(2.0f) * dist * dist * dist - Set8(3.0f) * dist * dist + Set8(1.0f);
+		return Select8(Greater8(dist, Set8(1.0f)), Set8(0.0f), k);
+	}
+
+	inline float8 dist8(const float3x8& pos, const float3x8& surfelCenter, const float3x8& surfelNormal)
+	{
+		float3x8 offset = pos - surfelCenter;
+		float3x8 v = offset + (Set8(2.0f) * Dot8(offset, surfelNormal)) * surfelNormal;
+		return Sqrt8(Dot8(v, v));
+	}
+
+	// Unpacked surfels of one batch, the lanes past the batch count get a zero normal and so a zero weight
+	struct SurfelBatch
+	{
+		float3x8 Position;
+		float3x8 Normal;
+		float8 Radius;
+		float3x8 Irradiance;
+		float8 LuminanceVariance;
+	};
+
+	// Gathers count <= BATCH_SIZE surfels. The estimators are only read for the variance.
+	inline SurfelBatch LoadSurfelBatch(const SurfelsDataView& data, const uint* surfelIndices, uint count, bool loadVariance)
+	{
+		float lanes[11][BATCH_SIZE] = {};
+		for (uint lane = 0; lane < BATCH_SIZE; ++lane)
+		{
+			lanes[6][lane] = SurfelRadius;
+		}
+		for (uint lane = 0; lane < count; ++lane)
+		{
+			const uint surfelIndex = surfelIndices[lane];
+			const uint4 geometry = data.Geometry[surfelIndex];
+			const float3 position = UnpackSurfelPosition(geometry);
+			const float3 normal = UnpackSurfelNormal(geometry);
+			const float4 irradiance = data.Irradiance[surfelIndex];
+			lanes[0][lane] = position.x;
+			lanes[1][lane] = position.y;
+			lanes[2][lane] = position.z;
+			lanes[3][lane] = normal.x;
+			lanes[4][lane] = normal.y;
+			lanes[5][lane] = normal.z;
+			lanes[6][lane] = GetSurfelRadius(geometry);
+			lanes[7][lane] = irradiance.x;
+			lanes[8][lane] = irradiance.y;
+			lanes[9][lane] = irradiance.z;
+			lanes[10][lane] = loadVariance ? UnpackSurfelLuminanceVariance(data.Estimator[surfelIndex]) : 0.0f;
+		}
+
+		SurfelBatch batch;
+		batch.Position = { Load8(lanes[0]), Load8(lanes[1]), Load8(lanes[2]) };
+		batch.Normal = { Load8(lanes[3]), Load8(lanes[4]), Load8(lanes[5]) };
+		batch.Radius = Load8(lanes[6]);
+		batch.Irradiance = { Load8(lanes[7]), Load8(lanes[8]), Load8(lanes[9]) };
+		batch.LuminanceVariance = Load8(lanes[10]);
+		return batch;
+	}
+
+	// AccumulateSurfelIrradiance over a batch
+	inline void AccumulateSurfelIrradiance8(const SurfelBatch& batch, const float3& posW, const float3& normal, bool useWeightFunctions,
+		float3& totalIrradiance, float& totalWeight, float* pTotalVariance = nullptr)
+	{
+		const float8 distanceAttenuation = Smoothstep8(1.0f, 0.0f, dist8(Set3x8(posW), batch.Position, batch.Normal) / batch.Radius);
+		const float8 NdotSN = Max8(Set8(0.0f), Dot8(Set3x8(normal), batch.Normal));
+		const float8 weight = useWeightFunctions ? distanceAttenuation * NdotSN * NdotSN : distanceAttenuation * NdotSN;
+
+		totalIrradiance += float3(ReduceAdd8(weight * batch.Irradiance.X), ReduceAdd8(weight * batch.Irradiance.Y), ReduceAdd8(weight * batch.Irradiance.Z));
+		if (useWeightFunctions)
+		{
+			totalWeight += ReduceAdd8(weight);
+		}
+		if (pTotalVariance)
+		{
+			*pTotalVariance += ReduceAdd8(weight * weight * batch.LuminanceVariance);
+		}
+	}
+
+	// GetIrradianceAtPoint with the cell list walked a batch at a time
+	inline float3 GetIrradianceAtPoint8(const SurfelsDataView& data, const float3& posW, const float3& normal, bool useWeightFunctions = true,
+		uint* candidateCount = nullptr, float* pVariance = nullptr)
+	{
+		float3 totalIrradiance = { 0.0f, 0.0f, 0.0f };
+		float totalWeight = 0.0f;
+		float totalVariance = 0.0f;
+		if (pVariance)
+		{
+			*pVariance = 0.0f;
+		}
+
+		uint level = GetWorldLevel(posW, data.CameraPosW);
+		uint worldIndex = FindWorldCell(data.WorldStructureKeys, GetWorldCell(posW, level), level);
+		if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX)
+		{
+			return totalIrradiance;
+		}
+
+		uint startIndex = data.WorldStructure[worldIndex].StartIndex;
+		uint count = data.WorldStructure[worldIndex].Count;
+		if (startIndex + count > data.IndicesSize)
+		{
+			count = startIndex < data.IndicesSize ? data.IndicesSize - startIndex : 0;
+		}
+		for (uint i = 0; i < count; i += BATCH_SIZE)
+		{
+			const SurfelBatch batch = LoadSurfelBatch(data, data.Indices + startIndex + i, std::min(count - i, BATCH_SIZE), pVariance != nullptr);
+			AccumulateSurfelIrradiance8(batch, posW, normal, useWeightFunctions, totalIrradiance, totalWeight, pVariance ? &totalVariance : nullptr);
+		}
+		if (candidateCount)
+		{
+			*candidateCount += count;
+		}
+		if (pVariance)
+		{
+			*pVariance = ResolveIrradianceVariance(totalVariance, totalWeight, useWeightFunctions);
+		}
+
+		return ResolveIrradiance(totalIrradiance, totalWeight, useWeightFunctions);
+	}
+
+	// MultiscaleMeanEstimatorData of 8 surfels
+	struct EstimatorBatch
+	{
+		float3x8 Mean;
+		float3x8 ShortMean;
+		float8 Vbbr;
+		float3x8 Variance;
+		float8 Inconsistency;
+	};
+
+	inline EstimatorBatch LoadEstimatorBatch(const MultiscaleMeanEstimatorData* estimators, uint count)
+	{
+		float lanes[11][BATCH_SIZE] = {};
+		for (uint lane = 0; lane < count; ++lane)
+		{
+			const MultiscaleMeanEstimatorData& estimator = estimators[lane];
+			for (uint channel = 0; channel < 3; ++channel)
+			{
+				lanes[channel][lane] = estimator.mean[channel];
+				lanes[3 + channel][lane] = estimator.shortMean[channel];
+				lanes[7 + channel][lane] = estimator.variance[channel];
+			}
+			lanes[6][lane] = estimator.vbbr;
+			lanes[10][lane] = estimator.inconsistency;
+		}
+
+		EstimatorBatch batch;
+		batch.Mean = { Load8(lanes[0]), Load8(lanes[1]), Load8(lanes[2]) };
+		batch.ShortMean = { Load8(lanes[3]), Load8(lanes[4]), Load8(lanes[5]) };
+		batch.Vbbr = Load8(lanes[6]);
+		batch.Variance = { Load8(lanes[7]), Load8(lanes[8]), Load8(lanes[9]) };
+		batch.Inconsistency = Load8(lanes[10]);
+		return batch;
+	}
+
+	inline void StoreEstimatorBatch(const EstimatorBatch& batch, MultiscaleMeanEstimatorData* estimators, uint count)
+	{
+		float lanes[11][BATCH_SIZE];
+		Store8(lanes[0], batch.Mean.X);
+		Store8(lanes[1], batch.Mean.Y);
+		Store8(lanes[2], batch.Mean.Z);
+		Store8(lanes[3], batch.ShortMean.X);
+		Store8(lanes[4], batch.ShortMean.Y);
+		Store8(lanes[5], batch.ShortMean.Z);
+		Store8(lanes[6], batch.Vbbr);
+		Store8(lanes[7], batch.Variance.X);
+		Store8(lanes[8], batch.Variance.Y);
+		Store8(lanes[9], batch.Variance.Z);
+		Store8(lanes[10], batch.Inconsistency);
+		for (uint lane = 0; lane < count; ++lane)
+		{
+			MultiscaleMeanEstimatorData& estimator = estimators[lane];
+			for (uint channel = 0; channel < 3; ++channel)
+			{
+				estimator.mean[channel] = lanes[channel][lane];
+				estimator.shortMean[channel] = lanes[3 + channel][lane];
+				estimator.variance[channel] = lanes[7 + channel][lane];
+			}
+			estimator.vbbr = lanes[6][lane];
+			estimator.inconsistency = lanes[10][lane];
+		}
+	}
+
+	// MultiscaleMeanEstimator over a batch, y holds one new sample per lane
+	inline void MultiscaleMeanEstimator8(float3x8 y, EstimatorBatch& data, float shortWindowBlend = 0.08f)
+	{
+		const float3x8 luminance = Set3x8(float3(0.299f, 0.587f, 0.114f));
+		float8* yChannels[3] = { &y.X, &y.Y, &y.Z };
+		float8* shortMean[3] = { &data.ShortMean.X, &data.ShortMean.Y, &data.ShortMean.Z };
+		float8* variance[3] = { &data.Variance.X, &data.Variance.Y, &data.Variance.Z };
+		float8* mean[3] = { &data.Mean.X, &data.Mean.Y, &data.Mean.Z };
+
+		// Suppress fireflies.
+		for (uint channel = 0; channel < 3; ++channel)
+		{
+			float8 dev = Sqrt8(Max8(*variance[channel], Set8(1e-5f)));
+			float8 highThreshold = Set8(0.1f) + *shortMean[channel] + dev * Set8(8.0f);
+			float8 overflow = Max8(*yChannels[channel] - highThreshold, Set8(0.0f));
+			*yChannels[channel] = *yChannels[channel] - overflow;
+		}
+
+		float3x8 dev;
+		float8* devChannels[3] = { &dev.X, &dev.Y, &dev.Z };
+		float varianceBlend = shortWindowBlend * 0.5f;
+		for (uint channel = 0; channel < 3; ++channel)
+		{
+			float8 delta = *yChannels[channel] - *shortMean[channel];
+			*shortMean[channel] = Mix8(*shortMean[channel], *yChannels[channel], Set8(shortWindowBlend));
+			float8 delta2 = *yChannels[channel] - *shortMean[channel];
+
+			*variance[channel] = Mix8(*variance[channel], delta * delta2, Set8(varianceBlend));
+			*devChannels[channel] = Max8(Sqrt8(Max8(*variance[channel], Set8(1e-5f))), Set8(1e-5f));
+		}
+
+		float3x8 shortDiff = data.Mean - data.ShortMean;
+		float3x8 relativeDiffs = { Abs8(shortDiff.X) / dev.X, Abs8(shortDiff.Y) / dev.Y, Abs8(shortDiff.Z) / dev.Z };
+		float8 relativeDiff = Dot8(luminance, relativeDiffs);
+		data.Inconsistency = Mix8(data.Inconsistency, relativeDiff, Set8(0.08f));
+
+		float3x8 blendReductions = { Set8(0.5f) * data.ShortMean.X / dev.X, Set8(0.5f) * data.ShortMean.Y / dev.Y, Set8(0.5f) * data.ShortMean.Z / dev.Z };
+		float8 varianceBasedBlendReduction = Clamp8(Dot8(luminance, blendReductions), 1.0f / 32, 1.0f);
+
+		float8 catchUpBlend = Clamp8(Smoothstep8(0.0f, 1.0f,
+			relativeDiff * Max8(Set8(0.02f), data.Inconsistency - Set8(0.2f))), 1.0f / 256, 1.0f);
+		catchUpBlend = catchUpBlend * data.Vbbr;
+
+		data.Vbbr = Mix8(data.Vbbr, varianceBasedBlendReduction, Set8(0.1f));
+		for (uint channel = 0; channel < 3; ++channel)
+		{
+			*mean[channel] = Mix8(*mean[channel], *yChannels[channel], Clamp8(catchUpBlend, 0.0f, 1.0f));
+		}
+	}
+}
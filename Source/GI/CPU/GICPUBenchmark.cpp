@@ -0,0 +1,2767 @@
+#include "GICPUBenchmark.h"
+
+#include "GIBatch.h"
+#include "GI/LightSampling.h"
+#include "GlobalIlluminationCPU.h"
+#include "ParallelPrimitivesCPU.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+namespace
+{
+	// Closed room centered at the origin, fits inside the world structure
+	const float ROOM_HALF_EXTENT = 4.0f;
+
+	struct RoomHit
+	{
+		float3 Position;
+		float3 Normal;
+		float3 Albedo;
+		bool Emissive;
+	};
+
+	// Box floating in the room, moved by the invalidation benchmark
+	struct RoomBox
+	{
+		float3 Center;
+		float3 HalfExtent;
+	};
+
+	RoomHit TraceRoom(const float3& origin, const float3& direction, const RoomBox* pBox = nullptr)
+	{
+		float tMin = FLT_MAX;
+		int hitAxis = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (direction[axis] == 0.0f)
+				continue;
+
+			float wall = direction[axis] > 0.0f ? ROOM_HALF_EXTENT : -ROOM_HALF_EXTENT;
+			float t = (wall - origin[axis]) / direction[axis];
+			if (t > 1e-4f && t < tMin)
+			{
+				tMin = t;
+				hitAxis = axis;
+			}
+		}
+
+		RoomHit hit;
+		hit.Position = origin + direction * tMin;
+		hit.Normal = float3(0.0f);
+		hit.Normal[hitAxis] = direction[hitAxis] > 0.0f ? -1.0f : 1.0f;
+		hit.Albedo = float3(0.75f);
+		hit.Emissive = (hitAxis == 1 && direction[hitAxis] > 0.0f);
+		if (hitAxis == 0)
+		{
+			hit.Albedo = direction[hitAxis] > 0.0f ? float3(0.14f, 0.45f, 0.09f) : float3(0.63f, 0.065f, 0.05f);
+		}
+
+		if (pBox)
+		{
+			// Slab test, the box is entered through the face of the axis with the furthest entry
+			float tEnter = -FLT_MAX;
+			float tExit = FLT_MAX;
+			int enterAxis = 0;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				const float inverse = 1.0f / direction[axis];
+				const float t0 = (pBox->Center[axis] - pBox->HalfExtent[axis] - origin[axis]) * inverse;
+				const float t1 = (pBox->Center[axis] + pBox->HalfExtent[axis] - origin[axis]) * inverse;
+				if (std::min(t0, t1) > tEnter)
+				{
+					tEnter = std::min(t0, t1);
+					enterAxis = axis;
+				}
+				tExit = std::min(tExit, std::max(t0, t1));
+			}
+			if (tEnter > 1e-4f && tEnter <= tExit && tEnter < tMin)
+			{
+				hit.Position = origin + direction * tEnter;
+				hit.Normal = float3(0.0f);
+				hit.Normal[enterAxis] = direction[enterAxis] > 0.0f ? -1.0f : 1.0f;
+				hit.Albedo = float3(0.8f, 0.7f, 0.3f);
+				hit.Emissive = false;
+			}
+		}
+		return hit;
+	}
+
+	float3 GetOrbitCameraPosition(float time)
+	{
+		return float3(std::cos(time * 0.5f) * 2.5f, 0.5f, std::sin(time * 0.5f) * 2.5f);
+	}
+
+	// Looks at the room centre, which puts everything in view 6.5 m or more away, or away from it at the nearest wall.
+	// The previous frame is 1/60 s earlier, like the frames of the benchmarks.
+	GICPUCamera CreateOrbitCamera(float time, float aspectRatio, bool lookOutward = false)
+	{
+		const float4x4 proj = glm::perspective(glm::radians(60.0f), aspectRatio, 0.1f, 100.0f);
+		const float3 eye = GetOrbitCameraPosition(time);
+		const float3 prevEye = GetOrbitCameraPosition(time - 1.0f / 60.0f);
+		const float targetScale = lookOutward ? 2.0f : 0.0f;
+
+		GICPUCamera camera;
+		camera.ViewProj = proj * glm::lookAt(eye, eye * targetScale, float3(0.0f, 1.0f, 0.0f));
+		camera.InvViewProj = glm::inverse(camera.ViewProj);
+		camera.PrevViewProj = proj * glm::lookAt(prevEye, prevEye * targetScale, float3(0.0f, 1.0f, 0.0f));
+		camera.PosW = eye;
+		return camera;
+	}
+
+	void RasterizeRoom(ThreadPool& pool, const GICPUCamera& camera, GBufferCPU& gBuffer, const RoomBox* pBox = nullptr)
+	{
+		pool.ParallelFor(gBuffer.Height, 8, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t y = begin; y < end; ++y)
+			{
+				for (uint32_t x = 0; x < gBuffer.Width; ++x)
+				{
+					const uint2 loc = uint2(x, y);
+					const uint2 dim = uint2(gBuffer.Width, gBuffer.Height);
+					const float3 nearPos = GICPU::GetWorldPosition(loc, dim, 0.0f, camera.InvViewProj);
+					const float3 farPos = GICPU::GetWorldPosition(loc, dim, 1.0f, camera.InvViewProj);
+					const RoomHit hit = TraceRoom(camera.PosW, glm::normalize(farPos - nearPos), pBox);
+
+					const float4 clipPos = camera.ViewProj * float4(hit.Position, 1.0f);
+					const uint32_t pixel = y * gBuffer.Width + x;
+					gBuffer.Depth[pixel] = clipPos.z / clipPos.w;
+					gBuffer.Normal[pixel] = hit.Normal * 0.5f + 0.5f;
+					gBuffer.Albedo[pixel] = hit.Albedo;
+
+					// calcMotionVector of the G-buffer pass
+					if (!gBuffer.Motion.empty())
+					{
+						const float4 prevClipPos = camera.PrevViewProj * float4(hit.Position, 1.0f);
+						const float2 prevTexC = float2(prevClipPos.x, prevClipPos.y) / prevClipPos.w * float2(0.5f, -0.5f) + 0.5f;
+						gBuffer.Motion[pixel] = prevTexC - (float2(loc) + 0.5f) / float2(dim);
+					}
+				}
+			}
+		});
+	}
+
+	float3 GetRoomHitRadiance(const RoomHit& hit)
+	{
+		if (hit.Emissive)
+		{
+			return float3(1.0f, 0.95f, 0.85f);
+		}
+		return hit.Albedo * 0.2f;
+	}
+
+	float3 RoomRadiance(const float3& origin, const float3& direction)
+	{
+		return GetRoomHitRadiance(TraceRoom(origin, direction));
+	}
+
+	// Looks from the middle of the room into the corner at -ROOM_HALF_EXTENT on every axis, the camera does not move
+	GICPUCamera CreateCornerCamera(float aspectRatio)
+	{
+		const float4x4 proj = glm::perspective(glm::radians(60.0f), aspectRatio, 0.1f, 100.0f);
+		const float3 eye = float3(1.0f, 0.5f, 1.0f);
+
+		GICPUCamera camera;
+		camera.ViewProj = proj * glm::lookAt(eye, float3(-ROOM_HALF_EXTENT), float3(0.0f, 1.0f, 0.0f));
+		camera.InvViewProj = glm::inverse(camera.ViewProj);
+		camera.PrevViewProj = camera.ViewProj;
+		camera.PosW = eye;
+		return camera;
+	}
+
+	// Slides across the room for a second, then rests a second at the other end before sliding back
+	RoomBox GetMovingRoomBox(float time)
+	{
+		const float period = std::floor(time * 0.5f);
+		const float progress = std::min(time - period * 2.0f, 1.0f);
+		const float from = std::fmod(period, 2.0f) == 0.0f ? -1.5f : 1.5f;
+		return RoomBox{ float3(from * (1.0f - 2.0f * progress), -0.5f, 0.0f), float3(0.5f) };
+	}
+
+	// Distance to the nearest room wall or box face, negative inside the box
+	float GetRoomSurfaceDistance(const float3& position, const RoomBox& box)
+	{
+		const float3 wallDistance = ROOM_HALF_EXTENT - glm::abs(position);
+		const float3 boxDistance = glm::abs(position - box.Center) - box.HalfExtent;
+		const float outside = glm::length(glm::max(boxDistance, float3(0.0f)));
+		const float boxSurfaceDistance = outside > 0.0f ? outside : std::max(boxDistance.x, std::max(boxDistance.y, boxDistance.z));
+		const float wallSurfaceDistance = std::min(wallDistance.x, std::min(wallDistance.y, wallDistance.z));
+		return std::abs(boxSurfaceDistance) < wallSurfaceDistance ? boxSurfaceDistance : wallSurfaceDistance;
+	}
+
+	std::string FormatMs(const char* name, double totalMs, uint32_t frameCount)
+	{
+		return std::string(name) + ": " + std::to_string(totalMs / frameCount) + " ms\n";
+	}
+
+	template<typename Func>
+	double TimeIterations(uint32_t iterationCount, Func&& func)
+	{
+		double totalMs = 0.0;
+		for (uint32_t iteration = 0; iteration < iterationCount; ++iteration)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			func();
+			totalMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+		return totalMs;
+	}
+
+	// Sphere-box distance reference for GetOverlappedCellMask. Neighbours within a small margin of the radius
+	// may go either way as the two compute the distance in different units.
+	struct OverlapReference
+	{
+		uint Required = 0;
+		uint Allowed = 0;
+	};
+
+	OverlapReference GetOverlappedCellMaskReference(const float3& position, const int3& cell, uint level, float radiusScale)
+	{
+		const float size = WORLD_STRUCTURE_CHUNK_SIZE * GICPU::GetLevelScale(level);
+		const float radius = GICPU::GetSurfelRadius(level) * radiusScale;
+		const float radiusSquared = radius * radius;
+		OverlapReference reference;
+		for (uint i = 0; i < WORLD_STRUCTURE_OVERLAP_CELL_COUNT; ++i)
+		{
+			const float3 boxMin = float3(cell + GICPU::OverlapCellOffsets[i]) * size;
+			const float3 boxMax = boxMin + size;
+			const float3 outside = glm::max(glm::max(boxMin - position, position - boxMax), float3(0.0f));
+			const float distanceSquared = glm::dot(outside, outside);
+			reference.Required |= (distanceSquared < radiusSquared * 0.999f ? 1u : 0u) << i;
+			reference.Allowed |= (distanceSquared < radiusSquared * 1.001f ? 1u : 0u) << i;
+		}
+		return reference;
+	}
+
+	std::string FormatPrimitive(const char* name, double totalMs, uint32_t iterationCount, uint32_t elementCount, bool valid)
+	{
+		const double ms = totalMs / iterationCount;
+		const double elementsPerSecond = ms > 0.0 ? elementCount / (ms * 1e-3) : 0.0;
+		return std::string(name) + ": " + std::to_string(ms) + " ms, " + std::to_string(elementsPerSecond * 1e-9) + " Gelements/s"
+			+ (valid ? "\n" : " MISMATCH\n");
+	}
+
+	// Set associative cache with LRU replacement, counts the line fetches a memory access pattern causes
+	class CacheSimulator
+	{
+	public:
+		CacheSimulator(uint32_t size, uint32_t lineSize, uint32_t ways)
+			: m_LineSize(lineSize)
+			, m_Ways(ways)
+			, m_SetCount(std::max(size / (lineSize * ways), 1u))
+			, m_Lines(size_t(m_SetCount) * ways, UINT64_MAX)
+		{
+		}
+
+		void Access(uint64_t address)
+		{
+			const uint64_t line = address / m_LineSize;
+			uint64_t* set = m_Lines.data() + size_t(line % m_SetCount) * m_Ways;
+			// Most recently used first
+			uint32_t way = 0;
+			while (way < m_Ways && set[way] != line)
+			{
+				++way;
+			}
+			if (way == m_Ways)
+			{
+				++m_Misses;
+				way = m_Ways - 1;
+			}
+			std::copy_backward(set, set + way, set + way + 1);
+			set[0] = line;
+			++m_Accesses;
+		}
+
+		uint32_t GetLineSize() const { return m_LineSize; }
+		uint64_t GetAccesses() const { return m_Accesses; }
+		uint64_t GetMisses() const { return m_Misses; }
+
+	private:
+		uint32_t m_LineSize;
+		uint32_t m_Ways;
+		uint32_t m_SetCount;
+		std::vector<uint64_t> m_Lines;
+		uint64_t m_Accesses = 0;
+		uint64_t m_Misses = 0;
+	};
+}
+
+bool RunGICPUBenchmark(const GICPUBenchmarkDesc& desc)
+{
+	GlobalIlluminationCPU gi(desc.ThreadCount);
+	gi.Initilize(uvec2(desc.Width, desc.Height));
+	gi.SetSpawnChance(desc.SpawnChance);
+	gi.SetWorldStructureBuildMode(desc.RebuildWorldStructure
+		? GlobalIlluminationCPU::WorldStructureBuildMode::Rebuild
+		: GlobalIlluminationCPU::WorldStructureBuildMode::Incremental);
+
+	bool warmStart = false;
+	const double cacheLoadMs = TimeIterations(1, [&]()
+	{
+		warmStart = !desc.SurfelCachePath.empty() && gi.LoadSurfelCache(desc.SurfelCachePath);
+	});
+	const uint32_t initialSurfelCount = gi.GetSurfelCount();
+	uint32_t firstFrameSurfelCount = 0;
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	gBuffer.Motion.resize(desc.Width * desc.Height);
+
+	GlobalIlluminationCPU::StageTimings total;
+	GIStatisticsLog statisticsLog;
+	for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+	{
+		const double time = frame / 60.0;
+		const GICPUCamera camera = CreateOrbitCamera(float(time), float(desc.Width) / float(desc.Height));
+		RasterizeRoom(gi.GetThreadPool(), camera, gBuffer);
+
+		gi.GenerateGIMap(camera, gBuffer);
+		gi.AccumulateIrradiance(RoomRadiance);
+		if (frame == 0)
+		{
+			firstFrameSurfelCount = gi.GetSurfelCount();
+		}
+		statisticsLog.Add(gi.GetStatistics());
+
+		const auto& timings = gi.GetTimings();
+		total.Eviction += timings.Eviction;
+		total.Coverage += timings.Coverage;
+		total.ExclusiveScan += timings.ExclusiveScan;
+		total.UpdateWorldStructure += timings.UpdateWorldStructure;
+		total.SpawnSurfels += timings.SpawnSurfels;
+		total.SurfelBinning += timings.SurfelBinning;
+		total.SurfelsRendering += timings.SurfelsRendering;
+		total.ResolveGI += timings.ResolveGI;
+		total.Denoise += timings.Denoise;
+		total.Compaction += timings.Compaction;
+		total.Defragment += timings.Defragment;
+		total.ScheduleRays += timings.ScheduleRays;
+		total.Accumulate += timings.Accumulate;
+	}
+
+	std::string report = "GI CPU benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(gi.GetThreadPool().GetThreadCount()) + " threads\n";
+	report += "Surfel Count: " + std::to_string(gi.GetSurfelCount()) + "\n";
+	report += "Free Surfels: " + std::to_string(gi.GetFreeSurfelCount()) + "\n";
+	if (warmStart)
+	{
+		report += "Surfel Cache: loaded " + std::to_string(initialSurfelCount) + " surfels in " + std::to_string(cacheLoadMs) + " ms\n";
+	}
+	else
+	{
+		report += "Surfel Cache: cold start\n";
+	}
+	report += "Surfel Count After First Frame: " + std::to_string(firstFrameSurfelCount) + "\n";
+	report += std::string("World Structure: ") + (desc.RebuildWorldStructure ? "Rebuild" : "Incremental") + "\n";
+	report += "Surfel Data: " + std::to_string(SURFEL_PACKED_SIZE) + " bytes per surfel, " + std::to_string(sizeof(Surfel)) + " unpacked\n";
+	report += FormatMs("Eviction", total.Eviction, desc.FrameCount);
+	report += FormatMs("Compute Coverage", total.Coverage, desc.FrameCount);
+	report += FormatMs("Exclusive Scan", total.ExclusiveScan, desc.FrameCount);
+	report += FormatMs("Update World Structure", total.UpdateWorldStructure, desc.FrameCount);
+	report += FormatMs("Spawn Surfels", total.SpawnSurfels, desc.FrameCount);
+	report += FormatMs("Surfel Binning", total.SurfelBinning, desc.FrameCount);
+	report += FormatMs("Surfels Rendering", total.SurfelsRendering, desc.FrameCount);
+	report += FormatMs("Resolve GI", total.ResolveGI, desc.FrameCount);
+	report += FormatMs("Denoise GI", total.Denoise, desc.FrameCount);
+	report += FormatMs("Compaction", total.Compaction, desc.FrameCount);
+	report += FormatMs("Defragment", total.Defragment, desc.FrameCount);
+	report += "Ray Budget: " + std::to_string(gi.GetRayBudget()) + "\n";
+	report += FormatMs("Schedule Rays", total.ScheduleRays, desc.FrameCount);
+	report += FormatMs("Accumulate", total.Accumulate, desc.FrameCount);
+	const GIFrameStatistics& statistics = gi.GetStatistics();
+	report += "Last Frame: " + std::to_string(statistics.SpawnedSurfels) + " spawned, " + std::to_string(statistics.EvictedSurfels) + " evicted, "
+		+ std::to_string(statistics.TracedRays) + " rays traced\n";
+	report += "Last Frame Cells: " + std::to_string(statistics.OccupiedCells) + " occupied, "
+		+ std::to_string(statistics.GetAverageCellListLength()) + " average list length, " + std::to_string(statistics.MaxCellListLength) + " max\n";
+	logInfo(report);
+
+	bool valid = true;
+	if (!desc.SurfelCachePath.empty() && !gi.SaveSurfelCache(desc.SurfelCachePath))
+	{
+		logError("Can't save the surfel cache to " + desc.SurfelCachePath);
+		valid = false;
+	}
+	if (!desc.StatisticsPath.empty() && !statisticsLog.Write(desc.StatisticsPath))
+	{
+		logError("Can't write the GI statistics to " + desc.StatisticsPath);
+		valid = false;
+	}
+	return valid;
+}
+
+bool RunWorldStructureBenchmark(const WorldStructureBenchmarkDesc& desc)
+{
+	// Scattered through a box inside the finest clipmap level around the camera, a few hundred surfels per cell at 4M
+	const float extent = desc.Extent;
+	std::vector<Surfel> surfels(desc.SurfelCount);
+	uint32_t state = 0x9E3779B9;
+	auto nextFloat = [&state]()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return float(state) * (1.0f / 4294967296.0f);
+	};
+	for (Surfel& surfel : surfels)
+	{
+		surfel.Position = float3(nextFloat(), nextFloat(), nextFloat()) * (2.0f * extent) - extent;
+		surfel.Normal = float3(0.0f);
+		surfel.Normal[uint32_t(nextFloat() * 3.0f) % 3] = nextFloat() < 0.5f ? -1.0f : 1.0f;
+		surfel.Irradiance = MultiscaleMeanEstimatorData{};
+	}
+
+	// Tiny G-buffer so coverage and rendering stay out of the way
+	GBufferCPU gBuffer;
+	gBuffer.Width = 16;
+	gBuffer.Height = 16;
+	gBuffer.Depth.resize(gBuffer.Width * gBuffer.Height);
+	gBuffer.Normal.resize(gBuffer.Width * gBuffer.Height);
+	gBuffer.Albedo.resize(gBuffer.Width * gBuffer.Height);
+	const GICPUCamera camera = CreateOrbitCamera(0.0f, 1.0f);
+
+	std::string report = "World structure benchmark, " + std::to_string(desc.SurfelCount) + " surfels, "
+		+ std::to_string(desc.FrameCount) + " frames\n";
+
+	const std::pair<const char*, GlobalIlluminationCPU::WorldStructureBuildMode> buildModes[] =
+	{
+		{ "Incremental", GlobalIlluminationCPU::WorldStructureBuildMode::Incremental },
+		{ "Rebuild", GlobalIlluminationCPU::WorldStructureBuildMode::Rebuild },
+	};
+	struct WorldStructureRun
+	{
+		GlobalIlluminationCPU::StageTimings Total;
+		std::vector<WorldStructureChunk> WorldStructure;
+		std::vector<uint32_t> Indices;
+		uint32_t ThreadCount = 0;
+	};
+
+	auto runBuildMode = [&](GlobalIlluminationCPU::WorldStructureBuildMode buildMode, uint32_t threadCount)
+	{
+		GlobalIlluminationCPU gi(threadCount);
+		gi.Initilize(uvec2(gBuffer.Width, gBuffer.Height), desc.SurfelCount + 1024);
+		gi.SetSpawnChance(1.0f);
+		// Keep every surfel alive for the whole run
+		gi.SetMaxSurfelCoverage(FLT_MAX);
+		gi.SetWorldStructureBuildMode(buildMode);
+		RasterizeRoom(gi.GetThreadPool(), camera, gBuffer);
+		gi.GenerateGIMap(camera, gBuffer);
+		gi.AddSurfels(surfels);
+
+		WorldStructureRun run;
+		for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+		{
+			gi.GenerateGIMap(camera, gBuffer);
+			run.Total.ExclusiveScan += gi.GetTimings().ExclusiveScan;
+			run.Total.UpdateWorldStructure += gi.GetTimings().UpdateWorldStructure;
+			run.Total.SpawnSurfels += gi.GetTimings().SpawnSurfels;
+		}
+
+		// Spawned surfels land in their lists in any order, as on the GPU. Sorted lists compare across thread counts.
+		run.WorldStructure = gi.GetWorldStructure();
+		run.Indices = gi.GetSurfelIndices();
+		for (const WorldStructureChunk& chunk : run.WorldStructure)
+		{
+			if (chunk.Count > 0 && uint64_t(chunk.StartIndex) + chunk.Count <= run.Indices.size())
+			{
+				std::sort(run.Indices.begin() + chunk.StartIndex, run.Indices.begin() + chunk.StartIndex + chunk.Count);
+			}
+		}
+		run.ThreadCount = gi.GetThreadPool().GetThreadCount();
+		return run;
+	};
+
+	auto isEquivalent = [](const WorldStructureRun& a, const WorldStructureRun& b)
+	{
+		if (a.WorldStructure.size() != b.WorldStructure.size())
+			return false;
+
+		for (size_t worldIndex = 0; worldIndex < a.WorldStructure.size(); ++worldIndex)
+		{
+			const WorldStructureChunk& chunkA = a.WorldStructure[worldIndex];
+			const WorldStructureChunk& chunkB = b.WorldStructure[worldIndex];
+			if (chunkA.StartIndex != chunkB.StartIndex || chunkA.Count != chunkB.Count)
+				return false;
+		}
+
+		const WorldStructureChunk& lastChunk = a.WorldStructure.back();
+		const size_t usedCount = std::min<size_t>(size_t(lastChunk.StartIndex) + lastChunk.Count, std::min(a.Indices.size(), b.Indices.size()));
+		return std::equal(a.Indices.begin(), a.Indices.begin() + usedCount, b.Indices.begin());
+	};
+
+	const uint32_t frameCount = std::max(desc.FrameCount, 1u);
+	bool allValid = true;
+	for (const auto& buildMode : buildModes)
+	{
+		const WorldStructureRun run = runBuildMode(buildMode.second, desc.ThreadCount);
+
+		// Both modes keep the lists packed in slot order, the last slot ends at the total
+		const WorldStructureChunk& lastChunk = run.WorldStructure.back();
+		report += std::string(buildMode.first) + ": " + std::to_string(lastChunk.StartIndex + lastChunk.Count) + " index entries, "
+			+ std::to_string(run.ThreadCount) + " threads";
+
+		// The single thread run is the reference the parallel passes have to reproduce
+		if (desc.VerifyAgainstSerial && run.ThreadCount > 1)
+		{
+			const bool valid = isEquivalent(run, runBuildMode(buildMode.second, 1));
+			allValid &= valid;
+			report += valid ? ", matches serial" : ", MISMATCH against serial";
+		}
+		report += "\n";
+
+		report += "  " + FormatMs("Exclusive Scan", run.Total.ExclusiveScan, frameCount);
+		report += "  " + FormatMs(buildMode.second == GlobalIlluminationCPU::WorldStructureBuildMode::Rebuild ? "Rebuild World Structure" : "Update World Structure",
+			run.Total.UpdateWorldStructure, frameCount);
+		report += "  " + FormatMs("Spawn Surfels", run.Total.SpawnSurfels, frameCount);
+	}
+
+	if (allValid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return allValid;
+}
+
+bool RunOverlapBenchmark(const OverlapBenchmarkDesc& desc)
+{
+	// Spread over every clipmap level around a camera at the origin
+	const float3 cameraPosW = float3(0.0f);
+	const float extent = WORLD_STRUCTURE_CHUNK_SIZE * WORLD_STRUCTURE_LEVEL_HALF_EXTENT * float(1u << WORLD_STRUCTURE_LEVEL_COUNT);
+	std::vector<float3> positions(desc.PositionCount);
+	std::vector<int3> cells(desc.PositionCount);
+	std::vector<uint> levels(desc.PositionCount);
+	std::vector<float> radiusScales(desc.PositionCount);
+	uint32_t state = 0x9E3779B9;
+	auto nextFloat = [&state]()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return float(state) * (1.0f / 4294967296.0f);
+	};
+	for (uint32_t i = 0; i < desc.PositionCount; ++i)
+	{
+		// Cubed so the finer levels get their share
+		const float3 direction = float3(nextFloat(), nextFloat(), nextFloat()) * 2.0f - 1.0f;
+		positions[i] = direction * direction * direction * extent;
+		levels[i] = GICPU::GetWorldLevel(positions[i], cameraPosW);
+		cells[i] = GICPU::GetWorldCell(positions[i], levels[i]);
+		radiusScales[i] = 1.0f + nextFloat() * (SURFEL_MAX_RADIUS_SCALE - 1.0f);
+	}
+
+	const uint32_t iterationCount = std::max(desc.IterationCount, 1u);
+	std::vector<uint> masks(desc.PositionCount);
+	const double maskMs = TimeIterations(iterationCount, [&]
+	{
+		for (uint32_t i = 0; i < desc.PositionCount; ++i)
+		{
+			masks[i] = GICPU::GetOverlappedCellMask(positions[i], cells[i], levels[i], radiusScales[i]);
+		}
+	});
+
+	std::vector<OverlapReference> references(desc.PositionCount);
+	const double referenceMs = TimeIterations(iterationCount, [&]
+	{
+		for (uint32_t i = 0; i < desc.PositionCount; ++i)
+		{
+			references[i] = GetOverlappedCellMaskReference(positions[i], cells[i], levels[i], radiusScales[i]);
+		}
+	});
+
+	uint32_t maskMismatches = 0;
+	uint64_t overlappedCells = 0;
+	for (uint32_t i = 0; i < desc.PositionCount; ++i)
+	{
+		const OverlapReference& reference = references[i];
+		if ((masks[i] & reference.Required) != reference.Required || (masks[i] & ~reference.Allowed) != 0)
+		{
+			++maskMismatches;
+		}
+		uint mask = masks[i];
+		while (mask != 0)
+		{
+			GICPU::PopOverlappedCell(mask);
+			++overlappedCells;
+		}
+	}
+
+	auto nsPerPosition = [&](double totalMs)
+	{
+		return std::to_string(totalMs * 1e6 / (double(iterationCount) * std::max(desc.PositionCount, 1u))) + " ns per position\n";
+	};
+
+	std::string report = "Overlap benchmark, " + std::to_string(desc.PositionCount) + " positions, "
+		+ std::to_string(iterationCount) + " iterations\n";
+	report += "Overlapped Cells: " + std::to_string(desc.PositionCount > 0 ? double(overlappedCells) / desc.PositionCount : 0.0) + " per position\n";
+	report += "Overlap Mask: " + nsPerPosition(maskMs);
+	report += "Distance Reference: " + nsPerPosition(referenceMs);
+	report += "Mask Mismatches: " + std::to_string(maskMismatches) + "\n";
+
+	// Coverage counts a spawn in every cell of its mask and SpawnSurfels inserts it in every one of them.
+	// A count without its insertion would leave an unfilled slot behind, so the counts have to be used up every frame.
+	const std::pair<const char*, GlobalIlluminationCPU::WorldStructureBuildMode> buildModes[] =
+	{
+		{ "Incremental", GlobalIlluminationCPU::WorldStructureBuildMode::Incremental },
+		{ "Rebuild", GlobalIlluminationCPU::WorldStructureBuildMode::Rebuild },
+	};
+	uint32_t countMismatches = 0;
+	for (const auto& buildMode : buildModes)
+	{
+		const uvec2 size(320, 176);
+		GlobalIlluminationCPU gi;
+		gi.Initilize(size);
+		gi.SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+		gi.SetWorldStructureBuildMode(buildMode.second);
+
+		GBufferCPU gBuffer;
+		gBuffer.Width = size.x;
+		gBuffer.Height = size.y;
+		gBuffer.Depth.resize(size.x * size.y);
+		gBuffer.Normal.resize(size.x * size.y);
+		gBuffer.Albedo.resize(size.x * size.y);
+
+		uint32_t pendingFrames = 0;
+		for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+		{
+			const double time = frame / 60.0;
+			const GICPUCamera camera = CreateOrbitCamera(float(time), float(size.x) / float(size.y));
+			RasterizeRoom(gi.GetThreadPool(), camera, gBuffer);
+			gi.GenerateGIMap(camera, gBuffer);
+			if (gi.GetPendingNewSurfelCells() != 0)
+			{
+				++pendingFrames;
+			}
+		}
+		countMismatches += pendingFrames;
+		report += std::string(buildMode.first) + ": " + std::to_string(gi.GetSurfelCount()) + " surfels, "
+			+ std::to_string(pendingFrames) + " of " + std::to_string(desc.FrameCount) + " frames with counts left over\n";
+	}
+
+	const bool valid = maskMismatches == 0 && countMismatches == 0;
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunSurfelBinningBenchmark(const SurfelBinningBenchmarkDesc& desc)
+{
+	// Binning only changes how SurfelsRendering finds its surfels, both instances see the same surfels every frame
+	GlobalIlluminationCPU cellLists(desc.ThreadCount);
+	GlobalIlluminationCPU tiles(desc.ThreadCount);
+	for (GlobalIlluminationCPU* gi : { &cellLists, &tiles })
+	{
+		gi->Initilize(uvec2(desc.Width, desc.Height));
+		gi->SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+	}
+	cellLists.SetBinSurfelsPerTile(false);
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+
+	double cellListsMs = 0.0;
+	double binningMs = 0.0;
+	double tilesMs = 0.0;
+	uint64_t cellListsCandidates = 0;
+	uint64_t tilesCandidates = 0;
+	uint64_t overflowTiles = 0;
+	float maxDifference = 0.0f;
+	float maxIrradiance = 0.0f;
+	for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+	{
+		const double time = frame / 60.0;
+		const GICPUCamera camera = CreateOrbitCamera(float(time), float(desc.Width) / float(desc.Height));
+		RasterizeRoom(tiles.GetThreadPool(), camera, gBuffer);
+
+		for (GlobalIlluminationCPU* gi : { &cellLists, &tiles })
+		{
+			gi->GenerateGIMap(camera, gBuffer);
+			gi->AccumulateIrradiance(RoomRadiance);
+		}
+
+		cellListsMs += cellLists.GetTimings().SurfelsRendering;
+		binningMs += tiles.GetTimings().SurfelBinning;
+		tilesMs += tiles.GetTimings().SurfelsRendering;
+		cellListsCandidates += cellLists.GetRenderedCandidateCount();
+		tilesCandidates += tiles.GetRenderedCandidateCount();
+		const std::vector<uint32_t>& tileSurfelCounts = tiles.GetTileSurfelCounts();
+		overflowTiles += std::count(tileSurfelCounts.begin(), tileSurfelCounts.end(), SURFEL_TILE_OVERFLOW);
+
+		// Same surfels summed in another order
+		const std::vector<float4>& expected = cellLists.GetIrradiance();
+		const std::vector<float4>& irradiance = tiles.GetIrradiance();
+		for (size_t pixel = 0; pixel < expected.size(); ++pixel)
+		{
+			const float3 difference = glm::abs(float3(irradiance[pixel] - expected[pixel]));
+			maxDifference = std::max(maxDifference, std::max(difference.x, std::max(difference.y, difference.z)));
+			maxIrradiance = std::max(maxIrradiance, std::max(expected[pixel].x, std::max(expected[pixel].y, expected[pixel].z)));
+		}
+	}
+
+	const double pixelCount = double(desc.FrameCount) * tiles.GetIrradiance().size();
+	const double tileCount = double(desc.FrameCount) * tiles.GetTileSurfelCounts().size();
+	const bool matches = maxDifference <= std::max(maxIrradiance, 1.0f) * 1e-4f;
+
+	std::string report = "Surfel binning benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(tiles.GetThreadPool().GetThreadCount()) + " threads\n";
+	report += "Surfel Count: " + std::to_string(tiles.GetSurfelCount()) + "\n";
+	report += "Candidates Per Pixel: " + std::to_string(cellListsCandidates / pixelCount) + " from cell lists, "
+		+ std::to_string(tilesCandidates / pixelCount) + " from tiles\n";
+	report += "Overflowing Tiles: " + std::to_string(100.0 * overflowTiles / tileCount) + " %\n";
+	report += FormatMs("Surfels Rendering (cell lists)", cellListsMs, desc.FrameCount);
+	report += FormatMs("Surfel Binning", binningMs, desc.FrameCount);
+	report += FormatMs("Surfels Rendering (tiles)", tilesMs, desc.FrameCount);
+	report += "Max Irradiance Difference: " + std::to_string(maxDifference) + (matches ? "\n" : " MISMATCH\n");
+	if (matches)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return matches;
+}
+
+bool RunGIResolutionBenchmark(const GIResolutionBenchmarkDesc& desc)
+{
+	// Bytes per pixel of the GI targets. The RGBA16F GI map and RG32F coverage are G-buffer sized, per GI pixel there are
+	// the RGBA16F irradiance and debug textures, two RGBA16F irradiance and geometry histories and two RGBA16F denoise targets.
+	const uint64_t GI_MAP_PIXEL_SIZE = 8 + 8;
+	const uint64_t GI_TARGETS_PIXEL_SIZE = 8 + 8 + 2 * 8 + 2 * 8 + 2 * 8;
+
+	const GlobalIlluminationCPU::GIResolution resolutions[] =
+	{
+		GlobalIlluminationCPU::GIResolution::Full,
+		GlobalIlluminationCPU::GIResolution::Half,
+		GlobalIlluminationCPU::GIResolution::Quarter,
+	};
+	const char* resolutionNames[] = { "Full", "Half", "Quarter" };
+	const uint32_t resolutionCount = uint32_t(arraysize(resolutions));
+
+	std::vector<std::unique_ptr<GlobalIlluminationCPU>> instances;
+	for (GlobalIlluminationCPU::GIResolution resolution : resolutions)
+	{
+		instances.push_back(std::make_unique<GlobalIlluminationCPU>(desc.ThreadCount));
+		instances.back()->SetResolution(resolution);
+		instances.back()->Initilize(uvec2(desc.Width, desc.Height));
+		instances.back()->SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+	}
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	gBuffer.Motion.resize(desc.Width * desc.Height);
+
+	// Differences are taken once the surfels of every instance had time to converge
+	const uint32_t firstComparedFrame = desc.FrameCount / 2;
+	std::vector<double> shadingMs(resolutionCount, 0.0);
+	std::vector<double> resolveMs(resolutionCount, 0.0);
+	std::vector<double> difference(resolutionCount, 0.0);
+	double reference = 0.0;
+	for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+	{
+		const double time = frame / 60.0;
+		const GICPUCamera camera = CreateOrbitCamera(float(time), float(desc.Width) / float(desc.Height));
+		RasterizeRoom(instances[0]->GetThreadPool(), camera, gBuffer);
+
+		for (uint32_t i = 0; i < resolutionCount; ++i)
+		{
+			instances[i]->GenerateGIMap(camera, gBuffer);
+			instances[i]->AccumulateIrradiance(RoomRadiance);
+
+			const GlobalIlluminationCPU::StageTimings& timings = instances[i]->GetTimings();
+			shadingMs[i] += timings.Coverage + timings.SurfelBinning + timings.SurfelsRendering;
+			resolveMs[i] += timings.ResolveGI + timings.Denoise;
+		}
+
+		if (frame < firstComparedFrame)
+			continue;
+
+		const std::vector<float4>& expected = instances[0]->GetGIMap();
+		for (size_t pixel = 0; pixel < expected.size(); ++pixel)
+		{
+			reference += expected[pixel].x + expected[pixel].y + expected[pixel].z;
+			for (uint32_t i = 1; i < resolutionCount; ++i)
+			{
+				const float3 pixelDifference = glm::abs(float3(instances[i]->GetGIMap()[pixel] - expected[pixel]));
+				difference[i] += pixelDifference.x + pixelDifference.y + pixelDifference.z;
+			}
+		}
+	}
+
+	std::string report = "GI resolution benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(instances[0]->GetThreadPool().GetThreadCount()) + " threads\n";
+	for (uint32_t i = 0; i < resolutionCount; ++i)
+	{
+		const uvec2 giMapSize = instances[i]->GetGIMapSize();
+		const uint64_t targetsSize = GI_MAP_PIXEL_SIZE * desc.Width * desc.Height + GI_TARGETS_PIXEL_SIZE * giMapSize.x * giMapSize.y;
+		report += std::string(resolutionNames[i]) + " (" + std::to_string(giMapSize.x) + "x" + std::to_string(giMapSize.y) + ")\n";
+		report += "  Surfel Count: " + std::to_string(instances[i]->GetSurfelCount()) + "\n";
+		report += "  GI Targets: " + std::to_string(double(targetsSize) / (1024 * 1024)) + " MB\n";
+		report += "  " + FormatMs("Coverage, Binning And Rendering", shadingMs[i], desc.FrameCount);
+		report += "  " + FormatMs("Resolve GI", resolveMs[i], desc.FrameCount);
+		if (i > 0)
+		{
+			report += "  Mean Relative Difference From Full: " + std::to_string(reference > 0.0 ? 100.0 * difference[i] / reference : 0.0) + " %\n";
+		}
+	}
+
+	// A static camera reads its history from the GI pixel itself, any offset smears the GI over the history length.
+	// Also checked at a size that is not a multiple of the GI pixel size, the pixels clamped to the last row or column are skipped.
+	const uint2 checkedSizes[] = { uint2(desc.Width, desc.Height), uint2(desc.Width + 1, desc.Height + 3) };
+	float maxHistoryShift = 0.0f;
+	for (GlobalIlluminationCPU::GIResolution resolution : resolutions)
+	{
+		const uint resolutionShift = uint(resolution);
+		for (const uint2& size : checkedSizes)
+		{
+			const uint2 giMapSize = GICPU::GetGIMapDimensions(size, resolutionShift);
+			for (uint y = 0; y < giMapSize.y; ++y)
+			{
+				for (uint x = 0; x < giMapSize.x; ++x)
+				{
+					const uint2 loc = GICPU::GetGBufferLoc(uint2(x, y), size, resolutionShift);
+					if (loc != (uint2(x, y) << resolutionShift) + uint2((1u << resolutionShift) / 2))
+						continue;
+
+					const float2 shift = glm::abs(GICPU::GetHistoryPixel(loc, float2(0.0f), size, resolutionShift) - float2(x, y));
+					maxHistoryShift = std::max(maxHistoryShift, std::max(shift.x, shift.y));
+				}
+			}
+		}
+	}
+	report += "Max History Shift With A Static Camera: " + std::to_string(maxHistoryShift) + " GI pixels\n";
+
+	const bool valid = maxHistoryShift <= 1e-3f;
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunGIDenoiseBenchmark(const GIDenoiseBenchmarkDesc& desc)
+{
+	const uint32_t defaultRayBudget = GlobalIlluminationCPU(1).GetRayBudget();
+	const uint32_t rayBudgetDivisors[] = { 1, 2, 4, 8 };
+	const uint32_t budgetCount = uint32_t(arraysize(rayBudgetDivisors));
+
+	const uint32_t referenceRayBudget = defaultRayBudget * desc.ReferenceRayBudgetScale;
+	auto createInstance = [&](uint32_t denoiseIterations)
+	{
+		auto instance = std::make_unique<GlobalIlluminationCPU>(desc.ThreadCount);
+		instance->Initilize(uvec2(desc.Width, desc.Height));
+		instance->SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+		instance->SetRayBudget(referenceRayBudget);
+		instance->SetDenoiseIterations(denoiseIterations);
+		return instance;
+	};
+
+	// Instance 2 * i runs budget i without the denoiser, 2 * i + 1 with it. Every instance converges with the reference
+	// budget over the first half of the frames and drops to its own for the compared half, so the differences are the
+	// noise a budget leaves rather than how long the surfels take to converge with it.
+	std::unique_ptr<GlobalIlluminationCPU> reference = createInstance(0);
+	std::vector<std::unique_ptr<GlobalIlluminationCPU>> instances;
+	for (uint32_t budget = 0; budget < budgetCount; ++budget)
+	{
+		instances.push_back(createInstance(0));
+		instances.push_back(createInstance(desc.DenoiseIterations));
+	}
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	gBuffer.Motion.resize(desc.Width * desc.Height);
+
+	// Pixels next to another surface, where a blur would leak the GI of one wall onto the other
+	auto isEdgePixel = [&](uint32_t x, uint32_t y)
+	{
+		const float3 normal = gBuffer.Normal[y * desc.Width + x];
+		const uint32_t neighbours[4][2] = { { x - 1, y }, { x + 1, y }, { x, y - 1 }, { x, y + 1 } };
+		for (const auto& neighbour : neighbours)
+		{
+			if (neighbour[0] < desc.Width && neighbour[1] < desc.Height
+				&& glm::dot(gBuffer.Normal[neighbour[1] * desc.Width + neighbour[0]] * 2.0f - 1.0f, normal * 2.0f - 1.0f) < 0.9f)
+				return true;
+		}
+		return false;
+	};
+
+	const uint32_t firstComparedFrame = desc.FrameCount / 2;
+	std::vector<double> difference(instances.size(), 0.0);
+	std::vector<double> noiseDifference(instances.size(), 0.0);
+	std::vector<double> edgeDifference(instances.size(), 0.0);
+	std::vector<double> denoiseMs(instances.size(), 0.0);
+	double referenceSum = 0.0;
+	double edgeReferenceSum = 0.0;
+	for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+	{
+		if (frame == firstComparedFrame)
+		{
+			for (size_t i = 0; i < instances.size(); ++i)
+			{
+				instances[i]->SetRayBudget(defaultRayBudget / rayBudgetDivisors[i / 2]);
+			}
+		}
+
+		const double time = frame / 60.0;
+		const GICPUCamera camera = CreateOrbitCamera(float(time), float(desc.Width) / float(desc.Height));
+		RasterizeRoom(reference->GetThreadPool(), camera, gBuffer);
+
+		reference->GenerateGIMap(camera, gBuffer);
+		reference->AccumulateIrradiance(RoomRadiance);
+		for (size_t i = 0; i < instances.size(); ++i)
+		{
+			instances[i]->GenerateGIMap(camera, gBuffer);
+			instances[i]->AccumulateIrradiance(RoomRadiance);
+			denoiseMs[i] += instances[i]->GetTimings().Denoise;
+		}
+
+		if (frame < firstComparedFrame)
+			continue;
+
+		// The estimator loses some energy with few rays per frame whatever the denoiser does, so the map is scaled to
+		// the energy of the reference for the noise and edge differences
+		auto getEnergy = [&](const std::vector<float4>& giMap)
+		{
+			double energy = 0.0;
+			for (uint32_t pixel = 0; pixel < desc.Width * desc.Height; ++pixel)
+			{
+				energy += gBuffer.Depth[pixel] < 1.0f ? giMap[pixel].x + giMap[pixel].y + giMap[pixel].z : 0.0;
+			}
+			return energy;
+		};
+
+		const std::vector<float4>& expected = reference->GetGIMap();
+		const double referenceEnergy = getEnergy(expected);
+		std::vector<float> energyScales(instances.size());
+		for (size_t i = 0; i < instances.size(); ++i)
+		{
+			const double energy = getEnergy(instances[i]->GetGIMap());
+			energyScales[i] = energy > 0.0 ? float(referenceEnergy / energy) : 1.0f;
+		}
+
+		for (uint32_t y = 0; y < desc.Height; ++y)
+		{
+			for (uint32_t x = 0; x < desc.Width; ++x)
+			{
+				const uint32_t pixel = y * desc.Width + x;
+				if (gBuffer.Depth[pixel] >= 1.0f)
+					continue;
+
+				const bool edge = isEdgePixel(x, y);
+				const float3 expectedIrradiance = float3(expected[pixel]);
+				const double expectedSum = expectedIrradiance.x + expectedIrradiance.y + expectedIrradiance.z;
+				referenceSum += expectedSum;
+				edgeReferenceSum += edge ? expectedSum : 0.0;
+				for (size_t i = 0; i < instances.size(); ++i)
+				{
+					const float3 irradiance = float3(instances[i]->GetGIMap()[pixel]);
+					const float3 pixelDifference = glm::abs(irradiance - expectedIrradiance);
+					const float3 matchedDifference = glm::abs(irradiance * energyScales[i] - expectedIrradiance);
+					const double matchedSum = matchedDifference.x + matchedDifference.y + matchedDifference.z;
+					difference[i] += pixelDifference.x + pixelDifference.y + pixelDifference.z;
+					noiseDifference[i] += matchedSum;
+					edgeDifference[i] += edge ? matchedSum : 0.0;
+				}
+			}
+		}
+	}
+
+	auto percent = [](double value, double total) { return std::to_string(total > 0.0 ? 100.0 * value / total : 0.0) + " %"; };
+	std::string report = "GI denoise benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(desc.DenoiseIterations) + " iterations, "
+		+ std::to_string(reference->GetThreadPool().GetThreadCount()) + " threads\n";
+	report += "Reference: " + std::to_string(reference->GetRayBudget()) + " rays per frame, not denoised\n";
+	for (uint32_t budget = 0; budget < budgetCount; ++budget)
+	{
+		report += std::to_string(instances[2 * budget]->GetRayBudget()) + " Rays Per Frame\n";
+		for (uint32_t denoised = 0; denoised < 2; ++denoised)
+		{
+			const size_t i = 2 * budget + denoised;
+			report += std::string(denoised ? "  Denoised" : "  Raw") + ": " + percent(difference[i], referenceSum) + " mean relative difference, "
+				+ percent(noiseDifference[i], referenceSum) + " with the energy matched, " + percent(edgeDifference[i], edgeReferenceSum) + " at edges";
+			report += denoised ? ", " + FormatMs("Denoise", denoiseMs[i], desc.FrameCount) : "\n";
+		}
+	}
+	logInfo(report);
+	return true;
+}
+
+bool RunSurfelLodBenchmark(const SurfelLodBenchmarkDesc& desc)
+{
+	const float lodPixelRadii[] = { 0.0f, desc.LodPixelRadius * float(desc.Height) / 1080.0f };
+	const char* lodNames[] = { "Level Radius", "Footprint Radius" };
+	const uint32_t lodCount = uint32_t(arraysize(lodPixelRadii));
+
+	std::vector<std::unique_ptr<GlobalIlluminationCPU>> instances;
+	for (float lodPixelRadius : lodPixelRadii)
+	{
+		instances.push_back(std::make_unique<GlobalIlluminationCPU>(desc.ThreadCount));
+		instances.back()->Initilize(uvec2(desc.Width, desc.Height));
+		instances.back()->SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+		instances.back()->SetSurfelLodPixelRadius(lodPixelRadius);
+	}
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	gBuffer.Motion.resize(desc.Width * desc.Height);
+
+	// Differences are taken once the surfels of every instance had time to converge
+	const uint32_t firstComparedFrame = desc.FrameCount / 2;
+	std::vector<double> surfelMs(lodCount, 0.0);
+	std::vector<uint64_t> surfelCounts(lodCount, 0);
+	double reference = 0.0;
+	double difference = 0.0;
+	double nearReference = 0.0;
+	double nearDifference = 0.0;
+	for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+	{
+		const double time = frame / 60.0;
+		const GICPUCamera camera = CreateOrbitCamera(float(time), float(desc.Width) / float(desc.Height), true);
+		RasterizeRoom(instances[0]->GetThreadPool(), camera, gBuffer);
+
+		for (uint32_t i = 0; i < lodCount; ++i)
+		{
+			instances[i]->GenerateGIMap(camera, gBuffer);
+			instances[i]->AccumulateIrradiance(RoomRadiance);
+
+			const GlobalIlluminationCPU::StageTimings& timings = instances[i]->GetTimings();
+			surfelMs[i] += timings.Coverage + timings.SurfelBinning + timings.SurfelsRendering + timings.Accumulate;
+		}
+
+		if (frame < firstComparedFrame)
+			continue;
+
+		const std::vector<float4>& expected = instances[0]->GetGIMap();
+		const std::vector<float4>& actual = instances[1]->GetGIMap();
+		for (uint32_t i = 0; i < lodCount; ++i)
+		{
+			surfelCounts[i] += instances[i]->GetSurfelCount();
+		}
+		for (uint32_t y = 0; y < desc.Height; ++y)
+		{
+			for (uint32_t x = 0; x < desc.Width; ++x)
+			{
+				const uint32_t pixel = y * desc.Width + x;
+				const float3 expectedColor = float3(expected[pixel]);
+				const float3 pixelDifference = glm::abs(float3(actual[pixel]) - expectedColor);
+				const double pixelReference = expectedColor.x + expectedColor.y + expectedColor.z;
+				const double pixelError = pixelDifference.x + pixelDifference.y + pixelDifference.z;
+				reference += pixelReference;
+				difference += pixelError;
+
+				const float depth = gBuffer.Depth[pixel];
+				const float3 posW = GICPU::GetWorldPosition(uint2(x, y), uint2(desc.Width, desc.Height), depth, camera.InvViewProj);
+				if (depth < 1.0f && glm::length(posW - camera.PosW) < desc.NearDistance)
+				{
+					nearReference += pixelReference;
+					nearDifference += pixelError;
+				}
+			}
+		}
+	}
+
+	const uint32_t comparedFrameCount = std::max(desc.FrameCount - firstComparedFrame, 1u);
+	std::string report = "Surfel LOD benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(instances[0]->GetThreadPool().GetThreadCount()) + " threads\n";
+	for (uint32_t i = 0; i < lodCount; ++i)
+	{
+		report += std::string(lodNames[i]) + " (" + std::to_string(lodPixelRadii[i]) + " pixels)\n";
+		report += "  Mean Surfel Count: " + std::to_string(surfelCounts[i] / comparedFrameCount) + "\n";
+		report += "  " + FormatMs("Coverage, Binning, Rendering And Accumulation", surfelMs[i], desc.FrameCount);
+	}
+	report += "Mean Relative Difference: " + std::to_string(reference > 0.0 ? 100.0 * difference / reference : 0.0) + " %\n";
+	const double nearRelativeDifference = nearReference > 0.0 ? nearDifference / nearReference : 0.0;
+	report += "Mean Relative Difference Closer Than " + std::to_string(desc.NearDistance) + " m: "
+		+ std::to_string(100.0 * nearRelativeDifference) + " %\n";
+
+	// Distant surfaces get fewer and larger surfels, close up ones the same as without the footprint
+	const bool fewerSurfels = surfelCounts[1] < surfelCounts[0];
+	const bool nearValid = nearRelativeDifference <= desc.MaxNearRelativeDifference;
+	const bool valid = fewerSurfels && nearValid;
+	if (!fewerSurfels)
+	{
+		report += "The footprint radius does not reduce the surfel count\n";
+	}
+	if (!nearValid)
+	{
+		report += "The near pixels differ by more than " + std::to_string(100.0f * desc.MaxNearRelativeDifference) + " %\n";
+	}
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunSurfelInvalidationBenchmark(const SurfelInvalidationBenchmarkDesc& desc)
+{
+	enum class Mode : uint32_t { Ignore, Invalidate, Reset, Count };
+	const char* modeNames[] = { "Ignore Moves", "Invalidate Box Bounds", "Reset On Move" };
+	const uint32_t modeCount = uint32_t(Mode::Count);
+
+	std::vector<std::unique_ptr<GlobalIlluminationCPU>> instances;
+	for (uint32_t i = 0; i < modeCount; ++i)
+	{
+		instances.push_back(std::make_unique<GlobalIlluminationCPU>(desc.ThreadCount));
+		instances.back()->Initilize(uvec2(desc.Width, desc.Height));
+		instances.back()->SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+	}
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	gBuffer.Motion.resize(desc.Width * desc.Height);
+
+	std::vector<double> evictionMs(modeCount, 0.0);
+	std::vector<uint64_t> surfelCounts(modeCount, 0);
+	std::vector<uint64_t> staleCounts(modeCount, 0);
+	std::vector<uint32_t> maxStaleCounts(modeCount, 0);
+	uint32_t movedFrameCount = 0;
+	RoomBox previousBox = GetMovingRoomBox(0.0f);
+	for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+	{
+		const double time = frame / 60.0;
+		const RoomBox box = GetMovingRoomBox(float(time));
+		const bool moved = box.Center != previousBox.Center;
+		movedFrameCount += moved ? 1 : 0;
+
+		const GICPUCamera camera = CreateOrbitCamera(float(time), float(desc.Width) / float(desc.Height));
+		RasterizeRoom(instances[0]->GetThreadPool(), camera, gBuffer, &box);
+
+		for (uint32_t i = 0; i < modeCount; ++i)
+		{
+			GlobalIlluminationCPU& gi = *instances[i];
+			if (moved && Mode(i) == Mode::Invalidate)
+			{
+				gi.InvalidateBox(previousBox.Center - previousBox.HalfExtent, previousBox.Center + previousBox.HalfExtent);
+				gi.InvalidateBox(box.Center - box.HalfExtent, box.Center + box.HalfExtent);
+			}
+			else if (moved && Mode(i) == Mode::Reset)
+			{
+				gi.ResetGI();
+			}
+
+			gi.GenerateGIMap(camera, gBuffer);
+			gi.AccumulateIrradiance([&box](const float3& origin, const float3& direction)
+			{
+				return GetRoomHitRadiance(TraceRoom(origin, direction, &box));
+			});
+			evictionMs[i] += gi.GetTimings().Eviction;
+
+			uint32_t staleCount = 0;
+			for (uint32_t surfelIndex = 0; surfelIndex < gi.GetSurfelCount(); ++surfelIndex)
+			{
+				const Surfel surfel = gi.GetSurfel(surfelIndex);
+				if (surfel.Age != SURFEL_DEAD && std::abs(GetRoomSurfaceDistance(surfel.Position, box)) > desc.StaleDistance)
+				{
+					++staleCount;
+				}
+			}
+			surfelCounts[i] += gi.GetSurfelCount() - gi.GetFreeSurfelCount();
+			staleCounts[i] += staleCount;
+			maxStaleCounts[i] = std::max(maxStaleCounts[i], staleCount);
+		}
+		previousBox = box;
+	}
+
+	const uint32_t frameCount = std::max(desc.FrameCount, 1u);
+	std::string report = "Surfel invalidation benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(movedFrameCount) + " with the box moving, "
+		+ std::to_string(instances[0]->GetThreadPool().GetThreadCount()) + " threads\n";
+	for (uint32_t i = 0; i < modeCount; ++i)
+	{
+		report += std::string(modeNames[i]) + "\n";
+		report += "  Mean Alive Surfels: " + std::to_string(surfelCounts[i] / frameCount) + "\n";
+		report += "  Mean Stale Surfels: " + std::to_string(staleCounts[i] / frameCount) + ", Max: " + std::to_string(maxStaleCounts[i]) + "\n";
+		report += "  " + FormatMs("Eviction", evictionMs[i], frameCount);
+	}
+
+	// Invalidation that stops reaching the moved box leaves about as many stale surfels as ignoring the moves
+	const double invalidatedStale = double(staleCounts[uint32_t(Mode::Invalidate)]);
+	const double staleBound = std::max(double(staleCounts[uint32_t(Mode::Reset)]), desc.MaxStaleFraction * double(staleCounts[uint32_t(Mode::Ignore)]));
+	const bool valid = invalidatedStale <= staleBound;
+	report += "Mean Stale Surfels Bound For Invalidate Box Bounds: " + std::to_string(staleBound / frameCount) + (valid ? "\n" : " EXCEEDED\n");
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunSurfelCellCapacityBenchmark(const SurfelCellCapacityBenchmarkDesc& desc)
+{
+	// Spread over the floor and the two walls of the corner, facing into the room
+	std::vector<Surfel> surfels(desc.CrammedSurfelCount);
+	uint32_t state = 0x9E3779B9;
+	auto nextFloat = [&state]()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return float(state) * (1.0f / 4294967296.0f);
+	};
+	for (uint32_t i = 0; i < desc.CrammedSurfelCount; ++i)
+	{
+		const uint32_t axis = i % 3;
+		Surfel& surfel = surfels[i];
+		surfel.Position = float3(-ROOM_HALF_EXTENT) + float3(nextFloat(), nextFloat(), nextFloat()) * desc.CornerSize;
+		surfel.Position[axis] = -ROOM_HALF_EXTENT;
+		surfel.Normal = float3(0.0f);
+		surfel.Normal[axis] = 1.0f;
+		surfel.Irradiance = MultiscaleMeanEstimatorData{};
+	}
+
+	// SurfelClosestHit looks up the irradiance at every hit of the accumulation rays, the CPU accumulation only traces the room
+	std::vector<float3> lookupPositions(desc.LookupCount);
+	std::vector<float3> lookupNormals(desc.LookupCount);
+	for (uint32_t i = 0; i < desc.LookupCount; ++i)
+	{
+		const float3 direction = GICPU::GetCosHemisphereSample(float2(nextFloat(), nextFloat()), float3(0.0f, 1.0f, 0.0f), float3(1.0f, 0.0f, 0.0f));
+		const RoomHit hit = TraceRoom(float3(1.0f, 0.5f, 1.0f), nextFloat() < 0.5f ? direction : -direction);
+		lookupPositions[i] = hit.Position;
+		lookupNormals[i] = hit.Normal;
+	}
+
+	const char* modeNames[] = { "Unbounded", "Refuse", "Merge Nearest" };
+	const uint32_t modeCount = 3;
+	// One more refusing instance with tile binning on, it has to shade like the capped cell lists it falls back to
+	const uint32_t binnedIndex = modeCount;
+	std::vector<std::unique_ptr<GlobalIlluminationCPU>> instances;
+	for (uint32_t i = 0; i <= binnedIndex; ++i)
+	{
+		instances.push_back(std::make_unique<GlobalIlluminationCPU>(desc.ThreadCount));
+		GlobalIlluminationCPU& gi = *instances.back();
+		gi.Initilize(uvec2(desc.Width, desc.Height));
+		gi.SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+		gi.SetBinSurfelsPerTile(i == binnedIndex);
+		// The corner stays crammed instead of thinning out through the coverage eviction
+		gi.SetMaxSurfelCoverage(FLT_MAX);
+		gi.SetWorldStructureBuildMode(desc.RebuildWorldStructure ? GlobalIlluminationCPU::WorldStructureBuildMode::Rebuild
+			: GlobalIlluminationCPU::WorldStructureBuildMode::Incremental);
+		gi.SetSurfelCellCapacity(i == 0 ? 0 : desc.CellCapacity);
+		gi.SetSurfelCellOverflow(i == 2 ? SURFEL_CELL_OVERFLOW_MERGE : SURFEL_CELL_OVERFLOW_REFUSE);
+	}
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	const GICPUCamera camera = CreateCornerCamera(float(desc.Width) / float(desc.Height));
+	RasterizeRoom(instances[0]->GetThreadPool(), camera, gBuffer);
+	for (std::unique_ptr<GlobalIlluminationCPU>& gi : instances)
+	{
+		gi->GenerateGIMap(camera, gBuffer);
+		gi->AddSurfels(surfels);
+	}
+
+	std::vector<double> coverageMs(modeCount, 0.0);
+	std::vector<double> renderingMs(modeCount, 0.0);
+	std::vector<double> lookupMs(modeCount, 0.0);
+	std::vector<uint64_t> candidates(modeCount, 0);
+	std::vector<uint64_t> lookupCandidates(modeCount, 0);
+	std::vector<uint32_t> maxLookupCandidates(modeCount, 0);
+	std::vector<uint64_t> overflowedSpawns(modeCount, 0);
+	std::vector<uint32_t> maxCellLists(modeCount, 0);
+	std::vector<uint32_t> topCandidateBins(modeCount, 0);
+	std::vector<uint64_t> aliveSurfels(modeCount, 0);
+	float maxBinnedDifference = 0.0f;
+	float maxBinnedIrradiance = 0.0f;
+	for (uint32_t frame = 1; frame <= desc.FrameCount; ++frame)
+	{
+		for (uint32_t i = 0; i < modeCount; ++i)
+		{
+			GlobalIlluminationCPU& gi = *instances[i];
+			gi.GenerateGIMap(camera, gBuffer);
+			gi.AccumulateIrradiance(RoomRadiance);
+			const GICPU::SurfelsDataView data = gi.GetSurfelsDataView();
+			lookupMs[i] += TimeIterations(1, [&]
+			{
+				for (uint32_t lookup = 0; lookup < desc.LookupCount; ++lookup)
+				{
+					uint candidateCount = 0;
+					GICPU::GetIrradianceAtPoint(data, lookupPositions[lookup], lookupNormals[lookup], true, &candidateCount);
+					lookupCandidates[i] += candidateCount;
+					maxLookupCandidates[i] = std::max(maxLookupCandidates[i], candidateCount);
+				}
+			});
+			coverageMs[i] += gi.GetTimings().Coverage;
+			renderingMs[i] += gi.GetTimings().SurfelsRendering;
+			candidates[i] += gi.GetRenderedCandidateCount();
+
+			const GIFrameStatistics& statistics = gi.GetStatistics();
+			overflowedSpawns[i] += statistics.OverflowedSpawns;
+			maxCellLists[i] = std::max(maxCellLists[i], statistics.MaxCellListLength);
+			for (uint32_t bin = 0; bin < GI_STATISTICS_CANDIDATE_BIN_COUNT; ++bin)
+			{
+				if (statistics.CandidateHistogram[bin] != 0)
+				{
+					topCandidateBins[i] = std::max(topCandidateBins[i], bin);
+				}
+			}
+			aliveSurfels[i] += statistics.SurfelCount - statistics.FreeSurfelCount;
+		}
+
+		GlobalIlluminationCPU& binned = *instances[binnedIndex];
+		binned.GenerateGIMap(camera, gBuffer);
+		binned.AccumulateIrradiance(RoomRadiance);
+		const std::vector<float4>& expected = instances[1]->GetIrradiance();
+		const std::vector<float4>& irradiance = binned.GetIrradiance();
+		for (size_t pixel = 0; pixel < expected.size(); ++pixel)
+		{
+			const float3 difference = glm::abs(float3(irradiance[pixel] - expected[pixel]));
+			maxBinnedDifference = std::max(maxBinnedDifference, std::max(difference.x, std::max(difference.y, difference.z)));
+			maxBinnedIrradiance = std::max(maxBinnedIrradiance, std::max(expected[pixel].x, std::max(expected[pixel].y, expected[pixel].z)));
+		}
+	}
+
+	const uint32_t frameCount = std::max(desc.FrameCount, 1u);
+	const double pixelCount = double(frameCount) * instances[0]->GetIrradiance().size();
+	const double lookupCount = double(frameCount) * std::max(desc.LookupCount, 1u);
+	const float3 luminance = float3(0.299f, 0.587f, 0.114f);
+	const std::vector<float4>& reference = instances[0]->GetIrradiance();
+	bool withinCapacity = true;
+	std::string report = "Surfel cell capacity benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(desc.CrammedSurfelCount) + " crammed surfels, capacity "
+		+ std::to_string(desc.CellCapacity) + (desc.RebuildWorldStructure ? ", rebuild, " : ", incremental, ")
+		+ std::to_string(instances[0]->GetThreadPool().GetThreadCount()) + " threads\n";
+	for (uint32_t i = 0; i < modeCount; ++i)
+	{
+		// Last frame, a hole is a pixel the unbounded lists shade that gets no surfel. The crammed surfels share the ray
+		// budget, so none of the GI maps is converged and they are compared by brightness only.
+		const std::vector<float4>& irradiance = instances[i]->GetIrradiance();
+		double total = 0.0;
+		uint32_t holes = 0;
+		for (size_t pixel = 0; pixel < reference.size(); ++pixel)
+		{
+			const float value = glm::dot(luminance, float3(irradiance[pixel]));
+			total += value;
+			holes += glm::dot(luminance, float3(reference[pixel])) > 0.0f && value <= 0.0f ? 1 : 0;
+		}
+
+		const uint32_t topBin = topCandidateBins[i];
+		const bool capped = i != 0;
+		withinCapacity = withinCapacity && (!capped || maxCellLists[i] <= desc.CellCapacity);
+		report += std::string(modeNames[i]) + "\n";
+		report += "  Mean Alive Surfels: " + std::to_string(aliveSurfels[i] / frameCount) + "\n";
+		report += "  Max Cell List: " + std::to_string(maxCellLists[i]) + (capped && maxCellLists[i] > desc.CellCapacity ? " OVER CAPACITY\n" : "\n");
+		report += "  Candidates Per Pixel: " + std::to_string(candidates[i] / pixelCount) + ", Top Histogram Bin: "
+			+ std::to_string(GIFrameStatistics::GetCandidateBinStart(topBin)) + (topBin + 1 == GI_STATISTICS_CANDIDATE_BIN_COUNT ? "+\n" : "\n");
+		report += "  Candidates Per Lookup: " + std::to_string(lookupCandidates[i] / lookupCount) + ", Max: " + std::to_string(maxLookupCandidates[i]) + "\n";
+		report += "  Overflowed Spawns Per Frame: " + std::to_string(double(overflowedSpawns[i]) / frameCount) + "\n";
+		report += "  " + FormatMs("Coverage", coverageMs[i], frameCount);
+		report += "  " + FormatMs("Surfels Rendering", renderingMs[i], frameCount);
+		report += "  " + FormatMs("Closest Hit Lookups", lookupMs[i], frameCount);
+		report += "  Mean GI Luminance: " + std::to_string(total / std::max<size_t>(reference.size(), 1)) + ", Holes: "
+			+ std::to_string(100.0 * holes / std::max<size_t>(reference.size(), 1)) + " %\n";
+	}
+	const bool binnedMatches = maxBinnedDifference <= std::max(maxBinnedIrradiance, 1.0f) * 1e-4f;
+	report += "Max Irradiance Difference Of Tile Binning Under Capacity: " + std::to_string(maxBinnedDifference) + (binnedMatches ? "\n" : " MISMATCH\n");
+	const bool valid = withinCapacity && binnedMatches;
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunSurfelDefragmentBenchmark(const SurfelDefragmentBenchmarkDesc& desc)
+{
+	// Spread over the six walls facing into the room, lit by the radiance of the wall they face
+	std::vector<Surfel> surfels(desc.SurfelCount);
+	uint32_t state = 0x9E3779B9;
+	auto nextFloat = [&state]()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return float(state) * (1.0f / 4294967296.0f);
+	};
+	for (Surfel& surfel : surfels)
+	{
+		const uint32_t axis = std::min(uint32_t(nextFloat() * 3.0f), 2u);
+		const float side = nextFloat() < 0.5f ? -1.0f : 1.0f;
+		surfel.Position = (float3(nextFloat(), nextFloat(), nextFloat()) * 2.0f - 1.0f) * ROOM_HALF_EXTENT;
+		surfel.Position[axis] = side * ROOM_HALF_EXTENT;
+		surfel.Normal = float3(0.0f);
+		surfel.Normal[axis] = -side;
+		const float3 irradiance = RoomRadiance(surfel.Position, surfel.Normal);
+		surfel.Irradiance = MultiscaleMeanEstimatorData{};
+		surfel.Irradiance.mean = irradiance;
+		surfel.Irradiance.shortMean = irradiance;
+	}
+
+	const char* modeNames[] = { "Spawn Order", "Morton Defragment" };
+	const uint32_t modeCount = 2;
+	std::vector<std::unique_ptr<GlobalIlluminationCPU>> instances;
+	for (uint32_t i = 0; i < modeCount; ++i)
+	{
+		instances.push_back(std::make_unique<GlobalIlluminationCPU>(desc.ThreadCount));
+		GlobalIlluminationCPU& gi = *instances.back();
+		gi.Initilize(uvec2(desc.Width, desc.Height));
+		gi.SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+		gi.SetBinSurfelsPerTile(false);
+		// The walls behind the orbiting camera keep their surfels, so every lookup sees the same storage
+		gi.SetMaxSurfelCoverage(FLT_MAX);
+		gi.SetMaxUnseenFrames(UINT32_MAX);
+		gi.SetDefragmentWindow(i == 0 ? 0 : desc.DefragmentWindow);
+	}
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	const float aspectRatio = float(desc.Width) / float(desc.Height);
+	RasterizeRoom(instances[0]->GetThreadPool(), CreateOrbitCamera(0.0f, aspectRatio), gBuffer);
+	for (std::unique_ptr<GlobalIlluminationCPU>& gi : instances)
+	{
+		gi->GenerateGIMap(CreateOrbitCamera(0.0f, aspectRatio), gBuffer);
+		gi->AddSurfels(surfels);
+	}
+
+	// Walks the cell list of every pixel like GetIrradianceAtPoint, reading the index, the geometry and the irradiance
+	// mean of each surfel from buffers placed apart in the address space
+	struct CacheStatistics
+	{
+		double MissesPerLookup = 0.0;
+		double LinesPerTile = 0.0;
+		double CandidatesPerLookup = 0.0;
+	};
+	auto simulateLookups = [&](const GlobalIlluminationCPU& gi, const GICPUCamera& camera)
+	{
+		const GICPU::SurfelsDataView data = gi.GetSurfelsDataView();
+		const uint64_t indicesBase = 1ull << 40;
+		const uint64_t geometryBase = 2ull << 40;
+		const uint64_t irradianceBase = 3ull << 40;
+		CacheSimulator cache(desc.CacheSize, desc.CacheLineSize, desc.CacheWays);
+		std::vector<uint64_t> tileLines;
+		uint64_t lookups = 0;
+		uint64_t candidates = 0;
+		uint64_t lines = 0;
+		uint64_t tiles = 0;
+		const uint2 dim = uint2(desc.Width, desc.Height);
+		for (uint32_t tileY = 0; tileY < desc.Height; tileY += 8)
+		{
+			for (uint32_t tileX = 0; tileX < desc.Width; tileX += 8)
+			{
+				tileLines.clear();
+				auto access = [&](uint64_t address)
+				{
+					cache.Access(address);
+					tileLines.push_back(address / cache.GetLineSize());
+				};
+				for (uint32_t y = tileY; y < std::min(tileY + 8, desc.Height); ++y)
+				{
+					for (uint32_t x = tileX; x < std::min(tileX + 8, desc.Width); ++x)
+					{
+						const float depth = gBuffer.Depth[y * desc.Width + x];
+						if (depth >= 1.0f)
+							continue;
+
+						const float3 posW = GICPU::GetWorldPosition(uint2(x, y), dim, depth, camera.InvViewProj);
+						const uint level = GICPU::GetWorldLevel(posW, data.CameraPosW);
+						const uint worldIndex = GICPU::FindWorldCell(data.WorldStructureKeys, GICPU::GetWorldCell(posW, level), level);
+						if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX)
+							continue;
+
+						const WorldStructureChunk chunk = data.WorldStructure[worldIndex];
+						const uint count = chunk.StartIndex + chunk.Count > data.IndicesSize
+							? (chunk.StartIndex < data.IndicesSize ? data.IndicesSize - chunk.StartIndex : 0) : chunk.Count;
+						for (uint i = 0; i < count; ++i)
+						{
+							const uint surfelIndex = data.Indices[chunk.StartIndex + i];
+							access(indicesBase + uint64_t(chunk.StartIndex + i) * sizeof(uint));
+							access(geometryBase + uint64_t(surfelIndex) * sizeof(uint4));
+							access(irradianceBase + uint64_t(surfelIndex) * sizeof(float4));
+						}
+						candidates += count;
+						++lookups;
+					}
+				}
+				std::sort(tileLines.begin(), tileLines.end());
+				lines += std::unique(tileLines.begin(), tileLines.end()) - tileLines.begin();
+				++tiles;
+			}
+		}
+
+		CacheStatistics statistics;
+		statistics.MissesPerLookup = double(cache.GetMisses()) / std::max<uint64_t>(lookups, 1);
+		statistics.LinesPerTile = double(lines) / std::max<uint64_t>(tiles, 1);
+		statistics.CandidatesPerLookup = double(candidates) / std::max<uint64_t>(lookups, 1);
+		return statistics;
+	};
+
+	std::string report = "Surfel defragment benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(desc.SurfelCount) + " surfels, window "
+		+ std::to_string(desc.DefragmentWindow) + ", " + std::to_string(desc.CacheSize / 1024) + " KB " + std::to_string(desc.CacheWays)
+		+ " way cache with " + std::to_string(desc.CacheLineSize) + " B lines, " + std::to_string(instances[0]->GetThreadPool().GetThreadCount())
+		+ " threads\n";
+	std::vector<double> renderingMs(modeCount, 0.0);
+	std::vector<double> defragmentMs(modeCount, 0.0);
+	const float3 luminance = float3(0.299f, 0.587f, 0.114f);
+	float maxDifference = 0.0f;
+	uint32_t nextCheckpoint = 1;
+	for (uint32_t frame = 1; frame <= desc.FrameCount; ++frame)
+	{
+		const float time = frame / 60.0f;
+		const GICPUCamera camera = CreateOrbitCamera(time, aspectRatio);
+		RasterizeRoom(instances[0]->GetThreadPool(), camera, gBuffer);
+		for (uint32_t i = 0; i < modeCount; ++i)
+		{
+			GlobalIlluminationCPU& gi = *instances[i];
+			gi.GenerateGIMap(camera, gBuffer);
+			renderingMs[i] += gi.GetTimings().SurfelsRendering;
+			defragmentMs[i] += gi.GetTimings().Defragment;
+		}
+
+		// Moving surfels keeps every cell list in its order, so both add up the same surfels in the same order
+		const std::vector<float4>& reference = instances[0]->GetIrradiance();
+		const std::vector<float4>& irradiance = instances[1]->GetIrradiance();
+		for (size_t pixel = 0; pixel < reference.size(); ++pixel)
+		{
+			maxDifference = std::max(maxDifference, std::abs(glm::dot(luminance, float3(irradiance[pixel]) - float3(reference[pixel]))));
+		}
+
+		if (frame != nextCheckpoint && frame != desc.FrameCount)
+			continue;
+
+		nextCheckpoint *= 2;
+		report += "Frame " + std::to_string(frame) + "\n";
+		for (uint32_t i = 0; i < modeCount; ++i)
+		{
+			const CacheStatistics statistics = simulateLookups(*instances[i], camera);
+			report += std::string("  ") + modeNames[i] + ": " + std::to_string(statistics.MissesPerLookup) + " misses per lookup, "
+				+ std::to_string(statistics.LinesPerTile) + " lines per tile, " + std::to_string(statistics.CandidatesPerLookup) + " candidates per lookup\n";
+		}
+	}
+
+	const uint32_t frameCount = std::max(desc.FrameCount, 1u);
+	for (uint32_t i = 0; i < modeCount; ++i)
+	{
+		report += std::string(modeNames[i]) + "\n";
+		report += "  Surfel Count: " + std::to_string(instances[i]->GetSurfelCount()) + "\n";
+		report += "  " + FormatMs("Surfels Rendering", renderingMs[i], frameCount);
+		report += "  " + FormatMs("Defragment", defragmentMs[i], frameCount);
+	}
+	report += "Max GI Luminance Difference: " + std::to_string(maxDifference) + "\n";
+	const bool valid = maxDifference <= 1e-4f;
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunSurfelCapacityBenchmark(const SurfelCapacityBenchmarkDesc& desc)
+{
+	const char* modeNames[] = { "Grow In Place", "Start Over" };
+	const uint32_t modeCount = 2;
+	std::vector<std::unique_ptr<GlobalIlluminationCPU>> instances;
+	for (uint32_t i = 0; i < modeCount; ++i)
+	{
+		instances.push_back(std::make_unique<GlobalIlluminationCPU>(desc.ThreadCount));
+		GlobalIlluminationCPU& gi = *instances.back();
+		gi.Initilize(uvec2(desc.Width, desc.Height), desc.InitialMaxSurfels);
+		gi.SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+		gi.SetWorldStructureBuildMode(desc.RebuildWorldStructure ? GlobalIlluminationCPU::WorldStructureBuildMode::Rebuild
+			: GlobalIlluminationCPU::WorldStructureBuildMode::Incremental);
+	}
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	const float aspectRatio = float(desc.Width) / float(desc.Height);
+	const float3 luminance = float3(0.299f, 0.587f, 0.114f);
+	auto getMeanLuminance = [&](const GlobalIlluminationCPU& gi)
+	{
+		double total = 0.0;
+		for (const float4& value : gi.GetGIMap())
+		{
+			total += glm::dot(luminance, float3(value));
+		}
+		return total / std::max<size_t>(gi.GetGIMap().size(), 1);
+	};
+
+	const uint32_t growFrame = desc.FrameCount / 2;
+	std::vector<uint32_t> capacityChanges(modeCount, 0);
+	std::vector<uint32_t> framesOverCapacity(modeCount, 0);
+	std::vector<uint32_t> endsOverCapacity(modeCount, 0);
+	std::vector<double> maxEntriesPerSurfel(modeCount, 0.0);
+	std::vector<double> luminanceBefore(modeCount, 0.0);
+	std::vector<double> luminanceAfter(modeCount, 0.0);
+	std::vector<uint32_t> surfelsBefore(modeCount, 0);
+	std::vector<uint32_t> surfelsAfter(modeCount, 0);
+	std::string growthLog;
+	for (uint32_t frame = 1; frame <= desc.FrameCount; ++frame)
+	{
+		const float time = frame / 60.0f;
+		const GICPUCamera camera = CreateOrbitCamera(time, aspectRatio);
+		RasterizeRoom(instances[0]->GetThreadPool(), camera, gBuffer);
+		for (uint32_t i = 0; i < modeCount; ++i)
+		{
+			GlobalIlluminationCPU& gi = *instances[i];
+			if (frame == growFrame + 1)
+			{
+				surfelsBefore[i] = gi.GetSurfelCount() - gi.GetFreeSurfelCount();
+				luminanceBefore[i] = getMeanLuminance(gi);
+				gi.SetMaxSurfels(desc.GrownMaxSurfels);
+				if (i == 1)
+				{
+					gi.ResetGI();
+				}
+				surfelsAfter[i] = gi.GetSurfelCount() - gi.GetFreeSurfelCount();
+			}
+
+			const uint32_t capacity = gi.GetIndexCapacity();
+			gi.GenerateGIMap(camera, gBuffer);
+			gi.AccumulateIrradiance(RoomRadiance);
+			if (frame == growFrame + 1)
+			{
+				luminanceAfter[i] = getMeanLuminance(gi);
+			}
+
+			// The count is taken before the growth at the end of the frame, the capacity after it
+			const GIFrameStatistics& statistics = gi.GetStatistics();
+			const uint32_t aliveSurfels = statistics.SurfelCount - statistics.FreeSurfelCount;
+			framesOverCapacity[i] += gi.GetIndexCount() > capacity ? 1 : 0;
+			endsOverCapacity[i] += gi.GetIndexCount() > gi.GetIndexCapacity() ? 1 : 0;
+			maxEntriesPerSurfel[i] = std::max(maxEntriesPerSurfel[i], double(gi.GetIndexCount()) / std::max(aliveSurfels, 1u));
+			if (gi.GetIndexCapacity() != capacity)
+			{
+				++capacityChanges[i];
+				if (i == 0)
+				{
+					growthLog += "  Frame " + std::to_string(frame) + ": " + std::to_string(gi.GetIndexCount()) + " entries, "
+						+ std::to_string(capacity) + " -> " + std::to_string(gi.GetIndexCapacity()) + "\n";
+				}
+			}
+		}
+	}
+
+	bool valid = true;
+	std::string report = "Surfel capacity benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height)
+		+ ", " + std::to_string(desc.FrameCount) + " frames, " + std::to_string(desc.InitialMaxSurfels) + " -> " + std::to_string(desc.GrownMaxSurfels)
+		+ " surfels at frame " + std::to_string(growFrame + 1) + (desc.RebuildWorldStructure ? ", rebuild, " : ", incremental, ")
+		+ std::to_string(instances[0]->GetThreadPool().GetThreadCount()) + " threads\n";
+	if (!desc.RebuildWorldStructure)
+	{
+		report += "Index Buffer Growth (" + std::string(modeNames[0]) + ")\n" + growthLog;
+	}
+	for (uint32_t i = 0; i < modeCount; ++i)
+	{
+		const GlobalIlluminationCPU& gi = *instances[i];
+		const bool lostSurfels = i == 0 && surfelsAfter[i] != surfelsBefore[i];
+		valid = valid && !lostSurfels && endsOverCapacity[i] == 0;
+		report += std::string(modeNames[i]) + "\n";
+		report += "  Alive Surfels Around The Raise: " + std::to_string(surfelsBefore[i]) + " -> " + std::to_string(surfelsAfter[i])
+			+ (lostSurfels ? " LOST SURFELS\n" : "\n");
+		report += "  Mean GI Luminance Around The Raise: " + std::to_string(luminanceBefore[i]) + " -> " + std::to_string(luminanceAfter[i]) + "\n";
+		report += "  Index Capacity Changes: " + std::to_string(capacityChanges[i]) + ", Frames With Lists Past The End: "
+			+ std::to_string(framesOverCapacity[i]) + (endsOverCapacity[i] != 0 ? ", NOT GROWN AFTER " + std::to_string(endsOverCapacity[i]) + "\n" : "\n");
+		report += "  Max List Entries Per Alive Surfel: " + std::to_string(maxEntriesPerSurfel[i]) + ", Bound: "
+			+ std::to_string(WORLD_STRUCTURE_OVERLAP_CELL_COUNT) + "\n";
+		report += "  Index Entries: " + std::to_string(gi.GetIndexCount()) + ", Capacity: " + std::to_string(gi.GetIndexCapacity())
+			+ ", Initial: " + std::to_string(gi.GetMaxSurfels() * SURFEL_INITIAL_INDICES_PER_SURFEL)
+			+ ", One Per Surfel: " + std::to_string(gi.GetMaxSurfels()) + ", Bound: " + std::to_string(gi.GetMaxSurfels() * WORLD_STRUCTURE_OVERLAP_CELL_COUNT) + "\n";
+	}
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunSurfelSamplingBenchmark(const SurfelSamplingBenchmarkDesc& desc)
+{
+	enum class Mode : uint32_t { WhiteNoise, R2, Count };
+	const char* modeNames[] = { "White Noise", "Scrambled R2" };
+	const uint32_t modeCount = uint32_t(Mode::Count);
+	const uint32_t maxRayCount = std::max(desc.MaxRayCount, 1u);
+
+	ThreadPool pool(desc.ThreadCount);
+
+	// Surfels where rays from near the room centre land, stored and reloaded like the spawn pass does
+	std::vector<uint4> geometries(desc.SurfelCount);
+	for (uint32_t surfelIndex = 0; surfelIndex < desc.SurfelCount; ++surfelIndex)
+	{
+		uint seed = GICPU::RandomSeed(surfelIndex + 1);
+		const float2 randVal = float2(GICPU::RandomFloat(seed), GICPU::RandomFloat(seed));
+		const float z = 1.0f - 2.0f * randVal.x;
+		const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		const float3 direction = float3(r * std::cos(2.0f * GICPU::PI * randVal.y), r * std::sin(2.0f * GICPU::PI * randVal.y), z);
+		const RoomHit hit = TraceRoom(float3(0.3f, 0.1f, -0.2f), direction);
+		geometries[surfelIndex] = PackSurfelGeometry(hit.Position, hit.Normal, 1.0f);
+	}
+
+	auto getRay = [&](Mode mode, uint4 geometry, uint32_t trial, uint32_t rayIndex)
+	{
+		if (mode == Mode::WhiteNoise)
+		{
+			// Every ray seeded on its own, as from the ray index and the frame time
+			uint randSeed = GICPU::RandInit(rayIndex, trial, 16);
+			return float2(GICPU::RandNext(randSeed), GICPU::RandNext(randSeed));
+		}
+		// Trials differ by the scramble, as surfels at other places would
+		return GetSurfelSample(rayIndex, GetSurfelSampleScramble(uint4(geometry.x, geometry.y, geometry.z, geometry.w ^ GICPU::RandomSeed(trial))));
+	};
+
+	// Squared relative error of the running mean after every ray count, summed over the trials of each surfel
+	std::vector<double> squaredErrors(size_t(modeCount) * desc.SurfelCount * maxRayCount, 0.0);
+	pool.ParallelFor(desc.SurfelCount, 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			const uint4 geometry = geometries[surfelIndex];
+			const float3 position = UnpackSurfelPosition(geometry);
+			const float3 normal = UnpackSurfelNormal(geometry);
+			const float3 bitangent = GICPU::GetPerpendicularStark(normal);
+			auto luminance = [&](const float2& randVal)
+			{
+				const float3 radiance = RoomRadiance(position, GICPU::GetCosHemisphereSample(randVal, normal, bitangent));
+				return double(glm::dot(radiance, float3(0.299f, 0.587f, 0.114f)));
+			};
+
+			double reference = 0.0;
+			for (uint32_t rayIndex = 0; rayIndex < desc.ReferenceRayCount; ++rayIndex)
+			{
+				reference += luminance(GetSurfelSample(rayIndex, GetSurfelSampleScramble(geometry)));
+			}
+			reference /= std::max(desc.ReferenceRayCount, 1u);
+
+			for (uint32_t mode = 0; mode < modeCount; ++mode)
+			{
+				double* surfelErrors = &squaredErrors[(size_t(mode) * desc.SurfelCount + surfelIndex) * maxRayCount];
+				for (uint32_t trial = 0; trial < desc.TrialCount; ++trial)
+				{
+					double sum = 0.0;
+					for (uint32_t rayIndex = 0; rayIndex < maxRayCount; ++rayIndex)
+					{
+						sum += luminance(getRay(Mode(mode), geometry, trial + 1, rayIndex));
+						const double error = (sum / double(rayIndex + 1) - reference) / std::max(reference, 1e-6);
+						surfelErrors[rayIndex] += error * error;
+					}
+				}
+			}
+		}
+	});
+
+	const double estimateCount = double(std::max(desc.SurfelCount * desc.TrialCount, 1u));
+	std::string report = "Surfel sampling benchmark, " + std::to_string(desc.SurfelCount) + " surfels, " + std::to_string(desc.TrialCount)
+		+ " trials each, " + std::to_string(pool.GetThreadCount()) + " threads\n";
+	std::vector<uint32_t> raysToTarget(modeCount, 0);
+	std::vector<double> finalErrors(modeCount, 0.0);
+	for (uint32_t mode = 0; mode < modeCount; ++mode)
+	{
+		report += std::string(modeNames[mode]) + "\n";
+		for (uint32_t rayIndex = 0; rayIndex < maxRayCount; ++rayIndex)
+		{
+			// Surfels are summed in order so the result does not depend on the thread count
+			double squaredError = 0.0;
+			for (uint32_t surfelIndex = 0; surfelIndex < desc.SurfelCount; ++surfelIndex)
+			{
+				squaredError += squaredErrors[(size_t(mode) * desc.SurfelCount + surfelIndex) * maxRayCount + rayIndex];
+			}
+			const double rmsError = std::sqrt(squaredError / estimateCount);
+			const uint32_t rayCount = rayIndex + 1;
+			finalErrors[mode] = rmsError;
+			if (raysToTarget[mode] == 0 && rmsError <= desc.TargetRelativeError)
+			{
+				raysToTarget[mode] = rayCount;
+			}
+			if ((rayCount & (rayCount - 1)) == 0)
+			{
+				report += "  " + std::to_string(rayCount) + " rays: " + std::to_string(rmsError * 100.0) + "% RMS error\n";
+			}
+		}
+		report += "  Rays to " + std::to_string(desc.TargetRelativeError * 100.0f) + "% RMS error: "
+			+ (raysToTarget[mode] != 0 ? std::to_string(raysToTarget[mode]) : "more than " + std::to_string(maxRayCount)) + "\n";
+	}
+	// A single ray cannot show a difference in convergence
+	const bool valid = maxRayCount <= 1 || finalErrors[uint32_t(Mode::R2)] < finalErrors[uint32_t(Mode::WhiteNoise)];
+	if (!valid)
+	{
+		report += "Scrambled R2 did not end with a lower RMS error than white noise\n";
+	}
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunLightSamplingBenchmark(const LightSamplingBenchmarkDesc& desc)
+{
+	const uint32_t lightCount = std::max(desc.LightCount, 1u);
+	const uint32_t maxRayCount = std::max(desc.MaxRayCount, 1u);
+	ThreadPool pool(desc.ThreadCount);
+
+	// Point lights inside the room with log uniform intensities, weighted by their power like Falcor's point lights
+	std::vector<float3> lightPositions(lightCount);
+	std::vector<float> lightIntensities(lightCount);
+	std::vector<float> lightPowers(lightCount);
+	for (uint32_t lightIndex = 0; lightIndex < lightCount; ++lightIndex)
+	{
+		uint seed = GICPU::RandomSeed(lightIndex + 1000);
+		const float3 randVal = float3(GICPU::RandomFloat(seed), GICPU::RandomFloat(seed), GICPU::RandomFloat(seed));
+		lightPositions[lightIndex] = (randVal * 2.0f - 1.0f) * (ROOM_HALF_EXTENT * 0.9f);
+		lightIntensities[lightIndex] = std::pow(std::max(desc.PowerRange, 1.0f), GICPU::RandomFloat(seed));
+		lightPowers[lightIndex] = 4.0f * GICPU::PI * lightIntensities[lightIndex];
+	}
+
+	// The same point lights and a directional light, weighted the way UpdateLightAliasTable weighs scene lights.
+	// Falcor reports no power for directional lights.
+	const float3 sunDirection = glm::normalize(float3(-0.189f, -0.861f, -0.471f));
+	const float sunIntensity = 10.0f;
+	std::vector<float> mixedWeights(lightCount + 1);
+	for (uint32_t lightIndex = 0; lightIndex < lightCount; ++lightIndex)
+	{
+		mixedWeights[lightIndex] = GetLightSamplingWeight(lightPowers[lightIndex], float3(lightIntensities[lightIndex]));
+	}
+	mixedWeights[lightCount] = GetLightSamplingWeight(0.0f, float3(sunIntensity));
+
+	// Tables checked against their weights. Negative and non finite weights count as 0.
+	struct TestTable
+	{
+		const char* Name;
+		std::vector<float> Weights;
+	};
+	std::vector<TestTable> testTables;
+	testTables.push_back({ "Uniform", std::vector<float>(lightCount, 1.0f) });
+	testTables.push_back({ "Power Spread", lightPowers });
+	testTables.push_back({ "One Dominant", std::vector<float>(lightCount, 1.0f) });
+	testTables.back().Weights[lightCount / 2] = 1e6f;
+	testTables.push_back({ "Partly Zero", lightPowers });
+	for (uint32_t lightIndex = 0; lightIndex < lightCount; lightIndex += 2)
+	{
+		testTables.back().Weights[lightIndex] = lightIndex % 6 == 0 ? 0.0f : (lightIndex % 6 == 2 ? -1.0f : NAN);
+	}
+	testTables.push_back({ "All Zero", std::vector<float>(lightCount, 0.0f) });
+	testTables.push_back({ "Single Light", std::vector<float>(1, 5.0f) });
+	testTables.push_back({ "Directional And Points", mixedWeights });
+
+	bool valid = true;
+	std::string report = "Light sampling benchmark, " + std::to_string(lightCount) + " lights, power range " + std::to_string(desc.PowerRange)
+		+ ", " + std::to_string(desc.SurfelCount) + " surfels, " + std::to_string(desc.TrialCount) + " trials each, "
+		+ std::to_string(pool.GetThreadCount()) + " threads\n";
+	report += "Alias Tables (" + std::to_string(desc.DrawCount) + " draws each)\n";
+	for (const TestTable& test : testTables)
+	{
+		const uint32_t count = uint32_t(test.Weights.size());
+		const std::vector<LightAliasEntry> table = BuildLightAliasTable(test.Weights);
+		double totalWeight = 0.0;
+		for (float weight : test.Weights)
+		{
+			totalWeight += std::isfinite(weight) && weight > 0.0f ? weight : 0.0;
+		}
+		std::vector<double> expected(count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const bool weighted = std::isfinite(test.Weights[i]) && test.Weights[i] > 0.0f;
+			expected[i] = totalWeight > 0.0 ? (weighted ? test.Weights[i] / totalWeight : 0.0) : 1.0 / count;
+		}
+
+		// Probability of every light over the slots, its own share of its slot and what it gets as the alias of others
+		std::vector<double> slotPdfs(count, 0.0);
+		for (uint32_t slot = 0; slot < count; ++slot)
+		{
+			slotPdfs[slot] += table[slot].Probability / double(count);
+			slotPdfs[table[slot].Alias] += (1.0 - table[slot].Probability) / double(count);
+		}
+
+		std::vector<uint32_t> picks(count, 0);
+		uint seed = GICPU::RandomSeed(count * 7919u + uint32_t(&test - testTables.data()));
+		for (uint32_t draw = 0; draw < desc.DrawCount; ++draw)
+		{
+			const float choice = GICPU::RandomFloat(seed);
+			const uint slot = GetLightAliasSlot(choice, count);
+			++picks[SelectLightAlias(table[slot], slot, choice, count)];
+		}
+
+		double slotPdfError = 0.0;
+		double storedPdfError = 0.0;
+		double chiSquare = 0.0;
+		uint32_t degreesOfFreedom = 0;
+		uint32_t zeroPicks = 0;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			slotPdfError = std::max(slotPdfError, std::abs(slotPdfs[i] - expected[i]));
+			storedPdfError = std::max(storedPdfError, std::abs(double(table[i].Pdf) - expected[i]) / std::max(expected[i], 1e-30));
+			if (expected[i] == 0.0)
+			{
+				zeroPicks += picks[i];
+				continue;
+			}
+			const double expectedPicks = expected[i] * desc.DrawCount;
+			chiSquare += (picks[i] - expectedPicks) * (picks[i] - expectedPicks) / expectedPicks;
+			++degreesOfFreedom;
+		}
+		// Normalized distance of the chi square from its mean, past 6 is a table that does not draw what it claims
+		degreesOfFreedom = degreesOfFreedom > 0 ? degreesOfFreedom - 1 : 0;
+		const double chiSquareScore = degreesOfFreedom != 0 ? (chiSquare - degreesOfFreedom) / std::sqrt(2.0 * degreesOfFreedom) : 0.0;
+		const bool tableValid = slotPdfError <= 1e-6 && storedPdfError <= 1e-6 && zeroPicks == 0 && chiSquareScore < 6.0;
+		valid = valid && tableValid;
+		report += "  " + std::string(test.Name) + ": slot pdf error " + std::to_string(slotPdfError) + ", stored pdf relative error "
+			+ std::to_string(storedPdfError) + ", chi square " + std::to_string(chiSquare) + " over " + std::to_string(degreesOfFreedom)
+			+ " dof, picks without weight " + std::to_string(zeroPicks) + (tableValid ? "\n" : " WRONG\n");
+	}
+
+	// Surfels where rays from near the room centre land
+	std::vector<float3> positions(desc.SurfelCount);
+	std::vector<float3> normals(desc.SurfelCount);
+	for (uint32_t surfelIndex = 0; surfelIndex < desc.SurfelCount; ++surfelIndex)
+	{
+		uint seed = GICPU::RandomSeed(surfelIndex + 1);
+		const float2 randVal = float2(GICPU::RandomFloat(seed), GICPU::RandomFloat(seed));
+		const float z = 1.0f - 2.0f * randVal.x;
+		const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		const float3 direction = float3(r * std::cos(2.0f * GICPU::PI * randVal.y), r * std::sin(2.0f * GICPU::PI * randVal.y), z);
+		const RoomHit hit = TraceRoom(float3(0.3f, 0.1f, -0.2f), direction);
+		positions[surfelIndex] = hit.Position;
+		normals[surfelIndex] = hit.Normal;
+	}
+
+	enum class Mode : uint32_t { RoundedPick, UniformTable, PowerTable, Count };
+	const char* modeNames[] = { "Rounded Pick", "Uniform Table", "Power Table" };
+	const uint32_t modeCount = uint32_t(Mode::Count);
+	const std::vector<LightAliasEntry> uniformTable = BuildLightAliasTable(std::vector<float>(lightCount, 1.0f));
+	const std::vector<LightAliasEntry> powerTable = BuildLightAliasTable(lightPowers);
+
+	// Squared relative error of the running mean after every ray count, summed over the trials of each surfel.
+	// The room is convex and the lights are inside it, so no shadow ray is blocked.
+	std::vector<double> squaredErrors(size_t(modeCount) * desc.SurfelCount * maxRayCount, 0.0);
+	pool.ParallelFor(desc.SurfelCount, 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			auto irradiance = [&](uint32_t lightIndex)
+			{
+				const float3 toLight = lightPositions[lightIndex] - positions[surfelIndex];
+				const float distanceSquared = std::max(glm::dot(toLight, toLight), 1e-4f);
+				const float cosTheta = glm::dot(normals[surfelIndex], toLight) / std::sqrt(distanceSquared);
+				return double(lightIntensities[lightIndex] * std::max(cosTheta, 0.0f) / distanceSquared);
+			};
+
+			double reference = 0.0;
+			for (uint32_t lightIndex = 0; lightIndex < lightCount; ++lightIndex)
+			{
+				reference += irradiance(lightIndex);
+			}
+
+			for (uint32_t mode = 0; mode < modeCount; ++mode)
+			{
+				const std::vector<LightAliasEntry>& table = Mode(mode) == Mode::PowerTable ? powerTable : uniformTable;
+				double* surfelErrors = &squaredErrors[(size_t(mode) * desc.SurfelCount + surfelIndex) * maxRayCount];
+				for (uint32_t trial = 0; trial < desc.TrialCount; ++trial)
+				{
+					double sum = 0.0;
+					for (uint32_t rayIndex = 0; rayIndex < maxRayCount; ++rayIndex)
+					{
+						uint randSeed = GICPU::RandInit(rayIndex, trial * desc.SurfelCount + surfelIndex, 16);
+						const float choice = GICPU::RandNext(randSeed);
+						if (Mode(mode) == Mode::RoundedPick)
+						{
+							sum += irradiance(uint32_t(std::round((lightCount - 1) * choice))) * lightCount;
+						}
+						else
+						{
+							const uint slot = GetLightAliasSlot(choice, lightCount);
+							const uint lightIndex = SelectLightAlias(table[slot], slot, choice, lightCount);
+							sum += irradiance(lightIndex) / table[lightIndex].Pdf;
+						}
+						const double error = (sum / double(rayIndex + 1) - reference) / std::max(reference, 1e-6);
+						surfelErrors[rayIndex] += error * error;
+					}
+				}
+			}
+		}
+	});
+
+	const double estimateCount = double(std::max(desc.SurfelCount * desc.TrialCount, 1u));
+	std::vector<uint32_t> raysToTarget(modeCount, 0);
+	std::vector<double> finalErrors(modeCount, 0.0);
+	for (uint32_t mode = 0; mode < modeCount; ++mode)
+	{
+		report += std::string(modeNames[mode]) + "\n";
+		for (uint32_t rayIndex = 0; rayIndex < maxRayCount; ++rayIndex)
+		{
+			// Surfels are summed in order so the result does not depend on the thread count
+			double squaredError = 0.0;
+			for (uint32_t surfelIndex = 0; surfelIndex < desc.SurfelCount; ++surfelIndex)
+			{
+				squaredError += squaredErrors[(size_t(mode) * desc.SurfelCount + surfelIndex) * maxRayCount + rayIndex];
+			}
+			const double rmsError = std::sqrt(squaredError / estimateCount);
+			const uint32_t rayCount = rayIndex + 1;
+			finalErrors[mode] = rmsError;
+			if (raysToTarget[mode] == 0 && rmsError <= desc.TargetRelativeError)
+			{
+				raysToTarget[mode] = rayCount;
+			}
+			if ((rayCount & (rayCount - 1)) == 0)
+			{
+				report += "  " + std::to_string(rayCount) + " rays: " + std::to_string(rmsError * 100.0) + "% RMS error\n";
+			}
+		}
+		report += "  Rays to " + std::to_string(desc.TargetRelativeError * 100.0f) + "% RMS error: "
+			+ (raysToTarget[mode] != 0 ? std::to_string(raysToTarget[mode]) : "more than " + std::to_string(maxRayCount)) + "\n";
+	}
+	valid = valid && (desc.PowerRange <= 1.0f || finalErrors[uint32_t(Mode::PowerTable)] < finalErrors[uint32_t(Mode::UniformTable)]);
+
+	// The expected estimate of a table only misses the lights it never picks, so the directional light has to keep
+	// a share of the mixed table or its irradiance is gone at any ray count. Shadowing by the room is left out.
+	const std::vector<LightAliasEntry> mixedTable = BuildLightAliasTable(mixedWeights);
+	double maxMixedBias = 0.0;
+	for (uint32_t surfelIndex = 0; surfelIndex < desc.SurfelCount; ++surfelIndex)
+	{
+		double reference = 0.0;
+		double expected = 0.0;
+		for (uint32_t lightIndex = 0; lightIndex <= lightCount; ++lightIndex)
+		{
+			double lightIrradiance;
+			if (lightIndex == lightCount)
+			{
+				lightIrradiance = sunIntensity * std::max(-glm::dot(normals[surfelIndex], sunDirection), 0.0f);
+			}
+			else
+			{
+				const float3 toLight = lightPositions[lightIndex] - positions[surfelIndex];
+				const float distanceSquared = std::max(glm::dot(toLight, toLight), 1e-4f);
+				const float cosTheta = glm::dot(normals[surfelIndex], toLight) / std::sqrt(distanceSquared);
+				lightIrradiance = lightIntensities[lightIndex] * std::max(cosTheta, 0.0f) / distanceSquared;
+			}
+			reference += lightIrradiance;
+			expected += mixedTable[lightIndex].Pdf > 0.0f ? lightIrradiance : 0.0;
+		}
+		maxMixedBias = std::max(maxMixedBias, (reference - expected) / std::max(reference, 1e-6));
+	}
+	const bool mixedValid = maxMixedBias <= 1e-6;
+	valid = valid && mixedValid;
+	report += "Directional And Point Lights\n";
+	report += "  Directional Light Pdf: " + std::to_string(mixedTable[lightCount].Pdf) + "\n";
+	report += "  Max Relative Bias: " + std::to_string(maxMixedBias * 100.0) + "%" + (mixedValid ? "\n" : " WRONG\n");
+
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunSurfelResamplingBenchmark(const SurfelResamplingBenchmarkDesc& desc)
+{
+	const float3 luminance = float3(0.299f, 0.587f, 0.114f);
+	bool valid = true;
+	std::string report = "Surfel resampling benchmark, " + std::to_string(desc.Width) + "x" + std::to_string(desc.Height) + ", "
+		+ std::to_string(desc.FrameCount) + " frames, " + std::to_string(desc.RayBudget) + " rays per frame\n";
+
+	// Kernel checks, directions drawn from the cosine distribution around the normal like the accumulation rays
+	{
+		uint seed = GICPU::RandomSeed(17);
+		auto randomDirection = [&](const float3& normal)
+		{
+			const float2 randVal = float2(GICPU::RandomFloat(seed), GICPU::RandomFloat(seed));
+			return GICPU::GetCosHemisphereSample(randVal, normal, GICPU::GetPerpendicularStark(normal));
+		};
+		const float3 normal = glm::normalize(float3(0.2f, 1.0f, -0.1f));
+
+		double directionError = 0.0;
+		double radianceError = 0.0;
+		bool packedWeights = true;
+		double constantError = 0.0;
+		const float3 constantRadiance = float3(0.8f, 0.5f, 0.3f);
+		for (uint32_t trial = 0; trial < desc.KernelTrialCount; ++trial)
+		{
+			SurfelReservoir reservoir = {};
+			reservoir.Direction = randomDirection(normal);
+			reservoir.Radiance = constantRadiance * (1.0f + 100.0f * GICPU::RandomFloat(seed));
+			reservoir.WeightSum = 100.0f * GICPU::RandomFloat(seed);
+			reservoir.Count = float(1 + trial % 64);
+			const SurfelReservoir unpacked = UnpackSurfelReservoir(PackSurfelReservoir(reservoir));
+			directionError = std::max(directionError, double(glm::length(unpacked.Direction - reservoir.Direction)));
+			radianceError = std::max(radianceError, double(glm::length(unpacked.Radiance - reservoir.Radiance) / glm::length(reservoir.Radiance)));
+			packedWeights = packedWeights && unpacked.WeightSum == reservoir.WeightSum && unpacked.Count == reservoir.Count;
+
+			// A history, new rays and neighbours facing the same way, all seeing the same radiance
+			SurfelReservoir constant = {};
+			const uint32_t historyCount = 1 + trial % 40;
+			for (uint32_t i = 0; i < historyCount; ++i)
+			{
+				constant = AddSurfelReservoirRay(constant, randomDirection(normal), constantRadiance, GICPU::RandomFloat(seed));
+			}
+			constant = UnpackSurfelReservoir(PackSurfelReservoir(ClampSurfelReservoir(constant, SURFEL_RESERVOIR_MAX_COUNT)));
+			constant = AddSurfelReservoirRay(constant, randomDirection(normal), constantRadiance, GICPU::RandomFloat(seed));
+			for (uint32_t i = 0; i < SURFEL_RESERVOIR_NEIGHBOUR_COUNT; ++i)
+			{
+				SurfelReservoir neighbour = {};
+				for (uint32_t j = 0; j <= (trial + i) % 20; ++j)
+				{
+					neighbour = AddSurfelReservoirRay(neighbour, randomDirection(normal), constantRadiance, GICPU::RandomFloat(seed));
+				}
+				constant = MergeSurfelReservoir(constant, normal, neighbour, normal, GICPU::RandomFloat(seed));
+			}
+			const float3 estimate = GetSurfelReservoirRadiance(constant);
+			constantError = std::max(constantError, double(glm::length(estimate - constantRadiance) / glm::length(constantRadiance)));
+		}
+
+		// Single frame estimates of a sky above a dim floor, the mean against the cosine weighted integral
+		auto skyRadiance = [](const float3& direction)
+		{
+			return direction.y > 0.8f ? float3(20.0f, 19.0f, 17.0f) : (direction.y > 0.0f ? float3(0.2f, 0.3f, 0.6f) : float3(0.1f, 0.08f, 0.05f));
+		};
+		const uint32_t rayCount = 4;
+		double reference = 0.0;
+		double estimateSum = 0.0;
+		double estimateSquaredSum = 0.0;
+		for (uint32_t trial = 0; trial < desc.KernelTrialCount; ++trial)
+		{
+			SurfelReservoir reservoir = {};
+			for (uint32_t i = 0; i < rayCount; ++i)
+			{
+				const float3 direction = randomDirection(normal);
+				reference += glm::dot(luminance, skyRadiance(randomDirection(normal)));
+				reservoir = AddSurfelReservoirRay(reservoir, direction, skyRadiance(direction), GICPU::RandomFloat(seed));
+			}
+			const double estimate = glm::dot(luminance, GetSurfelReservoirRadiance(reservoir));
+			estimateSum += estimate;
+			estimateSquaredSum += estimate * estimate;
+		}
+		const double trialCount = double(std::max(desc.KernelTrialCount, 2u));
+		reference /= trialCount * rayCount;
+		const double mean = estimateSum / trialCount;
+		const double standardError = std::sqrt(std::max(estimateSquaredSum / trialCount - mean * mean, 0.0) / trialCount);
+		// The reference is a Monte Carlo mean over as many rays, so both sides carry about the same error
+		const double biasScore = std::abs(mean - reference) / std::max(standardError * std::sqrt(2.0), 1e-12);
+
+		// The direction is quantized like the surfel normal and the radiance to a 9 bit mantissa, the weights are exact.
+		// The constant radiance estimate only keeps the quantization of the kept radiance's colour.
+		const bool kernelValid = directionError < 1e-2 && radianceError < 1e-2 && packedWeights && constantError < 1e-2 && biasScore < 5.0;
+		valid = valid && kernelValid;
+		report += "Kernel (" + std::to_string(desc.KernelTrialCount) + " trials): packed direction error " + std::to_string(directionError)
+			+ ", packed radiance error " + std::to_string(radianceError) + (packedWeights ? "" : ", packed weights differ")
+			+ ", constant radiance error " + std::to_string(constantError) + ", single frame mean " + std::to_string(mean)
+			+ " against " + std::to_string(reference) + " (" + std::to_string(biasScore) + " standard errors)" + (kernelValid ? "\n" : " WRONG\n");
+	}
+
+	// The emissive ceiling, and a small lamp as bright in total with the rest of the ceiling dark
+	const float lampHalfExtent = 0.5f;
+	const float lampScale = (2.0f * ROOM_HALF_EXTENT) * (2.0f * ROOM_HALF_EXTENT) / ((2.0f * lampHalfExtent) * (2.0f * lampHalfExtent));
+	auto lampRadiance = [&](const float3& origin, const float3& direction)
+	{
+		RoomHit hit = TraceRoom(origin, direction);
+		if (hit.Emissive && (std::abs(hit.Position.x) > lampHalfExtent || std::abs(hit.Position.z) > lampHalfExtent))
+		{
+			hit.Emissive = false;
+		}
+		return hit.Emissive ? GetRoomHitRadiance(hit) * lampScale : GetRoomHitRadiance(hit);
+	};
+	const char* sceneNames[] = { "Emissive Ceiling", "Ceiling Lamp" };
+	const GlobalIlluminationCPU::RadianceFunction sceneRadiance[] = { RoomRadiance, lampRadiance };
+	const char* modeNames[] = { "Off", "Temporal", "Temporal And Spatial" };
+	const uint32_t modes[] = { SURFEL_RESAMPLE_OFF, SURFEL_RESAMPLE_TEMPORAL, SURFEL_RESAMPLE_SPATIOTEMPORAL };
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	const GICPUCamera camera = CreateOrbitCamera(0.0f, float(desc.Width) / float(desc.Height));
+
+	for (uint32_t scene = 0; scene < 2; ++scene)
+	{
+		report += std::string(sceneNames[scene]) + "\n";
+		std::vector<double> finalErrors;
+		for (uint32_t mode : modes)
+		{
+			GlobalIlluminationCPU gi(desc.ThreadCount);
+			gi.Initilize(uvec2(desc.Width, desc.Height), 64 * 1024);
+			gi.SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+			gi.SetRayBudget(desc.RayBudget);
+			gi.SetResampleMode(mode);
+			RasterizeRoom(gi.GetThreadPool(), camera, gBuffer);
+
+			// Reference irradiance of every surfel, recomputed when compaction or defragmentation moved one in its slot
+			std::vector<uint4> referenceGeometry;
+			std::vector<double> references;
+			std::string errors;
+			double rmsError = 0.0;
+			double accumulateTime = 0.0;
+			uint64_t tracedRays = 0;
+			for (uint32_t frame = 1; frame <= desc.FrameCount; ++frame)
+			{
+				gi.GenerateGIMap(camera, gBuffer);
+				gi.AccumulateIrradiance(sceneRadiance[scene]);
+				accumulateTime += gi.GetTimings().Accumulate;
+				tracedRays += gi.GetStatistics().TracedRays;
+				if ((frame & (frame - 1)) != 0 && frame != desc.FrameCount)
+					continue;
+
+				const uint32_t surfelCount = gi.GetSurfelCount();
+				referenceGeometry.resize(surfelCount, uint4(0));
+				references.resize(surfelCount, -1.0);
+				gi.GetThreadPool().ParallelFor(surfelCount, 16, [&](uint32_t begin, uint32_t end)
+				{
+					for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+					{
+						const uint4 geometry = gi.GetSurfelsDataView().Geometry[surfelIndex];
+						if (references[surfelIndex] >= 0.0 && referenceGeometry[surfelIndex] == geometry)
+							continue;
+
+						const float3 position = UnpackSurfelPosition(geometry);
+						const float3 normal = UnpackSurfelNormal(geometry);
+						const float3 bitangent = GICPU::GetPerpendicularStark(normal);
+						const uint2 scramble = GetSurfelSampleScramble(geometry);
+						double reference = 0.0;
+						for (uint32_t rayIndex = 0; rayIndex < desc.ReferenceRayCount; ++rayIndex)
+						{
+							const float3 direction = GICPU::GetCosHemisphereSample(GetSurfelSample(rayIndex, scramble), normal, bitangent);
+							reference += glm::dot(luminance, sceneRadiance[scene](position, direction));
+						}
+						references[surfelIndex] = reference / std::max(desc.ReferenceRayCount, 1u);
+						referenceGeometry[surfelIndex] = geometry;
+					}
+				});
+
+				// Surfels are summed in order so the result does not depend on the thread count
+				double squaredError = 0.0;
+				uint32_t aliveSurfels = 0;
+				for (uint32_t surfelIndex = 0; surfelIndex < surfelCount; ++surfelIndex)
+				{
+					const Surfel surfel = gi.GetSurfel(surfelIndex);
+					if (!GICPU::IsSurfelAlive(surfel))
+						continue;
+					const double error = (glm::dot(luminance, surfel.Irradiance.mean) - references[surfelIndex]) / std::max(references[surfelIndex], 1e-3);
+					squaredError += error * error;
+					++aliveSurfels;
+				}
+				rmsError = std::sqrt(squaredError / std::max(aliveSurfels, 1u));
+				errors += "    Frame " + std::to_string(frame) + ": " + std::to_string(rmsError * 100.0) + "% RMS error, "
+					+ std::to_string(double(tracedRays) / std::max(aliveSurfels, 1u)) + " rays per surfel\n";
+			}
+			finalErrors.push_back(rmsError);
+			report += "  " + std::string(modeNames[finalErrors.size() - 1]) + ", " + std::to_string(accumulateTime / desc.FrameCount) + " ms accumulation\n" + errors;
+		}
+		valid = valid && finalErrors[2] < finalErrors[0];
+	}
+
+	if (valid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return valid;
+}
+
+bool RunGIMathBenchmark(const GIMathBenchmarkDesc& desc)
+{
+	GlobalIlluminationCPU gi(1);
+	gi.Initilize(uvec2(desc.Width, desc.Height));
+	gi.SetSpawnChance(GICPUBenchmarkDesc().SpawnChance);
+
+	GBufferCPU gBuffer;
+	gBuffer.Width = desc.Width;
+	gBuffer.Height = desc.Height;
+	gBuffer.Depth.resize(desc.Width * desc.Height);
+	gBuffer.Normal.resize(desc.Width * desc.Height);
+	gBuffer.Albedo.resize(desc.Width * desc.Height);
+	gBuffer.Motion.resize(desc.Width * desc.Height);
+
+	GICPUCamera camera;
+	for (uint32_t frame = 0; frame < desc.FrameCount; ++frame)
+	{
+		const double time = frame / 60.0;
+		camera = CreateOrbitCamera(float(time), float(desc.Width) / float(desc.Height));
+		RasterizeRoom(gi.GetThreadPool(), camera, gBuffer);
+		gi.GenerateGIMap(camera, gBuffer);
+		gi.AccumulateIrradiance(RoomRadiance);
+	}
+
+	// Every covered pixel of the last frame
+	std::vector<float3> positions;
+	std::vector<float3> normals;
+	for (uint32_t y = 0; y < desc.Height; ++y)
+	{
+		for (uint32_t x = 0; x < desc.Width; ++x)
+		{
+			const uint32_t pixel = y * desc.Width + x;
+			if (gBuffer.Depth[pixel] >= 1.0f)
+				continue;
+
+			positions.push_back(GICPU::GetWorldPosition(uint2(x, y), uint2(desc.Width, desc.Height), gBuffer.Depth[pixel], camera.InvViewProj));
+			normals.push_back(GICPU::DecodeNormal(gBuffer.Normal[pixel]));
+		}
+	}
+
+	const uint32_t iterationCount = std::max(desc.IterationCount, 1u);
+	const uint32_t lookupCount = uint32_t(positions.size());
+	std::string report = "GI math benchmark, " + std::string(GICPU::GetBatchInstructionSet()) + " batches of " + std::to_string(GICPU::BATCH_SIZE)
+		+ ", " + std::to_string(iterationCount) + " iterations, 1 thread\n";
+	bool allValid = true;
+
+	// Relative to the scalar value, floored so values near zero compare absolutely
+	auto getDifference = [](float scalar, float batch) { return std::abs(batch - scalar) / std::max(std::abs(scalar), 1e-3f); };
+	const float maxDifference = 1e-3f;
+
+	{
+		const GICPU::SurfelsDataView data = gi.GetSurfelsDataView();
+		std::vector<float4> scalarResults(lookupCount);
+		std::vector<float4> batchResults(lookupCount);
+		uint candidateCount = 0;
+		for (uint32_t i = 0; i < lookupCount; ++i)
+		{
+			GICPU::GetIrradianceAtPoint(data, positions[i], normals[i], true, &candidateCount);
+		}
+
+		const double scalarMs = TimeIterations(iterationCount, [&]
+		{
+			for (uint32_t i = 0; i < lookupCount; ++i)
+			{
+				float variance;
+				const float3 irradiance = GICPU::GetIrradianceAtPoint(data, positions[i], normals[i], true, nullptr, &variance);
+				scalarResults[i] = float4(irradiance, variance);
+			}
+		});
+		const double batchMs = TimeIterations(iterationCount, [&]
+		{
+			for (uint32_t i = 0; i < lookupCount; ++i)
+			{
+				float variance;
+				const float3 irradiance = GICPU::GetIrradianceAtPoint8(data, positions[i], normals[i], true, nullptr, &variance);
+				batchResults[i] = float4(irradiance, variance);
+			}
+		});
+
+		float difference = 0.0f;
+		for (uint32_t i = 0; i < lookupCount; ++i)
+		{
+			for (uint32_t channel = 0; channel < 4; ++channel)
+			{
+				difference = std::max(difference, getDifference(scalarResults[i][channel], batchResults[i][channel]));
+			}
+		}
+		const bool valid = difference <= maxDifference;
+		allValid &= valid;
+
+		report += std::to_string(gi.GetSurfelCount()) + " surfels, " + std::to_string(lookupCount) + " lookups, "
+			+ std::to_string(lookupCount > 0 ? float(candidateCount) / float(lookupCount) : 0.0f) + " candidates per lookup\n";
+		report += FormatPrimitive("GetIrradianceAtPoint", scalarMs, iterationCount, lookupCount, true);
+		report += FormatPrimitive("GetIrradianceAtPoint8", batchMs, iterationCount, lookupCount, valid);
+		report += "  Speedup: " + std::to_string(batchMs > 0.0 ? scalarMs / batchMs : 0.0) + "x, max relative difference " + std::to_string(difference) + "\n";
+	}
+
+	{
+		const uint32_t estimatorCount = (std::max(desc.EstimatorCount, 1u) + GICPU::BATCH_SIZE - 1) / GICPU::BATCH_SIZE * GICPU::BATCH_SIZE;
+		std::vector<MultiscaleMeanEstimatorData> initial(estimatorCount);
+		// Samples one channel after the other so a batch loads its lanes directly
+		std::vector<float> samples[3];
+		uint32_t state = 0x9E3779B9;
+		auto nextFloat = [&state]()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return float(state) * (1.0f / 4294967296.0f);
+		};
+		for (MultiscaleMeanEstimatorData& estimator : initial)
+		{
+			estimator.mean = float3(nextFloat(), nextFloat(), nextFloat());
+			estimator.shortMean = estimator.mean;
+			estimator.vbbr = 1.0f;
+			estimator.variance = float3(nextFloat(), nextFloat(), nextFloat()) * 0.1f;
+			estimator.inconsistency = 0.0f;
+		}
+		for (std::vector<float>& channelSamples : samples)
+		{
+			channelSamples.resize(estimatorCount);
+			for (float& sample : channelSamples)
+			{
+				// Mostly dim with a bright tail, so the firefly clamp and the catch up blend both get exercised
+				const float u = nextFloat();
+				sample = u * u * u * 4.0f;
+			}
+		}
+
+		std::vector<MultiscaleMeanEstimatorData> scalarEstimators = initial;
+		std::vector<MultiscaleMeanEstimatorData> batchEstimators = initial;
+		const double scalarMs = TimeIterations(iterationCount, [&]
+		{
+			for (uint32_t i = 0; i < estimatorCount; ++i)
+			{
+				GICPU::MultiscaleMeanEstimator(float3(samples[0][i], samples[1][i], samples[2][i]), scalarEstimators[i]);
+			}
+		});
+		const double batchMs = TimeIterations(iterationCount, [&]
+		{
+			for (uint32_t i = 0; i < estimatorCount; i += GICPU::BATCH_SIZE)
+			{
+				GICPU::EstimatorBatch batch = GICPU::LoadEstimatorBatch(&batchEstimators[i], GICPU::BATCH_SIZE);
+				const GICPU::float3x8 y = { GICPU::Load8(&samples[0][i]), GICPU::Load8(&samples[1][i]), GICPU::Load8(&samples[2][i]) };
+				GICPU::MultiscaleMeanEstimator8(y, batch);
+				GICPU::StoreEstimatorBatch(batch, &batchEstimators[i], GICPU::BATCH_SIZE);
+			}
+		});
+
+		float difference = 0.0f;
+		for (uint32_t i = 0; i < estimatorCount; ++i)
+		{
+			const MultiscaleMeanEstimatorData& scalar = scalarEstimators[i];
+			const MultiscaleMeanEstimatorData& batch = batchEstimators[i];
+			for (uint32_t channel = 0; channel < 3; ++channel)
+			{
+				difference = std::max(difference, getDifference(scalar.mean[channel], batch.mean[channel]));
+				difference = std::max(difference, getDifference(scalar.shortMean[channel], batch.shortMean[channel]));
+				difference = std::max(difference, getDifference(scalar.variance[channel], batch.variance[channel]));
+			}
+			difference = std::max(difference, getDifference(scalar.vbbr, batch.vbbr));
+			difference = std::max(difference, getDifference(scalar.inconsistency, batch.inconsistency));
+		}
+		const bool valid = difference <= maxDifference;
+		allValid &= valid;
+
+		report += std::to_string(estimatorCount) + " estimators\n";
+		report += FormatPrimitive("MultiscaleMeanEstimator", scalarMs, iterationCount, estimatorCount, true);
+		report += FormatPrimitive("MultiscaleMeanEstimator8", batchMs, iterationCount, estimatorCount, valid);
+		report += "  Speedup: " + std::to_string(batchMs > 0.0 ? scalarMs / batchMs : 0.0) + "x, max relative difference " + std::to_string(difference) + "\n";
+	}
+
+	if (allValid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return allValid;
+}
+
+bool RunParallelPrimitivesBenchmark(const ParallelPrimitivesBenchmarkDesc& desc)
+{
+	ThreadPool pool(desc.ThreadCount);
+	ParallelPrimitivesCPU primitives(pool);
+
+	const uint32_t count = desc.ElementCount;
+	const uint32_t iterationCount = std::max(desc.IterationCount, 1u);
+
+	// Fixed seed so runs can be compared
+	std::vector<uint32_t> input(count);
+	std::vector<uint32_t> flags(count);
+	uint32_t state = 0x9E3779B9;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		input[i] = state;
+		flags[i] = (state >> 7) & 1;
+	}
+
+	std::string report = "Parallel primitives benchmark, " + std::to_string(count) + " elements, "
+		+ std::to_string(iterationCount) + " iterations, " + std::to_string(pool.GetThreadCount()) + " threads\n";
+	bool allValid = true;
+
+	{
+		std::vector<uint32_t> reference(count);
+		std::vector<uint32_t> result(count);
+		uint32_t sum = 0;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			reference[i] = sum;
+			sum += input[i];
+		}
+
+		const double totalMs = TimeIterations(iterationCount, [&] { primitives.ExclusiveScan(input.data(), result.data(), count); });
+		const bool valid = result == reference;
+		allValid &= valid;
+		report += FormatPrimitive("Exclusive Scan", totalMs, iterationCount, count, valid);
+	}
+
+	const std::pair<const char*, ParallelPrimitivesCPU::ReduceOperation> reductions[] =
+	{
+		{ "Reduce Sum", ParallelPrimitivesCPU::ReduceOperation::Sum },
+		{ "Reduce Min", ParallelPrimitivesCPU::ReduceOperation::Min },
+		{ "Reduce Max", ParallelPrimitivesCPU::ReduceOperation::Max },
+	};
+	for (const auto& reduction : reductions)
+	{
+		uint32_t reference = 0;
+		switch (reduction.second)
+		{
+		case ParallelPrimitivesCPU::ReduceOperation::Min: reference = count > 0 ? *std::min_element(input.begin(), input.end()) : 0xFFFFFFFF; break;
+		case ParallelPrimitivesCPU::ReduceOperation::Max: reference = count > 0 ? *std::max_element(input.begin(), input.end()) : 0; break;
+		default: reference = std::accumulate(input.begin(), input.end(), 0u); break;
+		}
+
+		uint32_t result = 0;
+		const double totalMs = TimeIterations(iterationCount, [&] { result = primitives.Reduce(input.data(), count, reduction.second); });
+		const bool valid = result == reference;
+		allValid &= valid;
+		report += FormatPrimitive(reduction.first, totalMs, iterationCount, count, valid);
+	}
+
+	{
+		std::vector<uint32_t> reference;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (flags[i] != 0)
+			{
+				reference.push_back(input[i]);
+			}
+		}
+
+		std::vector<uint32_t> result(count);
+		uint32_t keptCount = 0;
+		const double totalMs = TimeIterations(iterationCount, [&] { keptCount = primitives.Compact(input.data(), flags.data(), result.data(), count); });
+		result.resize(keptCount);
+		const bool valid = result == reference;
+		allValid &= valid;
+		report += FormatPrimitive("Compact", totalMs, iterationCount, count, valid);
+	}
+
+	{
+		// Values hold the original index so the reference also checks stability
+		std::vector<uint32_t> referenceValues(count);
+		std::iota(referenceValues.begin(), referenceValues.end(), 0u);
+		std::stable_sort(referenceValues.begin(), referenceValues.end(), [&](uint32_t a, uint32_t b) { return input[a] < input[b]; });
+
+		std::vector<uint32_t> keys(count);
+		std::vector<uint32_t> values(count);
+		double totalMs = 0.0;
+		for (uint32_t iteration = 0; iteration < iterationCount; ++iteration)
+		{
+			keys = input;
+			std::iota(values.begin(), values.end(), 0u);
+			totalMs += TimeIterations(1, [&] { primitives.RadixSort(keys.data(), values.data(), count); });
+		}
+
+		bool valid = values == referenceValues;
+		for (uint32_t i = 0; valid && i < count; ++i)
+		{
+			valid = keys[i] == input[values[i]];
+		}
+		allValid &= valid;
+		report += FormatPrimitive("Radix Sort", totalMs, iterationCount, count, valid);
+	}
+
+	if (allValid)
+	{
+		logInfo(report);
+	}
+	else
+	{
+		logError(report);
+	}
+	return allValid;
+}
+
+namespace
+{
+	using ArgValues = std::vector<Falcor::ArgList::Arg>;
+
+	// A benchmark run from the command line. Run fills its desc from the values after Flag and the other arguments and runs it.
+	struct CommandLineBenchmark
+	{
+		const char* Flag;
+		std::function<bool(const Falcor::ArgList& args)> Run;
+	};
+
+	template<typename Desc>
+	CommandLineBenchmark MakeCommandLineBenchmark(const char* flag, void (*parse)(Desc& desc, const ArgValues& values, const Falcor::ArgList& args),
+		bool (*run)(const Desc& desc))
+	{
+		return { flag, [flag, parse, run](const Falcor::ArgList& args)
+		{
+			Desc desc;
+			parse(desc, args.getValues(flag), args);
+			return run(desc);
+		} };
+	}
+
+	// Most benchmarks take a single count after their flag
+	void ParseFirstValue(const ArgValues& values, uint32_t& value)
+	{
+		if (!values.empty())
+		{
+			value = values[0].asUint();
+		}
+	}
+
+	void ParseString(const Falcor::ArgList& args, const char* flag, std::string& value)
+	{
+		const ArgValues values = args.getValues(flag);
+		if (!values.empty())
+		{
+			value = values[0].asString();
+		}
+	}
+}
+
+bool RunCommandLineBenchmark(const Falcor::ArgList& args, bool& passed)
+{
+	static const CommandLineBenchmark benchmarks[] =
+	{
+		MakeCommandLineBenchmark<GICPUBenchmarkDesc>("gicpubench", [](GICPUBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList& args)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+			desc.RebuildWorldStructure = args.argExists("rebuild");
+			ParseString(args, "surfelcache", desc.SurfelCachePath);
+			ParseString(args, "gistats", desc.StatisticsPath);
+		}, RunGICPUBenchmark),
+		MakeCommandLineBenchmark<WorldStructureBenchmarkDesc>("worldbench", [](WorldStructureBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.SurfelCount);
+			if (values.size() > 1)
+			{
+				desc.Extent = values[1].asFloat();
+			}
+		}, RunWorldStructureBenchmark),
+		MakeCommandLineBenchmark<OverlapBenchmarkDesc>("overlapbench", [](OverlapBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.PositionCount);
+		}, RunOverlapBenchmark),
+		MakeCommandLineBenchmark<SurfelBinningBenchmarkDesc>("binningbench", [](SurfelBinningBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+		}, RunSurfelBinningBenchmark),
+		MakeCommandLineBenchmark<GIResolutionBenchmarkDesc>("giresolutionbench", [](GIResolutionBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+		}, RunGIResolutionBenchmark),
+		MakeCommandLineBenchmark<GIDenoiseBenchmarkDesc>("gidenoisebench", [](GIDenoiseBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+		}, RunGIDenoiseBenchmark),
+		MakeCommandLineBenchmark<SurfelLodBenchmarkDesc>("gilodbench", [](SurfelLodBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+		}, RunSurfelLodBenchmark),
+		MakeCommandLineBenchmark<SurfelInvalidationBenchmarkDesc>("giinvalidationbench", [](SurfelInvalidationBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+		}, RunSurfelInvalidationBenchmark),
+		MakeCommandLineBenchmark<SurfelCellCapacityBenchmarkDesc>("gicellcapbench", [](SurfelCellCapacityBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList& args)
+		{
+			ParseFirstValue(values, desc.CellCapacity);
+			desc.RebuildWorldStructure = args.argExists("rebuild");
+		}, RunSurfelCellCapacityBenchmark),
+		MakeCommandLineBenchmark<SurfelDefragmentBenchmarkDesc>("gidefragbench", [](SurfelDefragmentBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+		}, RunSurfelDefragmentBenchmark),
+		MakeCommandLineBenchmark<SurfelCapacityBenchmarkDesc>("gicapacitybench", [](SurfelCapacityBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList& args)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+			desc.RebuildWorldStructure = args.argExists("rebuild");
+		}, RunSurfelCapacityBenchmark),
+		MakeCommandLineBenchmark<SurfelSamplingBenchmarkDesc>("gisamplingbench", [](SurfelSamplingBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.MaxRayCount);
+		}, RunSurfelSamplingBenchmark),
+		MakeCommandLineBenchmark<LightSamplingBenchmarkDesc>("gilightbench", [](LightSamplingBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.LightCount);
+		}, RunLightSamplingBenchmark),
+		MakeCommandLineBenchmark<SurfelResamplingBenchmarkDesc>("giresamplebench", [](SurfelResamplingBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.FrameCount);
+		}, RunSurfelResamplingBenchmark),
+		MakeCommandLineBenchmark<GIMathBenchmarkDesc>("gimathbench", [](GIMathBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.IterationCount);
+		}, RunGIMathBenchmark),
+		MakeCommandLineBenchmark<ParallelPrimitivesBenchmarkDesc>("primitivesbench", [](ParallelPrimitivesBenchmarkDesc& desc, const ArgValues& values, const Falcor::ArgList&)
+		{
+			ParseFirstValue(values, desc.ElementCount);
+		}, RunParallelPrimitivesBenchmark),
+	};
+
+	for (const CommandLineBenchmark& benchmark : benchmarks)
+	{
+		if (args.argExists(benchmark.Flag))
+		{
+			passed = benchmark.Run(args);
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <Falcor.h>
+
+#include <cstdint>
+#include <string>
+
+#include "GI/Data/HostDeviceSurfelsData.h"
+
+struct GICPUBenchmarkDesc
+{
+	uint32_t Width = 1280;
+	uint32_t Height = 720;
+	uint32_t FrameCount = 300;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+	float SpawnChance = 0.5f;
+	bool RebuildWorldStructure = false;
+	std::string SurfelCachePath; // Loaded before the first frame if it exists and saved after the last one
+	std::string StatisticsPath; // Per frame GI statistics are written there after the last frame, JSON for a .json path and CSV otherwise
+};
+
+// Runs the CPU surfel pipeline headless over a procedural room seen from an orbiting camera
+// and logs the average cost of every stage. Does not need a GPU.
+// With a surfel cache from an earlier run the benchmark starts from its surfels instead of an empty storage.
+// Returns false if the surfel cache or the statistics can't be written.
+bool RunGICPUBenchmark(const GICPUBenchmarkDesc& desc);
+
+struct WorldStructureBenchmarkDesc
+{
+	uint32_t SurfelCount = 1024 * 1024;
+	uint32_t FrameCount = 10;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+	float Extent = 8.0f; // Half size of the box the surfels are scattered in, smaller boxes give longer cell lists
+	bool VerifyAgainstSerial = true;
+};
+
+// Seeds the CPU pipeline with SurfelCount surfels scattered around the camera and logs the per frame cost of every
+// world structure stage for the incremental update and the counting sort rebuild. With VerifyAgainstSerial each mode
+// is run again on a single thread and an error is logged and false returned if the cell lists differ.
+bool RunWorldStructureBenchmark(const WorldStructureBenchmarkDesc& desc);
+
+struct OverlapBenchmarkDesc
+{
+	uint32_t PositionCount = 1 << 20;
+	uint32_t IterationCount = 10;
+	uint32_t FrameCount = 60; // Frames of the room scene checked for counts without an insertion
+};
+
+// Checks GetOverlappedCellMask against a sphere-box distance reference over random positions and radii on every clipmap level
+// and times both. Then runs the room scene and checks that every cell counted during coverage gets its insertion.
+// Logs an error and returns false on any mismatch.
+bool RunOverlapBenchmark(const OverlapBenchmarkDesc& desc);
+
+struct SurfelBinningBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 60;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+};
+
+// Runs the room scene with SurfelsRendering walking the cell lists and with the screen tile candidate lists side by side.
+// Logs the surfels looked at per pixel and the cost of both, and an error if the irradiance differs by more than rounding, returning false then.
+bool RunSurfelBinningBenchmark(const SurfelBinningBenchmarkDesc& desc);
+
+struct GIResolutionBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 60;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+};
+
+// Runs the room scene at every GI resolution side by side and logs the cost of the per pixel stages, the size of
+// the GI targets in the formats GlobalIllumination uses and how far the upsampled GI map is from the full resolution one.
+// Logs an error and returns false when a static camera would read its history away from the GI pixel itself.
+bool RunGIResolutionBenchmark(const GIResolutionBenchmarkDesc& desc);
+
+struct GIDenoiseBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 120;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+	uint32_t DenoiseIterations = 3;
+	uint32_t ReferenceRayBudgetScale = 8; // Reference rays per frame relative to the default budget
+};
+
+// Runs the room scene at fractions of the default ray budget with and without the a-trous denoiser side by side,
+// after converging every instance with the reference budget, and logs how far each GI map is from one traced with
+// many more rays and no denoiser, as is and with its energy matched to the reference over the whole screen and at
+// the pixels next to another surface, and the cost of the denoiser.
+bool RunGIDenoiseBenchmark(const GIDenoiseBenchmarkDesc& desc);
+
+struct SurfelLodBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 120;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+	float LodPixelRadius = SURFEL_DEFAULT_LOD_PIXEL_RADIUS; // At 1080p, scaled to Height so surfels get the same world size
+	float NearDistance = 2.5f; // Pixels closer to the camera are compared on their own
+	float MaxNearRelativeDifference = 0.15f; // Close up surfels keep the level radius, so the near pixels stay this close
+};
+
+// Runs the room scene looking at the walls with every surfel at the radius of its level and with the pixel footprint radius side by side.
+// Logs the surfel counts, the cost of the surfel stages and how far the footprint GI map is from the fixed radius one,
+// over the whole screen and over the pixels closer than NearDistance. Logs an error and returns false if the footprint
+// radius does not need fewer surfels or the near pixels differ by more than MaxNearRelativeDifference.
+bool RunSurfelLodBenchmark(const SurfelLodBenchmarkDesc& desc);
+
+struct SurfelInvalidationBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 360;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+	float StaleDistance = 0.02f; // Surfels further than this from every surface of the scene are stale
+	float MaxStaleFraction = 0.5f; // Stale surfels invalidating may leave, relative to ignoring the moves
+};
+
+// Runs the room scene with a box sliding through it, side by side ignoring the moves, invalidating the surfels
+// around the old and new box bounds each frame it moves, and resetting the GI each frame it moves.
+// Logs the surfel counts, the surfels left stale in mid air or inside the box and the cost of the eviction.
+// Logs an error and returns false if invalidating leaves more stale surfels than both resetting and MaxStaleFraction
+// of ignoring the moves.
+bool RunSurfelInvalidationBenchmark(const SurfelInvalidationBenchmarkDesc& desc);
+
+struct SurfelCellCapacityBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 120;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+	uint32_t CellCapacity = 64;
+	uint32_t CrammedSurfelCount = 32 * 1024; // Added on the three faces of a room corner
+	float CornerSize = 1.0f; // Extent of the crammed patch on each face
+	uint32_t LookupCount = 8192; // Room hits of random rays from the camera, looked up like the accumulation closest hit does
+	bool RebuildWorldStructure = false;
+};
+
+// Crams surfels into a room corner in view and runs the room scene with unbounded cell lists and with CellCapacity
+// under every overflow policy side by side, cell list walks only. Logs the longest cell list, the surfels looked at
+// per pixel and per closest hit lookup, the cost of the stages walking the lists, the brightness of the GI map and
+// the pixels the unbounded lists shade that are left without surfels. Logs an error and returns false if a capped list grows past the capacity
+// or if tile binning shades the refusing run differently from its cell lists.
+bool RunSurfelCellCapacityBenchmark(const SurfelCellCapacityBenchmarkDesc& desc);
+
+struct SurfelDefragmentBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 128;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+	uint32_t SurfelCount = 128 * 1024; // Added on the room walls in random order
+	uint32_t DefragmentWindow = SURFEL_DEFAULT_DEFRAGMENT_WINDOW;
+	uint32_t CacheSize = 64 * 1024; // Simulated cache the cell list walks go through
+	uint32_t CacheLineSize = 128;
+	uint32_t CacheWays = 8;
+};
+
+// Fills the room walls with surfels stored in random order and runs the room scene with the storage left in spawn order
+// and with the Morton order defragmentation side by side. At every power of two frame both walk the cell lists of every
+// pixel, in 8x8 tiles like the GPU waves, through a simulated set associative LRU cache. Logs the cache misses per lookup,
+// the distinct cache lines each tile touches and the cost of the surfel rendering and of the defragmentation.
+// Logs an error and returns false if the GI maps differ by more than rounding.
+bool RunSurfelDefragmentBenchmark(const SurfelDefragmentBenchmarkDesc& desc);
+
+struct SurfelCapacityBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 120; // Half before the storage grows and half after
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+	uint32_t InitialMaxSurfels = 8 * 1024;
+	uint32_t GrownMaxSurfels = 32 * 1024;
+	bool RebuildWorldStructure = false;
+};
+
+// Runs the room scene with a storage that fills up within the first half of the frames, then raises Max Surfels
+// side by side growing the storage in place and starting over like the setting used to. Logs how the index buffers
+// grew from the exact entry count, the frames whose lists ran past their end, the list entries per surfel against
+// the bound and the brightness of the GI map around the raise. Logs an error and returns false if the grown storage lost surfels or
+// a frame ended with lists past the end of the buffers.
+bool RunSurfelCapacityBenchmark(const SurfelCapacityBenchmarkDesc& desc);
+
+struct SurfelSamplingBenchmarkDesc
+{
+	uint32_t SurfelCount = 64; // Surfels placed on the room walls, each estimated on its own
+	uint32_t TrialCount = 64; // Independent estimates per surfel the error is measured over
+	uint32_t MaxRayCount = 4096;
+	uint32_t ReferenceRayCount = 1 << 18;
+	float TargetRelativeError = 0.02f; // RMS error relative to the reference irradiance
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+};
+
+// Estimates the irradiance of surfels in the room scene as a running mean of cosine weighted rays, with the white noise
+// the ray generation shader used to seed from the frame time and with the scrambled R2 sequence indexed by the sample count.
+// Logs the RMS error against a reference at every power of two and the rays each needs to reach TargetRelativeError.
+// Logs an error and returns false if the R2 sequence does not end with a lower error than the white noise.
+bool RunSurfelSamplingBenchmark(const SurfelSamplingBenchmarkDesc& desc);
+
+struct LightSamplingBenchmarkDesc
+{
+	uint32_t LightCount = 64;
+	float PowerRange = 10000.0f; // Brightest to dimmest light, the powers are spread log uniformly in between
+	uint32_t SurfelCount = 64; // Surfels placed on the room walls, each estimated on its own
+	uint32_t TrialCount = 64; // Independent estimates per surfel the error is measured over
+	uint32_t MaxRayCount = 4096;
+	uint32_t DrawCount = 1 << 22; // Picks drawn from every test table to check its frequencies
+	float TargetRelativeError = 0.05f; // RMS error relative to the exact irradiance
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+};
+
+// Checks BuildLightAliasTable on uniform, spread, dominated, partly zero, all zero and single weights: the probability
+// its slots and aliases give every light and the stored Pdf against the weights, and the frequencies of DrawCount picks
+// against them. Then estimates the direct irradiance of surfels on the room walls lit by LightCount point lights with
+// one shadow ray per sample, picking the light with the rounded uniform pick SurfelClosestHit used before, a uniform
+// table and a table weighted by power. Logs the RMS error at every power of two and the rays each needs to reach
+// TargetRelativeError. Then checks that a table over the point lights and a directional light, weighted with
+// GetLightSamplingWeight, still picks the directional light. Logs an error and returns false if a table is off, a light
+// without weight is picked, weighting by power does not bring the error down or the directional light is never picked.
+bool RunLightSamplingBenchmark(const LightSamplingBenchmarkDesc& desc);
+
+struct SurfelResamplingBenchmarkDesc
+{
+	uint32_t Width = 320;
+	uint32_t Height = 180;
+	uint32_t FrameCount = 256;
+	uint32_t RayBudget = 2048; // About a ray per surfel and frame once the view is covered
+	uint32_t ReferenceRayCount = 4096; // Rays of the reference irradiance of every surfel
+	uint32_t KernelTrialCount = 1 << 16;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+};
+
+// Checks the reservoir kernel from HostDeviceSurfelsData.h on its own: the packing round trip, an exact estimate under
+// constant radiance whatever the history and the merges, and the mean of KernelTrialCount single frame estimates against
+// the integral. Then runs the room scene from a fixed camera with every SURFEL_RESAMPLE_* mode, lit by the emissive
+// ceiling and by a small lamp in it, and logs the RMS error of the surfel irradiance against a per surfel reference
+// along the frames with the rays traced per surfel. Logs an error and returns false if a kernel check fails or resampling does not bring
+// the error down.
+bool RunSurfelResamplingBenchmark(const SurfelResamplingBenchmarkDesc& desc);
+
+struct GIMathBenchmarkDesc
+{
+	uint32_t Width = 640;
+	uint32_t Height = 360;
+	uint32_t FrameCount = 30; // Frames of the room scene run to spawn the surfels the lookups go through
+	uint32_t IterationCount = 10;
+	uint32_t EstimatorCount = 1 << 16;
+};
+
+// Times GetIrradianceAtPoint at every pixel of the room scene and MultiscaleMeanEstimator over random samples on one
+// thread against their GIBatch.h versions, and logs an error and returns false if a batch result strays from the scalar one.
+bool RunGIMathBenchmark(const GIMathBenchmarkDesc& desc);
+
+struct ParallelPrimitivesBenchmarkDesc
+{
+	uint32_t ElementCount = 1 << 22;
+	uint32_t IterationCount = 20;
+	uint32_t ThreadCount = 0; // 0 uses all hardware threads
+};
+
+// Times every ParallelPrimitivesCPU operation over random data against a serial reference
+// and logs an error and returns false if any result differs from the reference.
+bool RunParallelPrimitivesBenchmark(const ParallelPrimitivesBenchmarkDesc& desc);
+
+// Runs the benchmark whose flag is on the command line, the first value after the flag sets its main count.
+// Returns false if there is no benchmark flag, otherwise sets passed to what the benchmark returned.
+bool RunCommandLineBenchmark(const Falcor::ArgList& args, bool& passed);
@@ -0,0 +1,529 @@
+#pragma once
+
+// Host side twin of GICommon.slang, Random.slang and the estimator in SurfelsAccumulate.slang.
+// Everything here should stay bit-for-bit close to the shader code so CPU and GPU results can be diffed.
+
+#include <Falcor.h>
+
+#include <cmath>
+
+#include "GI/Data/HostDeviceSurfelsData.h"
+
+using namespace Falcor;
+
+namespace GICPU
+{
+	static const float PI = 3.14159265358979323846f;
+
+	// Random.slang
+	inline uint RandXORShift(uint& rngState)
+	{
+		// Xorshift algorithm from George Marsaglia's paper
+		rngState ^= (rngState << 13);
+		rngState ^= (rngState >> 17);
+		rngState ^= (rngState << 5);
+		return rngState;
+	}
+
+	inline uint RandomSeed(uint seed)
+	{
+		// Wang hash
+		seed = (seed ^ 61) ^ (seed >> 16);
+		seed *= 9;
+		seed = seed ^ (seed >> 4);
+		seed *= 0x27d4eb2d;
+		seed = seed ^ (seed >> 15);
+		return seed;
+	}
+
+	inline float RandomFloat(uint& seed)
+	{
+		return float(RandXORShift(seed)) * (1.0f / 4294967296.0f);
+	}
+
+	// Falcor's Helpers.slang generator used by the ray generation shader
+	inline uint RandInit(uint val0, uint val1, uint backoff = 16)
+	{
+		uint v0 = val0, v1 = val1, s0 = 0;
+		for (uint n = 0; n < backoff; n++)
+		{
+			s0 += 0x9e3779b9;
+			v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+			v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+		}
+		return v0;
+	}
+
+	inline float RandNext(uint& s)
+	{
+		s = (1664525u * s + 1013904223u);
+		return float(s & 0x00FFFFFF) / float(0x01000000);
+	}
+
+	inline float3 GetPerpendicularStark(const float3& u)
+	{
+		float3 a = glm::abs(u);
+		uint xm = ((a.x - a.y) < 0 && (a.x - a.z) < 0) ? 1 : 0;
+		uint ym = (a.y - a.z) < 0 ? (1 ^ xm) : 0;
+		uint zm = 1 ^ (xm | ym);
+		return glm::cross(u, float3(float(xm), float(ym), float(zm)));
+	}
+
+	inline float3 GetCosHemisphereSample(const float2& randVal, const float3& hitNorm, const float3& bitangent)
+	{
+		float3 tangent = glm::cross(bitangent, hitNorm);
+		float r = std::sqrt(randVal.x);
+		float phi = 2.0f * PI * randVal.y;
+		return tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + hitNorm * std::sqrt(std::max(0.0f, 1.0f - randVal.x));
+	}
+
+	// GICommon.slang
+	inline float3 GetWorldPosition(uint2 loc, uint2 dimensions, float depth, const float4x4& invViewProj)
+	{
+		float2 texC = float2(float(loc.x), float(loc.y)) / float2(float(dimensions.x), float(dimensions.y));
+		float2 ndcCoords = texC * 2.0f - 1.0f;
+		ndcCoords.y = -ndcCoords.y;
+		float4 projectedPos = float4(ndcCoords, depth, 1.0f);
+		float4 transformedPos = invViewProj * projectedPos;
+		return float3(transformedPos.x, transformedPos.y, transformedPos.z) / transformedPos.w;
+	}
+
+	inline uint2 GetGIMapDimensions(uint2 dimensions, uint resolutionShift)
+	{
+		return (dimensions + uint2((1u << resolutionShift) - 1)) >> resolutionShift;
+	}
+
+	inline uint2 GetGBufferLoc(uint2 giLoc, uint2 dimensions, uint resolutionShift)
+	{
+		return glm::min((giLoc << resolutionShift) + uint2((1u << resolutionShift) / 2), dimensions - 1u);
+	}
+
+	// GI map position of last frame's history for the G-buffer pixel at loc, mapped back the way the upsample maps
+	// G-buffer pixels so a static camera reads the GI pixel GetGBufferLoc shaded it for
+	inline float2 GetHistoryPixel(uint2 loc, const float2& motion, uint2 dimensions, uint resolutionShift)
+	{
+		const uint scale = 1u << resolutionShift;
+		const float2 prevTexC = (float2(loc) + 0.5f) / float2(dimensions) + motion;
+		const float2 prevLoc = prevTexC * float2(dimensions) - 0.5f;
+		return (prevLoc - float(scale / 2)) / float(scale);
+	}
+
+	inline float3 DecodeNormal(const float3& encodedNormal)
+	{
+		return glm::normalize(encodedNormal * 2.0f - 1.0f);
+	}
+
+	inline float GetLevelScale(uint level)
+	{
+		return float(1u << level);
+	}
+
+	inline float GetSurfelRadius(uint level)
+	{
+		return SurfelRadius * GetLevelScale(level);
+	}
+
+	inline float GetSurfelRadius(const uint4& geometry)
+	{
+		return SurfelRadius * UnpackSurfelRadiusScale(geometry);
+	}
+
+	inline float GetListedSurfelRadiusScale(const uint4& geometry, uint level)
+	{
+		return std::min(UnpackSurfelRadiusScale(geometry) / GetLevelScale(level), SURFEL_MAX_RADIUS_SCALE);
+	}
+
+	inline int3 GetWorldCell(const float3& pos, uint level)
+	{
+		return int3(glm::floor(pos / (WORLD_STRUCTURE_CHUNK_SIZE * GetLevelScale(level))));
+	}
+
+	inline uint GetWorldLevel(const float3& pos, const float3& cameraPosW)
+	{
+		for (uint level = 0; level < WORLD_STRUCTURE_LEVEL_COUNT - 1; ++level)
+		{
+			int3 offset = glm::abs(GetWorldCell(pos, level) - GetWorldCell(cameraPosW, level));
+			if (std::max(offset.x, std::max(offset.y, offset.z)) < WORLD_STRUCTURE_LEVEL_HALF_EXTENT)
+				return level;
+		}
+		return WORLD_STRUCTURE_LEVEL_COUNT - 1;
+	}
+
+	inline float3 GetChunkCenter(const int3& cell, uint level)
+	{
+		return (float3(cell) + 0.5f) * (WORLD_STRUCTURE_CHUNK_SIZE * GetLevelScale(level));
+	}
+
+	inline uint WorldCellHash(const int3& cell, uint level)
+	{
+		return (uint(cell.x) * 73856093u) ^ (uint(cell.y) * 19349663u) ^ (uint(cell.z) * 83492791u) ^ (level * 2654435761u);
+	}
+
+	inline uint FindWorldCell(const WorldCellKey* keys, const int3& cell, uint level)
+	{
+		const WorldCellKey key = GetWorldCellKey(cell, level);
+		uint slot = WorldCellHash(cell, level) & (WORLD_STRUCTURE_TOTAL_SIZE - 1);
+		for (uint i = 0; i < WORLD_STRUCTURE_MAX_PROBES; ++i)
+		{
+			if (IsSameWorldCell(keys[slot], key))
+				return slot;
+			if (keys[slot].Tag == WORLD_STRUCTURE_EMPTY_KEY)
+				break;
+			slot = (slot + 1) & (WORLD_STRUCTURE_TOTAL_SIZE - 1);
+		}
+		return WORLD_STRUCTURE_INVALID_INDEX;
+	}
+
+	// Not thread safe, the CPU pipeline inserts from a single thread so slot placement is deterministic.
+	// Takes the first empty or retired slot of the window unless the cell is already further along it.
+	inline uint InsertWorldCell(WorldCellKey* keys, const int3& cell, uint level)
+	{
+		const uint found = FindWorldCell(keys, cell, level);
+		if (found != WORLD_STRUCTURE_INVALID_INDEX)
+			return found;
+
+		uint slot = WorldCellHash(cell, level) & (WORLD_STRUCTURE_TOTAL_SIZE - 1);
+		for (uint i = 0; i < WORLD_STRUCTURE_MAX_PROBES; ++i)
+		{
+			if (!IsWorldCellKeyUsed(keys[slot]))
+			{
+				keys[slot] = GetWorldCellKey(cell, level);
+				return slot;
+			}
+			slot = (slot + 1) & (WORLD_STRUCTURE_TOTAL_SIZE - 1);
+		}
+		return WORLD_STRUCTURE_INVALID_INDEX;
+	}
+
+	inline bool IsWorldCellOutsideLevel(const WorldCellKey& key, const float3& cameraPosW)
+	{
+		if (!IsWorldCellKeyUsed(key) || GetWorldCellKeyLevel(key) == WORLD_STRUCTURE_LEVEL_COUNT - 1)
+			return false;
+
+		const uint level = GetWorldCellKeyLevel(key);
+		const int3 offset = glm::abs(GetWorldCellKeyCell(key) - GetWorldCell(cameraPosW, level));
+		return std::max(offset.x, std::max(offset.y, offset.z)) > WORLD_STRUCTURE_LEVEL_HALF_EXTENT;
+	}
+
+	inline void RetireWorldCell(WorldCellKey* keys, uint worldIndex)
+	{
+		keys[worldIndex] = WorldCellKey{ WORLD_STRUCTURE_RETIRED_KEY, WORLD_STRUCTURE_PENDING_COORDS };
+	}
+
+	static const int3 OverlapCellOffsets[WORLD_STRUCTURE_OVERLAP_CELL_COUNT] =
+	{
+		int3( 0,  0,  0),
+		int3( 1,  1,  1), int3( 1,  1, -1), int3( 1, -1, -1), int3( 1, -1,  1),
+		int3(-1, -1,  1), int3(-1, -1, -1), int3(-1,  1, -1), int3(-1,  1,  1),
+		int3( 1,  0,  0), int3(-1,  0,  0), int3( 0,  1,  0), int3( 0, -1,  0), int3( 0,  0,  1), int3( 0,  0, -1),
+		int3( 0,  1,  1), int3( 0,  1, -1), int3( 0, -1, -1), int3( 0, -1,  1),
+		int3( 1,  0,  1), int3( 1,  0, -1), int3(-1,  0, -1), int3(-1,  0,  1),
+		int3( 1,  1,  0), int3( 1, -1,  0), int3(-1, -1,  0), int3(-1,  1,  0)
+	};
+
+	inline uint GetOverlappedCellMask(const float3& position, const int3& cell, uint level, float radiusScale)
+	{
+		const float radiusSquared = SurfelRadiusSquared * radiusScale * radiusScale;
+		const float3 posInChunk = (position - GetChunkCenter(cell, level)) / GetLevelScale(level);
+		const float d = WORLD_STRUCTURE_CHUNK_SIZE / 2.0f;
+		const float3 toLower = (d + posInChunk) * (d + posInChunk);
+		const float3 toUpper = (d - posInChunk) * (d - posInChunk);
+
+		// Per axis term of the squared distance indexed by offset + 1, the same values the shader selects
+		const float axisDistances[3][3] =
+		{
+			{ toLower.x, 0.0f, toUpper.x },
+			{ toLower.y, 0.0f, toUpper.y },
+			{ toLower.z, 0.0f, toUpper.z },
+		};
+
+		uint mask = 0;
+		for (uint i = 0; i < WORLD_STRUCTURE_OVERLAP_CELL_COUNT; ++i)
+		{
+			const int3& offset = OverlapCellOffsets[i];
+			const float distanceSquared = axisDistances[0][offset.x + 1] + axisDistances[1][offset.y + 1] + axisDistances[2][offset.z + 1];
+			mask |= (distanceSquared < radiusSquared ? 1u : 0u) << i;
+		}
+		return mask;
+	}
+
+	inline float GetMaxRadiusScaleInMask(const float3& position, const int3& cell, uint level, uint mask)
+	{
+		float maxRadiusSquared = SurfelRadiusSquared * SURFEL_MAX_RADIUS_SCALE * SURFEL_MAX_RADIUS_SCALE;
+		const float3 posInChunk = (position - GetChunkCenter(cell, level)) / GetLevelScale(level);
+		const float d = WORLD_STRUCTURE_CHUNK_SIZE / 2.0f;
+		const float3 toLower = (d + posInChunk) * (d + posInChunk);
+		const float3 toUpper = (d - posInChunk) * (d - posInChunk);
+
+		const float axisDistances[3][3] =
+		{
+			{ toLower.x, 0.0f, toUpper.x },
+			{ toLower.y, 0.0f, toUpper.y },
+			{ toLower.z, 0.0f, toUpper.z },
+		};
+
+		for (uint i = 0; i < WORLD_STRUCTURE_OVERLAP_CELL_COUNT; ++i)
+		{
+			if ((mask & (1u << i)) != 0)
+				continue;
+
+			const int3& offset = OverlapCellOffsets[i];
+			const float distanceSquared = axisDistances[0][offset.x + 1] + axisDistances[1][offset.y + 1] + axisDistances[2][offset.z + 1];
+			maxRadiusSquared = std::min(maxRadiusSquared, distanceSquared);
+		}
+		return std::sqrt(maxRadiusSquared) / SurfelRadius;
+	}
+
+	inline uint PopOverlappedCell(uint& mask)
+	{
+		const uint i = uint(glm::findLSB(mask));
+		mask &= mask - 1;
+		return i;
+	}
+
+	inline float K(float dist)
+	{
+		if (dist > 1)
+			return 0;
+		return (2 * dist * dist * dist) - (3 * dist * dist) + 1;
+	}
+
+	inline float dist(const float3& pos, const float3& surfelCenter, const float3& surfelNormal)
+	{
+		float3 v = (pos - surfelCenter + (2 * (glm::dot(pos - surfelCenter, surfelNormal)) * surfelNormal));
+		return glm::length(v);
+	}
+
+	inline float Smoothstep(float edge0, float edge1, float x)
+	{
+		float t = glm::clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+		return t * t * (3.0f - 2.0f * t);
+	}
+
+	inline bool IsSurfelAlive(const Surfel& surfel)
+	{
+		return surfel.Age != SURFEL_DEAD;
+	}
+
+	inline bool IsSurfelAlive(const SurfelState& state)
+	{
+		return state.Age != SURFEL_DEAD;
+	}
+
+	inline uint GetSurfelRayWeight(const Surfel& surfel)
+	{
+		if (!IsSurfelAlive(surfel))
+			return 0;
+
+		const float3 luminance = float3(0.299f, 0.587f, 0.114f);
+		float deviation = glm::dot(luminance, glm::sqrt(glm::max(surfel.Irradiance.variance, float3(0.0f))));
+		float relativeDeviation = deviation / std::max(glm::dot(luminance, surfel.Irradiance.mean), 1e-3f);
+		float youth = glm::clamp(1.0f - float(surfel.Age) / 64.0f, 0.0f, 1.0f);
+
+		float priority = 0.25f + glm::clamp(relativeDeviation, 0.0f, 1.0f) + glm::clamp(surfel.Irradiance.inconsistency, 0.0f, 1.0f) + youth;
+		if (surfel.LastSeen != 0)
+			priority *= 0.25f;
+
+		return glm::clamp(uint(priority * 4.0f + 0.5f), 1u, SURFEL_MAX_RAY_WEIGHT);
+	}
+
+	inline float ComputeCoverage(const float3& posW, const float3& normal, const float3& surfelPosition, const float3& surfelNormal, float surfelRadius)
+	{
+		float NdotSN = glm::dot(normal, surfelNormal);
+
+		// If normals are not in the same direction bail out
+		if (NdotSN <= 0)
+			return 0.0f;
+
+		float distance = dist(posW, surfelPosition, surfelNormal);
+		if (distance <= surfelRadius)
+		{
+			return (1.0f - (distance / surfelRadius)) * NdotSN;
+		}
+
+		return 0.0f;
+	}
+
+	// Mirrors SurfelsData from GICommon.slang
+	struct SurfelsDataView
+	{
+		const uint4* Geometry = nullptr;
+		const float4* Irradiance = nullptr;
+		const uint3* Estimator = nullptr;
+		const SurfelState* State = nullptr;
+		const WorldStructureChunk* WorldStructure = nullptr;
+		const WorldCellKey* WorldStructureKeys = nullptr;
+		const uint* Indices = nullptr;
+		uint IndicesSize = 0;
+		float3 CameraPosW = float3(0.0f); // Data.Camera.posW
+	};
+
+	inline Surfel LoadSurfel(const SurfelsDataView& data, uint surfelIndex)
+	{
+		const uint4 geometry = data.Geometry[surfelIndex];
+		Surfel surfel;
+		surfel.Position = UnpackSurfelPosition(geometry);
+		surfel.Normal = UnpackSurfelNormal(geometry);
+		surfel.RadiusScale = UnpackSurfelRadiusScale(geometry);
+		surfel.Irradiance = UnpackSurfelEstimator(data.Irradiance[surfelIndex], data.Estimator[surfelIndex]);
+		surfel.Age = data.State[surfelIndex].Age;
+		surfel.LastSeen = data.State[surfelIndex].LastSeen;
+		surfel.SampleCount = data.State[surfelIndex].SampleCount;
+		return surfel;
+	}
+
+	// pTotalVariance sums the surfel variances with the squared weights, see ResolveIrradianceVariance
+	inline void AccumulateSurfelIrradiance(const SurfelsDataView& data, const float3& posW, const float3& normal, uint surfelIndex,
+		bool useWeightFunctions, float3& totalIrradiance, float& totalWeight, float* pTotalVariance = nullptr)
+	{
+		const uint4 geometry = data.Geometry[surfelIndex];
+		const float surfelRadius = GetSurfelRadius(geometry);
+		const float3 surfelNormal = UnpackSurfelNormal(geometry);
+		const float3 surfelCenter = UnpackSurfelPosition(geometry);
+		const float4 surfelIrradiance = data.Irradiance[surfelIndex];
+		const float3 surfelMean = float3(surfelIrradiance.x, surfelIrradiance.y, surfelIrradiance.z);
+		float weight;
+		if (useWeightFunctions)
+		{
+			weight = Smoothstep(1.0f, 0.0f, dist(posW, surfelCenter, surfelNormal) / surfelRadius)
+				* std::pow(std::max(0.0f, glm::dot(normal, surfelNormal)), 2.0f);
+
+			totalIrradiance += weight * surfelMean;
+			totalWeight += weight;
+		}
+		else
+		{
+			float distanceAttenuation = Smoothstep(1.0f, 0.0f, dist(posW, surfelCenter, surfelNormal) / surfelRadius);
+
+			weight = distanceAttenuation // Disance attenuation
+				* std::max(0.0f, glm::dot(normal, surfelNormal)); // angular falloff
+			totalIrradiance += surfelMean * weight;
+		}
+		if (pTotalVariance)
+		{
+			*pTotalVariance += weight * weight * UnpackSurfelLuminanceVariance(data.Estimator[surfelIndex]);
+		}
+	}
+
+	inline float3 ResolveIrradiance(const float3& totalIrradiance, float totalWeight, bool useWeightFunctions)
+	{
+		if (useWeightFunctions)
+		{
+			if (totalWeight == 0.0f)
+			{
+				return float3(0.0f);
+			}
+
+			return totalIrradiance / totalWeight;
+		}
+
+		return totalIrradiance;
+	}
+
+	inline float ResolveIrradianceVariance(float totalVariance, float totalWeight, bool useWeightFunctions)
+	{
+		if (useWeightFunctions)
+		{
+			return totalWeight == 0.0f ? 0.0f : totalVariance / (totalWeight * totalWeight);
+		}
+		return totalVariance;
+	}
+
+	// candidateCount receives the number of surfels looked at, pVariance the variance of the irradiance
+	inline float3 GetIrradianceAtPoint(const SurfelsDataView& data, const float3& posW, const float3& normal, bool useWeightFunctions = true,
+		uint* candidateCount = nullptr, float* pVariance = nullptr)
+	{
+		float3 totalIrradiance = { 0.0f, 0.0f, 0.0f };
+		float totalWeight = 0.0f;
+		float totalVariance = 0.0f;
+		if (pVariance)
+		{
+			*pVariance = 0.0f;
+		}
+
+		uint level = GetWorldLevel(posW, data.CameraPosW);
+		uint worldIndex = FindWorldCell(data.WorldStructureKeys, GetWorldCell(posW, level), level);
+		if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX)
+		{
+			return totalIrradiance;
+		}
+
+		uint startIndex = data.WorldStructure[worldIndex].StartIndex;
+		uint count = data.WorldStructure[worldIndex].Count;
+		if (startIndex + count > data.IndicesSize)
+		{
+			count = startIndex < data.IndicesSize ? data.IndicesSize - startIndex : 0;
+		}
+		for (uint i = 0; i < count; ++i)
+		{
+			AccumulateSurfelIrradiance(data, posW, normal, data.Indices[startIndex + i], useWeightFunctions, totalIrradiance, totalWeight,
+				pVariance ? &totalVariance : nullptr);
+		}
+		if (candidateCount)
+		{
+			*candidateCount += count;
+		}
+		if (pVariance)
+		{
+			*pVariance = ResolveIrradianceVariance(totalVariance, totalWeight, useWeightFunctions);
+		}
+
+		return ResolveIrradiance(totalIrradiance, totalWeight, useWeightFunctions);
+	}
+
+	// SurfelsAccumulate.slang
+	inline float3 MultiscaleMeanEstimator(float3 y,
+		MultiscaleMeanEstimatorData& data,
+		float shortWindowBlend = 0.08f)
+	{
+		const float3 luminance = float3(0.299f, 0.587f, 0.114f);
+
+		float3 mean = data.mean;
+		float3 shortMean = data.shortMean;
+		float vbbr = data.vbbr;
+		float3 variance = data.variance;
+		float inconsistency = data.inconsistency;
+
+		// Suppress fireflies.
+		{
+			float3 dev = glm::sqrt(glm::max(variance, 1e-5f));
+			float3 highThreshold = 0.1f + shortMean + dev * 8.0f;
+			float3 overflow = glm::max(y - highThreshold, 0.0f);
+			y -= overflow;
+		}
+
+		float3 delta = y - shortMean;
+		shortMean = glm::mix(shortMean, y, shortWindowBlend);
+		float3 delta2 = y - shortMean;
+
+		// This should be a longer window than shortWindowBlend to avoid bias
+		// from the variance getting smaller when the short-term mean does.
+		float varianceBlend = shortWindowBlend * 0.5f;
+		variance = glm::mix(variance, delta * delta2, varianceBlend);
+		float3 dev = glm::sqrt(glm::max(variance, 1e-5f));
+
+		float3 shortDiff = mean - shortMean;
+
+		float relativeDiff = glm::dot(luminance, glm::abs(shortDiff) / glm::max(dev, 1e-5f));
+		inconsistency = glm::mix(inconsistency, relativeDiff, 0.08f);
+
+		float varianceBasedBlendReduction =
+			glm::clamp(glm::dot(luminance, 0.5f * shortMean / glm::max(dev, 1e-5f)), 1.0f / 32, 1.0f);
+
+		float catchUpBlend = glm::clamp(Smoothstep(0.0f, 1.0f,
+			relativeDiff * std::max(0.02f, inconsistency - 0.2f)), 1.0f / 256, 1.0f);
+		catchUpBlend *= vbbr;
+
+		vbbr = glm::mix(vbbr, varianceBasedBlendReduction, 0.1f);
+		mean = glm::mix(mean, y, glm::clamp(catchUpBlend, 0.0f, 1.0f));
+
+		// Output
+		data.mean = mean;
+		data.shortMean = shortMean;
+		data.vbbr = vbbr;
+		data.variance = variance;
+		data.inconsistency = inconsistency;
+
+		return mean;
+	}
+}
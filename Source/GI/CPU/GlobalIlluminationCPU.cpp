@@ -0,0 +1,1798 @@
+#include "GlobalIlluminationCPU.h"
+
+#include "GI/SurfelCache.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#define DENOISE_SSE 1
+#include <xmmintrin.h>
+#endif
+
+using namespace GICPU;
+
+namespace
+{
+	const uint32_t COVERAGE_THRESHOLD = 3;
+	const uint32_t COVERAGE_BLOCK_SIZE = 16;
+	// Lists at least this long are copied by the whole pool instead of the thread that owns the cell
+	const uint32_t COOPERATIVE_COPY_SIZE = 16 * 1024;
+	// Groupshared set sizes of BinSurfels.slang
+	const uint32_t TILE_CELL_SLOTS = 64;
+	const uint32_t TILE_SURFEL_SLOT_BITS = 9;
+	const uint32_t TILE_SURFEL_SLOTS = 1 << TILE_SURFEL_SLOT_BITS;
+	const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+	// ResolveGI.slang
+	const float HISTORY_DISTANCE_TOLERANCE = 0.1f;
+	const float HISTORY_NORMAL_THRESHOLD = 0.9f;
+	const float UPSAMPLE_DISTANCE_SCALE = 50.0f;
+	const float UPSAMPLE_NORMAL_POWER = 8.0f;
+	const float DENOISE_KERNEL[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+	const float DENOISE_VARIANCE_KERNEL[2] = { 0.5f, 0.25f };
+
+	// Weighted sum of the irradiance and its variance, the variance lane takes the squared weights
+	struct DenoiseSum
+	{
+#ifdef DENOISE_SSE
+		__m128 Lanes = _mm_setzero_ps();
+
+		void Add(const float4& value, float weight)
+		{
+			Lanes = _mm_add_ps(Lanes, _mm_mul_ps(_mm_loadu_ps(&value.x), _mm_setr_ps(weight, weight, weight, weight * weight)));
+		}
+
+		float4 Resolve(float totalWeight) const
+		{
+			float4 result;
+			_mm_storeu_ps(&result.x, _mm_div_ps(Lanes, _mm_setr_ps(totalWeight, totalWeight, totalWeight, totalWeight * totalWeight)));
+			return result;
+		}
+#else
+		float4 Value = float4(0.0f);
+
+		void Add(const float4& value, float weight)
+		{
+			Value += value * float4(weight, weight, weight, weight * weight);
+		}
+
+		float4 Resolve(float totalWeight) const
+		{
+			return Value / float4(totalWeight, totalWeight, totalWeight, totalWeight * totalWeight);
+		}
+#endif
+	};
+
+	float GetIrradianceLuminance(const float3& irradiance)
+	{
+		return glm::dot(irradiance, float3(0.299f, 0.587f, 0.114f));
+	}
+
+	template<typename Func>
+	double TimeStage(Func&& func)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		func();
+		auto end = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration<double, std::milli>(end - start).count();
+	}
+
+	// Out of bounds loads return 0 like texture loads on the GPU
+	float LoadDepth(const GBufferCPU& gBuffer, uint2 loc)
+	{
+		if (loc.x >= gBuffer.Width || loc.y >= gBuffer.Height)
+			return 0.0f;
+		return gBuffer.Depth[loc.y * gBuffer.Width + loc.x];
+	}
+
+	float3 LoadWorldPosition(const GBufferCPU& gBuffer, uint2 loc, const float4x4& invViewProj)
+	{
+		return GetWorldPosition(loc, uint2(gBuffer.Width, gBuffer.Height), LoadDepth(gBuffer, loc), invViewProj);
+	}
+
+	float3 LoadNormal(const GBufferCPU& gBuffer, uint2 loc)
+	{
+		return DecodeNormal(gBuffer.Normal[loc.y * gBuffer.Width + loc.x]);
+	}
+
+	float2 LoadMotion(const GBufferCPU& gBuffer, uint2 loc)
+	{
+		return gBuffer.Motion.empty() ? float2(0.0f) : gBuffer.Motion[loc.y * gBuffer.Width + loc.x];
+	}
+
+	float GetBilinearWeight(const float2& f, uint32_t tap)
+	{
+		return ((tap & 1) != 0 ? f.x : 1.0f - f.x) * ((tap >> 1) != 0 ? f.y : 1.0f - f.y);
+	}
+
+	float GetPixelWorldArea(const GBufferCPU& gBuffer, uint2 loc, const float4x4& invViewProj)
+	{
+		if (loc.x + 1 > gBuffer.Width
+			|| loc.y + 1 > gBuffer.Height)
+		{
+			return 0.0f;
+		}
+
+		float depth = LoadDepth(gBuffer, loc);
+		if (depth == 1.0f)
+		{
+			return 0.0f;
+		}
+
+		// a --- b
+		// |     |
+		// c --- d
+		float3 a = LoadWorldPosition(gBuffer, loc, invViewProj);
+		float3 b = LoadWorldPosition(gBuffer, loc + uint2(1, 0), invViewProj);
+		float3 c = LoadWorldPosition(gBuffer, loc + uint2(0, 1), invViewProj);
+		float3 d = LoadWorldPosition(gBuffer, loc + uint2(1, 1), invViewProj);
+		return 0.5f * (glm::length(glm::cross(b - a, d - a)) + glm::length(glm::cross(d - a, c - a)));
+	}
+
+	float GetPixelProjectedArea(const GBufferCPU& gBuffer, uint2 loc, const float4x4& invViewProj)
+	{
+		return glm::clamp(GetPixelWorldArea(gBuffer, loc, invViewProj) * 900000.0f, 0.0f, 1.0f);
+	}
+
+	uint4 GetSpawnSurfelGeometry(const GBufferCPU& gBuffer, uint2 loc, const float4x4& invViewProj, const float3& cameraPosW, float lodPixelRadius)
+	{
+		const float3 position = LoadWorldPosition(gBuffer, loc, invViewProj);
+		const float3 normal = LoadNormal(gBuffer, loc);
+		const uint level = GetWorldLevel(UnpackSurfelPosition(PackSurfelGeometry(position, normal, 1.0f)), cameraPosW);
+		const float radius = lodPixelRadius * std::sqrt(GetPixelWorldArea(gBuffer, loc, invViewProj));
+		return PackSurfelGeometry(position, normal, glm::clamp(radius / GetSurfelRadius(level), 1.0f, SURFEL_MAX_RADIUS_SCALE) * GetLevelScale(level));
+	}
+
+	// Calls func(cell, level) for the cell containing the surfel and every neighbour cell its sphere touches,
+	// in the bit order of GetOverlappedCellMask like the shaders
+	template<typename Func>
+	void ForEachOverlappedChunk(const uint4& geometry, const float3& cameraPosW, Func&& func)
+	{
+		const float3 pos = UnpackSurfelPosition(geometry);
+		const uint level = GetWorldLevel(pos, cameraPosW);
+		const int3 cell = GetWorldCell(pos, level);
+		for (uint mask = GetOverlappedCellMask(pos, cell, level, GetListedSurfelRadiusScale(geometry, level)); mask != 0;)
+		{
+			func(cell + OverlapCellOffsets[PopOverlappedCell(mask)], level);
+		}
+	}
+}
+
+GlobalIlluminationCPU::GlobalIlluminationCPU(uint32_t threadCount)
+	: m_ThreadPool(std::make_unique<ThreadPool>(threadCount))
+	, m_Primitives(*m_ThreadPool)
+{
+}
+
+void GlobalIlluminationCPU::Initilize(const uvec2& giMapSize, uint32_t maxSurfels)
+{
+	m_OutputSize = giMapSize;
+	m_GIMapSize = GetGIMapDimensions(giMapSize, uint(m_Resolution));
+	m_MaxSurfels = maxSurfels;
+
+	const uint32_t pixelCount = m_GIMapSize.x * m_GIMapSize.y;
+	m_Coverage.assign(giMapSize.x * giMapSize.y, float2(0.0f));
+	m_Irradiance.assign(pixelCount, float4(0.0f));
+	m_GIMap.assign(giMapSize.x * giMapSize.y, float4(0.0f));
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		m_IrradianceHistory[i].assign(pixelCount, float4(0.0f));
+		m_HistoryGeometry[i].assign(pixelCount, float4(0.0f));
+		m_DenoiseTargets[i].assign(pixelCount, float4(0.0f));
+	}
+
+	m_SurfelSpawnCoords.reserve((giMapSize.x / COVERAGE_BLOCK_SIZE) * (giMapSize.y / COVERAGE_BLOCK_SIZE));
+	m_NewSurfelCounts.reset(new std::atomic<uint32_t>[WORLD_STRUCTURE_TOTAL_SIZE]);
+	m_SurfelCountDeltas.assign(WORLD_STRUCTURE_TOTAL_SIZE, 0);
+	m_ScannedSurfelCountDeltas.assign(WORLD_STRUCTURE_TOTAL_SIZE, 0);
+
+	m_TileCount = (m_GIMapSize + uvec2(SURFEL_TILE_SIZE - 1)) / uvec2(SURFEL_TILE_SIZE);
+	m_TileSurfels.assign(m_TileCount.x * m_TileCount.y * SURFEL_TILE_MAX_SURFELS, 0);
+	m_TileSurfelCounts.assign(m_TileCount.x * m_TileCount.y, 0);
+
+	ResetGI();
+}
+
+void GlobalIlluminationCPU::ResetGI()
+{
+	m_SurfelGeometry.assign(m_MaxSurfels, PackSurfelGeometry(float3(0.0f), float3(0.0f, 0.0f, 1.0f), 1.0f));
+	m_SurfelIrradiance.assign(m_MaxSurfels, float4(0.0f));
+	m_SurfelEstimator.assign(m_MaxSurfels, uint3(0));
+	m_SurfelState.assign(m_MaxSurfels, SurfelState());
+	m_SurfelReservoirs.assign(m_MaxSurfels, uint4(0));
+	m_PreviousSurfelReservoirs.assign(m_MaxSurfels, uint4(0));
+	m_SurfelCount = 0;
+
+	m_FreeSurfelIndices.clear();
+	m_FreeSurfelIndices.reserve(m_MaxSurfels);
+	m_SurfelSeen.reset(new std::atomic<bool>[m_MaxSurfels]);
+	for (uint32_t i = 0; i < m_MaxSurfels; ++i)
+	{
+		m_SurfelSeen[i].store(false, std::memory_order_relaxed);
+	}
+	m_SurfelEvicted.assign(m_MaxSurfels, 0);
+	m_SurfelCellMissing.assign(m_MaxSurfels, 0);
+	m_InvalidationBoxes.clear();
+	m_FramesSinceCompaction = 0;
+	m_DefragmentCursor = 0;
+
+	// Same sizing as the GPU path, writes past the end are dropped until GrowSurfelIndices catches up
+	m_SurfelIndices[0].assign(m_MaxSurfels * SURFEL_INITIAL_INDICES_PER_SURFEL, 0);
+	m_SurfelIndices[1].assign(m_MaxSurfels * SURFEL_INITIAL_INDICES_PER_SURFEL, 0);
+	m_CurrentSurfelIndicesBuffer = 0;
+	m_IndexCount = 0;
+	m_RelistSurfels = false;
+
+	m_WorldStructure.assign(WORLD_STRUCTURE_TOTAL_SIZE, WorldStructureChunk{ 0, 0 });
+	m_WorldStructureKeys.assign(WORLD_STRUCTURE_TOTAL_SIZE, WorldCellKey{ WORLD_STRUCTURE_EMPTY_KEY, WORLD_STRUCTURE_PENDING_COORDS });
+}
+
+void GlobalIlluminationCPU::SetMaxSurfels(uint32_t maxSurfels)
+{
+	if (maxSurfels < m_MaxSurfels)
+	{
+		m_MaxSurfels = maxSurfels;
+		ResetGI();
+		return;
+	}
+
+	// Surfels keep their indices, so the counts, the free stack and the cell lists stay valid as they are
+	m_MaxSurfels = maxSurfels;
+	m_SurfelGeometry.resize(m_MaxSurfels, PackSurfelGeometry(float3(0.0f), float3(0.0f, 0.0f, 1.0f), 1.0f));
+	m_SurfelIrradiance.resize(m_MaxSurfels, float4(0.0f));
+	m_SurfelEstimator.resize(m_MaxSurfels, uint3(0));
+	m_SurfelState.resize(m_MaxSurfels, SurfelState());
+	m_SurfelReservoirs.resize(m_MaxSurfels, uint4(0));
+	m_PreviousSurfelReservoirs.resize(m_MaxSurfels, uint4(0));
+	m_FreeSurfelIndices.reserve(m_MaxSurfels);
+	// Only set within a frame
+	m_SurfelSeen.reset(new std::atomic<bool>[m_MaxSurfels]);
+	for (uint32_t i = 0; i < m_MaxSurfels; ++i)
+	{
+		m_SurfelSeen[i].store(false, std::memory_order_relaxed);
+	}
+	m_SurfelEvicted.resize(m_MaxSurfels, 0);
+	m_SurfelCellMissing.resize(m_MaxSurfels, 0);
+}
+
+GICPU::SurfelsDataView GlobalIlluminationCPU::GetSurfelsDataView() const
+{
+	SurfelsDataView view;
+	view.Geometry = m_SurfelGeometry.data();
+	view.Irradiance = m_SurfelIrradiance.data();
+	view.Estimator = m_SurfelEstimator.data();
+	view.State = m_SurfelState.data();
+	view.WorldStructure = m_WorldStructure.data();
+	view.WorldStructureKeys = m_WorldStructureKeys.data();
+	view.Indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer].data();
+	view.IndicesSize = uint(m_SurfelIndices[m_CurrentSurfelIndicesBuffer].size());
+	view.CameraPosW = m_CameraPosW;
+	return view;
+}
+
+void GlobalIlluminationCPU::StoreSurfel(uint32_t surfelIndex, const Surfel& surfel)
+{
+	m_SurfelGeometry[surfelIndex] = PackSurfelGeometry(surfel.Position, surfel.Normal, surfel.RadiusScale);
+	StoreSurfelEstimator(surfelIndex, surfel.Irradiance);
+	m_SurfelState[surfelIndex] = SurfelState{ surfel.Age, surfel.LastSeen, surfel.SampleCount };
+	m_SurfelReservoirs[surfelIndex] = uint4(0);
+}
+
+void GlobalIlluminationCPU::StoreSurfelEstimator(uint32_t surfelIndex, const MultiscaleMeanEstimatorData& estimator)
+{
+	m_SurfelIrradiance[surfelIndex] = PackSurfelIrradiance(estimator);
+	m_SurfelEstimator[surfelIndex] = PackSurfelEstimator(estimator);
+}
+
+void GlobalIlluminationCPU::CopySurfel(uint32_t sourceIndex, uint32_t destinationIndex)
+{
+	m_SurfelGeometry[destinationIndex] = m_SurfelGeometry[sourceIndex];
+	m_SurfelIrradiance[destinationIndex] = m_SurfelIrradiance[sourceIndex];
+	m_SurfelEstimator[destinationIndex] = m_SurfelEstimator[sourceIndex];
+	m_SurfelState[destinationIndex] = m_SurfelState[sourceIndex];
+	m_SurfelReservoirs[destinationIndex] = m_SurfelReservoirs[sourceIndex];
+}
+
+void GlobalIlluminationCPU::GenerateGIMap(const GICPUCamera& camera, const GBufferCPU& gBuffer)
+{
+	assert(gBuffer.Width == m_OutputSize.x && gBuffer.Height == m_OutputSize.y);
+	m_CameraPosW = camera.PosW;
+	// Surfels near the edge of a scrolled clipmap window changed level, mirrors GlobalIllumination::GenerateGIMap
+	const int3 clipmapCameraCell = GetWorldCell(m_CameraPosW, 0);
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental && clipmapCameraCell != m_ClipmapCameraCell)
+	{
+		m_RelistSurfels = true;
+	}
+	m_ClipmapCameraCell = clipmapCameraCell;
+	m_Statistics = GIFrameStatistics();
+	m_Statistics.Frame = m_FrameIndex++;
+
+	m_Timings.Eviction = TimeStage([&] { EvictSurfels(); });
+	m_Timings.Coverage = TimeStage([&] { ComputeCoverage(gBuffer, camera.InvViewProj); });
+	m_Timings.ExclusiveScan = 0.0;
+	m_Timings.UpdateWorldStructure = 0.0;
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		m_Timings.UpdateWorldStructure = TimeStage([&] { CountEvictedSurfels(); });
+		m_Timings.ExclusiveScan = TimeStage([&] { m_Primitives.ExclusiveScan(m_SurfelCountDeltas.data(), m_ScannedSurfelCountDeltas.data(), WORLD_STRUCTURE_TOTAL_SIZE); });
+		m_Timings.UpdateWorldStructure += TimeStage([&] { UpdateWorldStructure(); });
+	}
+	m_Timings.Compaction = 0.0;
+	if (++m_FramesSinceCompaction >= m_CompactionInterval)
+	{
+		m_Timings.Compaction = TimeStage([&] { CompactSurfels(); });
+		m_FramesSinceCompaction = 0;
+	}
+	m_Timings.Defragment = 0.0;
+	if (m_DefragmentWindow != 0)
+	{
+		m_Timings.Defragment = TimeStage([&] { DefragmentSurfels(); });
+	}
+	m_Timings.SpawnSurfels = TimeStage([&] { SpawnSurfels(gBuffer, camera.InvViewProj); });
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Rebuild || m_RelistSurfels)
+	{
+		const uint32_t indicesSize = GetIndexCapacity();
+		m_Timings.UpdateWorldStructure += TimeStage([&] { RebuildWorldStructure(); });
+		// The rebuild sizes its buffer to the lists, the incremental update needs both at the grown size
+		if (m_RelistSurfels)
+		{
+			ReserveSurfelIndices(indicesSize);
+			m_RelistSurfels = false;
+		}
+	}
+	m_Timings.SurfelBinning = 0.0;
+	if (m_BinSurfelsPerTile && m_SurfelCellCapacity == 0)
+	{
+		m_Timings.SurfelBinning = TimeStage([&] { BinSurfels(gBuffer, camera.InvViewProj); });
+	}
+	m_Timings.SurfelsRendering = TimeStage([&] { RenderSurfels(gBuffer, camera.InvViewProj); });
+	m_Timings.ResolveGI = TimeStage([&] { TemporalAccumulate(gBuffer, camera.InvViewProj); });
+	m_Timings.Denoise = TimeStage([&] { DenoiseGI(); });
+	m_Timings.ResolveGI += TimeStage([&] { UpsampleGI(gBuffer, camera.InvViewProj); });
+
+	CollectCellStatistics();
+	m_Statistics.SurfelCount = m_SurfelCount;
+	m_Statistics.FreeSurfelCount = uint32_t(m_FreeSurfelIndices.size());
+
+	// Where GlobalIllumination grows them from the count it reads back. The rebuild sizes its buffer exactly every frame.
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		GrowSurfelIndices(m_IndexCount);
+	}
+}
+
+void GlobalIlluminationCPU::CollectCellStatistics()
+{
+	// GIStatistics.slang CollectCellStatistics
+	for (uint32_t worldIndex = 0; worldIndex < WORLD_STRUCTURE_TOTAL_SIZE; ++worldIndex)
+	{
+		if (!IsWorldCellKeyUsed(m_WorldStructureKeys[worldIndex]))
+			continue;
+
+		const uint32_t count = m_WorldStructure[worldIndex].Count;
+		++m_Statistics.OccupiedCells;
+		m_Statistics.ListedSurfels += count;
+		m_Statistics.MaxCellListLength = std::max(m_Statistics.MaxCellListLength, count);
+	}
+}
+
+void GlobalIlluminationCPU::InvalidateBox(const float3& boxMin, const float3& boxMax)
+{
+	// Same cap as the GPU box buffer
+	if (m_InvalidationBoxes.size() < SURFEL_MAX_INVALIDATION_BOXES)
+	{
+		m_InvalidationBoxes.push_back(SurfelInvalidationBox{ boxMin, boxMax });
+	}
+	else
+	{
+		m_InvalidationBoxes.back().Min = glm::min(m_InvalidationBoxes.back().Min, boxMin);
+		m_InvalidationBoxes.back().Max = glm::max(m_InvalidationBoxes.back().Max, boxMax);
+	}
+}
+
+void GlobalIlluminationCPU::EvictSurfels()
+{
+	const SurfelsDataView data = GetSurfelsDataView();
+
+	// Decide first and apply after, the GPU pass reads neighbours while they are being updated
+	m_ThreadPool->ParallelFor(m_SurfelCount, 256, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			const SurfelState& surfel = m_SurfelState[surfelIndex];
+			m_SurfelEvicted[surfelIndex] = 0;
+			if (!IsSurfelAlive(surfel))
+				continue;
+
+			bool evict = surfel.LastSeen >= m_MaxUnseenFrames || (m_MaxSurfelAge != 0 && surfel.Age >= m_MaxSurfelAge);
+			if (!evict && !m_InvalidationBoxes.empty())
+			{
+				const uint4 geometry = m_SurfelGeometry[surfelIndex];
+				const float3 position = UnpackSurfelPosition(geometry);
+				const float radius = GetSurfelRadius(geometry);
+				for (const SurfelInvalidationBox& box : m_InvalidationBoxes)
+				{
+					const float3 toBox = position - glm::clamp(position, box.Min, box.Max);
+					evict = evict || glm::dot(toBox, toBox) <= radius * radius;
+				}
+			}
+			// Listed nowhere once the cell it lies in at its current level is gone, see IsSurfelUnlisted in EvictSurfels.slang
+			if (!evict && m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental && !m_RelistSurfels)
+			{
+				const float3 position = UnpackSurfelPosition(m_SurfelGeometry[surfelIndex]);
+				const uint level = GetWorldLevel(position, data.CameraPosW);
+				evict = FindWorldCell(data.WorldStructureKeys, GetWorldCell(position, level), level) == WORLD_STRUCTURE_INVALID_INDEX;
+			}
+			// An unbounded coverage never evicts, skip the neighbour loop
+			if (!evict && m_MaxSurfelCoverage < FLT_MAX)
+			{
+				// Coverage at the surfel center from older surfels sharing its cell
+				const float3 position = UnpackSurfelPosition(m_SurfelGeometry[surfelIndex]);
+				const float3 normal = UnpackSurfelNormal(m_SurfelGeometry[surfelIndex]);
+				const uint level = GetWorldLevel(position, data.CameraPosW);
+				const uint worldIndex = FindWorldCell(data.WorldStructureKeys, GetWorldCell(position, level), level);
+				const WorldStructureChunk chunk = worldIndex != WORLD_STRUCTURE_INVALID_INDEX ? data.WorldStructure[worldIndex] : WorldStructureChunk{ 0, 0 };
+				float coverage = 0.0f;
+				for (uint i = 0; i < chunk.Count && chunk.StartIndex + i < data.IndicesSize; ++i)
+				{
+					const uint otherIndex = data.Indices[chunk.StartIndex + i];
+					const SurfelState& other = data.State[otherIndex];
+					if (otherIndex == surfelIndex || !IsSurfelAlive(other))
+						continue;
+
+					if (other.Age > surfel.Age || (other.Age == surfel.Age && otherIndex < surfelIndex))
+					{
+						const uint4 geometry = data.Geometry[otherIndex];
+						coverage += GICPU::ComputeCoverage(position, normal, UnpackSurfelPosition(geometry), UnpackSurfelNormal(geometry), GetSurfelRadius(geometry));
+					}
+				}
+				evict = coverage > m_MaxSurfelCoverage;
+			}
+			m_SurfelEvicted[surfelIndex] = evict ? 1 : 0;
+		}
+	});
+
+	m_ThreadPool->ParallelFor(m_SurfelCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			SurfelState& surfel = m_SurfelState[surfelIndex];
+			if (!IsSurfelAlive(surfel))
+				continue;
+
+			if (m_SurfelEvicted[surfelIndex])
+			{
+				surfel.Age = SURFEL_DEAD;
+			}
+			else
+			{
+				++surfel.Age;
+				++surfel.LastSeen;
+			}
+		}
+	});
+
+	// Pushed in index order so the free stack does not depend on the thread count
+	for (uint32_t surfelIndex = 0; surfelIndex < m_SurfelCount; ++surfelIndex)
+	{
+		if (m_SurfelEvicted[surfelIndex])
+		{
+			m_FreeSurfelIndices.push_back(surfelIndex);
+			++m_Statistics.EvictedSurfels;
+		}
+	}
+	m_InvalidationBoxes.clear();
+}
+
+void GlobalIlluminationCPU::ComputeCoverage(const GBufferCPU& gBuffer, const float4x4& invViewProj)
+{
+	for (uint32_t i = 0; i < WORLD_STRUCTURE_TOTAL_SIZE; ++i)
+	{
+		m_NewSurfelCounts[i].store(0, std::memory_order_relaxed);
+	}
+
+	const uint32_t blocksX = gBuffer.Width / COVERAGE_BLOCK_SIZE;
+	const uint32_t blocksY = gBuffer.Height / COVERAGE_BLOCK_SIZE;
+	const SurfelsDataView data = GetSurfelsDataView();
+
+	// One slot per block so the append order does not depend on thread scheduling
+	static const uint2 NoSpawn = uint2(~0u, ~0u);
+	std::vector<uint2> blockSpawnCoords(blocksX * blocksY, NoSpawn);
+
+	m_ThreadPool->ParallelFor(blocksX * blocksY, 4, [&](uint32_t begin, uint32_t end)
+	{
+		const uint32_t threadCount = COVERAGE_BLOCK_SIZE * COVERAGE_BLOCK_SIZE;
+		float groupCoverage[threadCount];
+		uint2 groupScreenPos[threadCount];
+
+		for (uint32_t block = begin; block < end; ++block)
+		{
+			const uint2 groupOrigin = uint2((block % blocksX) * COVERAGE_BLOCK_SIZE, (block / blocksX) * COVERAGE_BLOCK_SIZE);
+			for (uint32_t groupIndex = 0; groupIndex < threadCount; ++groupIndex)
+			{
+				const uint2 tid = groupOrigin + uint2(groupIndex % COVERAGE_BLOCK_SIZE, groupIndex / COVERAGE_BLOCK_SIZE);
+				const float3 posW = LoadWorldPosition(gBuffer, tid, invViewProj);
+				const float3 normal = LoadNormal(gBuffer, tid);
+
+				const uint level = GetWorldLevel(posW, data.CameraPosW);
+				const uint worldIndex = FindWorldCell(data.WorldStructureKeys, GetWorldCell(posW, level), level);
+				const WorldStructureChunk chunk = worldIndex != WORLD_STRUCTURE_INVALID_INDEX ? data.WorldStructure[worldIndex] : WorldStructureChunk{ 0, 0 };
+				float coverage = 0.0f;
+				for (uint i = 0; i < chunk.Count && chunk.StartIndex + i < data.IndicesSize; ++i)
+				{
+					const uint surfelIndex = data.Indices[chunk.StartIndex + i];
+					// Evicted this frame, still listed until UpdateWorldStructure
+					if (!IsSurfelAlive(data.State[surfelIndex]))
+						continue;
+
+					const uint4 geometry = data.Geometry[surfelIndex];
+					const float surfelCoverage = GICPU::ComputeCoverage(posW, normal, UnpackSurfelPosition(geometry), UnpackSurfelNormal(geometry), GetSurfelRadius(geometry));
+					if (surfelCoverage > 0.0f)
+					{
+						m_SurfelSeen[surfelIndex].store(true, std::memory_order_relaxed);
+					}
+					coverage += surfelCoverage;
+				}
+
+				groupCoverage[groupIndex] = coverage;
+				groupScreenPos[groupIndex] = tid;
+				m_Coverage[tid.y * gBuffer.Width + tid.x] = float2(coverage, 0.0f);
+			}
+
+			// Same reduction order as the shader so ties pick the same pixel
+			for (uint32_t step = threadCount / 2; step > 0; step >>= 1)
+			{
+				for (uint32_t groupIndex = 0; groupIndex < step; ++groupIndex)
+				{
+					if (groupCoverage[groupIndex] > groupCoverage[groupIndex + step])
+					{
+						groupCoverage[groupIndex] = groupCoverage[groupIndex + step];
+						groupScreenPos[groupIndex] = groupScreenPos[groupIndex + step];
+					}
+				}
+			}
+
+			if (groupCoverage[0] < COVERAGE_THRESHOLD)
+			{
+				float chance = GetFrameJitter(uint(m_Statistics.Frame), groupOrigin.x * 4096 + groupOrigin.y);
+				float pixArea = GetPixelProjectedArea(gBuffer, groupScreenPos[0], invViewProj);
+				m_Coverage[groupScreenPos[0].y * gBuffer.Width + groupScreenPos[0].x] = float2(groupCoverage[0], pixArea);
+				if (chance * pixArea > m_SpawnChance)
+				{
+					blockSpawnCoords[block] = groupScreenPos[0];
+				}
+			}
+		}
+	});
+
+	// Cells are inserted in block order on this thread, so hash slots come out the same for any thread count
+	m_ThreadPool->ParallelFor(m_SurfelCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			if (m_SurfelSeen[surfelIndex].exchange(false, std::memory_order_relaxed))
+			{
+				m_SurfelState[surfelIndex].LastSeen = 0;
+			}
+		}
+	});
+
+	// Spawns past the free storage are refused before they reserve list slots, mirrors ReserveSurfelStorage
+	const uint32_t availableCount = uint32_t(m_FreeSurfelIndices.size()) + m_MaxSurfels - m_SurfelCount;
+	m_SurfelSpawnCoords.clear();
+	for (const uint2& coords : blockSpawnCoords)
+	{
+		if (coords == NoSpawn)
+			continue;
+
+		// Counted at the quantized position and radius SpawnSurfels lists the surfel by, so every count gets its insertion
+		const uint4 geometry = GetSpawnSurfelGeometry(gBuffer, coords, invViewProj, m_CameraPosW, m_SurfelLodPixelRadius);
+		const float3 pos = UnpackSurfelPosition(geometry);
+		const uint level = GetWorldLevel(pos, m_CameraPosW);
+		const int3 cell = GetWorldCell(pos, level);
+		const uint worldIndex = InsertWorldCell(m_WorldStructureKeys.data(), cell, level);
+		// Hash window for this cell or the surfel storage is full, skip spawning
+		if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX || m_SurfelSpawnCoords.size() >= availableCount)
+			continue;
+
+		// Reserved in block order, so which spawns a full cell turns away does not depend on the thread count
+		if (!CountNewSurfel(worldIndex))
+		{
+			if (m_SurfelCellOverflow == SURFEL_CELL_OVERFLOW_MERGE)
+			{
+				MergeIntoNearestSurfel(worldIndex, level, pos, UnpackSurfelNormal(geometry));
+			}
+			++m_Statistics.OverflowedSpawns;
+			continue;
+		}
+
+		// Full neighbour cells only miss the surfel, their bits are cleared so SpawnSurfels skips them
+		uint mask = GetOverlappedCellMask(pos, cell, level, GetListedSurfelRadiusScale(geometry, level)) | 1u;
+		for (uint neighbours = mask & ~1u; neighbours != 0;)
+		{
+			const uint i = PopOverlappedCell(neighbours);
+			const uint neighbourIndex = InsertWorldCell(m_WorldStructureKeys.data(), cell + OverlapCellOffsets[i], level);
+			if (neighbourIndex == WORLD_STRUCTURE_INVALID_INDEX || !CountNewSurfel(neighbourIndex))
+			{
+				mask &= ~(1u << i);
+			}
+		}
+		m_SurfelSpawnCoords.push_back(uint3(coords, mask));
+	}
+}
+
+bool GlobalIlluminationCPU::CountNewSurfel(uint32_t worldIndex)
+{
+	const uint32_t newCount = m_NewSurfelCounts[worldIndex].load(std::memory_order_relaxed);
+	if (!HasSurfelCellRoom(m_WorldStructure[worldIndex].Count + newCount, m_SurfelCellCapacity))
+		return false;
+
+	m_NewSurfelCounts[worldIndex].store(newCount + 1, std::memory_order_relaxed);
+	return true;
+}
+
+void GlobalIlluminationCPU::MergeIntoNearestSurfel(uint32_t worldIndex, uint level, const float3& position, const float3& normal)
+{
+	// Same search as the shader, ties go to the surfel listed first
+	const std::vector<uint32_t>& indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+	const WorldStructureChunk chunk = m_WorldStructure[worldIndex];
+	bool found = false;
+	uint32_t nearestIndex = 0;
+	float nearestDistance = 0.0f;
+	for (uint32_t i = 0; i < chunk.Count && chunk.StartIndex + i < indices.size(); ++i)
+	{
+		const uint32_t surfelIndex = indices[chunk.StartIndex + i];
+		if (!IsSurfelAlive(m_SurfelState[surfelIndex]))
+			continue;
+
+		const uint4 geometry = m_SurfelGeometry[surfelIndex];
+		const float3 surfelNormal = UnpackSurfelNormal(geometry);
+		if (glm::dot(normal, surfelNormal) <= 0.0f)
+			continue;
+
+		const float distance = dist(position, UnpackSurfelPosition(geometry), surfelNormal);
+		if (!found || distance < nearestDistance)
+		{
+			found = true;
+			nearestIndex = surfelIndex;
+			nearestDistance = distance;
+		}
+	}
+
+	if (found)
+	{
+		// Only as far as the cells the current radius reaches, as in the shader
+		uint4& geometry = m_SurfelGeometry[nearestIndex];
+		const float3 surfelPosition = UnpackSurfelPosition(geometry);
+		const int3 surfelCell = GetWorldCell(surfelPosition, level);
+		const uint listedMask = GetOverlappedCellMask(surfelPosition, surfelCell, level, GetListedSurfelRadiusScale(geometry, level)) | 1u;
+		const float maxRadiusScale = GetMaxRadiusScaleInMask(surfelPosition, surfelCell, level, listedMask) * SurfelExp2(-SURFEL_RADIUS_SCALE_LOG2_RANGE / 255.0f);
+		const float radiusScale = std::min(GetMergedSurfelRadiusScale(nearestDistance, GetSurfelRadius(level)), maxRadiusScale);
+		geometry.w = std::max(geometry.w, SetSurfelRadiusScale(geometry, radiusScale * GetLevelScale(level)));
+	}
+}
+
+void GlobalIlluminationCPU::CountEvictedSurfels()
+{
+	const SurfelsDataView data = GetSurfelsDataView();
+
+	m_ThreadPool->ParallelFor(WORLD_STRUCTURE_TOTAL_SIZE, 256, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t worldIndex = begin; worldIndex < end; ++worldIndex)
+		{
+			const WorldStructureChunk& chunk = m_WorldStructure[worldIndex];
+			// A cell the camera left behind drops its whole list, UpdateWorldStructure then retires it
+			const bool outsideLevel = IsWorldCellOutsideLevel(m_WorldStructureKeys[worldIndex], m_CameraPosW);
+			uint32_t evictedCount = 0;
+			for (uint32_t i = chunk.StartIndex; i < chunk.StartIndex + chunk.Count && i < data.IndicesSize; ++i)
+			{
+				if (outsideLevel || !IsSurfelAlive(m_SurfelState[data.Indices[i]]))
+				{
+					++evictedCount;
+				}
+			}
+
+			// Can wrap below zero, the scan and the start index math are all modulo 2^32
+			m_SurfelCountDeltas[worldIndex] = m_NewSurfelCounts[worldIndex].load(std::memory_order_relaxed) - evictedCount;
+		}
+	});
+}
+
+void GlobalIlluminationCPU::UpdateWorldStructure()
+{
+	const std::vector<uint32_t>& oldIndices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+	std::vector<uint32_t>& newIndices = m_SurfelIndices[(m_CurrentSurfelIndicesBuffer + 1) % 2];
+	const uint32_t indicesSize = uint32_t(newIndices.size());
+
+	// New surfels go first, SpawnSurfels fills those slots. Evicted surfels are dropped from the list.
+	auto copyList = [&](uint32_t worldIndex)
+	{
+		WorldStructureChunk& chunk = m_WorldStructure[worldIndex];
+		const uint32_t newStartIndex = chunk.StartIndex + m_ScannedSurfelCountDeltas[worldIndex];
+
+		uint32_t newCount = m_NewSurfelCounts[worldIndex].load(std::memory_order_relaxed);
+		// A cell outside its level keeps none of its list
+		const uint32_t listEnd = IsWorldCellOutsideLevel(m_WorldStructureKeys[worldIndex], m_CameraPosW) ? chunk.StartIndex : chunk.StartIndex + chunk.Count;
+		for (uint32_t i = chunk.StartIndex; i < listEnd && i < indicesSize; ++i)
+		{
+			const uint32_t surfelIndex = oldIndices[i];
+			if (!IsSurfelAlive(m_SurfelState[surfelIndex]))
+				continue;
+
+			const uint32_t destination = newStartIndex + newCount;
+			if (destination < indicesSize)
+			{
+				newIndices[destination] = surfelIndex;
+			}
+			++newCount;
+		}
+
+		chunk.StartIndex = newStartIndex;
+		chunk.Count = newCount;
+		// Nothing listed and nothing spawning, the slot goes back to the hash
+		if (newCount == 0 && IsWorldCellKeyUsed(m_WorldStructureKeys[worldIndex]))
+		{
+			RetireWorldCell(m_WorldStructureKeys.data(), worldIndex);
+		}
+	};
+
+	auto isCooperative = [&](uint32_t worldIndex)
+	{
+		return m_WorldStructure[worldIndex].Count >= COOPERATIVE_COPY_SIZE && !IsWorldCellOutsideLevel(m_WorldStructureKeys[worldIndex], m_CameraPosW);
+	};
+
+	// Picked on last frame's counts before copyList rewrites them, a list copied on its own may grow past the size
+	std::vector<uint32_t> cooperativeCells;
+	for (uint32_t worldIndex = 0; worldIndex < WORLD_STRUCTURE_TOTAL_SIZE; ++worldIndex)
+	{
+		if (isCooperative(worldIndex))
+		{
+			cooperativeCells.push_back(worldIndex);
+		}
+	}
+
+	m_ThreadPool->ParallelFor(WORLD_STRUCTURE_TOTAL_SIZE, 256, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t worldIndex = begin; worldIndex < end; ++worldIndex)
+		{
+			if (!isCooperative(worldIndex))
+			{
+				copyList(worldIndex);
+			}
+		}
+	});
+
+	// Same result as copyList, as in UpdateWorldStructure.slang the surviving entries are ranked by a scan of their alive flags
+	for (uint32_t worldIndex : cooperativeCells)
+	{
+		WorldStructureChunk& chunk = m_WorldStructure[worldIndex];
+
+		const uint32_t newStartIndex = chunk.StartIndex + m_ScannedSurfelCountDeltas[worldIndex];
+		const uint32_t newSurfelCount = m_NewSurfelCounts[worldIndex].load(std::memory_order_relaxed);
+		if (uint64_t(chunk.StartIndex) + chunk.Count > indicesSize
+			|| uint64_t(newStartIndex) + newSurfelCount + chunk.Count > indicesSize)
+		{
+			// Clipped by the end of the buffer
+			copyList(worldIndex);
+			continue;
+		}
+
+		m_CopyAliveFlags.resize(std::max<size_t>(m_CopyAliveFlags.size(), chunk.Count));
+		m_ThreadPool->ParallelFor(chunk.Count, 4096, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i = begin; i < end; ++i)
+			{
+				m_CopyAliveFlags[i] = IsSurfelAlive(m_SurfelState[oldIndices[chunk.StartIndex + i]]) ? 1 : 0;
+			}
+		});
+
+		const uint32_t aliveCount = m_Primitives.Compact(oldIndices.data() + chunk.StartIndex, m_CopyAliveFlags.data(),
+			newIndices.data() + newStartIndex + newSurfelCount, chunk.Count);
+		chunk.StartIndex = newStartIndex;
+		chunk.Count = newSurfelCount + aliveCount;
+		if (chunk.Count == 0)
+		{
+			RetireWorldCell(m_WorldStructureKeys.data(), worldIndex);
+		}
+	}
+
+	m_CurrentSurfelIndicesBuffer = (m_CurrentSurfelIndicesBuffer + 1) % 2;
+
+	// Lists keep their full count past the end of the buffer, so the last one ends at the entries the frame needs
+	const WorldStructureChunk& lastChunk = m_WorldStructure[WORLD_STRUCTURE_TOTAL_SIZE - 1];
+	m_IndexCount = lastChunk.StartIndex + lastChunk.Count;
+}
+
+void GlobalIlluminationCPU::RebuildWorldStructure()
+{
+	// Same passes as RebuildWorldStructure.slang: count the alive surfels per cell, scan the counts and scatter
+	const uint32_t surfelCount = m_SurfelCount;
+	std::vector<uint32_t>& indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+
+	for (uint32_t i = 0; i < WORLD_STRUCTURE_TOTAL_SIZE; ++i)
+	{
+		m_NewSurfelCounts[i].store(0, std::memory_order_relaxed);
+	}
+
+	m_ThreadPool->ParallelFor(surfelCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			m_SurfelCellMissing[surfelIndex] = 0;
+			if (!IsSurfelAlive(m_SurfelState[surfelIndex]))
+				continue;
+
+			ForEachOverlappedChunk(m_SurfelGeometry[surfelIndex], m_CameraPosW, [&](const int3& cell, uint level)
+			{
+				const uint worldIndex = FindWorldCell(m_WorldStructureKeys.data(), cell, level);
+				if (worldIndex != WORLD_STRUCTURE_INVALID_INDEX)
+				{
+					m_NewSurfelCounts[worldIndex].fetch_add(1, std::memory_order_relaxed);
+				}
+				else
+				{
+					m_SurfelCellMissing[surfelIndex] = 1;
+				}
+			});
+		}
+	});
+
+	// Cells missing from the hash are inserted in surfel order on this thread, so slots do not depend on the thread count.
+	// A cell found here but inserted by an earlier surfel of this loop was not counted above either.
+	std::vector<uint8_t> insertedCells;
+	for (uint32_t surfelIndex = 0; surfelIndex < surfelCount; ++surfelIndex)
+	{
+		if (m_SurfelCellMissing[surfelIndex] == 0)
+			continue;
+
+		insertedCells.resize(WORLD_STRUCTURE_TOTAL_SIZE, 0);
+		ForEachOverlappedChunk(m_SurfelGeometry[surfelIndex], m_CameraPosW, [&](const int3& cell, uint level)
+		{
+			uint worldIndex = FindWorldCell(m_WorldStructureKeys.data(), cell, level);
+			if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX)
+			{
+				worldIndex = InsertWorldCell(m_WorldStructureKeys.data(), cell, level);
+				if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX)
+					return;
+				insertedCells[worldIndex] = 1;
+			}
+			if (insertedCells[worldIndex] != 0)
+			{
+				m_NewSurfelCounts[worldIndex].fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+	}
+
+	for (uint32_t i = 0; i < WORLD_STRUCTURE_TOTAL_SIZE; ++i)
+	{
+		m_SurfelCountDeltas[i] = m_NewSurfelCounts[i].load(std::memory_order_relaxed);
+	}
+	m_Primitives.ExclusiveScan(m_SurfelCountDeltas.data(), m_ScannedSurfelCountDeltas.data(), WORLD_STRUCTURE_TOTAL_SIZE);
+
+	// The host knows the total right away, so the list buffer is sized exactly and nothing gets cut short
+	const uint32_t lastCell = WORLD_STRUCTURE_TOTAL_SIZE - 1;
+	m_IndexCount = m_ScannedSurfelCountDeltas[lastCell] + m_SurfelCountDeltas[lastCell];
+	indices.resize(m_IndexCount);
+	for (uint32_t i = 0; i < WORLD_STRUCTURE_TOTAL_SIZE; ++i)
+	{
+		m_WorldStructure[i] = WorldStructureChunk{ m_ScannedSurfelCountDeltas[i], m_SurfelCountDeltas[i] };
+		// No surfel reaches the cell any more, as in BeginScatter
+		if (m_SurfelCountDeltas[i] == 0 && IsWorldCellKeyUsed(m_WorldStructureKeys[i]))
+		{
+			RetireWorldCell(m_WorldStructureKeys.data(), i);
+		}
+	}
+
+	m_ThreadPool->ParallelFor(surfelCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			if (!IsSurfelAlive(m_SurfelState[surfelIndex]))
+				continue;
+
+			ForEachOverlappedChunk(m_SurfelGeometry[surfelIndex], m_CameraPosW, [&](const int3& cell, uint level)
+			{
+				const uint worldIndex = FindWorldCell(m_WorldStructureKeys.data(), cell, level);
+				if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX)
+					return;
+
+				// Filled from the front, so a single thread lists the surfels in index order
+				const WorldStructureChunk& chunk = m_WorldStructure[worldIndex];
+				const uint32_t oldValue = m_NewSurfelCounts[worldIndex].fetch_sub(1, std::memory_order_relaxed);
+				indices[chunk.StartIndex + chunk.Count - oldValue] = surfelIndex;
+			});
+		}
+	});
+
+	// With more threads the order within a list depends on scheduling, restore the single thread order
+	if (m_ThreadPool->GetThreadCount() > 1)
+	{
+		m_ThreadPool->ParallelFor(WORLD_STRUCTURE_TOTAL_SIZE, 256, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t worldIndex = begin; worldIndex < end; ++worldIndex)
+			{
+				const WorldStructureChunk& chunk = m_WorldStructure[worldIndex];
+				std::sort(indices.begin() + chunk.StartIndex, indices.begin() + chunk.StartIndex + chunk.Count);
+			}
+		});
+	}
+
+	// As in CapCellLists the sorted lists keep their lowest surfel indices, a surfel left out of the cell it lies in is marked
+	if (m_SurfelCellCapacity != 0)
+	{
+		for (uint32_t worldIndex = 0; worldIndex < WORLD_STRUCTURE_TOTAL_SIZE; ++worldIndex)
+		{
+			WorldStructureChunk& chunk = m_WorldStructure[worldIndex];
+			for (uint32_t i = m_SurfelCellCapacity; i < chunk.Count; ++i)
+			{
+				const uint32_t surfelIndex = indices[chunk.StartIndex + i];
+				const float3 position = UnpackSurfelPosition(m_SurfelGeometry[surfelIndex]);
+				const uint level = GetWorldLevel(position, m_CameraPosW);
+				if (FindWorldCell(m_WorldStructureKeys.data(), GetWorldCell(position, level), level) == worldIndex)
+				{
+					m_SurfelState[surfelIndex].LastSeen = SURFEL_OVERFLOWED;
+				}
+			}
+			chunk.Count = std::min(chunk.Count, m_SurfelCellCapacity);
+		}
+	}
+}
+
+void GlobalIlluminationCPU::ReserveSurfelIndices(uint32_t count)
+{
+	for (std::vector<uint32_t>& indices : m_SurfelIndices)
+	{
+		if (indices.size() < count)
+		{
+			indices.resize(count, 0);
+		}
+	}
+}
+
+void GlobalIlluminationCPU::GrowSurfelIndices(uint32_t requiredCount)
+{
+	const uint32_t indicesSize = GetIndexCapacity();
+	const uint32_t capacity = GetSurfelIndexCapacity(requiredCount, indicesSize, m_MaxSurfels);
+	if (capacity == indicesSize)
+		return;
+
+	// Lists that ran past the end lost their last entries, the incremental update only copies them and gets one rebuild to bring them back
+	ReserveSurfelIndices(capacity);
+	m_RelistSurfels = requiredCount > indicesSize;
+}
+
+void GlobalIlluminationCPU::SetWorldStructureBuildMode(WorldStructureBuildMode buildMode)
+{
+	// Both modes keep the lists packed in slot order, only the incremental path needs room in both buffers
+	m_WorldStructureBuildMode = buildMode;
+	if (buildMode == WorldStructureBuildMode::Incremental)
+	{
+		ReserveSurfelIndices(std::max(m_MaxSurfels * SURFEL_INITIAL_INDICES_PER_SURFEL, uint32_t(m_SurfelIndices[m_CurrentSurfelIndicesBuffer].size())));
+	}
+}
+
+bool GlobalIlluminationCPU::SaveSurfelCache(const std::string& path) const
+{
+	const std::vector<uint32_t>& indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+	const SurfelCache::Header header = SurfelCache::CreateHeader(m_SurfelCount, uint32_t(m_FreeSurfelIndices.size()),
+		std::min(m_IndexCount, uint32_t(indices.size())));
+	const void* sectionData[SurfelCache::kSectionCount] =
+	{
+		m_SurfelGeometry.data(),
+		m_SurfelIrradiance.data(),
+		m_SurfelEstimator.data(),
+		m_SurfelState.data(),
+		m_FreeSurfelIndices.data(),
+		m_WorldStructure.data(),
+		m_WorldStructureKeys.data(),
+		indices.data(),
+	};
+	return SurfelCache::Write(path, header, sectionData);
+}
+
+bool GlobalIlluminationCPU::LoadSurfelCache(const std::string& path)
+{
+	SurfelCache::UniquePtr pCache = SurfelCache::Open(path);
+	if (!pCache)
+	{
+		return false;
+	}
+
+	const SurfelCache::Header& header = pCache->GetHeader();
+	m_MaxSurfels = std::max(m_MaxSurfels, header.SurfelCount);
+	ResetGI();
+
+	auto load = [&pCache](void* destination, SurfelCache::Section section)
+	{
+		std::memcpy(destination, pCache->GetSection(section), size_t(pCache->GetSectionSize(section)));
+	};
+	load(m_SurfelGeometry.data(), SurfelCache::Section::Geometry);
+	load(m_SurfelIrradiance.data(), SurfelCache::Section::Irradiance);
+	load(m_SurfelEstimator.data(), SurfelCache::Section::Estimator);
+	load(m_SurfelState.data(), SurfelCache::Section::State);
+	m_SurfelCount = header.SurfelCount;
+
+	m_FreeSurfelIndices.resize(header.FreeSurfelCount);
+	load(m_FreeSurfelIndices.data(), SurfelCache::Section::FreeIndices);
+	load(m_WorldStructure.data(), SurfelCache::Section::WorldStructure);
+	load(m_WorldStructureKeys.data(), SurfelCache::Section::WorldStructureKeys);
+
+	std::vector<uint32_t>& indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+	indices.resize(header.IndexCount);
+	m_IndexCount = header.IndexCount;
+	load(indices.data(), SurfelCache::Section::Indices);
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		ReserveSurfelIndices(std::max(m_MaxSurfels * SURFEL_INITIAL_INDICES_PER_SURFEL, header.IndexCount));
+	}
+
+	// Listed around the camera at save time, as in ReadSurfelCache
+	m_RelistSurfels = true;
+	return true;
+}
+
+void GlobalIlluminationCPU::AddSurfels(const std::vector<Surfel>& surfels)
+{
+	const uint32_t addedCount = std::min(uint32_t(surfels.size()), m_MaxSurfels - m_SurfelCount);
+	m_ThreadPool->ParallelFor(addedCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			StoreSurfel(m_SurfelCount + i, surfels[i]);
+		}
+	});
+	m_SurfelCount += addedCount;
+
+	RebuildWorldStructure();
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		ReserveSurfelIndices(std::max(m_MaxSurfels * SURFEL_INITIAL_INDICES_PER_SURFEL, uint32_t(m_SurfelIndices[m_CurrentSurfelIndicesBuffer].size())));
+	}
+}
+
+void GlobalIlluminationCPU::CompactSurfels()
+{
+	// Same passes as CompactSurfels.slang: the k-th hole below the alive count takes the k-th alive surfel above it
+	const uint32_t count = m_SurfelCount;
+	std::vector<uint32_t> alive(count);
+	std::vector<uint32_t> scannedAlive(count);
+	std::vector<uint32_t> remap(count);
+
+	m_ThreadPool->ParallelFor(count, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			alive[surfelIndex] = IsSurfelAlive(m_SurfelState[surfelIndex]) ? 1 : 0;
+		}
+	});
+
+	m_Primitives.ExclusiveScan(alive.data(), scannedAlive.data(), count);
+	const uint32_t aliveCount = count == 0 ? 0 : scannedAlive[count - 1] + alive[count - 1];
+
+	m_ThreadPool->ParallelFor(aliveCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = begin; surfelIndex < end; ++surfelIndex)
+		{
+			if (alive[surfelIndex] == 0)
+			{
+				remap[surfelIndex - scannedAlive[surfelIndex]] = surfelIndex;
+			}
+		}
+	});
+
+	m_ThreadPool->ParallelFor(count - aliveCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t surfelIndex = aliveCount + begin; surfelIndex < aliveCount + end; ++surfelIndex)
+		{
+			if (alive[surfelIndex] == 0)
+				continue;
+
+			const uint32_t newIndex = remap[scannedAlive[surfelIndex] - scannedAlive[aliveCount]];
+			CopySurfel(surfelIndex, newIndex);
+			remap[surfelIndex] = newIndex;
+		}
+	});
+
+	// A rebuild lists the moved surfels at their new indices later this frame
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		std::vector<uint32_t>& indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+		m_ThreadPool->ParallelFor(uint32_t(indices.size()), 4096, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i = begin; i < end; ++i)
+			{
+				if (indices[i] >= aliveCount && indices[i] < count)
+				{
+					indices[i] = remap[indices[i]];
+				}
+			}
+		});
+	}
+
+	m_SurfelCount = aliveCount;
+	m_FreeSurfelIndices.clear();
+}
+
+void GlobalIlluminationCPU::DefragmentSurfels()
+{
+	// Same steps as DefragmentSurfels.slang. Windows overlap by half, so a surfel can travel past its window over the frames.
+	const uint32_t count = m_SurfelCount;
+	const uint32_t windowStart = m_DefragmentCursor < count ? m_DefragmentCursor : 0;
+	const uint32_t windowCount = std::min(m_DefragmentWindow, count - windowStart);
+	m_DefragmentCursor = windowStart + windowCount >= count ? 0 : windowStart + std::max(m_DefragmentWindow / 2, 1u);
+	if (windowCount <= 1)
+		return;
+
+	m_DefragmentKeys.resize(windowCount);
+	m_DefragmentValues.resize(windowCount);
+	m_DefragmentRemap.resize(windowCount);
+	m_DefragmentGeometry.resize(windowCount);
+	m_DefragmentIrradiance.resize(windowCount);
+	m_DefragmentEstimator.resize(windowCount);
+	m_DefragmentState.resize(windowCount);
+	m_DefragmentReservoirs.resize(windowCount);
+
+	m_ThreadPool->ParallelFor(windowCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t slot = begin; slot < end; ++slot)
+		{
+			const uint32_t surfelIndex = windowStart + slot;
+			m_DefragmentKeys[slot] = IsSurfelAlive(m_SurfelState[surfelIndex]) ? GetSurfelMortonKey(m_SurfelGeometry[surfelIndex]) : SURFEL_MORTON_DEAD_KEY;
+			m_DefragmentValues[slot] = slot;
+
+			m_DefragmentGeometry[slot] = m_SurfelGeometry[surfelIndex];
+			m_DefragmentIrradiance[slot] = m_SurfelIrradiance[surfelIndex];
+			m_DefragmentEstimator[slot] = m_SurfelEstimator[surfelIndex];
+			m_DefragmentState[slot] = m_SurfelState[surfelIndex];
+			m_DefragmentReservoirs[slot] = m_SurfelReservoirs[surfelIndex];
+		}
+	});
+
+	m_Primitives.RadixSort(m_DefragmentKeys.data(), m_DefragmentValues.data(), windowCount, SURFEL_MORTON_KEY_BITS);
+
+	m_ThreadPool->ParallelFor(windowCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t slot = begin; slot < end; ++slot)
+		{
+			const uint32_t oldSlot = m_DefragmentValues[slot];
+			m_DefragmentRemap[oldSlot] = slot;
+			if (oldSlot == slot)
+				continue;
+
+			const uint32_t surfelIndex = windowStart + slot;
+			m_SurfelGeometry[surfelIndex] = m_DefragmentGeometry[oldSlot];
+			m_SurfelIrradiance[surfelIndex] = m_DefragmentIrradiance[oldSlot];
+			m_SurfelEstimator[surfelIndex] = m_DefragmentEstimator[oldSlot];
+			m_SurfelState[surfelIndex] = m_DefragmentState[oldSlot];
+			m_SurfelReservoirs[surfelIndex] = m_DefragmentReservoirs[oldSlot];
+		}
+	});
+
+	auto remapIndices = [&](std::vector<uint32_t>& indices, uint32_t indexCount)
+	{
+		m_ThreadPool->ParallelFor(indexCount, 4096, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i = begin; i < end; ++i)
+			{
+				const uint32_t slot = indices[i] - windowStart;
+				if (slot < windowCount)
+				{
+					indices[i] = windowStart + m_DefragmentRemap[slot];
+				}
+			}
+		});
+	};
+
+	// A rebuild lists the moved surfels at their new indices later this frame
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		std::vector<uint32_t>& indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+		remapIndices(indices, uint32_t(indices.size()));
+	}
+	// Dead surfels move like alive ones, the free stack follows them
+	remapIndices(m_FreeSurfelIndices, uint32_t(m_FreeSurfelIndices.size()));
+}
+
+void GlobalIlluminationCPU::SpawnSurfels(const GBufferCPU& gBuffer, const float4x4& invViewProj)
+{
+	const uint32_t currentCount = m_SurfelCount;
+	const uint32_t freeCount = uint32_t(m_FreeSurfelIndices.size());
+	const uint32_t spawnCount = uint32_t(m_SurfelSpawnCoords.size());
+	std::vector<uint32_t>& indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+	const uint32_t indicesSize = uint32_t(indices.size());
+
+	m_ThreadPool->ParallelFor(spawnCount, 64, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t k = begin; k < end; ++k)
+		{
+			// Reuse evicted surfels first, append past the end once the free stack is empty
+			const uint32_t surfelIndex = k < freeCount
+				? m_FreeSurfelIndices[freeCount - 1 - k]
+				: currentCount + (k - freeCount);
+
+			const uint2 screenPos = uint2(m_SurfelSpawnCoords[k].x, m_SurfelSpawnCoords[k].y);
+
+			// Create new Surfel, quantized to what every later pass sees so it is listed by its stored position and radius
+			const uint4 geometry = GetSpawnSurfelGeometry(gBuffer, screenPos, invViewProj, m_CameraPosW, m_SurfelLodPixelRadius);
+			Surfel surfel;
+			surfel.Position = UnpackSurfelPosition(geometry);
+			surfel.Normal = UnpackSurfelNormal(geometry);
+			surfel.RadiusScale = UnpackSurfelRadiusScale(geometry);
+			surfel.Irradiance = MultiscaleMeanEstimatorData{};
+			surfel.Age = 0;
+			surfel.LastSeen = 0;
+			surfel.SampleCount = 0;
+			StoreSurfel(surfelIndex, surfel);
+
+			// With the rebuild the surfel gets listed by RebuildWorldStructure after this pass
+			if (m_WorldStructureBuildMode == WorldStructureBuildMode::Rebuild)
+				continue;
+
+			// Only the cells coverage reserved a slot in are in the mask, the full ones are left out
+			const uint level = GetWorldLevel(surfel.Position, m_CameraPosW);
+			const int3 cell = GetWorldCell(surfel.Position, level);
+			for (uint mask = m_SurfelSpawnCoords[k].z; mask != 0;)
+			{
+				// Cells are inserted during coverage, one that did not fit in the hash did not reserve a slot
+				const uint worldIndex = FindWorldCell(m_WorldStructureKeys.data(), cell + OverlapCellOffsets[PopOverlappedCell(mask)], level);
+				if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX)
+					continue;
+
+				uint32_t oldValue = m_NewSurfelCounts[worldIndex].fetch_sub(1, std::memory_order_relaxed);
+				uint32_t slot = m_WorldStructure[worldIndex].StartIndex + oldValue - 1;
+				if (slot < indicesSize)
+				{
+					indices[slot] = surfelIndex;
+				}
+			}
+		}
+	});
+
+	const uint32_t reusedCount = std::min(spawnCount, freeCount);
+	m_FreeSurfelIndices.resize(freeCount - reusedCount);
+	// Coverage only keeps the spawns there is storage for, every one of them got a surfel
+	m_Statistics.SpawnedSurfels = spawnCount;
+	m_SurfelCount = currentCount + spawnCount - reusedCount;
+}
+
+uint32_t GlobalIlluminationCPU::GetPendingNewSurfelCells() const
+{
+	uint32_t pendingCount = 0;
+	for (uint32_t worldIndex = 0; worldIndex < WORLD_STRUCTURE_TOTAL_SIZE; ++worldIndex)
+	{
+		if (m_NewSurfelCounts[worldIndex].load(std::memory_order_relaxed) != 0)
+		{
+			++pendingCount;
+		}
+	}
+	return pendingCount;
+}
+
+void GlobalIlluminationCPU::BinSurfels(const GBufferCPU& gBuffer, const float4x4& invViewProj)
+{
+	const SurfelsDataView data = GetSurfelsDataView();
+
+	// One tile per task in place of one group per tile. The sets are filled in pixel and list order,
+	// the candidate lists come out as the shader's would with its lanes run one after the other.
+	m_ThreadPool->ParallelFor(m_TileCount.x * m_TileCount.y, 1, [&](uint32_t begin, uint32_t end)
+	{
+		uint32_t cells[TILE_CELL_SLOTS];
+		uint32_t cellLevels[TILE_CELL_SLOTS];
+		uint32_t surfels[TILE_SURFEL_SLOTS];
+		for (uint32_t tileIndex = begin; tileIndex < end; ++tileIndex)
+		{
+			const uint2 tile = uint2(tileIndex % m_TileCount.x, tileIndex / m_TileCount.x);
+			std::fill(std::begin(cells), std::end(cells), EMPTY_SLOT);
+			std::fill(std::begin(surfels), std::end(surfels), EMPTY_SLOT);
+			bool overflow = false;
+
+			auto insertCell = [&](uint32_t worldIndex, uint32_t level)
+			{
+				uint32_t slot = worldIndex & (TILE_CELL_SLOTS - 1);
+				for (uint32_t probe = 0; probe < TILE_CELL_SLOTS; ++probe)
+				{
+					if (cells[slot] == EMPTY_SLOT)
+					{
+						cells[slot] = worldIndex;
+						cellLevels[slot] = level;
+						return true;
+					}
+					if (cells[slot] == worldIndex)
+						return true;
+					slot = (slot + 1) & (TILE_CELL_SLOTS - 1);
+				}
+				return false;
+			};
+
+			auto insertSurfel = [&](uint32_t entry)
+			{
+				uint32_t slot = (entry * 2654435761u) >> (32 - TILE_SURFEL_SLOT_BITS);
+				for (uint32_t probe = 0; probe < TILE_SURFEL_SLOTS; ++probe)
+				{
+					if (surfels[slot] == EMPTY_SLOT)
+					{
+						surfels[slot] = entry;
+						return true;
+					}
+					if (surfels[slot] == entry)
+						return false;
+					slot = (slot + 1) & (TILE_SURFEL_SLOTS - 1);
+				}
+				return false;
+			};
+
+			// Background pixels are left out of the bounds, RenderSurfels shades them from the cell lists
+			float3 boundsMin = float3(FLT_MAX);
+			float3 boundsMax = float3(-FLT_MAX);
+			for (uint32_t y = tile.y * SURFEL_TILE_SIZE; y < std::min((tile.y + 1) * SURFEL_TILE_SIZE, m_GIMapSize.y); ++y)
+			{
+				for (uint32_t x = tile.x * SURFEL_TILE_SIZE; x < std::min((tile.x + 1) * SURFEL_TILE_SIZE, m_GIMapSize.x); ++x)
+				{
+					const uint2 loc = GetGBufferLoc(uint2(x, y), uint2(gBuffer.Width, gBuffer.Height), uint(m_Resolution));
+					if (LoadDepth(gBuffer, loc) >= 1.0f)
+						continue;
+
+					const float3 posW = LoadWorldPosition(gBuffer, loc, invViewProj);
+					boundsMin = glm::min(boundsMin, posW);
+					boundsMax = glm::max(boundsMax, posW);
+
+					const uint level = GetWorldLevel(posW, data.CameraPosW);
+					const uint worldIndex = FindWorldCell(data.WorldStructureKeys, GetWorldCell(posW, level), level);
+					if (worldIndex != WORLD_STRUCTURE_INVALID_INDEX && !insertCell(worldIndex, level))
+					{
+						overflow = true;
+					}
+				}
+			}
+
+			uint32_t* tileSurfels = &m_TileSurfels[tileIndex * SURFEL_TILE_MAX_SURFELS];
+			uint32_t surfelCount = 0;
+			for (uint32_t cellSlot = 0; cellSlot < TILE_CELL_SLOTS && !overflow; ++cellSlot)
+			{
+				const uint32_t worldIndex = cells[cellSlot];
+				if (worldIndex == EMPTY_SLOT)
+					continue;
+
+				const uint32_t level = cellLevels[cellSlot];
+				const WorldStructureChunk chunk = data.WorldStructure[worldIndex];
+				const uint32_t count = chunk.StartIndex < data.IndicesSize ? std::min(chunk.Count, data.IndicesSize - chunk.StartIndex) : 0;
+				for (uint32_t i = 0; i < count && !overflow; ++i)
+				{
+					const uint32_t surfelIndex = data.Indices[chunk.StartIndex + i];
+					const float3 surfelCenter = UnpackSurfelPosition(data.Geometry[surfelIndex]);
+					const float surfelRadius = GetSurfelRadius(data.Geometry[surfelIndex]);
+					const float3 toBounds = surfelCenter - glm::clamp(surfelCenter, boundsMin, boundsMax);
+					if (glm::dot(toBounds, toBounds) > surfelRadius * surfelRadius)
+						continue;
+
+					const uint32_t entry = surfelIndex | (level << SURFEL_TILE_LEVEL_SHIFT);
+					if (!insertSurfel(entry))
+						continue;
+
+					if (surfelCount < SURFEL_TILE_MAX_SURFELS)
+					{
+						tileSurfels[surfelCount++] = entry;
+					}
+					else
+					{
+						overflow = true;
+					}
+				}
+			}
+
+			m_TileSurfelCounts[tileIndex] = overflow ? SURFEL_TILE_OVERFLOW : surfelCount;
+		}
+	});
+}
+
+void GlobalIlluminationCPU::RenderSurfels(const GBufferCPU& gBuffer, const float4x4& invViewProj)
+{
+	const SurfelsDataView data = GetSurfelsDataView();
+
+	std::atomic<uint64_t> candidateCount(0);
+	std::atomic<uint32_t> candidateHistogram[GI_STATISTICS_CANDIDATE_BIN_COUNT] = {};
+	m_ThreadPool->ParallelFor(m_GIMapSize.y, 8, [&](uint32_t begin, uint32_t end)
+	{
+		uint64_t rowsCandidateCount = 0;
+		uint32_t rowsCandidateHistogram[GI_STATISTICS_CANDIDATE_BIN_COUNT] = {};
+		for (uint32_t y = begin; y < end; ++y)
+		{
+			for (uint32_t x = 0; x < m_GIMapSize.x; ++x)
+			{
+				const uint2 loc = GetGBufferLoc(uint2(x, y), uint2(gBuffer.Width, gBuffer.Height), uint(m_Resolution));
+				const uint32_t pixel = y * m_GIMapSize.x + x;
+
+				const float3 posW = LoadWorldPosition(gBuffer, loc, invViewProj);
+				const float3 normal = LoadNormal(gBuffer, loc);
+				float3 irradiance;
+				float variance = 0.0f;
+				uint pixelCandidateCount = 0;
+
+				// SurfelsRendering.slang GetIrradianceFromTile
+				const uint32_t tileIndex = (y / SURFEL_TILE_SIZE) * m_TileCount.x + x / SURFEL_TILE_SIZE;
+				const uint32_t tileSurfelCount = m_BinSurfelsPerTile && m_SurfelCellCapacity == 0 ? m_TileSurfelCounts[tileIndex] : SURFEL_TILE_OVERFLOW;
+				if (tileSurfelCount == SURFEL_TILE_OVERFLOW || LoadDepth(gBuffer, loc) >= 1.0f)
+				{
+					irradiance = GetIrradianceAtPoint(data, posW, normal, m_UseWeightFunctions, &pixelCandidateCount, &variance);
+				}
+				else
+				{
+					float3 totalIrradiance = float3(0.0f);
+					float totalWeight = 0.0f;
+					float totalVariance = 0.0f;
+					const uint level = GetWorldLevel(posW, data.CameraPosW);
+					const uint32_t* tileSurfels = &m_TileSurfels[tileIndex * SURFEL_TILE_MAX_SURFELS];
+					for (uint32_t i = 0; i < tileSurfelCount; ++i)
+					{
+						if ((tileSurfels[i] >> SURFEL_TILE_LEVEL_SHIFT) == level)
+						{
+							AccumulateSurfelIrradiance(data, posW, normal, tileSurfels[i] & SURFEL_TILE_INDEX_MASK,
+								m_UseWeightFunctions, totalIrradiance, totalWeight, &totalVariance);
+						}
+					}
+					irradiance = ResolveIrradiance(totalIrradiance, totalWeight, m_UseWeightFunctions);
+					variance = ResolveIrradianceVariance(totalVariance, totalWeight, m_UseWeightFunctions);
+					pixelCandidateCount = tileSurfelCount;
+				}
+				rowsCandidateCount += pixelCandidateCount;
+				++rowsCandidateHistogram[GetCandidateHistogramBin(pixelCandidateCount)];
+
+				m_Irradiance[pixel] = float4(irradiance, variance);
+			}
+		}
+		candidateCount.fetch_add(rowsCandidateCount, std::memory_order_relaxed);
+		for (uint32_t bin = 0; bin < GI_STATISTICS_CANDIDATE_BIN_COUNT; ++bin)
+		{
+			candidateHistogram[bin].fetch_add(rowsCandidateHistogram[bin], std::memory_order_relaxed);
+		}
+	});
+	m_RenderedCandidateCount = candidateCount.load();
+	for (uint32_t bin = 0; bin < GI_STATISTICS_CANDIDATE_BIN_COUNT; ++bin)
+	{
+		m_Statistics.CandidateHistogram[bin] = candidateHistogram[bin].load();
+	}
+}
+
+void GlobalIlluminationCPU::TemporalAccumulate(const GBufferCPU& gBuffer, const float4x4& invViewProj)
+{
+	const uint32_t previousHistory = m_CurrentHistory;
+	m_CurrentHistory = (m_CurrentHistory + 1) % 2;
+	const std::vector<float4>& prevHistory = m_IrradianceHistory[previousHistory];
+	const std::vector<float4>& prevHistoryGeometry = m_HistoryGeometry[previousHistory];
+	std::vector<float4>& history = m_IrradianceHistory[m_CurrentHistory];
+	std::vector<float4>& historyGeometry = m_HistoryGeometry[m_CurrentHistory];
+	std::vector<float4>& denoiseInput = m_DenoiseTargets[0];
+	const uint2 dimensions = uint2(gBuffer.Width, gBuffer.Height);
+
+	m_ThreadPool->ParallelFor(m_GIMapSize.y, 8, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t y = begin; y < end; ++y)
+		{
+			for (uint32_t x = 0; x < m_GIMapSize.x; ++x)
+			{
+				const uint32_t pixel = y * m_GIMapSize.x + x;
+				float3 irradiance = float3(m_Irradiance[pixel]);
+				const uint2 loc = GetGBufferLoc(uint2(x, y), dimensions, uint(m_Resolution));
+				if (LoadDepth(gBuffer, loc) >= 1.0f)
+				{
+					history[pixel] = float4(irradiance, 1.0f);
+					historyGeometry[pixel] = float4(0.0f);
+					denoiseInput[pixel] = float4(irradiance, 0.0f);
+					continue;
+				}
+
+				const float3 normal = LoadNormal(gBuffer, loc);
+				const float distance = glm::length(LoadWorldPosition(gBuffer, loc, invViewProj) - m_CameraPosW);
+
+				const float2 prevPixel = GetHistoryPixel(loc, LoadMotion(gBuffer, loc), dimensions, uint(m_Resolution));
+				const int2 base = int2(glm::floor(prevPixel));
+				const float2 f = prevPixel - float2(base);
+
+				float4 prevIrradiance = float4(0.0f);
+				float totalWeight = 0.0f;
+				for (uint32_t tap = 0; tap < 4; ++tap)
+				{
+					const int2 tapLoc = base + int2(tap & 1, tap >> 1);
+					if (tapLoc.x < 0 || tapLoc.y < 0 || tapLoc.x >= int(m_GIMapSize.x) || tapLoc.y >= int(m_GIMapSize.y))
+						continue;
+
+					const uint32_t tapPixel = tapLoc.y * m_GIMapSize.x + tapLoc.x;
+					const float4& tapGeometry = prevHistoryGeometry[tapPixel];
+					if (tapGeometry.w <= 0.0f
+						|| std::abs(tapGeometry.w - distance) > HISTORY_DISTANCE_TOLERANCE * distance
+						|| glm::dot(float3(tapGeometry), normal) < HISTORY_NORMAL_THRESHOLD)
+						continue;
+
+					const float weight = GetBilinearWeight(f, tap);
+					prevIrradiance += prevHistory[tapPixel] * weight;
+					totalWeight += weight;
+				}
+
+				float historyLength = 1.0f;
+				if (totalWeight > 1e-3f)
+				{
+					prevIrradiance /= totalWeight;
+					historyLength = std::min(prevIrradiance.w + 1.0f, float(m_MaxHistoryLength));
+					irradiance = glm::mix(float3(prevIrradiance), irradiance, 1.0f / historyLength);
+				}
+
+				history[pixel] = float4(irradiance, historyLength);
+				historyGeometry[pixel] = float4(normal, distance);
+				denoiseInput[pixel] = float4(irradiance, m_Irradiance[pixel].w / historyLength);
+			}
+		}
+	});
+}
+
+// Mirrors Denoise from ResolveGI.slang, every iteration reads one of m_DenoiseTargets and writes the other
+void GlobalIlluminationCPU::DenoiseGI()
+{
+	const std::vector<float4>& geometry = m_HistoryGeometry[m_CurrentHistory];
+	const int2 giDimensions = int2(m_GIMapSize);
+
+	for (uint32_t iteration = 0; iteration < m_DenoiseIterations; ++iteration)
+	{
+		const std::vector<float4>& source = m_DenoiseTargets[iteration % 2];
+		std::vector<float4>& target = m_DenoiseTargets[(iteration + 1) % 2];
+		const int stepSize = 1 << iteration;
+
+		m_ThreadPool->ParallelFor(m_GIMapSize.y, 8, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t y = begin; y < end; ++y)
+			{
+				for (uint32_t x = 0; x < m_GIMapSize.x; ++x)
+				{
+					const uint32_t pixel = y * m_GIMapSize.x + x;
+					const float4& center = source[pixel];
+					const float4& centerGeometry = geometry[pixel];
+					if (centerGeometry.w <= 0.0f)
+					{
+						target[pixel] = center;
+						continue;
+					}
+
+					float variance = 0.0f;
+					for (int tapY = -1; tapY <= 1; ++tapY)
+					{
+						for (int tapX = -1; tapX <= 1; ++tapX)
+						{
+							const int2 tapLoc = glm::clamp(int2(x, y) + int2(tapX, tapY), int2(0), giDimensions - 1);
+							variance += source[tapLoc.y * m_GIMapSize.x + tapLoc.x].w * DENOISE_VARIANCE_KERNEL[std::abs(tapX)] * DENOISE_VARIANCE_KERNEL[std::abs(tapY)];
+						}
+					}
+
+					const float centerLuminance = GetIrradianceLuminance(float3(center));
+					const float luminanceScale = 1.0f / (m_DenoiseVarianceSigma * std::sqrt(std::max(variance, 0.0f)) + 1e-4f);
+					const float distanceScale = 1.0f / (m_DenoiseDistanceSigma * float(stepSize) * centerGeometry.w);
+
+					DenoiseSum sum;
+					float totalWeight = DENOISE_KERNEL[0] * DENOISE_KERNEL[0];
+					sum.Add(center, totalWeight);
+					for (int tapY = -2; tapY <= 2; ++tapY)
+					{
+						for (int tapX = -2; tapX <= 2; ++tapX)
+						{
+							const int2 tapLoc = int2(x, y) + int2(tapX, tapY) * stepSize;
+							if ((tapX == 0 && tapY == 0) || tapLoc.x < 0 || tapLoc.y < 0 || tapLoc.x >= giDimensions.x || tapLoc.y >= giDimensions.y)
+								continue;
+
+							const uint32_t tapPixel = tapLoc.y * m_GIMapSize.x + tapLoc.x;
+							const float4& tapGeometry = geometry[tapPixel];
+							if (tapGeometry.w <= 0.0f)
+								continue;
+
+							const float4& tap = source[tapPixel];
+							const float weight = DENOISE_KERNEL[std::abs(tapX)] * DENOISE_KERNEL[std::abs(tapY)]
+								* std::pow(glm::clamp(glm::dot(float3(tapGeometry), float3(centerGeometry)), 0.0f, 1.0f), m_DenoiseNormalPower)
+								* std::exp(-std::abs(tapGeometry.w - centerGeometry.w) * distanceScale
+									- std::abs(GetIrradianceLuminance(float3(tap)) - centerLuminance) * luminanceScale);
+							sum.Add(tap, weight);
+							totalWeight += weight;
+						}
+					}
+
+					target[pixel] = sum.Resolve(totalWeight);
+				}
+			}
+		});
+	}
+}
+
+void GlobalIlluminationCPU::UpsampleGI(const GBufferCPU& gBuffer, const float4x4& invViewProj)
+{
+	const std::vector<float4>& history = m_DenoiseIterations > 0 ? m_DenoiseTargets[m_DenoiseIterations % 2] : m_IrradianceHistory[m_CurrentHistory];
+	const std::vector<float4>& historyGeometry = m_HistoryGeometry[m_CurrentHistory];
+	const uint32_t scale = 1u << uint32_t(m_Resolution);
+
+	m_ThreadPool->ParallelFor(gBuffer.Height, 8, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t y = begin; y < end; ++y)
+		{
+			for (uint32_t x = 0; x < gBuffer.Width; ++x)
+			{
+				const uint2 loc = uint2(x, y);
+				const uint32_t pixel = y * gBuffer.Width + x;
+				const float2 giPixel = (float2(loc) - float(scale / 2)) / float(scale);
+				const int2 base = int2(glm::floor(giPixel));
+				const float2 f = giPixel - float2(base);
+
+				const bool background = gBuffer.Depth[pixel] >= 1.0f;
+				const float3 normal = LoadNormal(gBuffer, loc);
+				const float distance = glm::length(LoadWorldPosition(gBuffer, loc, invViewProj) - m_CameraPosW);
+
+				float3 irradiance = float3(0.0f);
+				float3 bilinearIrradiance = float3(0.0f);
+				float totalWeight = 0.0f;
+				for (uint32_t tap = 0; tap < 4; ++tap)
+				{
+					const int2 tapLoc = glm::clamp(base + int2(tap & 1, tap >> 1), int2(0), int2(m_GIMapSize) - 1);
+					const uint32_t tapPixel = tapLoc.y * m_GIMapSize.x + tapLoc.x;
+					float weight = GetBilinearWeight(f, tap);
+					const float3 tapIrradiance = float3(history[tapPixel]);
+					bilinearIrradiance += tapIrradiance * weight;
+
+					const float4& tapGeometry = historyGeometry[tapPixel];
+					if (!background && tapGeometry.w > 0.0f)
+					{
+						weight *= std::pow(glm::clamp(glm::dot(float3(tapGeometry), normal), 0.0f, 1.0f), UPSAMPLE_NORMAL_POWER)
+							/ (1.0f + UPSAMPLE_DISTANCE_SCALE * std::abs(tapGeometry.w - distance) / distance);
+						irradiance += tapIrradiance * weight;
+						totalWeight += weight;
+					}
+				}
+
+				irradiance = totalWeight > 1e-4f ? irradiance / totalWeight : bilinearIrradiance;
+				m_GIMap[pixel] = float4((gBuffer.Albedo[pixel] / PI) * irradiance, 1.0f);
+			}
+		}
+	});
+}
+
+void GlobalIlluminationCPU::AccumulateIrradiance(const RadianceFunction& radiance)
+{
+	m_Timings.ScheduleRays = TimeStage([&] { ScheduleSurfelRays(); });
+
+	m_Timings.Accumulate = TimeStage([&]
+	{
+		// Frame index of the GenerateGIMap call this accumulation follows
+		const float offset = GetFrameJitter(uint(m_Statistics.Frame), 0);
+		const bool resample = m_ResampleMode != SURFEL_RESAMPLE_OFF;
+		if (m_ResampleMode == SURFEL_RESAMPLE_SPATIOTEMPORAL)
+		{
+			std::copy(m_SurfelReservoirs.begin(), m_SurfelReservoirs.begin() + m_SurfelCount, m_PreviousSurfelReservoirs.begin());
+		}
+
+		std::atomic<uint32_t> tracedRays(0);
+		m_ThreadPool->ParallelFor(m_RayBudget, 256, [&](uint32_t begin, uint32_t end)
+		{
+			uint32_t rangeTracedRays = 0;
+			for (uint32_t index = begin; index < end; ++index)
+			{
+				uint32_t surfelIndex;
+				const uint32_t rayCount = GetScheduledRays(index, offset, surfelIndex);
+				if (rayCount == 0)
+					continue;
+				rangeTracedRays += rayCount;
+
+				const uint4 geometry = m_SurfelGeometry[surfelIndex];
+				const float3 surfelPosition = UnpackSurfelPosition(geometry);
+				const float3 surfelNormal = UnpackSurfelNormal(geometry);
+				const uint2 scramble = GetSurfelSampleScramble(geometry);
+				const uint32_t sampleCount = m_SurfelState[surfelIndex].SampleCount;
+				const uint choiceSeed = SurfelHash(scramble.x ^ sampleCount);
+				SurfelReservoir reservoir = ClampSurfelReservoir(UnpackSurfelReservoir(m_SurfelReservoirs[surfelIndex]), SURFEL_RESERVOIR_MAX_COUNT);
+				float3 irradiance = float3(0.0f);
+				for (uint32_t i = 0; i < rayCount; ++i)
+				{
+					const float2 randVal = GetSurfelSample(sampleCount + i, scramble);
+
+					const float3 direction = GetCosHemisphereSample(randVal, surfelNormal, GetPerpendicularStark(surfelNormal));
+					const float3 rayRadiance = radiance(surfelPosition, direction);
+					irradiance += rayRadiance;
+					if (resample)
+					{
+						reservoir = AddSurfelReservoirRay(reservoir, direction, rayRadiance, GetSurfelReservoirChoice(choiceSeed, i));
+					}
+				}
+				m_SurfelState[surfelIndex].SampleCount = sampleCount + rayCount;
+
+				if (resample)
+				{
+					m_SurfelReservoirs[surfelIndex] = PackSurfelReservoir(reservoir);
+					if (m_ResampleMode == SURFEL_RESAMPLE_SPATIOTEMPORAL)
+					{
+						reservoir = MergeNeighbourReservoirs(surfelIndex, surfelPosition, surfelNormal, reservoir, choiceSeed, rayCount);
+					}
+					irradiance = GetSurfelReservoirRadiance(reservoir) * float(rayCount);
+				}
+				MultiscaleMeanEstimatorData estimator = UnpackSurfelEstimator(m_SurfelIrradiance[surfelIndex], m_SurfelEstimator[surfelIndex]);
+				MultiscaleMeanEstimator(irradiance / float(rayCount), estimator);
+				StoreSurfelEstimator(surfelIndex, estimator);
+			}
+			tracedRays.fetch_add(rangeTracedRays, std::memory_order_relaxed);
+		});
+		m_Statistics.TracedRays = tracedRays.load();
+	});
+}
+
+void GlobalIlluminationCPU::ScheduleSurfelRays()
+{
+	m_RayWeights.resize(m_SurfelCount);
+	m_ScannedRayWeights.resize(m_SurfelCount);
+	m_ThreadPool->ParallelFor(m_SurfelCount, 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t index = begin; index < end; ++index)
+		{
+			m_RayWeights[index] = GetSurfelRayWeight(GetSurfel(index));
+		}
+	});
+	m_Primitives.ExclusiveScan(m_RayWeights.data(), m_ScannedRayWeights.data(), m_SurfelCount);
+}
+
+// Mirrors MergeNeighbourReservoirs from SurfelsAccumulate.slang
+SurfelReservoir GlobalIlluminationCPU::MergeNeighbourReservoirs(uint32_t surfelIndex, const float3& position, const float3& normal,
+	SurfelReservoir reservoir, uint choiceSeed, uint firstChoice) const
+{
+	const uint level = GetWorldLevel(position, m_CameraPosW);
+	const uint worldIndex = FindWorldCell(m_WorldStructureKeys.data(), GetWorldCell(position, level), level);
+	if (worldIndex == WORLD_STRUCTURE_INVALID_INDEX)
+		return reservoir;
+
+	const std::vector<uint32_t>& indices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+	const WorldStructureChunk chunk = m_WorldStructure[worldIndex];
+	const uint count = chunk.StartIndex < indices.size() ? std::min(chunk.Count, uint(indices.size()) - chunk.StartIndex) : 0;
+	for (uint i = 0; i < SURFEL_RESERVOIR_NEIGHBOUR_COUNT && count > 1; ++i)
+	{
+		const uint slot = std::min(uint(GetSurfelReservoirChoice(choiceSeed, firstChoice + 2 * i) * float(count)), count - 1);
+		const uint32_t neighbourIndex = indices[chunk.StartIndex + slot];
+		if (neighbourIndex == surfelIndex || !IsSurfelAlive(m_SurfelState[neighbourIndex]))
+			continue;
+
+		const float3 neighbourNormal = UnpackSurfelNormal(m_SurfelGeometry[neighbourIndex]);
+		if (glm::dot(neighbourNormal, normal) < SURFEL_RESERVOIR_MIN_NORMAL_COSINE)
+			continue;
+
+		const SurfelReservoir neighbour = ClampSurfelReservoir(UnpackSurfelReservoir(m_PreviousSurfelReservoirs[neighbourIndex]), SURFEL_RESERVOIR_MAX_COUNT);
+		reservoir = MergeSurfelReservoir(reservoir, normal, neighbour, neighbourNormal, GetSurfelReservoirChoice(choiceSeed, firstChoice + 2 * i + 1));
+	}
+	return reservoir;
+}
+
+// Mirrors GetScheduledRays from SurfelsAccumulate.slang
+uint32_t GlobalIlluminationCPU::GetScheduledRays(uint32_t rayIndex, float offset, uint32_t& surfelIndex) const
+{
+	surfelIndex = 0;
+	if (m_SurfelCount == 0)
+		return 0;
+
+	const uint32_t totalWeight = m_ScannedRayWeights[m_SurfelCount - 1] + m_RayWeights[m_SurfelCount - 1];
+	if (totalWeight == 0)
+		return 0;
+
+	const uint32_t scheduledRayCount = totalWeight >= (m_RayBudget * SURFEL_MAX_RAY_WEIGHT + SURFEL_MAX_RAYS_PER_FRAME - 1) / SURFEL_MAX_RAYS_PER_FRAME
+		? m_RayBudget
+		: std::max(totalWeight * SURFEL_MAX_RAYS_PER_FRAME / SURFEL_MAX_RAY_WEIGHT, 1u);
+	if (rayIndex >= scheduledRayCount)
+		return 0;
+
+	const float step = float(totalWeight) / float(scheduledRayCount);
+	auto samplePoint = [&](uint32_t index) { return uint32_t((float(index) + offset) * step); };
+
+	// Last surfel whose range starts at or before the sample point
+	const uint32_t point = samplePoint(rayIndex);
+	surfelIndex = uint32_t(std::upper_bound(m_ScannedRayWeights.begin(), m_ScannedRayWeights.begin() + m_SurfelCount, point) - m_ScannedRayWeights.begin()) - 1;
+
+	const uint32_t rangeStart = m_ScannedRayWeights[surfelIndex];
+	const uint32_t rangeEnd = rangeStart + m_RayWeights[surfelIndex];
+	if (rayIndex > 0 && samplePoint(rayIndex - 1) >= rangeStart)
+		return 0;
+
+	uint32_t rayCount = 1;
+	while (rayIndex + rayCount < scheduledRayCount && rayCount < SURFEL_MAX_RAYS_PER_FRAME && samplePoint(rayIndex + rayCount) < rangeEnd)
+	{
+		++rayCount;
+	}
+	return rayCount;
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+#include "GICommon.h"
+#include "GI/GIStatistics.h"
+#include "ParallelPrimitivesCPU.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// G-buffer as the GI pipeline sees it. Layouts match the textures bound to Data.GBuffer.
+struct GBufferCPU
+{
+	uint32_t Width = 0;
+	uint32_t Height = 0;
+	std::vector<float> Depth;   // Post projection depth, 1.0 is background
+	std::vector<float3> Normal; // Encoded as n * 0.5 + 0.5 like the RGBA8 G-buffer target
+	std::vector<float3> Albedo;
+	std::vector<float2> Motion; // Texture coordinate offset to the previous frame, left empty when nothing moves
+};
+
+struct GICPUCamera
+{
+	float4x4 ViewProj;
+	float4x4 InvViewProj;
+	float4x4 PrevViewProj; // For the motion vectors of a G-buffer
+	float3 PosW;
+};
+
+// Headless CPU implementation of the surfel GI pipeline from GlobalIllumination.
+// Runs the same stages (ComputeCoverage -> ExclusiveScan -> UpdateWorldStructure -> SpawnSurfels -> SurfelsRendering)
+// over the same Surfel/WorldStructureChunk layouts, each stage spread over a thread pool.
+class GlobalIlluminationCPU
+{
+public:
+	// Returns the radiance arriving at origin from direction, stands in for the ray traced closest hit/miss shaders
+	using RadianceFunction = std::function<float3(const float3& origin, const float3& direction)>;
+
+	// Mirrors GlobalIllumination::WorldStructureBuildMode
+	enum class WorldStructureBuildMode : uint32_t
+	{
+		Incremental = 0,
+		Rebuild = 1,
+	};
+
+	// Mirrors GlobalIllumination::GIResolution
+	enum class GIResolution : uint32_t
+	{
+		Full = 0,
+		Half = 1,
+		Quarter = 2,
+	};
+
+	struct StageTimings
+	{
+		double Eviction = 0.0;
+		double Coverage = 0.0;
+		double ExclusiveScan = 0.0;
+		double UpdateWorldStructure = 0.0;
+		double SpawnSurfels = 0.0;
+		double SurfelBinning = 0.0;
+		double SurfelsRendering = 0.0;
+		double ResolveGI = 0.0;
+		double Denoise = 0.0;
+		double Compaction = 0.0;
+		double Defragment = 0.0;
+		double ScheduleRays = 0.0;
+		double Accumulate = 0.0;
+	};
+
+	explicit GlobalIlluminationCPU(uint32_t threadCount = 0);
+
+	// giMapSize is the G-buffer size, the GI targets are scaled down from it by the resolution set beforehand
+	void Initilize(const uvec2& giMapSize, uint32_t maxSurfels = 1024 * 1024);
+	void ResetGI();
+	// Like the "Max Surfels" setting of GlobalIllumination, a larger storage keeps every surfel and a smaller one starts over
+	void SetMaxSurfels(uint32_t maxSurfels);
+
+	void GenerateGIMap(const GICPUCamera& camera, const GBufferCPU& gBuffer);
+	void AccumulateIrradiance(const RadianceFunction& radiance);
+	// Appends surfels after the live ones and lists them, lets benchmarks start from a given surfel count
+	void AddSurfels(const std::vector<Surfel>& surfels);
+	// Same file layout as GlobalIllumination, caches written by either pipeline load into the other
+	bool SaveSurfelCache(const std::string& path) const;
+	bool LoadSurfelCache(const std::string& path);
+
+	// Evicts the surfels reaching into the box at the start of the next GenerateGIMap, stands in for the bounds
+	// GlobalIllumination collects from the scene instances that moved
+	void InvalidateBox(const float3& boxMin, const float3& boxMax);
+
+	void SetSpawnChance(float spawnChance) { m_SpawnChance = spawnChance; }
+	// Radius new surfels get in pixels of the surface they land on, 0 spawns them all at the radius of their level
+	void SetSurfelLodPixelRadius(float lodPixelRadius) { m_SurfelLodPixelRadius = lodPixelRadius; }
+	// Surfels a cell lists at most, 0 leaves the lists unbounded. Spawns into a full cell follow the SURFEL_CELL_OVERFLOW_* policy.
+	void SetSurfelCellCapacity(uint32_t cellCapacity) { m_SurfelCellCapacity = cellCapacity; }
+	void SetSurfelCellOverflow(uint32_t cellOverflow) { m_SurfelCellOverflow = cellOverflow; }
+	void SetUseWeightFunctions(bool useWeightFunctions) { m_UseWeightFunctions = useWeightFunctions; }
+	void SetMaxUnseenFrames(uint32_t maxUnseenFrames) { m_MaxUnseenFrames = maxUnseenFrames; }
+	void SetMaxSurfelAge(uint32_t maxSurfelAge) { m_MaxSurfelAge = maxSurfelAge; }
+	void SetMaxSurfelCoverage(float maxSurfelCoverage) { m_MaxSurfelCoverage = maxSurfelCoverage; }
+	void SetCompactionInterval(uint32_t compactionInterval) { m_CompactionInterval = compactionInterval; }
+	// Surfels sorted into Morton order per frame, 0 leaves them in spawn order
+	void SetDefragmentWindow(uint32_t defragmentWindow) { m_DefragmentWindow = defragmentWindow; m_DefragmentCursor = 0; }
+	void SetRayBudget(uint32_t rayBudget) { m_RayBudget = std::max(rayBudget, 1u); }
+	// SURFEL_RESAMPLE_* use of the surfel reservoirs by the accumulation rays
+	void SetResampleMode(uint32_t resampleMode) { m_ResampleMode = resampleMode; }
+	void SetWorldStructureBuildMode(WorldStructureBuildMode buildMode);
+	// Ignored while a cell capacity is set, capped cell lists are walked directly
+	void SetBinSurfelsPerTile(bool binSurfelsPerTile) { m_BinSurfelsPerTile = binSurfelsPerTile; }
+	void SetResolution(GIResolution resolution) { m_Resolution = resolution; }
+	void SetMaxHistoryLength(uint32_t maxHistoryLength) { m_MaxHistoryLength = std::max(maxHistoryLength, 1u); }
+	// 0 upsamples the history as it is
+	void SetDenoiseIterations(uint32_t denoiseIterations) { m_DenoiseIterations = denoiseIterations; }
+	void SetDenoiseVarianceSigma(float varianceSigma) { m_DenoiseVarianceSigma = varianceSigma; }
+	void SetDenoiseNormalPower(float normalPower) { m_DenoiseNormalPower = normalPower; }
+	void SetDenoiseDistanceSigma(float distanceSigma) { m_DenoiseDistanceSigma = distanceSigma; }
+
+	// Views the surfel arrays like the shaders see Data.Surfels, valid until the next call that changes them
+	GICPU::SurfelsDataView GetSurfelsDataView() const;
+	Surfel GetSurfel(uint32_t surfelIndex) const { return GICPU::LoadSurfel(GetSurfelsDataView(), surfelIndex); }
+	uint32_t GetSurfelCount() const { return m_SurfelCount; }
+	uint32_t GetMaxSurfels() const { return m_MaxSurfels; }
+	// List entries the world structure needed last frame, Surfels.Count[SURFEL_INDEX_COUNT_INDEX] on the GPU
+	uint32_t GetIndexCount() const { return m_IndexCount; }
+	uint32_t GetIndexCapacity() const { return uint32_t(std::min(m_SurfelIndices[0].size(), m_SurfelIndices[1].size())); }
+	uint32_t GetFreeSurfelCount() const { return uint32_t(m_FreeSurfelIndices.size()); }
+	uint32_t GetRayBudget() const { return m_RayBudget; }
+	WorldStructureBuildMode GetWorldStructureBuildMode() const { return m_WorldStructureBuildMode; }
+	const std::vector<WorldStructureChunk>& GetWorldStructure() const { return m_WorldStructure; }
+	const std::vector<WorldCellKey>& GetWorldStructureKeys() const { return m_WorldStructureKeys; }
+	const std::vector<uint32_t>& GetSurfelIndices() const { return m_SurfelIndices[m_CurrentSurfelIndicesBuffer]; }
+	const std::vector<float2>& GetSurfelCoverage() const { return m_Coverage; }
+	// Irradiance is GetGIMapSize() pixels, coverage and the GI map are the G-buffer size
+	uvec2 GetGIMapSize() const { return m_GIMapSize; }
+	// Irradiance and its variance
+	const std::vector<float4>& GetIrradiance() const { return m_Irradiance; }
+	const std::vector<float4>& GetGIMap() const { return m_GIMap; }
+	const StageTimings& GetTimings() const { return m_Timings; }
+	// Counters of the last frame, TracedRays is filled in by AccumulateIrradiance
+	const GIFrameStatistics& GetStatistics() const { return m_Statistics; }
+	// Surfels looked at while shading the last frame, summed over its pixels
+	uint64_t GetRenderedCandidateCount() const { return m_RenderedCandidateCount; }
+	// Candidate count of every screen tile of the last frame, SURFEL_TILE_OVERFLOW for tiles shaded from the cell lists
+	const std::vector<uint32_t>& GetTileSurfelCounts() const { return m_TileSurfelCounts; }
+	// Cells whose new surfel count was not used up. Zero after every frame as SpawnSurfels inserts a surfel
+	// in each cell ComputeCoverage counted it in.
+	uint32_t GetPendingNewSurfelCells() const;
+	ThreadPool& GetThreadPool() { return *m_ThreadPool; }
+
+private:
+	void EvictSurfels();
+	void ComputeCoverage(const GBufferCPU& gBuffer, const float4x4& invViewProj);
+	bool CountNewSurfel(uint32_t worldIndex);
+	void MergeIntoNearestSurfel(uint32_t worldIndex, uint level, const float3& position, const float3& normal);
+	void CountEvictedSurfels();
+	void UpdateWorldStructure();
+	void RebuildWorldStructure();
+	void ReserveSurfelIndices(uint32_t count);
+	void GrowSurfelIndices(uint32_t requiredCount);
+	void CompactSurfels();
+	void DefragmentSurfels();
+	void SpawnSurfels(const GBufferCPU& gBuffer, const float4x4& invViewProj);
+	void BinSurfels(const GBufferCPU& gBuffer, const float4x4& invViewProj);
+	void RenderSurfels(const GBufferCPU& gBuffer, const float4x4& invViewProj);
+	void TemporalAccumulate(const GBufferCPU& gBuffer, const float4x4& invViewProj);
+	void DenoiseGI();
+	void UpsampleGI(const GBufferCPU& gBuffer, const float4x4& invViewProj);
+	void ScheduleSurfelRays();
+	void CollectCellStatistics();
+	uint32_t GetScheduledRays(uint32_t rayIndex, float offset, uint32_t& surfelIndex) const;
+	SurfelReservoir MergeNeighbourReservoirs(uint32_t surfelIndex, const float3& position, const float3& normal, SurfelReservoir reservoir,
+		uint choiceSeed, uint firstChoice) const;
+
+	void StoreSurfel(uint32_t surfelIndex, const Surfel& surfel);
+	void StoreSurfelEstimator(uint32_t surfelIndex, const MultiscaleMeanEstimatorData& estimator);
+	void CopySurfel(uint32_t sourceIndex, uint32_t destinationIndex);
+
+	std::unique_ptr<ThreadPool> m_ThreadPool;
+	ParallelPrimitivesCPU m_Primitives;
+
+	// Data Structures
+	// Packed like the Surfels.Geometry/Irradiance/Estimator/State buffers
+	std::vector<uint4> m_SurfelGeometry;
+	std::vector<float4> m_SurfelIrradiance;
+	std::vector<uint3> m_SurfelEstimator;
+	std::vector<SurfelState> m_SurfelState;
+	std::vector<uint4> m_SurfelReservoirs; // Surfels.Reservoirs
+	uint32_t m_SurfelCount = 0;
+	uint32_t m_MaxSurfels = 0;
+	std::vector<WorldStructureChunk> m_WorldStructure;
+	std::vector<WorldCellKey> m_WorldStructureKeys;
+	std::vector<uint32_t> m_SurfelIndices[2];
+	uint32_t m_IndexCount = 0;
+	bool m_RelistSurfels = false;
+	int3 m_ClipmapCameraCell = int3(0); // See GlobalIllumination::m_ClipmapCameraCell
+	uint32_t m_CurrentSurfelIndicesBuffer = 0;
+	WorldStructureBuildMode m_WorldStructureBuildMode = WorldStructureBuildMode::Incremental;
+	std::vector<uint8_t> m_SurfelCellMissing;
+
+	// Surfels Placement
+	std::vector<uint3> m_SurfelSpawnCoords; // Screen position and the overlap mask of the cells that reserved a slot
+	std::unique_ptr<std::atomic<uint32_t>[]> m_NewSurfelCounts;
+	std::vector<uint32_t> m_SurfelCountDeltas;
+	std::vector<uint32_t> m_ScannedSurfelCountDeltas;
+	std::vector<uint32_t> m_CopyAliveFlags;
+	float m_SpawnChance = 1.0f;
+	float m_SurfelLodPixelRadius = SURFEL_DEFAULT_LOD_PIXEL_RADIUS;
+	uint32_t m_SurfelCellCapacity = SURFEL_DEFAULT_CELL_CAPACITY;
+	uint32_t m_SurfelCellOverflow = SURFEL_CELL_OVERFLOW_REFUSE;
+	float3 m_CameraPosW = float3(0.0f);
+
+	// Surfels Recycling
+	std::vector<uint32_t> m_FreeSurfelIndices;
+	std::unique_ptr<std::atomic<bool>[]> m_SurfelSeen;
+	std::vector<uint8_t> m_SurfelEvicted;
+	uint32_t m_MaxUnseenFrames = 300;
+	uint32_t m_MaxSurfelAge = 0;
+	float m_MaxSurfelCoverage = 6.0f;
+	std::vector<SurfelInvalidationBox> m_InvalidationBoxes;
+	uint32_t m_CompactionInterval = 64;
+	uint32_t m_FramesSinceCompaction = 0;
+	uint32_t m_DefragmentWindow = SURFEL_DEFAULT_DEFRAGMENT_WINDOW;
+	uint32_t m_DefragmentCursor = 0;
+	std::vector<uint32_t> m_DefragmentKeys;
+	std::vector<uint32_t> m_DefragmentValues;
+	std::vector<uint32_t> m_DefragmentRemap;
+	std::vector<uint4> m_DefragmentGeometry;
+	std::vector<float4> m_DefragmentIrradiance;
+	std::vector<uint3> m_DefragmentEstimator;
+	std::vector<SurfelState> m_DefragmentState;
+	std::vector<uint4> m_DefragmentReservoirs;
+
+	// Ray Scheduling
+	std::vector<uint32_t> m_RayWeights;
+	std::vector<uint32_t> m_ScannedRayWeights;
+	uint32_t m_RayBudget = 2048 * 4;
+	// Reservoirs as they were before this frame's rays, the neighbours of a surfel are merged from it
+	std::vector<uint4> m_PreviousSurfelReservoirs;
+	uint32_t m_ResampleMode = SURFEL_DEFAULT_RESAMPLE_MODE;
+
+	// Screen Tile Binning
+	uvec2 m_TileCount;
+	std::vector<uint32_t> m_TileSurfels;
+	std::vector<uint32_t> m_TileSurfelCounts;
+	bool m_BinSurfelsPerTile = true;
+	uint64_t m_RenderedCandidateCount = 0;
+
+	// Outputs
+	uvec2 m_OutputSize;
+	uvec2 m_GIMapSize;
+	GIResolution m_Resolution = GIResolution::Half;
+	std::vector<float2> m_Coverage;
+	std::vector<float4> m_Irradiance;
+	std::vector<float4> m_GIMap;
+	GIFrameStatistics m_Statistics;
+	uint64_t m_FrameIndex = 0;
+	bool m_UseWeightFunctions = true;
+
+	// Reduced Resolution Resolve
+	std::vector<float4> m_IrradianceHistory[2];
+	std::vector<float4> m_HistoryGeometry[2];
+	uint32_t m_CurrentHistory = 0;
+	uint32_t m_MaxHistoryLength = 8;
+	std::vector<float4> m_DenoiseTargets[2];
+	uint32_t m_DenoiseIterations = 0;
+	float m_DenoiseVarianceSigma = 0.5f;
+	float m_DenoiseNormalPower = 64.0f;
+	float m_DenoiseDistanceSigma = 0.05f;
+
+	StageTimings m_Timings;
+};
@@ -0,0 +1,275 @@
+#include "ParallelPrimitivesCPU.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define PRIMITIVES_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+	const uint32_t CHUNK_SIZE = 16 * 1024;
+	const uint32_t RADIX_BITS = 8;
+	const uint32_t RADIX_DIGITS = 1 << RADIX_BITS;
+
+	uint32_t GetChunkCount(uint32_t count)
+	{
+		return (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	}
+
+	uint32_t ReduceIdentity(ParallelPrimitivesCPU::ReduceOperation operation)
+	{
+		return operation == ParallelPrimitivesCPU::ReduceOperation::Min ? 0xFFFFFFFF : 0;
+	}
+
+	uint32_t ReduceCombine(uint32_t a, uint32_t b, ParallelPrimitivesCPU::ReduceOperation operation)
+	{
+		switch (operation)
+		{
+		case ParallelPrimitivesCPU::ReduceOperation::Min: return std::min(a, b);
+		case ParallelPrimitivesCPU::ReduceOperation::Max: return std::max(a, b);
+		default: return a + b;
+		}
+	}
+
+#ifdef PRIMITIVES_SSE2
+	// SSE2 has no unsigned 32 bit compare, flip the sign bit and compare signed
+	__m128i GreaterU32(__m128i a, __m128i b)
+	{
+		const __m128i bias = _mm_set1_epi32(int(0x80000000));
+		return _mm_cmpgt_epi32(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias));
+	}
+
+	__m128i Select(__m128i mask, __m128i a, __m128i b)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+
+	__m128i ReduceCombine(__m128i a, __m128i b, ParallelPrimitivesCPU::ReduceOperation operation)
+	{
+		switch (operation)
+		{
+		case ParallelPrimitivesCPU::ReduceOperation::Min: return Select(GreaterU32(a, b), b, a);
+		case ParallelPrimitivesCPU::ReduceOperation::Max: return Select(GreaterU32(a, b), a, b);
+		default: return _mm_add_epi32(a, b);
+		}
+	}
+#endif
+
+	uint32_t ReduceRange(const uint32_t* input, uint32_t count, ParallelPrimitivesCPU::ReduceOperation operation)
+	{
+		uint32_t value = ReduceIdentity(operation);
+		uint32_t i = 0;
+#ifdef PRIMITIVES_SSE2
+		__m128i lanes = _mm_set1_epi32(int(value));
+		for (; i + 4 <= count; i += 4)
+		{
+			lanes = ReduceCombine(lanes, _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i)), operation);
+		}
+		alignas(16) uint32_t laneValues[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(laneValues), lanes);
+		for (uint32_t lane = 0; lane < 4; ++lane)
+		{
+			value = ReduceCombine(value, laneValues[lane], operation);
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			value = ReduceCombine(value, input[i], operation);
+		}
+		return value;
+	}
+
+	// Exclusive scan of a range starting from carry, returns the carry for the next range
+	uint32_t ScanRange(const uint32_t* input, uint32_t* result, uint32_t count, uint32_t carry)
+	{
+		uint32_t i = 0;
+#ifdef PRIMITIVES_SSE2
+		__m128i carryLanes = _mm_set1_epi32(int(carry));
+		for (; i + 4 <= count; i += 4)
+		{
+			const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+			__m128i inclusive = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+			inclusive = _mm_add_epi32(inclusive, _mm_slli_si128(inclusive, 8));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(result + i), _mm_add_epi32(carryLanes, _mm_sub_epi32(inclusive, values)));
+			carryLanes = _mm_add_epi32(carryLanes, _mm_shuffle_epi32(inclusive, _MM_SHUFFLE(3, 3, 3, 3)));
+		}
+		carry = uint32_t(_mm_cvtsi128_si32(carryLanes));
+#endif
+		for (; i < count; ++i)
+		{
+			const uint32_t value = input[i];
+			result[i] = carry;
+			carry += value;
+		}
+		return carry;
+	}
+}
+
+ParallelPrimitivesCPU::ParallelPrimitivesCPU(ThreadPool& threadPool)
+	: m_ThreadPool(threadPool)
+{
+}
+
+void ParallelPrimitivesCPU::ExclusiveScan(const uint32_t* input, uint32_t* result, uint32_t count)
+{
+	// Reduce the chunks, scan the chunk sums and scan every chunk from its prefix
+	const uint32_t chunkCount = GetChunkCount(count);
+	m_ChunkSums.resize(chunkCount);
+
+	m_ThreadPool.ParallelFor(chunkCount, 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t chunk = begin; chunk < end; ++chunk)
+		{
+			const uint32_t first = chunk * CHUNK_SIZE;
+			m_ChunkSums[chunk] = ReduceRange(input + first, std::min(CHUNK_SIZE, count - first), ReduceOperation::Sum);
+		}
+	});
+
+	ScanRange(m_ChunkSums.data(), m_ChunkSums.data(), chunkCount, 0);
+
+	m_ThreadPool.ParallelFor(chunkCount, 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t chunk = begin; chunk < end; ++chunk)
+		{
+			const uint32_t first = chunk * CHUNK_SIZE;
+			ScanRange(input + first, result + first, std::min(CHUNK_SIZE, count - first), m_ChunkSums[chunk]);
+		}
+	});
+}
+
+uint32_t ParallelPrimitivesCPU::Reduce(const uint32_t* input, uint32_t count, ReduceOperation operation)
+{
+	const uint32_t chunkCount = GetChunkCount(count);
+	m_ChunkSums.resize(chunkCount);
+
+	m_ThreadPool.ParallelFor(chunkCount, 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t chunk = begin; chunk < end; ++chunk)
+		{
+			const uint32_t first = chunk * CHUNK_SIZE;
+			m_ChunkSums[chunk] = ReduceRange(input + first, std::min(CHUNK_SIZE, count - first), operation);
+		}
+	});
+
+	return ReduceRange(m_ChunkSums.data(), chunkCount, operation);
+}
+
+uint32_t ParallelPrimitivesCPU::Compact(const uint32_t* input, const uint32_t* flags, uint32_t* result, uint32_t count)
+{
+	const uint32_t chunkCount = GetChunkCount(count);
+	m_ChunkSums.resize(chunkCount);
+
+	m_ThreadPool.ParallelFor(chunkCount, 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t chunk = begin; chunk < end; ++chunk)
+		{
+			const uint32_t first = chunk * CHUNK_SIZE;
+			const uint32_t last = std::min(first + CHUNK_SIZE, count);
+			uint32_t kept = 0;
+			for (uint32_t i = first; i < last; ++i)
+			{
+				kept += flags[i] != 0 ? 1 : 0;
+			}
+			m_ChunkSums[chunk] = kept;
+		}
+	});
+
+	const uint32_t keptCount = ScanRange(m_ChunkSums.data(), m_ChunkSums.data(), chunkCount, 0);
+
+	m_ThreadPool.ParallelFor(chunkCount, 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t chunk = begin; chunk < end; ++chunk)
+		{
+			const uint32_t first = chunk * CHUNK_SIZE;
+			const uint32_t last = std::min(first + CHUNK_SIZE, count);
+			uint32_t destination = m_ChunkSums[chunk];
+			for (uint32_t i = first; i < last; ++i)
+			{
+				if (flags[i] != 0)
+				{
+					result[destination++] = input[i];
+				}
+			}
+		}
+	});
+
+	return keptCount;
+}
+
+void ParallelPrimitivesCPU::RadixSort(uint32_t* keys, uint32_t* values, uint32_t count, uint32_t keyBits)
+{
+	if (count <= 1)
+		return;
+
+	// Least significant digit first. Every chunk counts its digits, the offsets are laid out digit major over
+	// the chunks and every chunk scatters in order, which keeps the sort stable.
+	const uint32_t chunkCount = GetChunkCount(count);
+	const uint32_t passCount = (std::min(std::max(keyBits, 1u), 32u) + RADIX_BITS - 1) / RADIX_BITS;
+	m_Histograms.resize(RADIX_DIGITS * chunkCount);
+	m_SortKeys.resize(count);
+	m_SortValues.resize(count);
+
+	uint32_t* sourceKeys = keys;
+	uint32_t* sourceValues = values;
+	uint32_t* destinationKeys = m_SortKeys.data();
+	uint32_t* destinationValues = m_SortValues.data();
+
+	for (uint32_t pass = 0; pass < passCount; ++pass)
+	{
+		const uint32_t shift = pass * RADIX_BITS;
+
+		m_ThreadPool.ParallelFor(chunkCount, 1, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t chunk = begin; chunk < end; ++chunk)
+			{
+				uint32_t counts[RADIX_DIGITS] = {};
+				const uint32_t first = chunk * CHUNK_SIZE;
+				const uint32_t last = std::min(first + CHUNK_SIZE, count);
+				for (uint32_t i = first; i < last; ++i)
+				{
+					++counts[(sourceKeys[i] >> shift) & (RADIX_DIGITS - 1)];
+				}
+				for (uint32_t digit = 0; digit < RADIX_DIGITS; ++digit)
+				{
+					m_Histograms[digit * chunkCount + chunk] = counts[digit];
+				}
+			}
+		});
+
+		ScanRange(m_Histograms.data(), m_Histograms.data(), uint32_t(m_Histograms.size()), 0);
+
+		m_ThreadPool.ParallelFor(chunkCount, 1, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t chunk = begin; chunk < end; ++chunk)
+			{
+				uint32_t offsets[RADIX_DIGITS];
+				for (uint32_t digit = 0; digit < RADIX_DIGITS; ++digit)
+				{
+					offsets[digit] = m_Histograms[digit * chunkCount + chunk];
+				}
+
+				const uint32_t first = chunk * CHUNK_SIZE;
+				const uint32_t last = std::min(first + CHUNK_SIZE, count);
+				for (uint32_t i = first; i < last; ++i)
+				{
+					const uint32_t destination = offsets[(sourceKeys[i] >> shift) & (RADIX_DIGITS - 1)]++;
+					destinationKeys[destination] = sourceKeys[i];
+					destinationValues[destination] = sourceValues[i];
+				}
+			}
+		});
+
+		std::swap(sourceKeys, destinationKeys);
+		std::swap(sourceValues, destinationValues);
+	}
+
+	// An odd pass count leaves the sorted data in the scratch arrays
+	if (sourceKeys != keys)
+	{
+		std::memcpy(keys, sourceKeys, sizeof(uint32_t) * count);
+		std::memcpy(values, sourceValues, sizeof(uint32_t) * count);
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "ThreadPool.h"
+
+#include <cstdint>
+#include <vector>
+
+// Host twin of ParallelPrimitives: scan, stream compaction, reduction and radix sort over uint32_t arrays of any length.
+// Work is split in fixed size chunks spread over the thread pool, the inner loops use SSE2 where available.
+// Results never depend on the thread count.
+class ParallelPrimitivesCPU
+{
+public:
+	enum class ReduceOperation : uint32_t
+	{
+		Sum = 0,
+		Min = 1,
+		Max = 2,
+	};
+
+	explicit ParallelPrimitivesCPU(ThreadPool& threadPool);
+
+	// Sums wrap modulo 2^32, result may alias input
+	void ExclusiveScan(const uint32_t* input, uint32_t* result, uint32_t count);
+	uint32_t Reduce(const uint32_t* input, uint32_t count, ReduceOperation operation);
+	// Packs the elements with a non zero flag to the front of result keeping their order, returns their number
+	uint32_t Compact(const uint32_t* input, const uint32_t* flags, uint32_t* result, uint32_t count);
+	// Stable in place key-value sort on the lowest keyBits of the keys
+	void RadixSort(uint32_t* keys, uint32_t* values, uint32_t count, uint32_t keyBits = 32);
+
+private:
+	ThreadPool& m_ThreadPool;
+
+	std::vector<uint32_t> m_ChunkSums;
+	std::vector<uint32_t> m_Histograms;
+	std::vector<uint32_t> m_SortKeys;
+	std::vector<uint32_t> m_SortValues;
+};
@@ -0,0 +1,101 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	m_Workers.reserve(threadCount - 1);
+	for (uint32_t i = 1; i < threadCount; ++i)
+	{
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Quit = true;
+	}
+	m_WakeUp.notify_all();
+
+	for (auto& worker : m_Workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::ParallelFor(uint32_t count, uint32_t grainSize, const RangeFunction& func)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	grainSize = std::max(1u, grainSize);
+	if (m_Workers.empty() || count <= grainSize)
+	{
+		func(0, count);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Function = &func;
+		m_Count = count;
+		m_GrainSize = grainSize;
+		m_ChunkCount = (count + grainSize - 1) / grainSize;
+		m_NextChunk = 0;
+		m_ActiveWorkers = uint32_t(m_Workers.size());
+		++m_JobId;
+	}
+	m_WakeUp.notify_all();
+
+	RunChunks();
+
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_Done.wait(lock, [this] { return m_ActiveWorkers == 0; });
+	m_Function = nullptr;
+}
+
+void ThreadPool::RunChunks()
+{
+	for (uint32_t chunk = m_NextChunk++; chunk < m_ChunkCount; chunk = m_NextChunk++)
+	{
+		const uint32_t begin = chunk * m_GrainSize;
+		const uint32_t end = std::min(begin + m_GrainSize, m_Count);
+		(*m_Function)(begin, end);
+	}
+}
+
+void ThreadPool::WorkerLoop()
+{
+	uint64_t lastJobId = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_WakeUp.wait(lock, [this, lastJobId] { return m_Quit || m_JobId != lastJobId; });
+			if (m_Quit)
+			{
+				return;
+			}
+			lastJobId = m_JobId;
+		}
+
+		RunChunks();
+
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			if (--m_ActiveWorkers == 0)
+			{
+				m_Done.notify_one();
+			}
+		}
+	}
+}
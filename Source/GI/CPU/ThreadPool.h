@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Minimal fork-join pool used by the CPU surfel pipeline.
+// Every stage is expressed as a ParallelFor over a flat index range, the calling
+// thread participates in the work and the call returns once the range is done.
+class ThreadPool
+{
+public:
+	using RangeFunction = std::function<void(uint32_t begin, uint32_t end)>;
+
+	explicit ThreadPool(uint32_t threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void ParallelFor(uint32_t count, uint32_t grainSize, const RangeFunction& func);
+
+	// Number of threads taking part in a ParallelFor (workers + caller)
+	uint32_t GetThreadCount() const { return uint32_t(m_Workers.size()) + 1; }
+
+private:
+	void WorkerLoop();
+	void RunChunks();
+
+	std::vector<std::thread> m_Workers;
+	std::mutex m_Mutex;
+	std::condition_variable m_WakeUp;
+	std::condition_variable m_Done;
+
+	// Current job
+	const RangeFunction* m_Function = nullptr;
+	uint32_t m_Count = 0;
+	uint32_t m_GrainSize = 1;
+	std::atomic<uint32_t> m_NextChunk{ 0 };
+	uint32_t m_ChunkCount = 0;
+	uint32_t m_ActiveWorkers = 0;
+	uint64_t m_JobId = 0;
+	bool m_Quit = false;
+};
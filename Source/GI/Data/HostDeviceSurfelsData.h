@@ -12,24 +12,592 @@ struct MultiscaleMeanEstimatorData
 	float inconsistency;
 };
 
+// Unpacked surfel, only used as a working copy. Storage is split into the packed arrays further down
+// so the coverage and lookup loops only load the packed geometry and the irradiance mean.
 struct Surfel
 {
 	float3 Position  DEFAULTS(float3(0.0f, 0.0f, 0.0f));
 	float3 Normal    DEFAULTS(float3(0.0f, 0.0f, 1.0f));
+	float RadiusScale DEFAULTS(1.0f); // Radius relative to SurfelRadius, the level 0 radius, so it is the same at any level
 	MultiscaleMeanEstimatorData Irradiance;
+	uint Age         DEFAULTS(0); // Frames since spawn, SURFEL_DEAD once evicted
+	uint LastSeen    DEFAULTS(0); // Frames since the surfel last covered a pixel
+	uint SampleCount DEFAULTS(0); // Accumulation rays traced so far, the index of the next one in the surfel's sample sequence
 };
 
+struct SurfelState
+{
+	uint Age         DEFAULTS(0);
+	uint LastSeen    DEFAULTS(0);
+	uint SampleCount DEFAULTS(0);
+};
+
+static const uint SURFEL_DEAD = 0xFFFFFFFF;
+// LastSeen of a surfel a rebuild left out of the full cell it lies in, no pixel can see it and the next eviction frees it
+static const uint SURFEL_OVERFLOWED = 0xFFFFFFFF;
+
+// Layout of Surfels.Count
+static const uint SURFEL_COUNT_INDEX = 0;      // Surfels in [0, count) are either alive or dead
+static const uint SURFEL_FREE_COUNT_INDEX = 1; // Dead surfel indices on the free stack
+static const uint SURFEL_INDEX_COUNT_INDEX = 2; // Index list entries the world structure needed this frame, listed or not
+static const uint SURFEL_COUNT_SIZE = 3;
+
+// Accumulation rays are shared out in proportion to per surfel weights. Alive surfels weigh at least 1 so none starve,
+// the upper bound keeps the scanned total of a full storage exact in a float.
+static const uint SURFEL_MAX_RAY_WEIGHT = 15;
+// A single lane traces every ray of its surfel one after another. When the total weight is too low to spread the budget
+// that thin, fewer rays are scheduled so no surfel gets more than this many in a frame.
+static const uint SURFEL_MAX_RAYS_PER_FRAME = 64;
+
 struct WorldStructureChunk
 {
 	uint StartIndex;
 	uint Count;
 };
 
-static const uint WORLD_STRUCTURE_DIMENSION = 32;
-static const float WORLD_DIMENSION = 20.0f;
-static const float WORLD_STRUCTURE_CHUNK_SIZE = (WORLD_DIMENSION / WORLD_STRUCTURE_DIMENSION);
+// Full coordinates and level of the cell in a hash slot, see GetWorldCellKey.
+// Tag is claimed first when a cell is inserted and Coords once the slot is won.
+struct WorldCellKey
+{
+	uint Tag;
+	uint Coords;
+};
+
+// The world structure is an open addressing hash of cells keyed on their integer coordinates,
+// so a fixed number of slots covers an unbounded world. A cell gives its slot back once its list runs empty.
+static const float WORLD_STRUCTURE_CHUNK_SIZE = 0.625f;
+
+// Cells are organized in camera centred clipmap levels. Level N doubles the chunk size and surfel radius of level N - 1,
+// a point uses the finest level whose camera centred box of 2 * HALF_EXTENT cells contains it, the last level is unbounded.
+static const uint WORLD_STRUCTURE_LEVEL_COUNT = 6;
+static const int WORLD_STRUCTURE_LEVEL_HALF_EXTENT = 16;
+
+// Number of hash slots. Power of two so probing wraps with a mask.
+static const uint WORLD_STRUCTURE_TOTAL_SIZE = 64 * 1024;
+// Upper bound on the slots visited by a lookup, a cell that does not fit in its window is not inserted
+static const uint WORLD_STRUCTURE_MAX_PROBES = 16;
+// Lookups stop at an empty slot. A retired slot held a cell whose list ran empty, lookups walk past it
+// so the cells inserted behind it stay reachable and the next insert along the window takes it over.
+static const uint WORLD_STRUCTURE_EMPTY_KEY = 0;
+static const uint WORLD_STRUCTURE_RETIRED_KEY = 0xFFFFFFFF;
+// Coords of a free slot, and of a claimed one until its coordinates are written. Never the coords of a cell.
+static const uint WORLD_STRUCTURE_PENDING_COORDS = 0xFFFFFFFF;
+// Bits per cell coordinate in a key. Positions stay within +-2^15 level 0 cells, which leaves room for the camera
+// and the neighbour cells around them at any level.
+static const uint WORLD_STRUCTURE_KEY_COORD_BITS = 20;
+static const uint WORLD_STRUCTURE_INVALID_INDEX = 0xFFFFFFFF;
+// A surfel is listed in the cell containing it and in the neighbours its sphere reaches, one bit each in an overlap mask
+static const uint WORLD_STRUCTURE_OVERLAP_CELL_COUNT = 27;
+// The index buffers start with this many list entries per surfel of the storage and grow from the exact entry count
+// the world structure passes write to Surfels.Count, see GetSurfelIndexCapacity
+static const uint SURFEL_INITIAL_INDICES_PER_SURFEL = 2;
+// UpdateWorldStructure copies every list with a group of its own. The groups are laid out in rows
+// as a dispatch dimension stops at 65535.
+static const uint WORLD_STRUCTURE_COPY_GROUP_SIZE = 64;
+static const uint WORLD_STRUCTURE_COPY_DISPATCH_WIDTH = 256;
+
+// Surfels created by one SpawnSurfels group
+static const uint SURFEL_SPAWN_GROUP_SIZE = 64;
+
+// A surfel is spawned about SurfelLodPixelRadius pixels wide on the surface it lands on, so distant surfaces get fewer
+// and larger surfels. The radius is clamped to [1, SURFEL_MAX_RADIUS_SCALE] times the radius of the level it spawns at.
+// Close up surfaces keep the density of the level and a surfel still only reaches the cells next to its own.
+static const float SURFEL_MAX_RADIUS_SCALE = 4.0f;
+// The stored radius is relative to the level 0 radius, so a surfel relisted at another level keeps its world size.
+// It is stored as log2 over [0, SURFEL_RADIUS_SCALE_LOG2_RANGE], up to SURFEL_MAX_RADIUS_SCALE at the coarsest level.
+static const float SURFEL_RADIUS_SCALE_LOG2_RANGE = float(WORLD_STRUCTURE_LEVEL_COUNT - 1) + 2.0f;
+static const float SURFEL_DEFAULT_LOD_PIXEL_RADIUS = 24.0f;
+
+// A cell lists at most SurfelCellCapacity surfels, 0 leaves the lists unbounded. Coverage reserves the slots of a spawn up front:
+// a spawn whose own cell is full goes through the overflow policy, a full neighbour cell only misses the surfel.
+static const uint SURFEL_CELL_OVERFLOW_REFUSE = 0; // The spawn is dropped
+static const uint SURFEL_CELL_OVERFLOW_MERGE = 1; // The nearest surfel of the cell facing the same way grows to reach the spawn
+static const uint SURFEL_DEFAULT_CELL_CAPACITY = 0;
+
+// Surfels are stored in spawn order, DefragmentSurfels sorts a window of the surfel arrays by the Morton code of their
+// positions each frame so the surfels of a cell end up next to each other. The window moves on by half its size and wraps
+// at the surfel count, the overlap carries surfels from window to window until the whole storage is in order.
+static const uint SURFEL_DEFAULT_DEFRAGMENT_WINDOW = 64 * 1024;
+// 10 bits per axis, dead surfels sort behind every alive one
+static const uint SURFEL_MORTON_KEY_BITS = 31;
+static const uint SURFEL_MORTON_DEAD_KEY = 1u << 30;
+
+// Accumulation rays can go through a reservoir per surfel (weighted reservoir resampling as in ReSTIR) before the estimator.
+// Every ray is a candidate weighted by the luminance it brought back, the reservoir keeps one of them in proportion to its
+// weight along with the weight sum and the candidate count, and carries them over frames. Neighbours in the surfel's cell
+// facing the same way merge their reservoirs in, their directions reused as seen from the surfel. The estimator is fed the
+// kept radiance scaled to the mean candidate weight, see GetSurfelReservoirRadiance.
+static const uint SURFEL_RESAMPLE_OFF = 0; // Rays feed the estimator directly
+static const uint SURFEL_RESAMPLE_TEMPORAL = 1;
+static const uint SURFEL_RESAMPLE_SPATIOTEMPORAL = 2;
+static const uint SURFEL_DEFAULT_RESAMPLE_MODE = SURFEL_RESAMPLE_SPATIOTEMPORAL;
+// Candidates a reservoir remembers. Kept radiance is never traced again, the history fades so a change in the lighting
+// takes over within about as many rays.
+static const float SURFEL_RESERVOIR_MAX_COUNT = 16.0f;
+// Reservoirs of the surfel's cell list merged in, drawn at random. Lower cosines between the normals are skipped.
+static const uint SURFEL_RESERVOIR_NEIGHBOUR_COUNT = 4;
+static const float SURFEL_RESERVOIR_MIN_NORMAL_COSINE = 0.9f;
+
+// Packed in a uint4: octahedral direction, RGB9E5 radiance, weight sum and candidate count as float bits
+struct SurfelReservoir
+{
+	float3 Direction;
+	float3 Radiance;
+	float WeightSum;
+	float Count;
+};
+
+// BinSurfels gathers the surfels that can reach a screen tile into a candidate list per tile, SurfelsRendering shades from it.
+// An entry is the surfel index with the level of the cell it was found in above SURFEL_TILE_LEVEL_SHIFT.
+// Tiles match the SurfelsRendering groups, larger ones reach across more cells than a single pixel looks up.
+static const uint SURFEL_TILE_SIZE = 8;
+static const uint SURFEL_TILE_MAX_SURFELS = 256;
+static const uint SURFEL_TILE_LEVEL_SHIFT = 29;
+static const uint SURFEL_TILE_INDEX_MASK = (1u << SURFEL_TILE_LEVEL_SHIFT) - 1;
+static const uint SURFEL_TILE_OVERFLOW = 0xFFFFFFFF; // Count of a tile whose candidates did not fit, its pixels walk the cell lists
+
+// World space bounds a scene instance left or moved into since the last frame. Surfels whose sphere reaches one
+// are evicted and coverage respawns them on the geometry that is there now. Boxes past the maximum are merged into the last one.
+struct SurfelInvalidationBox
+{
+	float3 Min;
+	float3 Max;
+};
+static const uint SURFEL_MAX_INVALIDATION_BOXES = 64;
+
+// Entry of the alias table surfel rays pick the light of their shadow ray from, see BuildLightAliasTable.
+// A sample landing in slot i keeps light i below Probability and takes Alias above it. Pdf is the probability
+// light i is picked over the whole table, the shadow ray's contribution is divided by it.
+struct LightAliasEntry
+{
+	float Probability;
+	uint Alias;
+	float Pdf;
+};
+
+// Counters the GI passes add to during a frame, cleared at its start and read back a few frames later
+static const uint GI_STATISTICS_SPAWNED_SURFELS = 0;
+static const uint GI_STATISTICS_EVICTED_SURFELS = 1;
+static const uint GI_STATISTICS_OCCUPIED_CELLS = 2;
+static const uint GI_STATISTICS_LISTED_SURFELS = 3; // Entries over every cell list, a surfel is listed in each cell it reaches
+static const uint GI_STATISTICS_MAX_CELL_LIST = 4;
+static const uint GI_STATISTICS_TRACED_RAYS = 5;
+static const uint GI_STATISTICS_OVERFLOWED_SPAWNS = 6; // Spawns whose cell was at SurfelCellCapacity
+static const uint GI_STATISTICS_CANDIDATE_HISTOGRAM = 7; // GI pixels by the number of surfels shading them, see GetCandidateHistogramBin
+static const uint GI_STATISTICS_CANDIDATE_BIN_COUNT = 10;
+static const uint GI_STATISTICS_SIZE = GI_STATISTICS_CANDIDATE_HISTOGRAM + GI_STATISTICS_CANDIDATE_BIN_COUNT;
+
+// Packed storage per surfel:
+// Geometry   uint4  - level 0 cell as int16 x3, unorm16 offset inside the cell x3, octahedral snorm12 normal, unorm8 log2 radius scale
+// Irradiance float4 - long window mean and inconsistency. The mean stays float, its blend goes down to 1/8192
+//                     which is below half precision and would freeze the estimator.
+// Estimator  uint3  - half short window mean and vbbr, shared exponent variance
+// State      SurfelState
+static const uint SURFEL_PACKED_SIZE = 16 + 16 + 12 + 12;
+
+#ifdef HOST_CODE
+#include <cmath>
+#include <cstring>
+#include <glm/gtc/packing.hpp>
+
+inline uint SurfelPackHalf(float value) { return glm::packHalf1x16(value); }
+inline float SurfelUnpackHalf(uint bits) { return glm::unpackHalf1x16(uint16_t(bits & 0xFFFF)); }
+inline uint SurfelAsUint(float value) { uint bits; std::memcpy(&bits, &value, sizeof(bits)); return bits; }
+inline float SurfelAsFloat(uint bits) { float value; std::memcpy(&value, &bits, sizeof(value)); return value; }
+inline float SurfelLog2(float value) { return std::log2(value); }
+inline float SurfelExp2(float value) { return std::exp2(value); }
+#else
+uint SurfelPackHalf(float value) { return f32tof16(value); }
+float SurfelUnpackHalf(uint bits) { return f16tof32(bits & 0xFFFF); }
+uint SurfelAsUint(float value) { return asuint(value); }
+float SurfelAsFloat(uint bits) { return asfloat(bits); }
+float SurfelLog2(float value) { return log2(value); }
+float SurfelExp2(float value) { return exp2(value); }
+#endif
+
+inline float SurfelAbs(float value) { return value < 0.0f ? -value : value; }
+inline float SurfelSignNotZero(float value) { return value >= 0.0f ? 1.0f : -1.0f; }
+inline float SurfelClamp(float value, float low, float high) { return value < low ? low : (value > high ? high : value); }
+
+// Accumulation rays of a surfel follow the R2 sequence (the 2D Kronecker lattice of the plastic number) in 0.32 fixed point,
+// indexed by the surfel's SampleCount. Successive rays fill the hemisphere evenly whatever the frame time does, and each
+// surfel shifts the lattice by a hash of its packed geometry so neighbouring surfels do not trace the same directions.
+static const uint SURFEL_R2_STEP_X = 3242174889u; // 2^32 / plastic number
+static const uint SURFEL_R2_STEP_Y = 2447445414u; // 2^32 / plastic number^2
+// Per frame jitters step along the golden ratio sequence, so a pixel or schedule offset never repeats a value in a row
+static const uint SURFEL_R1_STEP = 2654435769u;   // 2^32 / golden ratio
 
-static const uint WORLD_STRUCTURE_TOTAL_SIZE = WORLD_STRUCTURE_DIMENSION * WORLD_STRUCTURE_DIMENSION * WORLD_STRUCTURE_DIMENSION;
+inline uint SurfelHash(uint value)
+{
+	// Wang hash
+	value = (value ^ 61u) ^ (value >> 16);
+	value *= 9u;
+	value = value ^ (value >> 4);
+	value *= 0x27d4eb2du;
+	value = value ^ (value >> 15);
+	return value;
+}
+
+inline float SurfelFixedToFloat(uint value)
+{
+	// Top 24 bits, exact in a float and below 1
+	return float(value >> 8) * (1.0f / 16777216.0f);
+}
+
+// Cranley-Patterson rotation of the surfel's sample sequence. Geometry does not change while the surfel lives
+// and moves with it when the storage is compacted or cached.
+inline uint2 GetSurfelSampleScramble(uint4 geometry)
+{
+	uint hash = SurfelHash(geometry.x ^ SurfelHash(geometry.y ^ SurfelHash(geometry.z ^ SurfelHash(geometry.w))));
+	return uint2(hash, SurfelHash(hash));
+}
+
+inline float2 GetSurfelSample(uint sampleIndex, uint2 scramble)
+{
+	return float2(SurfelFixedToFloat(scramble.x + sampleIndex * SURFEL_R2_STEP_X), SurfelFixedToFloat(scramble.y + sampleIndex * SURFEL_R2_STEP_Y));
+}
+
+// Value in [0, 1) for frameIndex, stratified over consecutive frames and decorrelated between keys
+inline float GetFrameJitter(uint frameIndex, uint key)
+{
+	return SurfelFixedToFloat(SurfelHash(key) + frameIndex * SURFEL_R1_STEP);
+}
+
+// Slot of the light alias table a value in [0, 1) lands in, the rest of it picks between the slot and its alias
+inline uint GetLightAliasSlot(float choice, uint lightCount)
+{
+	uint slot = uint(choice * float(lightCount));
+	return slot < lightCount ? slot : lightCount - 1;
+}
+
+inline uint SelectLightAlias(LightAliasEntry entry, uint slot, float choice, uint lightCount)
+{
+	return choice * float(lightCount) - float(slot) < entry.Probability ? slot : entry.Alias;
+}
+
+// Bin 0 holds pixels without candidates, bin i holds [2^(i - 1), 2^i) and the last bin everything above
+inline uint GetCandidateHistogramBin(uint candidateCount)
+{
+	uint bin = 0;
+	while (candidateCount != 0 && bin < GI_STATISTICS_CANDIDATE_BIN_COUNT - 1)
+	{
+		candidateCount >>= 1;
+		++bin;
+	}
+	return bin;
+}
+
+// Index buffer size for requiredCount list entries. It stays while they fill up to 7/8 of it, the headroom covers the
+// frames the count is read back late, and at least doubles past that so a growing storage copies the lists a few times only.
+// A surfel is listed in WORLD_STRUCTURE_OVERLAP_CELL_COUNT cells at most, more than that many entries per surfel is never needed.
+inline uint GetSurfelIndexCapacity(uint requiredCount, uint capacity, uint maxSurfels)
+{
+	if (requiredCount <= capacity - capacity / 8)
+		return capacity;
+
+	uint grown = capacity * 2 > requiredCount + requiredCount / 4 ? capacity * 2 : requiredCount + requiredCount / 4;
+	uint bound = maxSurfels * WORLD_STRUCTURE_OVERLAP_CELL_COUNT;
+	return grown < bound ? grown : (bound > requiredCount ? bound : requiredCount);
+}
+
+inline bool HasSurfelCellRoom(uint count, uint capacity)
+{
+	return capacity == 0 || count < capacity;
+}
+
+// x and the low 11 bits of y in Coords, the high 9 bits of y, z and level + 1 in Tag. Bit 31 of Coords is never set
+// and level + 1 is 1 to 6, so a cell key never reads as empty, retired or pending.
+inline WorldCellKey GetWorldCellKey(int3 cell, uint level)
+{
+	uint mask = (1u << WORLD_STRUCTURE_KEY_COORD_BITS) - 1;
+	uint y = uint(cell.y) & mask;
+	WorldCellKey key;
+	key.Coords = (uint(cell.x) & mask) | ((y & 0x7FF) << WORLD_STRUCTURE_KEY_COORD_BITS);
+	key.Tag = (y >> 11) | ((uint(cell.z) & mask) << 9) | ((level + 1) << 29);
+	return key;
+}
+
+inline bool IsWorldCellKeyUsed(WorldCellKey key)
+{
+	return key.Tag != WORLD_STRUCTURE_EMPTY_KEY && key.Tag != WORLD_STRUCTURE_RETIRED_KEY;
+}
+
+inline bool IsSameWorldCell(WorldCellKey a, WorldCellKey b)
+{
+	return a.Tag == b.Tag && a.Coords == b.Coords;
+}
+
+inline uint GetWorldCellKeyLevel(WorldCellKey key)
+{
+	return (key.Tag >> 29) - 1;
+}
+
+inline int3 GetWorldCellKeyCell(WorldCellKey key)
+{
+	// Shifted up to bit 31 and back down to sign extend them
+	int shift = 32 - int(WORLD_STRUCTURE_KEY_COORD_BITS);
+	uint y = (key.Coords >> WORLD_STRUCTURE_KEY_COORD_BITS) | (key.Tag << 11);
+	return int3(int(key.Coords << shift) >> shift, int(y << shift) >> shift, int((key.Tag >> 9) << shift) >> shift);
+}
+
+inline uint PackUnorm16(float value)
+{
+	return uint(SurfelClamp(value, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+inline float UnpackUnorm16(uint bits)
+{
+	return float(bits & 0xFFFF) / 65535.0f;
+}
+
+inline uint PackSnorm12(float value)
+{
+	float scaled = SurfelClamp(value, -1.0f, 1.0f) * 2047.0f;
+	return uint(int(scaled + (scaled >= 0.0f ? 0.5f : -0.5f))) & 0xFFF;
+}
+
+inline float UnpackSnorm12(uint bits)
+{
+	return SurfelClamp(float(int(bits << 20) >> 20) / 2047.0f, -1.0f, 1.0f);
+}
+
+inline uint PackHalf2(float low, float high)
+{
+	return SurfelPackHalf(low) | (SurfelPackHalf(high) << 16);
+}
+
+inline uint PackOctahedralNormal(float3 normal)
+{
+	float3 n = normal / (SurfelAbs(normal.x) + SurfelAbs(normal.y) + SurfelAbs(normal.z));
+	float x = n.x;
+	float y = n.y;
+	if (n.z < 0.0f)
+	{
+		x = (1.0f - SurfelAbs(n.y)) * SurfelSignNotZero(n.x);
+		y = (1.0f - SurfelAbs(n.x)) * SurfelSignNotZero(n.y);
+	}
+	return PackSnorm12(x) | (PackSnorm12(y) << 12);
+}
+
+inline float3 UnpackOctahedralNormal(uint bits)
+{
+	float x = UnpackSnorm12(bits);
+	float y = UnpackSnorm12(bits >> 12);
+	float3 n = float3(x, y, 1.0f - SurfelAbs(x) - SurfelAbs(y));
+	if (n.z < 0.0f)
+	{
+		n.x = (1.0f - SurfelAbs(y)) * SurfelSignNotZero(x);
+		n.y = (1.0f - SurfelAbs(x)) * SurfelSignNotZero(y);
+	}
+	return normalize(n);
+}
+
+// Shared exponent RGB with 9 bit mantissas, negative channels clamp to 0
+static const float SURFEL_RGB9E5_MAX = 65408.0f;
+
+inline uint PackRGB9E5(float3 value)
+{
+	float r = SurfelClamp(value.x, 0.0f, SURFEL_RGB9E5_MAX);
+	float g = SurfelClamp(value.y, 0.0f, SURFEL_RGB9E5_MAX);
+	float b = SurfelClamp(value.z, 0.0f, SURFEL_RGB9E5_MAX);
+	float maxChannel = r > g ? (r > b ? r : b) : (g > b ? g : b);
+
+	// floor(log2(maxChannel)) read from the float exponent, biased by 15
+	int exponent = int((SurfelAsUint(maxChannel) >> 23) & 0xFF) - 127;
+	exponent = (exponent < -16 ? -16 : exponent) + 1 + 15;
+	float scale = SurfelAsFloat(uint(exponent - 15 - 9 + 127) << 23);
+	if (uint(maxChannel / scale + 0.5f) == 512)
+	{
+		scale *= 2.0f;
+		++exponent;
+	}
+
+	return uint(r / scale + 0.5f) | (uint(g / scale + 0.5f) << 9) | (uint(b / scale + 0.5f) << 18) | (uint(exponent) << 27);
+}
+
+inline float3 UnpackRGB9E5(uint bits)
+{
+	float scale = SurfelAsFloat(uint(int(bits >> 27) - 15 - 9 + 127) << 23);
+	return float3(float(bits & 0x1FF), float((bits >> 9) & 0x1FF), float((bits >> 18) & 0x1FF)) * scale;
+}
+
+inline uint PackSurfelRadiusScale(float radiusScale)
+{
+	return uint(SurfelClamp(SurfelLog2(radiusScale) / SURFEL_RADIUS_SCALE_LOG2_RANGE, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// Positions are stored relative to their level 0 world cell, which covers +-20km per axis with int16 cells
+inline uint4 PackSurfelGeometry(float3 position, float3 normal, float radiusScale)
+{
+	float3 cellPosition = position / WORLD_STRUCTURE_CHUNK_SIZE;
+	int3 cell = int3(floor(cellPosition));
+	float3 offset = cellPosition - float3(cell);
+
+	uint4 packed;
+	packed.x = (uint(cell.x) & 0xFFFF) | (uint(cell.y) << 16);
+	packed.y = (uint(cell.z) & 0xFFFF) | (PackUnorm16(offset.x) << 16);
+	packed.z = PackUnorm16(offset.y) | (PackUnorm16(offset.z) << 16);
+	packed.w = PackOctahedralNormal(normal) | (PackSurfelRadiusScale(radiusScale) << 24);
+	return packed;
+}
+
+inline float3 UnpackSurfelPosition(uint4 packed)
+{
+	int3 cell = int3(int(packed.x << 16) >> 16, int(packed.x) >> 16, int(packed.y << 16) >> 16);
+	float3 offset = float3(UnpackUnorm16(packed.y >> 16), UnpackUnorm16(packed.z), UnpackUnorm16(packed.z >> 16));
+	return (float3(cell) + offset) * WORLD_STRUCTURE_CHUNK_SIZE;
+}
+
+inline float3 UnpackSurfelNormal(uint4 packed)
+{
+	return UnpackOctahedralNormal(packed.w);
+}
+
+inline float UnpackSurfelRadiusScale(uint4 packed)
+{
+	return SurfelExp2(float(packed.w >> 24) * (SURFEL_RADIUS_SCALE_LOG2_RANGE / 255.0f));
+}
+
+inline uint SurfelSpreadBits3(uint value)
+{
+	value &= 0x3FF;
+	value = (value | (value << 16)) & 0x030000FF;
+	value = (value | (value << 8)) & 0x0300F00F;
+	value = (value | (value << 4)) & 0x030C30C3;
+	value = (value | (value << 2)) & 0x09249249;
+	return value;
+}
+
+// Morton code of the low 6 bits of the level 0 cell and the top 4 bits of the offset in it per axis,
+// the order wraps every 64 cells but neighbours in a cell list always land close
+inline uint GetSurfelMortonKey(uint4 packed)
+{
+	uint x = ((packed.x << 4) | (packed.y >> 28)) & 0x3FF;
+	uint y = (((packed.x >> 16) << 4) | ((packed.z >> 12) & 0xF)) & 0x3FF;
+	uint z = ((packed.y << 4) | (packed.z >> 28)) & 0x3FF;
+	return SurfelSpreadBits3(x) | (SurfelSpreadBits3(y) << 1) | (SurfelSpreadBits3(z) << 2);
+}
+
+// Radius scale relative to levelRadius the merge of a spawn at distance from the surfel center gives it,
+// the spawn position then gets half coverage
+inline float GetMergedSurfelRadiusScale(float distance, float levelRadius)
+{
+	return SurfelClamp(2.0f * distance / levelRadius, 1.0f, SURFEL_MAX_RADIUS_SCALE);
+}
+
+// Geometry.w with the radius scale replaced. The normal bits stay, so a max over the words is a max over the radii.
+inline uint SetSurfelRadiusScale(uint4 packed, float radiusScale)
+{
+	return (packed.w & 0xFFFFFF) | (PackSurfelRadiusScale(radiusScale) << 24);
+}
+
+inline float4 PackSurfelIrradiance(MultiscaleMeanEstimatorData data)
+{
+	return float4(data.mean, data.inconsistency);
+}
+
+inline uint3 PackSurfelEstimator(MultiscaleMeanEstimatorData data)
+{
+	return uint3(PackHalf2(data.shortMean.x, data.shortMean.y), PackHalf2(data.shortMean.z, data.vbbr), PackRGB9E5(data.variance));
+}
+
+inline MultiscaleMeanEstimatorData UnpackSurfelEstimator(float4 irradiance, uint3 estimator)
+{
+	MultiscaleMeanEstimatorData data;
+	data.mean = float3(irradiance.x, irradiance.y, irradiance.z);
+	data.inconsistency = irradiance.w;
+	data.shortMean = float3(SurfelUnpackHalf(estimator.x), SurfelUnpackHalf(estimator.x >> 16), SurfelUnpackHalf(estimator.y));
+	data.vbbr = SurfelUnpackHalf(estimator.y >> 16);
+	data.variance = UnpackRGB9E5(estimator.z);
+	return data;
+}
+
+// Luminance of the spread of the per frame estimates, the noise level the GI denoiser steers by
+inline float UnpackSurfelLuminanceVariance(uint3 estimator)
+{
+	float3 variance = UnpackRGB9E5(estimator.z);
+	return variance.x * 0.299f + variance.y * 0.587f + variance.z * 0.114f;
+}
+
+inline uint4 PackSurfelReservoir(SurfelReservoir reservoir)
+{
+	return uint4(PackOctahedralNormal(reservoir.Direction), PackRGB9E5(reservoir.Radiance), SurfelAsUint(reservoir.WeightSum), SurfelAsUint(reservoir.Count));
+}
+
+// uint4(0) is the empty reservoir
+inline SurfelReservoir UnpackSurfelReservoir(uint4 packed)
+{
+	SurfelReservoir reservoir;
+	reservoir.Direction = UnpackOctahedralNormal(packed.x);
+	reservoir.Radiance = UnpackRGB9E5(packed.y);
+	reservoir.WeightSum = SurfelAsFloat(packed.z);
+	reservoir.Count = SurfelAsFloat(packed.w);
+	return reservoir;
+}
+
+// Value in [0, 1) for the i-th reservoir decision of a surfel's rays
+inline float GetSurfelReservoirChoice(uint seed, uint i)
+{
+	return SurfelFixedToFloat(SurfelHash(seed ^ (i * SURFEL_R1_STEP)));
+}
+
+// The target is the luminance of the integrand, radiance times the cosine at the surfel. Rays follow the cosine,
+// so a ray's weight is the target over its pdf, the luminance it brought back up to a constant.
+inline float GetSurfelReservoirLuminance(float3 radiance)
+{
+	return radiance.x * 0.299f + radiance.y * 0.587f + radiance.z * 0.114f;
+}
+
+// Streams in a candidate standing for count rays with the given weight sum, it replaces the kept one with probability weight / WeightSum
+inline SurfelReservoir AddSurfelReservoirCandidate(SurfelReservoir reservoir, float3 direction, float3 radiance, float weight, float count, float choice)
+{
+	reservoir.WeightSum += weight;
+	reservoir.Count += count;
+	if (choice * reservoir.WeightSum < weight)
+	{
+		reservoir.Direction = direction;
+		reservoir.Radiance = radiance;
+	}
+	return reservoir;
+}
+
+// A ray the surfel traced along direction
+inline SurfelReservoir AddSurfelReservoirRay(SurfelReservoir reservoir, float3 direction, float3 radiance, float choice)
+{
+	return AddSurfelReservoirCandidate(reservoir, direction, radiance, GetSurfelReservoirLuminance(radiance), 1.0f, choice);
+}
+
+// Scales the history down to maxCount candidates, the mean weight stays
+inline SurfelReservoir ClampSurfelReservoir(SurfelReservoir reservoir, float maxCount)
+{
+	if (reservoir.Count > maxCount)
+	{
+		reservoir.WeightSum *= maxCount / reservoir.Count;
+		reservoir.Count = maxCount;
+	}
+	return reservoir;
+}
+
+// Merges the reservoir of a neighbour into the surfel's. The kept direction is reused from the surfel's position, its targets
+// at the two surfels differ by the ratio of the cosines and the weight sum is rescaled by it. Directions below either horizon weigh 0.
+inline SurfelReservoir MergeSurfelReservoir(SurfelReservoir reservoir, float3 normal, SurfelReservoir neighbour, float3 neighbourNormal, float choice)
+{
+	float3 direction = neighbour.Direction;
+	float cosine = direction.x * normal.x + direction.y * normal.y + direction.z * normal.z;
+	float neighbourCosine = direction.x * neighbourNormal.x + direction.y * neighbourNormal.y + direction.z * neighbourNormal.z;
+	float weight = cosine > 0.0f && neighbourCosine > 0.0f ? neighbour.WeightSum * (cosine / neighbourCosine) : 0.0f;
+	return AddSurfelReservoirCandidate(reservoir, direction, neighbour.Radiance, weight, neighbour.Count, choice);
+}
+
+// Estimate of the mean radiance over the cosine distribution, what a single ray estimates. The kept radiance over its
+// target times the mean weight, the cosine cancels out.
+inline float3 GetSurfelReservoirRadiance(SurfelReservoir reservoir)
+{
+	float luminance = GetSurfelReservoirLuminance(reservoir.Radiance);
+	if (luminance <= 0.0f || reservoir.Count <= 0.0f)
+		return float3(0.0f, 0.0f, 0.0f);
+	return reservoir.Radiance * (reservoir.WeightSum / (reservoir.Count * luminance));
+}
 
 static const float SurfelRadius = WORLD_STRUCTURE_CHUNK_SIZE / 6.0f;
 static const float SurfelRadiusSquared = SurfelRadius * SurfelRadius;
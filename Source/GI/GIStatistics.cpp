@@ -0,0 +1,98 @@
+#include "GIStatistics.h"
+
+#include <fstream>
+
+using namespace Falcor;
+
+void GIFrameStatistics::SetCounters(const uint32_t* counters)
+{
+	SpawnedSurfels = counters[GI_STATISTICS_SPAWNED_SURFELS];
+	EvictedSurfels = counters[GI_STATISTICS_EVICTED_SURFELS];
+	OccupiedCells = counters[GI_STATISTICS_OCCUPIED_CELLS];
+	ListedSurfels = counters[GI_STATISTICS_LISTED_SURFELS];
+	MaxCellListLength = counters[GI_STATISTICS_MAX_CELL_LIST];
+	TracedRays = counters[GI_STATISTICS_TRACED_RAYS];
+	OverflowedSpawns = counters[GI_STATISTICS_OVERFLOWED_SPAWNS];
+	for (uint32_t bin = 0; bin < GI_STATISTICS_CANDIDATE_BIN_COUNT; ++bin)
+	{
+		CandidateHistogram[bin] = counters[GI_STATISTICS_CANDIDATE_HISTOGRAM + bin];
+	}
+}
+
+bool GIStatisticsLog::WriteCsv(const std::string& path) const
+{
+	std::ofstream file(path, std::ios::trunc);
+	if (!file)
+	{
+		logWarning("Can't write GI statistics " + path);
+		return false;
+	}
+
+	file << "Frame,SurfelCount,FreeSurfelCount,SpawnedSurfels,EvictedSurfels,OccupiedCells,ListedSurfels,AverageCellListLength,MaxCellListLength,TracedRays,OverflowedSpawns";
+	for (uint32_t bin = 0; bin < GI_STATISTICS_CANDIDATE_BIN_COUNT; ++bin)
+	{
+		file << ",Candidates" << GIFrameStatistics::GetCandidateBinStart(bin) << (bin + 1 == GI_STATISTICS_CANDIDATE_BIN_COUNT ? "Plus" : "");
+	}
+	file << "\n";
+
+	for (const GIFrameStatistics& frame : m_Frames)
+	{
+		file << frame.Frame << "," << frame.SurfelCount << "," << frame.FreeSurfelCount << "," << frame.SpawnedSurfels << "," << frame.EvictedSurfels
+			<< "," << frame.OccupiedCells << "," << frame.ListedSurfels << "," << frame.GetAverageCellListLength() << "," << frame.MaxCellListLength
+			<< "," << frame.TracedRays << "," << frame.OverflowedSpawns;
+		for (uint32_t count : frame.CandidateHistogram)
+		{
+			file << "," << count;
+		}
+		file << "\n";
+	}
+	return bool(file);
+}
+
+bool GIStatisticsLog::WriteJson(const std::string& path) const
+{
+	std::ofstream file(path, std::ios::trunc);
+	if (!file)
+	{
+		logWarning("Can't write GI statistics " + path);
+		return false;
+	}
+
+	file << "{\n\t\"candidateBinStarts\": [";
+	for (uint32_t bin = 0; bin < GI_STATISTICS_CANDIDATE_BIN_COUNT; ++bin)
+	{
+		file << (bin != 0 ? ", " : "") << GIFrameStatistics::GetCandidateBinStart(bin);
+	}
+	file << "],\n\t\"frames\": [";
+
+	for (size_t i = 0; i < m_Frames.size(); ++i)
+	{
+		const GIFrameStatistics& frame = m_Frames[i];
+		file << (i != 0 ? "," : "") << "\n\t\t{ \"frame\": " << frame.Frame
+			<< ", \"surfelCount\": " << frame.SurfelCount
+			<< ", \"freeSurfelCount\": " << frame.FreeSurfelCount
+			<< ", \"spawnedSurfels\": " << frame.SpawnedSurfels
+			<< ", \"evictedSurfels\": " << frame.EvictedSurfels
+			<< ", \"occupiedCells\": " << frame.OccupiedCells
+			<< ", \"listedSurfels\": " << frame.ListedSurfels
+			<< ", \"averageCellListLength\": " << frame.GetAverageCellListLength()
+			<< ", \"maxCellListLength\": " << frame.MaxCellListLength
+			<< ", \"tracedRays\": " << frame.TracedRays
+			<< ", \"overflowedSpawns\": " << frame.OverflowedSpawns
+			<< ", \"candidateHistogram\": [";
+		for (uint32_t bin = 0; bin < GI_STATISTICS_CANDIDATE_BIN_COUNT; ++bin)
+		{
+			file << (bin != 0 ? ", " : "") << frame.CandidateHistogram[bin];
+		}
+		file << "] }";
+	}
+	file << "\n\t]\n}\n";
+	return bool(file);
+}
+
+bool GIStatisticsLog::Write(const std::string& path) const
+{
+	const std::string extension = ".json";
+	const bool json = path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+	return json ? WriteJson(path) : WriteCsv(path);
+}
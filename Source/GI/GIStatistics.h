@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Falcor.h>
+
+#include "Data/HostDeviceSurfelsData.h"
+
+#include <string>
+#include <vector>
+
+// Counters of one GI frame. GlobalIllumination fills them from the GI_STATISTICS_* counters the GPU passes write,
+// read back a few frames late, GlobalIlluminationCPU from the frame it just ran.
+struct GIFrameStatistics
+{
+	uint64_t Frame = 0;
+	uint32_t SurfelCount = 0; // Alive and dead surfels below Surfels.Count[SURFEL_COUNT_INDEX]
+	uint32_t FreeSurfelCount = 0;
+	uint32_t SpawnedSurfels = 0;
+	uint32_t EvictedSurfels = 0;
+	uint32_t OccupiedCells = 0;
+	uint32_t ListedSurfels = 0; // Entries over every cell list
+	uint32_t MaxCellListLength = 0;
+	uint32_t TracedRays = 0;
+	uint32_t OverflowedSpawns = 0; // Spawns refused or merged as their cell was at the capacity
+	uint32_t CandidateHistogram[GI_STATISTICS_CANDIDATE_BIN_COUNT] = {};
+
+	float GetAverageCellListLength() const { return OccupiedCells != 0 ? float(ListedSurfels) / float(OccupiedCells) : 0.0f; }
+	// Sets the counters from a GI_STATISTICS_SIZE copy of the statistics buffer
+	void SetCounters(const uint32_t* counters);
+	// Lower bound of the candidate counts in a histogram bin
+	static uint32_t GetCandidateBinStart(uint32_t bin) { return bin == 0 ? 0 : 1u << (bin - 1); }
+};
+
+// Frames recorded for a dump, so scenes with long cell lists or a saturated surfel storage show up in captures
+class GIStatisticsLog
+{
+public:
+	void Add(const GIFrameStatistics& statistics) { m_Frames.push_back(statistics); }
+	void Clear() { m_Frames.clear(); }
+	const std::vector<GIFrameStatistics>& GetFrames() const { return m_Frames; }
+
+	// One row per frame, the histogram bins are named after their lower bound
+	bool WriteCsv(const std::string& path) const;
+	// An array of frames, the histogram as an array of counts
+	bool WriteJson(const std::string& path) const;
+	// JSON for a .json path and CSV otherwise
+	bool Write(const std::string& path) const;
+
+private:
+	std::vector<GIFrameStatistics> m_Frames;
+};
@@ -1,26 +1,102 @@
 #include "GlobaIllumination.h"
 
-#include "Data/HostDeviceSurfelsData.h"
+#include "LightSampling.h"
+#include "SurfelCache.h"
+
+const Gui::DropdownList worldStructureBuildModeList =
+{
+	{ uint32_t(GlobalIllumination::WorldStructureBuildMode::Incremental), "Incremental" },
+	{ uint32_t(GlobalIllumination::WorldStructureBuildMode::Rebuild), "Rebuild" },
+};
+
+const Gui::DropdownList cellOverflowList =
+{
+	{ SURFEL_CELL_OVERFLOW_REFUSE, "Refuse" },
+	{ SURFEL_CELL_OVERFLOW_MERGE, "Merge Nearest" },
+};
+
+const Gui::DropdownList resampleModeList =
+{
+	{ SURFEL_RESAMPLE_OFF, "Off" },
+	{ SURFEL_RESAMPLE_TEMPORAL, "Temporal" },
+	{ SURFEL_RESAMPLE_SPATIOTEMPORAL, "Temporal And Spatial" },
+};
+
+const Gui::DropdownList giResolutionList =
+{
+	{ uint32_t(GlobalIllumination::GIResolution::Full), "Full" },
+	{ uint32_t(GlobalIllumination::GIResolution::Half), "Half" },
+	{ uint32_t(GlobalIllumination::GIResolution::Quarter), "Quarter" },
+};
 
 void GlobalIllumination::Initilize(const uvec2& giMapSize)
 {
 	m_GIMap = Texture::create2D(giMapSize.x, giMapSize.y, ResourceFormat::RGBA16Float, 1, 1, nullptr, ResourceBindFlags::ShaderResource | ResourceBindFlags::UnorderedAccess | ResourceBindFlags::RenderTarget);
 
 	m_SurfelRendering = ComputeProgram::createFromFile("SurfelsRendering.slang", "main");
+	if (m_BinSurfelsPerTile)
+	{
+		m_SurfelRendering->addDefine("SURFEL_TILE_BINNING");
+	}
 	m_SurfelRenderingVars = ComputeVars::create(m_SurfelRendering->getReflector());
 
+	m_BinSurfels = ComputeProgram::createFromFile("BinSurfels.slang", "main");
+	m_BinSurfelsVars = ComputeVars::create(m_BinSurfels->getReflector());
+
+	// The history is written by one pass and read by the other, each gets its own vars
+	m_TemporalAccumulate = ComputeProgram::createFromFile("ResolveGI.slang", "TemporalAccumulate");
+	m_TemporalAccumulateVars = ComputeVars::create(m_TemporalAccumulate->getReflector());
+	m_UpsampleGI = ComputeProgram::createFromFile("ResolveGI.slang", "Upsample");
+	m_UpsampleGIVars = ComputeVars::create(m_UpsampleGI->getReflector());
+	m_DenoiseGI = ComputeProgram::createFromFile("ResolveGI.slang", "Denoise");
+	m_DenoiseGIVars = ComputeVars::create(m_DenoiseGI->getReflector());
+
 	m_SurfelCoverage = ComputeProgram::createFromFile("ComputeCoverage.slang", "main");
 	m_SurfelCoverageVars = ComputeVars::create(m_SurfelCoverage->getReflector());
 
 	m_SpawnSurfel = ComputeProgram::createFromFile("SpawnSurfels.slang", "main");
 	m_SpawnSurfelVars = ComputeVars::create(m_SpawnSurfel->getReflector());
+	m_PrepareSpawnSurfel = ComputeProgram::createFromFile("SpawnSurfels.slang", "PrepareSpawnDispatch");
+	m_PrepareSpawnSurfelVars = ComputeVars::create(m_PrepareSpawnSurfel->getReflector());
 
 	m_UpdateWorldStructure = ComputeProgram::createFromFile("UpdateWorldStructure.slang", "main");
 	m_UpdateWorldStructureVars = ComputeVars::create(m_UpdateWorldStructure->getReflector());
 
+	m_ClearCellCounts = ComputeProgram::createFromFile("RebuildWorldStructure.slang", "ClearCellCounts");
+	m_CountSurfelCells = ComputeProgram::createFromFile("RebuildWorldStructure.slang", "CountSurfelCells");
+	m_BeginScatter = ComputeProgram::createFromFile("RebuildWorldStructure.slang", "BeginScatter");
+	m_ScatterSurfelIndices = ComputeProgram::createFromFile("RebuildWorldStructure.slang", "ScatterSurfelIndices");
+	m_CapCellLists = ComputeProgram::createFromFile("RebuildWorldStructure.slang", "CapCellLists");
+	m_RebuildWorldStructureVars = ComputeVars::create(m_CountSurfelCells->getReflector());
+
+	m_SelectEvictedSurfels = ComputeProgram::createFromFile("EvictSurfels.slang", "SelectEvictedSurfels");
+	m_EvictSurfels = ComputeProgram::createFromFile("EvictSurfels.slang", "EvictSurfels");
+	m_CountEvictedSurfels = ComputeProgram::createFromFile("EvictSurfels.slang", "CountEvictedSurfels");
+	m_EvictSurfelsVars = ComputeVars::create(m_EvictSurfels->getReflector());
+
+	m_MarkAliveSurfels = ComputeProgram::createFromFile("CompactSurfels.slang", "MarkAliveSurfels");
+	m_FindSurfelHoles = ComputeProgram::createFromFile("CompactSurfels.slang", "FindSurfelHoles");
+	m_MoveSurfels = ComputeProgram::createFromFile("CompactSurfels.slang", "MoveSurfels");
+	m_RemapSurfelIndices = ComputeProgram::createFromFile("CompactSurfels.slang", "RemapSurfelIndices");
+	m_FinishCompaction = ComputeProgram::createFromFile("CompactSurfels.slang", "FinishCompaction");
+	m_CompactSurfelsVars = ComputeVars::create(m_MarkAliveSurfels->getReflector());
+
+	m_GetDefragmentKeys = ComputeProgram::createFromFile("DefragmentSurfels.slang", "GetDefragmentKeys");
+	m_MoveDefragmentedSurfels = ComputeProgram::createFromFile("DefragmentSurfels.slang", "MoveDefragmentedSurfels");
+	m_RemapDefragmentedIndices = ComputeProgram::createFromFile("DefragmentSurfels.slang", "RemapDefragmentedIndices");
+	m_RemapDefragmentedFreeIndices = ComputeProgram::createFromFile("DefragmentSurfels.slang", "RemapDefragmentedFreeIndices");
+	m_DefragmentSurfelsVars = ComputeVars::create(m_GetDefragmentKeys->getReflector());
+	m_PrepareRemapDispatch = ComputeProgram::createFromFile("DefragmentSurfels.slang", "PrepareRemapDispatch");
+	m_PrepareRemapDispatchVars = ComputeVars::create(m_PrepareRemapDispatch->getReflector());
+
+	m_ScheduleSurfelRays = ComputeProgram::createFromFile("ScheduleSurfelRays.slang", "main");
+	m_ScheduleSurfelRaysVars = ComputeVars::create(m_ScheduleSurfelRays->getReflector());
+
+	m_CollectCellStatistics = ComputeProgram::createFromFile("GIStatistics.slang", "CollectCellStatistics");
+	m_CollectCandidateStatistics = ComputeProgram::createFromFile("GIStatistics.slang", "CollectCandidateStatistics");
+	m_CollectStatisticsVars = ComputeVars::create(m_CollectCandidateStatistics->getReflector());
+
 	m_Coverage = Texture::create2D(giMapSize.x, giMapSize.y, ResourceFormat::RG32Float, 1, 1, nullptr, Resource::BindFlags::UnorderedAccess | Resource::BindFlags::ShaderResource);
-	m_Irradiance = Texture::create2D(giMapSize.x, giMapSize.y, ResourceFormat::RGBA16Float, 1, 1, nullptr, Resource::BindFlags::UnorderedAccess | Resource::BindFlags::ShaderResource);
-	m_DebugTexture = Texture::create2D(giMapSize.x, giMapSize.y, ResourceFormat::RGBA32Float, 1, 1, nullptr, Resource::BindFlags::UnorderedAccess | Resource::BindFlags::ShaderResource);
 
 	uint32_t initialData[3] = { 0, 1, 1 };
 	m_NewSurfelCountBuffer = Buffer::create(sizeof(uint32_t) * 3, Resource::BindFlags::UnorderedAccess, Buffer::CpuAccess::None, &initialData);
@@ -28,42 +104,93 @@ void GlobalIllumination::Initilize(const uvec2& giMapSize)
 	m_SurfelSpawnCoords = StructuredBuffer::create(m_SurfelCoverage, "gSurfelSpawnCoords", (giMapSize.x / 16) * (giMapSize.y / 16));
 
 	m_NewSurfelCounts = StructuredBuffer::create(m_SurfelCoverage, "gNewSurfelsCount", WORLD_STRUCTURE_TOTAL_SIZE);
+	m_ReservedSurfelCount = StructuredBuffer::create(m_SurfelCoverage, "gReservedSurfelCount", 1);
 
 	m_WorldStructure = StructuredBuffer::create(m_UpdateWorldStructure, "gWorldStructure", WORLD_STRUCTURE_TOTAL_SIZE);
 
 	m_ComputeState = ComputeState::create();
 	m_CommonData = ParameterBlock::create(m_SurfelCoverage->getReflector()->getParameterBlock("Data"), true);
 	m_CommonData->setStructuredBuffer("Surfels.WorldStructure", m_WorldStructure);
+	m_WorldStructureKeys = CreateSurfelsBuffer("Surfels.WorldStructureKeys", WORLD_STRUCTURE_TOTAL_SIZE);
 
-	m_SurfelRenderingVars->setTexture("gGIMap", m_GIMap);
-	m_SurfelRenderingVars->setTexture("gIrradiance", m_Irradiance);
+	m_UpsampleGIVars->setTexture("gGIMap", m_GIMap);
+
+	ConstantBuffer::SharedPtr pCB = m_CommonData->getDefaultConstantBuffer();
+	pCB["SurfelLodPixelRadius"] = m_SurfelLodPixelRadius;
+	pCB["SurfelCellCapacity"] = uint32_t(m_SurfelCellCapacity);
+	pCB["SurfelCellOverflow"] = m_SurfelCellOverflow;
 
 	m_SurfelCoverageVars["GlobalState"]["globalSpawnChance"] = m_SpawnChance;
 	m_SurfelCoverageVars->setStructuredBuffer("gSurfelSpawnCoords", m_SurfelSpawnCoords);
 	m_SurfelCoverageVars->setStructuredBuffer("gNewSurfelsCount", m_NewSurfelCounts);
+	m_SurfelCoverageVars->setStructuredBuffer("gReservedSurfelCount", m_ReservedSurfelCount);
 
 	m_SpawnSurfelVars->setStructuredBuffer("gNewSurfelsCount", m_NewSurfelCounts);
 	m_SpawnSurfelVars->setStructuredBuffer("gSurfelSpawnCoords", m_SurfelSpawnCoords);
 	m_SpawnSurfelVars->setRawBuffer("gSurfelCount", m_SurfelSpawnCoords->getUAVCounter());
+	// Separate vars, the arguments can not stay bound for writing while the spawn dispatch reads them
+	m_PrepareSpawnSurfelVars->setRawBuffer("gSurfelCount", m_SurfelSpawnCoords->getUAVCounter());
+	m_PrepareSpawnSurfelVars->setRawBuffer("gSpawnDispatchArgs", m_NewSurfelCountBuffer);
+
+	m_RemapDispatchArgs = Buffer::create(sizeof(uint32_t) * 6, Resource::BindFlags::UnorderedAccess, Buffer::CpuAccess::None);
+	m_PrepareRemapDispatchVars->setRawBuffer("gRemapDispatchArgs", m_RemapDispatchArgs);
+
+	m_SpawnCounts = Buffer::create(sizeof(uint32_t) * SURFEL_COUNT_SIZE, Resource::BindFlags::ShaderResource, Buffer::CpuAccess::None);
+	m_SpawnSurfelVars->setRawBuffer("gSpawnCounts", m_SpawnCounts);
+
+	// Surfel counts followed by the statistics counters
+	for (auto& readback : m_SurfelCountReadback)
+	{
+		readback = Buffer::create(sizeof(uint32_t) * (SURFEL_COUNT_SIZE + GI_STATISTICS_SIZE), Resource::BindFlags::None, Buffer::CpuAccess::Read);
+	}
 
 	m_SurfelCoverageVars->setParameterBlock("Data", m_CommonData);
 	m_SpawnSurfelVars->setParameterBlock("Data", m_CommonData);
 	m_SurfelRenderingVars->setParameterBlock("Data", m_CommonData);
-
-	m_ScannedNewSurfelCounts = StructuredBuffer::create(m_SurfelCoverage, "gNewSurfelsCount", WORLD_STRUCTURE_TOTAL_SIZE);
+	m_BinSurfelsVars->setParameterBlock("Data", m_CommonData);
+	m_TemporalAccumulateVars->setParameterBlock("Data", m_CommonData);
+	m_UpsampleGIVars->setParameterBlock("Data", m_CommonData);
+	m_DenoiseGIVars->setParameterBlock("Data", m_CommonData);
+	m_UpdateWorldStructureVars->setParameterBlock("Data", m_CommonData);
+	m_RebuildWorldStructureVars->setParameterBlock("Data", m_CommonData);
+	m_EvictSurfelsVars->setParameterBlock("Data", m_CommonData);
+	m_CompactSurfelsVars->setParameterBlock("Data", m_CommonData);
+	m_DefragmentSurfelsVars->setParameterBlock("Data", m_CommonData);
+	m_PrepareRemapDispatchVars->setParameterBlock("Data", m_CommonData);
+	m_ScheduleSurfelRaysVars->setParameterBlock("Data", m_CommonData);
+	m_CollectStatisticsVars->setParameterBlock("Data", m_CommonData);
+
+	m_Statistics = CreateSurfelsBuffer("Statistics", GI_STATISTICS_SIZE);
+
+	// Grown to the light count of the scene on the first frame
+	const LightAliasEntry singleLight = { 1.0f, 0, 1.0f };
+	m_LightAliasTable = CreateSurfelsBuffer("LightAliasTable", 1);
+	m_LightAliasTable->setBlob(&singleLight, 0, sizeof(singleLight));
+
+	m_SurfelCountDeltas = StructuredBuffer::create(m_CountEvictedSurfels, "gSurfelCountDeltas", WORLD_STRUCTURE_TOTAL_SIZE);
+	m_ScannedSurfelCountDeltas = StructuredBuffer::create(m_CountEvictedSurfels, "gSurfelCountDeltas", WORLD_STRUCTURE_TOTAL_SIZE);
+
+	m_EvictSurfelsVars->setStructuredBuffer("gNewSurfelsCount", m_NewSurfelCounts);
+	m_EvictSurfelsVars->setStructuredBuffer("gSurfelCountDeltas", m_SurfelCountDeltas);
+	m_EvictSurfelsVars["EvictionState"]["maxUnseenFrames"] = uint32_t(m_MaxUnseenFrames);
+	m_EvictSurfelsVars["EvictionState"]["maxAge"] = uint32_t(m_MaxSurfelAge);
+	m_EvictSurfelsVars["EvictionState"]["maxCoverage"] = m_MaxSurfelCoverage;
+	m_InvalidationBoxes = StructuredBuffer::create(m_EvictSurfels, "gInvalidationBoxes", SURFEL_MAX_INVALIDATION_BOXES);
+	m_EvictSurfelsVars->setStructuredBuffer("gInvalidationBoxes", m_InvalidationBoxes);
+	m_EvictSurfelsVars["EvictionState"]["invalidationBoxCount"] = 0u;
 
 	m_UpdateWorldStructureVars->setStructuredBuffer("gWorldStructure", m_WorldStructure);
 	m_UpdateWorldStructureVars->setStructuredBuffer("gNewSurfelsCount", m_NewSurfelCounts);
-	m_UpdateWorldStructureVars->setStructuredBuffer("gScannedNewSurfelsCount", m_ScannedNewSurfelCounts);
+	m_UpdateWorldStructureVars->setStructuredBuffer("gScannedSurfelCountDeltas", m_ScannedSurfelCountDeltas);
+
+	// The rebuild counts into the coverage pass counters and scans into the delta scan, neither is needed by then
+	m_RebuildWorldStructureVars->setStructuredBuffer("gCellCounts", m_NewSurfelCounts);
+	m_RebuildWorldStructureVars->setStructuredBuffer("gScannedCellCounts", m_ScannedSurfelCountDeltas);
+	m_RebuildWorldStructureVars->setStructuredBuffer("gWorldStructure", m_WorldStructure);
+
+	m_Primitives.Initilize();
 
-	// Exclusive Scan
-	m_ScanBlocks = ComputeProgram::createFromFile("ExclusiveScan.slang", "ExclusiveScanInBlocks");
-	m_ScanSumOfBlocks = ComputeProgram::createFromFile("ExclusiveScan.slang", "ExclusiveScanSumsOfBlocks");
-	m_AddSumToBlocks = ComputeProgram::createFromFile("ExclusiveScan.slang", "AddSumsToBlocks");
-	m_ScanVars = ComputeVars::create(m_AddSumToBlocks->getReflector());
-	assert(WORLD_STRUCTURE_TOTAL_SIZE <= (1024 * 1024));
-	m_ScanAuxiliaryBuffer[0] = StructuredBuffer::create(m_SurfelCoverage, "gNewSurfelsCount", 1024);
-	m_ScanAuxiliaryBuffer[1] = StructuredBuffer::create(m_SurfelCoverage, "gNewSurfelsCount", 1024);
+	CreateResolutionTargets();
 
 	// Raytracing
 	RtProgram::Desc rtDesc;
@@ -87,11 +214,6 @@ void GlobalIllumination::Initilize(const uvec2& giMapSize)
 		m_SurfelRendering->addDefine("WEIGHT_FUNCTIONS");
 		m_SurfelAccumulateProgram->addDefine("WEIGHT_FUNCTIONS");
 	}
-
-	m_Blur = GaussianBlur::create(5, 2.0f);
-	Fbo::Desc fboDesc;
-	m_BlurFbo = FboHelper::create2D(giMapSize.x, giMapSize.y, fboDesc);
-	m_BlurFbo->attachColorTarget(m_GIMap, 0);
 }
 
 void GlobalIllumination::RenderUI(Gui* pGui)
@@ -103,19 +225,79 @@ void GlobalIllumination::RenderUI(Gui* pGui)
 			m_SurfelCoverageVars["GlobalState"]["globalSpawnChance"] = m_SpawnChance;
 		}
 
-		//pGui->addIntVar("Ray Budget", m_SurfelAccumulateRayBudget, 0);
+		// 0 spawns every surfel at the radius of its level
+		if (pGui->addFloatVar("LOD Pixel Radius", m_SurfelLodPixelRadius, 0.0f, 128.0f))
+		{
+			ConstantBuffer::SharedPtr pCB = m_CommonData->getDefaultConstantBuffer();
+			pCB["SurfelLodPixelRadius"] = m_SurfelLodPixelRadius;
+		}
 
-		pGui->addCheckBox("Update Time", m_UpdateTime);
+		// 0 leaves the cell lists unbounded. Lowering it drains the longer lists through eviction.
+		if (pGui->addIntVar("Cell Capacity", m_SurfelCellCapacity, 0))
+		{
+			ConstantBuffer::SharedPtr pCB = m_CommonData->getDefaultConstantBuffer();
+			pCB["SurfelCellCapacity"] = uint32_t(m_SurfelCellCapacity);
+		}
+		if (pGui->addDropdown("Cell Overflow", cellOverflowList, m_SurfelCellOverflow))
+		{
+			ConstantBuffer::SharedPtr pCB = m_CommonData->getDefaultConstantBuffer();
+			pCB["SurfelCellOverflow"] = m_SurfelCellOverflow;
+		}
+
+		pGui->addIntVar("Ray Budget", m_SurfelAccumulateRayBudget, 1);
+		pGui->addCheckBox("Sample Lights By Power", m_SampleLightsByPower);
+		pGui->addDropdown("Irradiance Resampling", resampleModeList, m_ResampleMode);
+
+		if (pGui->addDropdown("World Structure", worldStructureBuildModeList, (uint32_t&)m_WorldStructureBuildMode))
+		{
+			if (m_WorldStructureBuildMode == WorldStructureBuildMode::Rebuild)
+			{
+				m_SpawnSurfel->addDefine("REBUILD_WORLD_STRUCTURE");
+			}
+			else
+			{
+				m_SpawnSurfel->removeDefine("REBUILD_WORLD_STRUCTURE");
+			}
+		}
+
+		if (pGui->addCheckBox("Bin Surfels Per Tile", m_BinSurfelsPerTile))
+		{
+			if (m_BinSurfelsPerTile)
+			{
+				m_SurfelRendering->addDefine("SURFEL_TILE_BINNING");
+			}
+			else
+			{
+				m_SurfelRendering->removeDefine("SURFEL_TILE_BINNING");
+			}
+		}
+
+		if (pGui->addDropdown("Resolution", giResolutionList, (uint32_t&)m_Resolution))
+		{
+			CreateResolutionTargets();
+		}
+		pGui->addIntVar("Max History Length", m_MaxHistoryLength, 1, 64);
+
+		// 0 upsamples the history as it is
+		pGui->addIntVar("Denoise Iterations", m_DenoiseIterations, 0, 5);
+		if (m_DenoiseIterations > 0)
+		{
+			pGui->addFloatVar("Denoise Variance Sigma", m_DenoiseVarianceSigma, 0.0f, 8.0f);
+			pGui->addFloatVar("Denoise Normal Power", m_DenoiseNormalPower, 0.0f, 256.0f);
+			pGui->addFloatVar("Denoise Distance Sigma", m_DenoiseDistanceSigma, 0.001f, 1.0f);
+		}
 
 		if (pGui->addCheckBox("Visualize Surfels", m_VisualizeSurfels))
 		{
 			if (m_VisualizeSurfels)
 			{
 				m_SurfelRendering->addDefine("VISUALIZE");
+				m_UpsampleGI->addDefine("VISUALIZE");
 			}
 			else
 			{
 				m_SurfelRendering->removeDefine("VISUALIZE");
+				m_UpsampleGI->removeDefine("VISUALIZE");
 			}
 		}
 	
@@ -135,28 +317,111 @@ void GlobalIllumination::RenderUI(Gui* pGui)
 		//	}
 		//}
 
-		//pGui->addCheckBox("Apply Blur", m_ApplyBlur);
-		//if (m_ApplyBlur)
-		//{
-		//	m_Blur->renderUI(pGui, "Blur Settings");
-
-		//}
-
 		if (pGui->beginGroup("Statistics"))
 		{
-			auto totalSurfelsSize = sizeof(Surfel) * m_MaxSurfels;
+			auto totalSurfelsSize = SURFEL_PACKED_SIZE * m_MaxSurfels;
 			std::string totalSurfelsSizeInMB = "Surfel Data: " + std::to_string(float(totalSurfelsSize) / (1024 * 1024)) + " MB";
 			pGui->addText(totalSurfelsSizeInMB.c_str());
-
-			if (pGui->addIntVar("Max Surfels", m_MaxSurfels, 0))
+			auto unpackedSurfelsSize = sizeof(Surfel) * m_MaxSurfels;
+			std::string packingSavingInMB = "Saved by Packing: " + std::to_string(float(unpackedSurfelsSize - totalSurfelsSize) / (1024 * 1024)) + " MB";
+			pGui->addText(packingSavingInMB.c_str());
+			std::string reservoirsSizeInMB = "Reservoirs: " + std::to_string(float(2 * m_SurfelReservoirs->getSize()) / (1024 * 1024)) + " MB";
+			pGui->addText(reservoirsSizeInMB.c_str());
+			std::string giTargetsSizeInMB = "GI Targets: " + std::to_string(float(GetGITargetsSize()) / (1024 * 1024)) + " MB";
+			pGui->addText(giTargetsSizeInMB.c_str());
+
+			std::string surfelIndicesSizeInMB = "Index Buffers: " + std::to_string(float(2 * m_SurfelIndices[0]->getSize()) / (1024 * 1024)) + " MB";
+			pGui->addText(surfelIndicesSizeInMB.c_str());
+
+			// A larger storage is grown at the start of the next frame with the surfels copied over, it needs a render context.
+			// A smaller one starts over.
+			if (pGui->addIntVar("Max Surfels", m_MaxSurfels, 1024, 8 * 1024 * 1024) && uint32_t(m_MaxSurfels) < m_SurfelGeometry->getElementCount())
 			{
 				ResetGI();
 			}
 
-			uint32_t count;
-			m_SurfelCount->getVariable(0, 0, count);
-			pGui->addText((std::string("Surfel Count: ") + std::to_string(count)).c_str());
-			//m_Surfels->renderUI(pGui, "Surfels Data");
+			// Lagging kSurfelCountReadbackLatency frames behind the GPU
+			pGui->addText((std::string("Surfel Count: ") + std::to_string(m_LaggedSurfelCount)).c_str());
+			pGui->addText((std::string("Free Surfels: ") + std::to_string(m_LaggedFreeSurfelCount)).c_str());
+			pGui->addText((std::string("Index Entries: ") + std::to_string(m_LaggedIndexCount)
+				+ " / " + std::to_string(m_SurfelIndices[0]->getElementCount())).c_str());
+			const GIFrameStatistics& statistics = m_LaggedStatistics;
+			pGui->addText((std::string("Spawned / Evicted: ") + std::to_string(statistics.SpawnedSurfels)
+				+ " / " + std::to_string(statistics.EvictedSurfels)).c_str());
+			pGui->addText((std::string("Traced Rays: ") + std::to_string(statistics.TracedRays)).c_str());
+			pGui->addText((std::string("Overflowed Spawns: ") + std::to_string(statistics.OverflowedSpawns)).c_str());
+
+			pGui->addCheckBox("Collect Cell And Pixel Statistics", m_CollectStatistics);
+			if (m_CollectStatistics)
+			{
+				pGui->addText((std::string("Occupied Cells: ") + std::to_string(statistics.OccupiedCells)).c_str());
+				pGui->addText((std::string("Cell List Length: ") + std::to_string(statistics.GetAverageCellListLength())
+					+ " average, " + std::to_string(statistics.MaxCellListLength) + " max").c_str());
+				for (uint32_t bin = 0; bin < GI_STATISTICS_CANDIDATE_BIN_COUNT; ++bin)
+				{
+					const uint32_t binStart = GIFrameStatistics::GetCandidateBinStart(bin);
+					const std::string binRange = bin + 1 == GI_STATISTICS_CANDIDATE_BIN_COUNT ? std::to_string(binStart) + "+"
+						: (bin < 2 ? std::to_string(binStart) : std::to_string(binStart) + "-" + std::to_string(2 * binStart - 1));
+					pGui->addText(("Pixels With " + binRange + " Candidates: " + std::to_string(statistics.CandidateHistogram[bin])).c_str());
+				}
+			}
+
+			pGui->addCheckBox("Record Statistics", m_RecordStatistics);
+			pGui->addText((std::string("Recorded Frames: ") + std::to_string(m_StatisticsLog.GetFrames().size())).c_str());
+			if (pGui->addButton("Dump CSV"))
+			{
+				m_StatisticsLog.WriteCsv(m_StatisticsPath + ".csv");
+			}
+			if (pGui->addButton("Dump JSON", true))
+			{
+				m_StatisticsLog.WriteJson(m_StatisticsPath + ".json");
+			}
+			if (pGui->addButton("Clear", true))
+			{
+				m_StatisticsLog.Clear();
+			}
+			//m_SurfelGeometry->renderUI(pGui, "Surfels Data");
+			pGui->endGroup();
+		}
+
+		if (pGui->beginGroup("Eviction"))
+		{
+			if (pGui->addIntVar("Max Unseen Frames", m_MaxUnseenFrames, 1))
+			{
+				m_EvictSurfelsVars["EvictionState"]["maxUnseenFrames"] = uint32_t(m_MaxUnseenFrames);
+			}
+			if (pGui->addIntVar("Max Surfel Age", m_MaxSurfelAge, 0))
+			{
+				m_EvictSurfelsVars["EvictionState"]["maxAge"] = uint32_t(m_MaxSurfelAge);
+			}
+			if (pGui->addFloatVar("Max Surfel Coverage", m_MaxSurfelCoverage, 0.0f))
+			{
+				m_EvictSurfelsVars["EvictionState"]["maxCoverage"] = m_MaxSurfelCoverage;
+			}
+			pGui->addCheckBox("Invalidate Moved Instances", m_InvalidateMovedInstances);
+			pGui->addText((std::string("Invalidation Boxes: ") + std::to_string(m_InvalidationBoxCount)).c_str());
+			pGui->addIntVar("Compaction Interval", m_CompactionInterval, 1);
+			// Surfels sorted into Morton order per frame, 0 leaves them in spawn order
+			if (pGui->addIntVar("Defragment Window", m_DefragmentWindow, 0, m_MaxSurfels))
+			{
+				CreateDefragmentBuffers();
+			}
+			pGui->endGroup();
+		}
+
+		if (pGui->beginGroup("Surfel Cache"))
+		{
+			pGui->addCheckBox("Load And Save With Scene", m_UseSurfelCache);
+			pGui->addText(m_SurfelCachePath.c_str());
+			if (pGui->addButton("Save"))
+			{
+				// Needs a render context, done at the start of the next frame
+				m_SaveSurfelCacheRequested = true;
+			}
+			if (pGui->addButton("Load", true))
+			{
+				ReadSurfelCache();
+			}
 			pGui->endGroup();
 		}
 
@@ -171,25 +436,128 @@ void GlobalIllumination::RenderUI(Gui* pGui)
 
 void GlobalIllumination::ResetGI()
 {
-	auto var = m_CommonData->getReflection()->getResource("Surfels.Storage");
-	m_Surfels = StructuredBuffer::create(var->getName(), var->getType()->unwrapArray()->asResourceType()->inherit_shared_from_this::shared_from_this(), m_MaxSurfels);
-
-	m_CommonData->setStructuredBuffer("Surfels.Storage", m_Surfels);
+	m_SurfelGeometry = CreateSurfelsBuffer("Surfels.Geometry", m_MaxSurfels);
+	m_SurfelIrradiance = CreateSurfelsBuffer("Surfels.Irradiance", m_MaxSurfels);
+	m_SurfelEstimator = CreateSurfelsBuffer("Surfels.Estimator", m_MaxSurfels);
+	m_SurfelState = CreateSurfelsBuffer("Surfels.State", m_MaxSurfels);
+	m_SurfelReservoirs = CreateSurfelsBuffer("Surfels.Reservoirs", m_MaxSurfels);
 
 	auto varCount = m_CommonData->getReflection()->getResource("Surfels.Count");
-	m_SurfelCount = StructuredBuffer::create(varCount->getName(), varCount->getType()->unwrapArray()->asResourceType()->inherit_shared_from_this::shared_from_this(), 1);
-	uint32_t count = 0;
-	m_SurfelCount->setBlob(&count, 0, sizeof(uint32_t));
+	m_SurfelCount = StructuredBuffer::create(varCount->getName(), varCount->getType()->unwrapArray()->asResourceType()->inherit_shared_from_this::shared_from_this(), SURFEL_COUNT_SIZE);
+	uint32_t counts[SURFEL_COUNT_SIZE] = {};
+	m_SurfelCount->setBlob(counts, 0, sizeof(counts));
 	m_CommonData->setStructuredBuffer("Surfels.Count", m_SurfelCount);
-	m_CommonData->setTexture("DebugTexture", m_DebugTexture);
 
-	// TODO: this size is wrong and is probably bugy!!!
-	m_SurfelIndices[0] = StructuredBuffer::create(m_UpdateWorldStructure, "gNewSurfelIndices", m_MaxSurfels);
-	m_SurfelIndices[1] = StructuredBuffer::create(m_UpdateWorldStructure, "gNewSurfelIndices", m_MaxSurfels);
+	m_FreeSurfelIndices = CreateSurfelsBuffer("Surfels.FreeIndices", m_MaxSurfels);
+
+	CreateSurfelScratchBuffers();
+	m_FramesSinceCompaction = 0;
+
+	m_SurfelCountReadbackFrame = 0;
+	m_LaggedSurfelCount = 0;
+	m_LaggedFreeSurfelCount = 0;
+	m_LaggedIndexCount = 0;
+
+	// A surfel is listed in every cell its sphere reaches, the buffers grow from there as the lists fill up
+	m_SurfelIndices[0] = StructuredBuffer::create(m_UpdateWorldStructure, "gNewSurfelIndices", m_MaxSurfels * SURFEL_INITIAL_INDICES_PER_SURFEL);
+	m_SurfelIndices[1] = StructuredBuffer::create(m_UpdateWorldStructure, "gNewSurfelIndices", m_MaxSurfels * SURFEL_INITIAL_INDICES_PER_SURFEL);
+	m_RelistSurfels = false;
 
 	std::vector<WorldStructureChunk> tempData(WORLD_STRUCTURE_TOTAL_SIZE);
 	memset(tempData.data(), 0, tempData.size() * sizeof(WorldStructureChunk));
 	m_WorldStructure->updateData(tempData.data(), 0, tempData.size() * sizeof(WorldStructureChunk));
+
+	const WorldCellKey emptyKey = { WORLD_STRUCTURE_EMPTY_KEY, WORLD_STRUCTURE_PENDING_COORDS };
+	std::vector<WorldCellKey> emptyKeys(WORLD_STRUCTURE_TOTAL_SIZE, emptyKey);
+	m_WorldStructureKeys->updateData(emptyKeys.data(), 0, emptyKeys.size() * sizeof(WorldCellKey));
+}
+
+void GlobalIllumination::CreateSurfelScratchBuffers()
+{
+	// Compaction scans the whole storage, pad it to whole 64 thread groups
+	m_SurfelAlive = StructuredBuffer::create(m_MarkAliveSurfels, "gAlive", GetSurfelScanSize());
+	m_ScannedSurfelAlive = StructuredBuffer::create(m_MarkAliveSurfels, "gAlive", GetSurfelScanSize());
+	m_SurfelRemap = StructuredBuffer::create(m_MarkAliveSurfels, "gRemap", m_MaxSurfels);
+	m_CompactSurfelsVars->setStructuredBuffer("gAlive", m_SurfelAlive);
+	m_CompactSurfelsVars->setStructuredBuffer("gScannedAlive", m_ScannedSurfelAlive);
+	m_CompactSurfelsVars->setStructuredBuffer("gRemap", m_SurfelRemap);
+	CreateDefragmentBuffers();
+
+	m_SurfelRayWeights = StructuredBuffer::create(m_ScheduleSurfelRays, "gRayWeights", GetSurfelScanSize());
+	m_ScannedSurfelRayWeights = StructuredBuffer::create(m_ScheduleSurfelRays, "gRayWeights", GetSurfelScanSize());
+	m_ScheduleSurfelRaysVars->setStructuredBuffer("gRayWeights", m_SurfelRayWeights);
+
+	// Same element type as Surfels.Reservoirs, only bound to the ray generation shader
+	auto varReservoirs = m_CommonData->getReflection()->getResource("Surfels.Reservoirs");
+	m_PreviousSurfelReservoirs = StructuredBuffer::create("gPreviousReservoirs", varReservoirs->getType()->unwrapArray()->asResourceType()->inherit_shared_from_this::shared_from_this(), m_MaxSurfels);
+
+	m_SurfelEvicted = StructuredBuffer::create(m_SelectEvictedSurfels, "gSurfelEvicted", m_MaxSurfels);
+	m_EvictSurfelsVars->setStructuredBuffer("gSurfelEvicted", m_SurfelEvicted);
+}
+
+void GlobalIllumination::GrowSurfelStorage(RenderContext* pContext)
+{
+	// Surfels keep their indices, so the counts, the free stack and the cell lists stay valid as they are
+	auto grow = [&](StructuredBuffer::SharedPtr& pBuffer, const std::string& name)
+	{
+		StructuredBuffer::SharedPtr pGrownBuffer = CreateSurfelsBuffer(name, m_MaxSurfels);
+		pContext->copyBufferRegion(pGrownBuffer.get(), 0, pBuffer.get(), 0, pBuffer->getSize());
+		pBuffer = pGrownBuffer;
+	};
+	grow(m_SurfelGeometry, "Surfels.Geometry");
+	grow(m_SurfelIrradiance, "Surfels.Irradiance");
+	grow(m_SurfelEstimator, "Surfels.Estimator");
+	grow(m_SurfelState, "Surfels.State");
+	grow(m_SurfelReservoirs, "Surfels.Reservoirs");
+	grow(m_FreeSurfelIndices, "Surfels.FreeIndices");
+	CreateSurfelScratchBuffers();
+
+	logInfo("Grew the surfel storage to " + std::to_string(m_MaxSurfels) + " surfels");
+}
+
+void GlobalIllumination::CreateResolutionTargets()
+{
+	// Everything shading reads or writes per GI pixel. m_GIMap stays at the G-buffer size for ApplyAOGI and so does
+	// m_Coverage, spawning from fewer pixels would place fewer surfels.
+	const uint32_t shift = uint32_t(m_Resolution);
+	const uvec2 outputSize = uvec2(m_GIMap->getWidth(), m_GIMap->getHeight());
+	m_GIMapSize = (outputSize + uvec2((1u << shift) - 1)) >> shift;
+	ConstantBuffer::SharedPtr pCB = m_CommonData->getDefaultConstantBuffer();
+	pCB["ResolutionShift"] = shift;
+
+	m_Irradiance = Texture::create2D(m_GIMapSize.x, m_GIMapSize.y, ResourceFormat::RGBA16Float, 1, 1, nullptr, Resource::BindFlags::UnorderedAccess | Resource::BindFlags::ShaderResource);
+	m_DebugTexture = Texture::create2D(m_GIMapSize.x, m_GIMapSize.y, ResourceFormat::RGBA16Float, 1, 1, nullptr, Resource::BindFlags::UnorderedAccess | Resource::BindFlags::ShaderResource);
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		m_IrradianceHistory[i] = Texture::create2D(m_GIMapSize.x, m_GIMapSize.y, ResourceFormat::RGBA16Float, 1, 1, nullptr, Resource::BindFlags::UnorderedAccess | Resource::BindFlags::ShaderResource);
+		m_HistoryGeometry[i] = Texture::create2D(m_GIMapSize.x, m_GIMapSize.y, ResourceFormat::RGBA16Float, 1, 1, nullptr, Resource::BindFlags::UnorderedAccess | Resource::BindFlags::ShaderResource);
+		m_DenoiseTargets[i] = Texture::create2D(m_GIMapSize.x, m_GIMapSize.y, ResourceFormat::RGBA16Float, 1, 1, nullptr, Resource::BindFlags::UnorderedAccess | Resource::BindFlags::ShaderResource);
+	}
+	m_ClearHistory = true;
+	m_CommonData->setTexture("DebugTexture", m_DebugTexture);
+	m_SurfelRenderingVars->setTexture("gIrradiance", m_Irradiance);
+	m_TemporalAccumulateVars->setTexture("gIrradiance", m_Irradiance);
+	m_TemporalAccumulateVars->setTexture("gDenoiseInput", m_DenoiseTargets[0]);
+
+	m_TileCount = (m_GIMapSize + uvec2(SURFEL_TILE_SIZE - 1)) / uvec2(SURFEL_TILE_SIZE);
+	m_TileSurfels = StructuredBuffer::create(m_BinSurfels, "gTileSurfels", m_TileCount.x * m_TileCount.y * SURFEL_TILE_MAX_SURFELS);
+	m_TileSurfelCounts = StructuredBuffer::create(m_BinSurfels, "gTileSurfelCounts", m_TileCount.x * m_TileCount.y);
+	m_BinSurfelsVars->setStructuredBuffer("gTileSurfels", m_TileSurfels);
+	m_BinSurfelsVars->setStructuredBuffer("gTileSurfelCounts", m_TileSurfelCounts);
+	m_SurfelRenderingVars->setStructuredBuffer("gTileSurfels", m_TileSurfels);
+	m_SurfelRenderingVars->setStructuredBuffer("gTileSurfelCounts", m_TileSurfelCounts);
+}
+
+uint64_t GlobalIllumination::GetGITargetsSize() const
+{
+	uint64_t size = 0;
+	for (const Texture* pTexture : { m_GIMap.get(), m_Coverage.get(), m_Irradiance.get(), m_DebugTexture.get(),
+		m_IrradianceHistory[0].get(), m_IrradianceHistory[1].get(), m_HistoryGeometry[0].get(), m_HistoryGeometry[1].get(),
+		m_DenoiseTargets[0].get(), m_DenoiseTargets[1].get() })
+	{
+		size += uint64_t(pTexture->getWidth()) * pTexture->getHeight() * getFormatBytesPerBlock(pTexture->getFormat());
+	}
+	return size;
 }
 
 Texture::SharedPtr GlobalIllumination::GenerateGIMap(RenderContext* pContext,
@@ -198,7 +566,8 @@ Texture::SharedPtr GlobalIllumination::GenerateGIMap(RenderContext* pContext,
 	const Camera* pCamera,
 	const Texture::SharedPtr& pDepthTexture,
 	const Texture::SharedPtr& pNormalTexture,
-	const Texture::SharedPtr& pAlbedoTexture)
+	const Texture::SharedPtr& pAlbedoTexture,
+	const Texture::SharedPtr& pMotionTexture)
 {
 	// Prepare common data
 	m_CommonData->setTexture("GBuffer.Normal", pNormalTexture);
@@ -210,17 +579,41 @@ Texture::SharedPtr GlobalIllumination::GenerateGIMap(RenderContext* pContext,
 
 	m_CommonData->setStructuredBuffer("Surfels.Indices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
 
+	// Surfels near the edge of a clipmap window change level when it scrolls. The incremental update keeps them
+	// in the cells of the level they were listed at, so that frame every surfel is listed again at its current level.
+	const ivec3 clipmapCameraCell = ivec3(glm::floor(pCamera->getPosition() / WORLD_STRUCTURE_CHUNK_SIZE));
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental && clipmapCameraCell != m_ClipmapCameraCell)
+	{
+		m_RelistSurfels = true;
+	}
+	m_ClipmapCameraCell = clipmapCameraCell;
+
+	if (m_SaveSurfelCacheRequested)
+	{
+		m_SaveSurfelCacheRequested = false;
+		WriteSurfelCache(pContext);
+	}
+
+	if (uint32_t(m_MaxSurfels) > m_SurfelGeometry->getElementCount())
+	{
+		GrowSurfelStorage(pContext);
+	}
+
 	// Reset counter
 	uint32_t zero = 0;
 	m_SurfelSpawnCoords->getUAVCounter()->updateData(&zero, 0, sizeof(zero));
+	m_ReservedSurfelCount->setBlob(&zero, 0, sizeof(zero));
+	const uint32_t zeroStatistics[GI_STATISTICS_SIZE] = {};
+	m_Statistics->setBlob(zeroStatistics, 0, sizeof(zeroStatistics));
+
+	UpdateInvalidationBoxes(pSceneRenderer->getScene());
+	UpdateLightAliasTable(pSceneRenderer->getScene());
+	EvictSurfels(pContext);
 
 	// New Surfel Placement
 	// Compute Coverage
 	m_SurfelCoverageVars->setTexture("gCoverage", m_Coverage);
-	if (m_UpdateTime)
-	{
-		m_SurfelCoverageVars["GlobalState"]["globalTime"] = float(currentTime);
-	}
+	m_SurfelCoverageVars["GlobalState"]["frameIndex"] = uint32_t(m_FrameIndex);
 
 	m_ComputeState->setProgram(m_SurfelCoverage);
 	pContext->pushComputeState(m_ComputeState);
@@ -230,22 +623,29 @@ Texture::SharedPtr GlobalIllumination::GenerateGIMap(RenderContext* pContext,
 
 	pContext->popComputeVars();
 
-	pContext->copyBufferRegion(m_NewSurfelCountBuffer.get(), 0, m_SurfelSpawnCoords->getUAVCounter().get(), 0, sizeof(uint32_t));
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		UpdateWorldStructure(pContext);
+	}
 
-	ExclusiveScan(pContext);
+	if (++m_FramesSinceCompaction >= uint32_t(m_CompactionInterval))
+	{
+		CompactSurfels(pContext);
+		m_FramesSinceCompaction = 0;
+	}
 
-	m_UpdateWorldStructureVars->setStructuredBuffer("gOldSurfelIndices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
-	m_UpdateWorldStructureVars->setStructuredBuffer("gNewSurfelIndices", m_SurfelIndices[(m_CurrentSurfelIndicesBuffer + 1) % 2]);
-	m_CurrentSurfelIndicesBuffer = (m_CurrentSurfelIndicesBuffer + 1) % 2;
-	m_ComputeState->setProgram(m_UpdateWorldStructure);
-	pContext->pushComputeVars(m_UpdateWorldStructureVars);
+	if (m_DefragmentWindow > 0)
+	{
+		DefragmentSurfels(pContext);
+	}
 
-	pContext->dispatch(WORLD_STRUCTURE_DIMENSION, WORLD_STRUCTURE_DIMENSION, WORLD_STRUCTURE_DIMENSION);
+	pContext->copyBufferRegion(m_SpawnCounts.get(), 0, m_SurfelCount.get(), 0, sizeof(uint32_t) * SURFEL_COUNT_SIZE);
 
+	m_ComputeState->setProgram(m_PrepareSpawnSurfel);
+	pContext->pushComputeVars(m_PrepareSpawnSurfelVars);
+	pContext->dispatch(1, 1, 1);
 	pContext->popComputeVars();
 
-	m_CommonData->setStructuredBuffer("Surfels.Indices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
-
 	m_SpawnSurfelVars->setStructuredBuffer("gIndices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
 	m_ComputeState->setProgram(m_SpawnSurfel);
 	pContext->pushComputeVars(m_SpawnSurfelVars);
@@ -254,18 +654,32 @@ Texture::SharedPtr GlobalIllumination::GenerateGIMap(RenderContext* pContext,
 
 	pContext->popComputeVars();
 
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Rebuild || m_RelistSurfels)
+	{
+		RebuildWorldStructure(pContext);
+		m_RelistSurfels = false;
+	}
+
+	// Capped cell lists are walked directly, see GetIrradianceFromTile
+	if (m_BinSurfelsPerTile && !m_VisualizeSurfels && m_SurfelCellCapacity == 0)
+	{
+		BinSurfels(pContext);
+	}
+
 	m_ComputeState->setProgram(m_SurfelRendering);
 	pContext->pushComputeVars(m_SurfelRenderingVars);
-	pContext->dispatch(m_Coverage->getWidth() / 8, m_Coverage->getHeight() / 8, 1);
+	pContext->dispatch((m_GIMapSize.x + 7) / 8, (m_GIMapSize.y + 7) / 8, 1);
 	pContext->popComputeVars();
 
-	pContext->popComputeState();
-
-	if (m_ApplyBlur)
+	if (m_CollectStatistics)
 	{
-		m_Blur->execute(pContext, m_GIMap, m_BlurFbo);
+		CollectStatistics(pContext);
 	}
 
+	pContext->popComputeState();
+
+	ResolveGI(pContext, pMotionTexture);
+
 	// RT Update
 	auto currentScene = std::static_pointer_cast<RtScene>(pSceneRenderer->getScene());
 	if (!m_SurfelAccumulateVars ||
@@ -283,16 +697,26 @@ Texture::SharedPtr GlobalIllumination::GenerateGIMap(RenderContext* pContext,
 		m_SurfelAccumulateVars->getRayGenVars()->getDefaultBlock()->setSrv(loc, 0, m_CachedScene->getTlasSrv(m_SurfelAccumulateVars->getHitProgramsCount()));
 	}
 
-	if (m_UpdateTime)
+	auto& rayGenVars = const_cast<GraphicsVars::SharedPtr&>(m_SurfelAccumulateVars->getRayGenVars());
+	rayGenVars["GlobalState"]["frameIndex"] = uint32_t(m_FrameIndex);
+
+	ScheduleSurfelRays(pContext);
+
+	const uint32_t rayBudget = uint32_t(std::max(m_SurfelAccumulateRayBudget, 1));
+	rayGenVars["GlobalState"]["rayBudget"] = rayBudget;
+	rayGenVars->setStructuredBuffer("gRayWeights", m_SurfelRayWeights);
+	rayGenVars->setStructuredBuffer("gScannedRayWeights", m_ScannedSurfelRayWeights);
+	rayGenVars["GlobalState"]["resampleMode"] = m_ResampleMode;
+	if (m_ResampleMode == SURFEL_RESAMPLE_SPATIOTEMPORAL)
 	{
-		const_cast<GraphicsVars::SharedPtr&>(m_SurfelAccumulateVars->getRayGenVars())["GlobalState"]["globalTime"] = float(currentTime);
+		pContext->copyResource(m_PreviousSurfelReservoirs.get(), m_SurfelReservoirs.get());
 	}
+	rayGenVars->setStructuredBuffer("gPreviousReservoirs", m_PreviousSurfelReservoirs);
 
-	// TODO: add budget actually !
-	uint32_t count;
-	m_SurfelCount->getVariable(0, 0, count);
+	pSceneRenderer->renderScene(pContext, m_SurfelAccumulateVars, m_RTState, { rayBudget, 1, 1});
 
-	pSceneRenderer->renderScene(pContext, m_SurfelAccumulateVars, m_RTState, { count, 1, 1});
+	ReadbackSurfelCounts(pContext);
+	GrowSurfelIndices(pContext, m_LaggedIndexCount);
 
 	if (!m_ApplyGI)
 	{
@@ -302,30 +726,581 @@ Texture::SharedPtr GlobalIllumination::GenerateGIMap(RenderContext* pContext,
 	return m_GIMap;
 }
 
-void GlobalIllumination::ExclusiveScan(RenderContext* pContext)
+StructuredBuffer::SharedPtr GlobalIllumination::CreateSurfelsBuffer(const std::string& name, uint32_t elementCount)
+{
+	auto var = m_CommonData->getReflection()->getResource(name);
+	auto buffer = StructuredBuffer::create(var->getName(), var->getType()->unwrapArray()->asResourceType()->inherit_shared_from_this::shared_from_this(), elementCount);
+	m_CommonData->setStructuredBuffer(name, buffer);
+	return buffer;
+}
+
+uint32_t GlobalIllumination::GetSurfelScanSize() const
+{
+	return ((uint32_t(m_MaxSurfels) + 63) / 64) * 64;
+}
+
+namespace
+{
+	void AddInvalidationBox(std::vector<SurfelInvalidationBox>& boxes, const BoundingBox& bounds)
+	{
+		const SurfelInvalidationBox box = { bounds.getMinPos(), bounds.getMaxPos() };
+		if (boxes.size() < SURFEL_MAX_INVALIDATION_BOXES)
+		{
+			boxes.push_back(box);
+		}
+		else
+		{
+			boxes.back().Min = glm::min(boxes.back().Min, box.Min);
+			boxes.back().Max = glm::max(boxes.back().Max, box.Max);
+		}
+	}
+}
+
+void GlobalIllumination::UpdateInvalidationBoxes(const Scene::SharedPtr& pScene)
+{
+	// Instances are matched by their order in the scene. Nothing is invalidated on the first frame of a scene,
+	// its surfels come from a reset or the surfel cache.
+	const bool sameScene = pScene == m_InvalidationScene;
+	m_InvalidationScene = pScene;
+
+	std::vector<SurfelInvalidationBox> boxes;
+	std::vector<BoundingBox> instanceBounds;
+	for (uint32_t modelID = 0; modelID < pScene->getModelCount(); ++modelID)
+	{
+		// Skinned meshes deform inside bounds that may not change, an animated model is invalidated every frame
+		const bool animated = pScene->getModel(modelID)->hasAnimations();
+		for (uint32_t instanceID = 0; instanceID < pScene->getModelInstanceCount(modelID); ++instanceID)
+		{
+			const BoundingBox& bounds = pScene->getModelInstance(modelID, instanceID)->getBoundingBox();
+			const size_t instanceIndex = instanceBounds.size();
+			instanceBounds.push_back(bounds);
+			if (!sameScene)
+				continue;
+
+			if (instanceIndex >= m_InstanceBounds.size())
+			{
+				AddInvalidationBox(boxes, bounds);
+				continue;
+			}
+
+			const BoundingBox& previous = m_InstanceBounds[instanceIndex];
+			if (animated || previous.center != bounds.center || previous.extent != bounds.extent)
+			{
+				AddInvalidationBox(boxes, previous);
+				AddInvalidationBox(boxes, bounds);
+			}
+		}
+	}
+	// Removed instances
+	for (size_t instanceIndex = instanceBounds.size(); sameScene && instanceIndex < m_InstanceBounds.size(); ++instanceIndex)
+	{
+		AddInvalidationBox(boxes, m_InstanceBounds[instanceIndex]);
+	}
+	m_InstanceBounds = std::move(instanceBounds);
+
+	m_InvalidationBoxCount = m_InvalidateMovedInstances ? uint32_t(boxes.size()) : 0;
+	if (m_InvalidationBoxCount != 0)
+	{
+		m_InvalidationBoxes->setBlob(boxes.data(), 0, sizeof(SurfelInvalidationBox) * m_InvalidationBoxCount);
+	}
+	m_EvictSurfelsVars["EvictionState"]["invalidationBoxCount"] = m_InvalidationBoxCount;
+}
+
+void GlobalIllumination::UpdateLightAliasTable(const Scene::SharedPtr& pScene)
 {
+	// One table serves every surfel, so lights are weighted by their power and not by how far they are from the hit
+	std::vector<float> weights(pScene->getLightCount(), 1.0f);
+	for (uint32_t lightID = 0; m_SampleLightsByPower && lightID < pScene->getLightCount(); ++lightID)
+	{
+		const Light::SharedPtr& pLight = pScene->getLight(lightID);
+		weights[lightID] = GetLightSamplingWeight(pLight->getPower(), pLight->getData().intensity);
+	}
+	if (weights.empty() || weights == m_LightWeights)
+		return;
+	m_LightWeights = weights;
+
+	const std::vector<LightAliasEntry> table = BuildLightAliasTable(weights);
+	if (m_LightAliasTable->getElementCount() < table.size())
+	{
+		m_LightAliasTable = CreateSurfelsBuffer("LightAliasTable", uint32_t(table.size()));
+	}
+	m_LightAliasTable->setBlob(table.data(), 0, sizeof(LightAliasEntry) * table.size());
+}
+
+void GlobalIllumination::EvictSurfels(RenderContext* pContext)
+{
+	// Retires unseen, old, over covered, invalidated and unlisted surfels and pushes their indices on the free stack.
+	// They stay listed in the world structure until UpdateWorldStructure drops them this frame.
+	// Every surfel is decided on first, the second pass applies the decisions.
+	// A frame that lists every surfel again keeps the ones whose level has no cell for them yet.
+	const bool evictUnlisted = m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental && !m_RelistSurfels;
+	m_EvictSurfelsVars["EvictionState"]["evictUnlisted"] = evictUnlisted ? 1u : 0u;
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_EvictSurfelsVars);
+	m_ComputeState->setProgram(m_SelectEvictedSurfels);
+	pContext->dispatch((m_MaxSurfels + 63) / 64, 1, 1);
+	m_ComputeState->setProgram(m_EvictSurfels);
+	pContext->dispatch((m_MaxSurfels + 63) / 64, 1, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+}
+
+void GlobalIllumination::UpdateWorldStructure(RenderContext* pContext)
+{
+	PROFILE("updateWorldStructure");
+
+	// Per cell list size changes are scanned into the new list layout, then every list is copied over
+	// without its evicted surfels and with room for this frame's spawns
+	m_ComputeState->setProgram(m_CountEvictedSurfels);
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_EvictSurfelsVars);
+	pContext->dispatch(WORLD_STRUCTURE_TOTAL_SIZE / 64, 1, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+
+	m_Primitives.ExclusiveScan(pContext, m_SurfelCountDeltas, m_ScannedSurfelCountDeltas, WORLD_STRUCTURE_TOTAL_SIZE);
+
+	m_UpdateWorldStructureVars->setStructuredBuffer("gOldSurfelIndices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
+	m_UpdateWorldStructureVars->setStructuredBuffer("gNewSurfelIndices", m_SurfelIndices[(m_CurrentSurfelIndicesBuffer + 1) % 2]);
+	m_CurrentSurfelIndicesBuffer = (m_CurrentSurfelIndicesBuffer + 1) % 2;
+	m_ComputeState->setProgram(m_UpdateWorldStructure);
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_UpdateWorldStructureVars);
+	pContext->dispatch(WORLD_STRUCTURE_COPY_DISPATCH_WIDTH, WORLD_STRUCTURE_TOTAL_SIZE / WORLD_STRUCTURE_COPY_DISPATCH_WIDTH, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+
+	m_CommonData->setStructuredBuffer("Surfels.Indices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
+}
+
+void GlobalIllumination::RebuildWorldStructure(RenderContext* pContext)
+{
+	PROFILE("rebuildWorldStructure");
+
+	// Lists every alive surfel again, including the ones SpawnSurfels just stored. The list layout comes from
+	// the exact per cell counts, so unlike the incremental path nothing depends on last frame's lists.
+	m_RebuildWorldStructureVars->setStructuredBuffer("gIndices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
+
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_RebuildWorldStructureVars);
+	m_ComputeState->setProgram(m_ClearCellCounts);
+	pContext->dispatch(WORLD_STRUCTURE_TOTAL_SIZE / 64, 1, 1);
+	m_ComputeState->setProgram(m_CountSurfelCells);
+	pContext->dispatch((m_MaxSurfels + 63) / 64, 1, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+
+	m_Primitives.ExclusiveScan(pContext, m_NewSurfelCounts, m_ScannedSurfelCountDeltas, WORLD_STRUCTURE_TOTAL_SIZE);
+
 	pContext->pushComputeState(m_ComputeState);
-	pContext->pushComputeVars(m_ScanVars);
+	pContext->pushComputeVars(m_RebuildWorldStructureVars);
+	m_ComputeState->setProgram(m_BeginScatter);
+	pContext->dispatch(WORLD_STRUCTURE_TOTAL_SIZE / 64, 1, 1);
+	m_ComputeState->setProgram(m_ScatterSurfelIndices);
+	pContext->dispatch((m_MaxSurfels + 63) / 64, 1, 1);
+	if (m_SurfelCellCapacity != 0)
+	{
+		m_ComputeState->setProgram(m_CapCellLists);
+		pContext->dispatch(WORLD_STRUCTURE_TOTAL_SIZE / 64, 1, 1);
+	}
+	pContext->popComputeVars();
+	pContext->popComputeState();
+}
+
+void GlobalIllumination::GrowSurfelIndices(RenderContext* pContext, uint32_t requiredCount)
+{
+	// The required count is kSurfelCountReadbackLatency frames old, GetSurfelIndexCapacity leaves headroom for the growth since
+	const uint32_t indicesSize = m_SurfelIndices[0]->getElementCount();
+	const uint32_t capacity = GetSurfelIndexCapacity(requiredCount, indicesSize, uint32_t(m_MaxSurfels));
+	if (capacity == indicesSize)
+	{
+		return;
+	}
+
+	for (auto& indices : m_SurfelIndices)
+	{
+		auto grownIndices = StructuredBuffer::create(m_UpdateWorldStructure, "gNewSurfelIndices", capacity);
+		pContext->copyBufferRegion(grownIndices.get(), 0, indices.get(), 0, indices->getSize());
+		indices = grownIndices;
+	}
+	m_CommonData->setStructuredBuffer("Surfels.Indices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
+
+	// Lists that ran past the end lost their last entries. A rebuild lists every surfel again next frame anyway,
+	// the incremental update only copies the lists and gets one rebuild to bring them back.
+	m_RelistSurfels = requiredCount > indicesSize;
+}
+
+void GlobalIllumination::BinSurfels(RenderContext* pContext)
+{
+	PROFILE("binSurfels");
+
+	m_ComputeState->setProgram(m_BinSurfels);
+	pContext->pushComputeVars(m_BinSurfelsVars);
+	pContext->dispatch(m_TileCount.x, m_TileCount.y, 1);
+	pContext->popComputeVars();
+}
+
+void GlobalIllumination::CollectStatistics(RenderContext* pContext)
+{
+	PROFILE("collectStatistics");
+
+	// The tile candidate counts are only written while binning runs
+	m_CollectStatisticsVars["StatisticsState"]["binSurfelsPerTile"] = uint32_t(m_BinSurfelsPerTile && !m_VisualizeSurfels && m_SurfelCellCapacity == 0);
+	m_CollectStatisticsVars->setStructuredBuffer("gTileSurfelCounts", m_TileSurfelCounts);
+	pContext->pushComputeVars(m_CollectStatisticsVars);
+	m_ComputeState->setProgram(m_CollectCellStatistics);
+	pContext->dispatch(WORLD_STRUCTURE_TOTAL_SIZE / 64, 1, 1);
+	m_ComputeState->setProgram(m_CollectCandidateStatistics);
+	pContext->dispatch((m_GIMapSize.x + 7) / 8, (m_GIMapSize.y + 7) / 8, 1);
+	pContext->popComputeVars();
+}
+
+void GlobalIllumination::ResolveGI(RenderContext* pContext, const Texture::SharedPtr& pMotionTexture)
+{
+	PROFILE("resolveGI");
+
+	if (m_ClearHistory)
+	{
+		m_ClearHistory = false;
+		for (auto& geometry : m_HistoryGeometry)
+		{
+			pContext->clearUAV(geometry->getUAV().get(), vec4(0.0f));
+		}
+	}
+
+	const uint32_t previousHistory = m_CurrentHistory;
+	m_CurrentHistory = (m_CurrentHistory + 1) % 2;
+	// Surfel colors are not blended over frames
+	m_TemporalAccumulateVars["ResolveState"]["maxHistoryLength"] = m_VisualizeSurfels ? 1u : uint32_t(std::max(m_MaxHistoryLength, 1));
+	m_TemporalAccumulateVars->setTexture("gMotion", pMotionTexture);
+	m_TemporalAccumulateVars->setTexture("gPrevHistory", m_IrradianceHistory[previousHistory]);
+	m_TemporalAccumulateVars->setTexture("gPrevHistoryGeometry", m_HistoryGeometry[previousHistory]);
+	m_TemporalAccumulateVars->setTexture("gHistory", m_IrradianceHistory[m_CurrentHistory]);
+	m_TemporalAccumulateVars->setTexture("gHistoryGeometry", m_HistoryGeometry[m_CurrentHistory]);
+	m_UpsampleGIVars->setTexture("gResolvedHistory", m_IrradianceHistory[m_CurrentHistory]);
+	m_UpsampleGIVars->setTexture("gResolvedHistoryGeometry", m_HistoryGeometry[m_CurrentHistory]);
+
+	m_ComputeState->setProgram(m_TemporalAccumulate);
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_TemporalAccumulateVars);
+	pContext->dispatch((m_GIMapSize.x + 7) / 8, (m_GIMapSize.y + 7) / 8, 1);
+	pContext->popComputeVars();
+
+	// Surfel colors are not filtered either
+	const uint32_t denoiseIterations = m_VisualizeSurfels ? 0u : uint32_t(std::max(m_DenoiseIterations, 0));
+	if (denoiseIterations > 0)
+	{
+		PROFILE("denoiseGI");
+		m_DenoiseGIVars->setTexture("gResolvedHistoryGeometry", m_HistoryGeometry[m_CurrentHistory]);
+		m_DenoiseGIVars["DenoiseState"]["varianceSigma"] = m_DenoiseVarianceSigma;
+		m_DenoiseGIVars["DenoiseState"]["normalPower"] = m_DenoiseNormalPower;
+		m_DenoiseGIVars["DenoiseState"]["distanceSigma"] = m_DenoiseDistanceSigma;
+		m_ComputeState->setProgram(m_DenoiseGI);
+		for (uint32_t iteration = 0; iteration < denoiseIterations; ++iteration)
+		{
+			m_DenoiseGIVars["DenoiseState"]["stepSize"] = 1u << iteration;
+			m_DenoiseGIVars->setTexture("gDenoiseSource", m_DenoiseTargets[iteration % 2]);
+			m_DenoiseGIVars->setTexture("gDenoiseTarget", m_DenoiseTargets[(iteration + 1) % 2]);
+			pContext->pushComputeVars(m_DenoiseGIVars);
+			pContext->dispatch((m_GIMapSize.x + 7) / 8, (m_GIMapSize.y + 7) / 8, 1);
+			pContext->popComputeVars();
+		}
+		m_UpsampleGIVars->setTexture("gResolvedHistory", m_DenoiseTargets[denoiseIterations % 2]);
+	}
+
+	m_ComputeState->setProgram(m_UpsampleGI);
+	pContext->pushComputeVars(m_UpsampleGIVars);
+	pContext->dispatch((m_GIMap->getWidth() + 7) / 8, (m_GIMap->getHeight() + 7) / 8, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+}
+
+void GlobalIllumination::ReadbackSurfelCounts(RenderContext* pContext)
+{
+	// Copy this frame's counts into the ring and read the oldest copy. It was written kSurfelCountReadbackLatency - 1
+	// frames ago, more than the frames Falcor keeps in flight, so mapping it does not wait on the GPU.
+	const uint32_t writeSlot = m_SurfelCountReadbackFrame % kSurfelCountReadbackLatency;
+	pContext->copyBufferRegion(m_SurfelCountReadback[writeSlot].get(), 0, m_SurfelCount.get(), 0, sizeof(uint32_t) * SURFEL_COUNT_SIZE);
+	pContext->copyBufferRegion(m_SurfelCountReadback[writeSlot].get(), sizeof(uint32_t) * SURFEL_COUNT_SIZE, m_Statistics.get(), 0, sizeof(uint32_t) * GI_STATISTICS_SIZE);
+	++m_FrameIndex;
+
+	if (++m_SurfelCountReadbackFrame >= kSurfelCountReadbackLatency)
+	{
+		const uint32_t readSlot = m_SurfelCountReadbackFrame % kSurfelCountReadbackLatency;
+		const uint32_t* counts = reinterpret_cast<const uint32_t*>(m_SurfelCountReadback[readSlot]->map(Buffer::MapType::Read));
+		m_LaggedSurfelCount = counts[SURFEL_COUNT_INDEX];
+		m_LaggedFreeSurfelCount = counts[SURFEL_FREE_COUNT_INDEX];
+		m_LaggedIndexCount = counts[SURFEL_INDEX_COUNT_INDEX];
+
+		m_LaggedStatistics.Frame = m_FrameIndex - kSurfelCountReadbackLatency;
+		m_LaggedStatistics.SurfelCount = m_LaggedSurfelCount;
+		m_LaggedStatistics.FreeSurfelCount = m_LaggedFreeSurfelCount;
+		m_LaggedStatistics.SetCounters(counts + SURFEL_COUNT_SIZE);
+		m_SurfelCountReadback[readSlot]->unmap();
+
+		if (m_RecordStatistics)
+		{
+			m_StatisticsLog.Add(m_LaggedStatistics);
+		}
+	}
+}
 
+void GlobalIllumination::LoadSurfelCache(const std::string& path)
+{
+	m_SurfelCachePath = path;
+	if (m_UseSurfelCache)
 	{
-		m_ComputeState->setProgram(m_ScanBlocks);
-		m_ScanVars->setStructuredBuffer("Input", m_NewSurfelCounts);
-		m_ScanVars->setStructuredBuffer("Result", m_ScannedNewSurfelCounts);
-		m_ScanVars->setStructuredBuffer("BlockSums", m_ScanAuxiliaryBuffer[0]);
-		pContext->dispatch(WORLD_STRUCTURE_TOTAL_SIZE / 1024, 1, 1);
+		ReadSurfelCache();
 	}
+}
+
+void GlobalIllumination::SaveSurfelCache(RenderContext* pContext)
+{
+	if (m_UseSurfelCache)
 	{
-		m_ComputeState->setProgram(m_ScanSumOfBlocks);
-		m_ScanVars->setStructuredBuffer("Input", m_ScanAuxiliaryBuffer[0]);
-		m_ScanVars->setStructuredBuffer("Result", m_ScanAuxiliaryBuffer[1]);
-		pContext->dispatch(1, 1, 1);
+		WriteSurfelCache(pContext);
 	}
+}
+
+bool GlobalIllumination::ReadSurfelCache()
+{
+	SurfelCache::UniquePtr pCache = SurfelCache::Open(m_SurfelCachePath);
+	if (!pCache)
+	{
+		return false;
+	}
+
+	// The storage grows to fit a larger cache, a smaller one is loaded into the front of it
+	const SurfelCache::Header& header = pCache->GetHeader();
+	m_MaxSurfels = std::max(m_MaxSurfels, int32_t(header.SurfelCount));
+	ResetGI();
+
+	// The sections are uploaded straight from the mapped file
+	auto upload = [&pCache](const StructuredBuffer::SharedPtr& pBuffer, SurfelCache::Section section)
 	{
-		m_ComputeState->setProgram(m_AddSumToBlocks);
-		m_ScanVars->setStructuredBuffer("Input", m_ScanAuxiliaryBuffer[1]);
-		m_ScanVars->setStructuredBuffer("Result", m_ScannedNewSurfelCounts);
-		pContext->dispatch(WORLD_STRUCTURE_TOTAL_SIZE / 1024, 1, 1);
+		if (pCache->GetSectionSize(section) > 0)
+		{
+			pBuffer->updateData(pCache->GetSection(section), 0, size_t(pCache->GetSectionSize(section)));
+		}
+	};
+	upload(m_SurfelGeometry, SurfelCache::Section::Geometry);
+	upload(m_SurfelIrradiance, SurfelCache::Section::Irradiance);
+	upload(m_SurfelEstimator, SurfelCache::Section::Estimator);
+	upload(m_SurfelState, SurfelCache::Section::State);
+	upload(m_FreeSurfelIndices, SurfelCache::Section::FreeIndices);
+	upload(m_WorldStructure, SurfelCache::Section::WorldStructure);
+	upload(m_WorldStructureKeys, SurfelCache::Section::WorldStructureKeys);
+
+	// Sized like GrowSurfelIndices does, the first frames list and spawn before the grown count is read back
+	const uint32_t indexCapacity = GetSurfelIndexCapacity(header.IndexCount, m_SurfelIndices[0]->getElementCount(), uint32_t(m_MaxSurfels));
+	if (indexCapacity > m_SurfelIndices[0]->getElementCount())
+	{
+		for (auto& indices : m_SurfelIndices)
+		{
+			indices = StructuredBuffer::create(m_UpdateWorldStructure, "gNewSurfelIndices", indexCapacity);
+		}
 	}
+	upload(m_SurfelIndices[m_CurrentSurfelIndicesBuffer], SurfelCache::Section::Indices);
+	m_CommonData->setStructuredBuffer("Surfels.Indices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
+
+	uint32_t counts[SURFEL_COUNT_SIZE] = {};
+	counts[SURFEL_COUNT_INDEX] = header.SurfelCount;
+	counts[SURFEL_FREE_COUNT_INDEX] = header.FreeSurfelCount;
+	counts[SURFEL_INDEX_COUNT_INDEX] = header.IndexCount;
+	m_SurfelCount->setBlob(counts, 0, sizeof(counts));
+	m_LaggedSurfelCount = header.SurfelCount;
+	m_LaggedFreeSurfelCount = header.FreeSurfelCount;
+	m_LaggedIndexCount = header.IndexCount;
+
+	// The cells were listed around the camera at save time, the incremental update would release or evict what moved
+	m_RelistSurfels = true;
+
+	logInfo("Loaded " + std::to_string(header.SurfelCount) + " surfels from " + m_SurfelCachePath);
+	return true;
+}
+
+void GlobalIllumination::WriteSurfelCache(RenderContext* pContext)
+{
+	if (m_SurfelCachePath.empty())
+	{
+		return;
+	}
+
+	// The section sizes depend on the counts, so they are read back first
+	auto pCountReadback = Buffer::create(sizeof(uint32_t) * SURFEL_COUNT_SIZE, Resource::BindFlags::None, Buffer::CpuAccess::Read);
+	pContext->copyBufferRegion(pCountReadback.get(), 0, m_SurfelCount.get(), 0, sizeof(uint32_t) * SURFEL_COUNT_SIZE);
+	pContext->flush(true);
+	const uint32_t* counts = reinterpret_cast<const uint32_t*>(pCountReadback->map(Buffer::MapType::Read));
+	const uint32_t surfelCount = counts[SURFEL_COUNT_INDEX];
+	const uint32_t freeSurfelCount = counts[SURFEL_FREE_COUNT_INDEX];
+	const uint32_t indexCount = counts[SURFEL_INDEX_COUNT_INDEX];
+	pCountReadback->unmap();
+
+	// Only the entries the lists use are stored, the rest of the buffer is slack for the next frames
+	const StructuredBuffer::SharedPtr& pIndices = m_SurfelIndices[m_CurrentSurfelIndicesBuffer];
+	const SurfelCache::Header header = SurfelCache::CreateHeader(surfelCount, freeSurfelCount, std::min(indexCount, uint32_t(pIndices->getElementCount())));
+
+	// A single staging buffer laid out like the file after the header, every section comes back with one wait
+	Buffer* sources[SurfelCache::kSectionCount] =
+	{
+		m_SurfelGeometry.get(),
+		m_SurfelIrradiance.get(),
+		m_SurfelEstimator.get(),
+		m_SurfelState.get(),
+		m_FreeSurfelIndices.get(),
+		m_WorldStructure.get(),
+		m_WorldStructureKeys.get(),
+		pIndices.get(),
+	};
+	const uint64_t payloadOffset = header.SectionOffsets[0];
+	auto pReadback = Buffer::create(size_t(SurfelCache::GetFileSize(header) - payloadOffset), Resource::BindFlags::None, Buffer::CpuAccess::Read);
+	for (uint32_t section = 0; section < SurfelCache::kSectionCount; ++section)
+	{
+		if (header.SectionSizes[section] > 0)
+		{
+			pContext->copyBufferRegion(pReadback.get(), header.SectionOffsets[section] - payloadOffset, sources[section], 0, header.SectionSizes[section]);
+		}
+	}
+	pContext->flush(true);
+
+	const uint8_t* pPayload = reinterpret_cast<const uint8_t*>(pReadback->map(Buffer::MapType::Read));
+	const void* sectionData[SurfelCache::kSectionCount];
+	for (uint32_t section = 0; section < SurfelCache::kSectionCount; ++section)
+	{
+		sectionData[section] = pPayload + (header.SectionOffsets[section] - payloadOffset);
+	}
+	if (SurfelCache::Write(m_SurfelCachePath, header, sectionData))
+	{
+		logInfo("Saved " + std::to_string(surfelCount) + " surfels to " + m_SurfelCachePath);
+	}
+	pReadback->unmap();
+}
+
+void GlobalIllumination::ScheduleSurfelRays(RenderContext* pContext)
+{
+	// Every alive surfel gets a weight, the scanned weights turn the ray index into a surfel index
+	// so the ray tracing pass can be dispatched with a fixed budget instead of one ray per surfel.
+	const uint32_t scanSize = GetSurfelScanSize();
+
+	m_ComputeState->setProgram(m_ScheduleSurfelRays);
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_ScheduleSurfelRaysVars);
+	pContext->dispatch(scanSize / 64, 1, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+
+	m_Primitives.ExclusiveScan(pContext, m_SurfelRayWeights, m_ScannedSurfelRayWeights, scanSize);
+}
+
+void GlobalIllumination::CompactSurfels(RenderContext* pContext)
+{
+	// Needs the world structure without evicted surfels, so it runs between UpdateWorldStructure and SpawnSurfels.
+	// A rebuild runs after SpawnSurfels and lists the surfels at their new indices, there is nothing to patch then.
+	const uint32_t scanSize = GetSurfelScanSize();
+	m_CompactSurfelsVars->setStructuredBuffer("gIndices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
+
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_CompactSurfelsVars);
+	m_ComputeState->setProgram(m_MarkAliveSurfels);
+	pContext->dispatch(scanSize / 64, 1, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+
+	m_Primitives.ExclusiveScan(pContext, m_SurfelAlive, m_ScannedSurfelAlive, scanSize);
+
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_CompactSurfelsVars);
+
+	m_ComputeState->setProgram(m_FindSurfelHoles);
+	pContext->dispatch((m_MaxSurfels + 63) / 64, 1, 1);
+
+	m_ComputeState->setProgram(m_MoveSurfels);
+	pContext->dispatch((m_MaxSurfels + 63) / 64, 1, 1);
+
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		m_ComputeState->setProgram(m_RemapSurfelIndices);
+		pContext->dispatch((m_SurfelIndices[m_CurrentSurfelIndicesBuffer]->getElementCount() + 63) / 64, 1, 1);
+	}
+
+	m_ComputeState->setProgram(m_FinishCompaction);
+	pContext->dispatch(1, 1, 1);
+
+	pContext->popComputeVars();
+	pContext->popComputeState();
+}
+
+void GlobalIllumination::CreateDefragmentBuffers()
+{
+	// Sized for one window, the sort keeps its own scratch in ParallelPrimitives
+	const uint32_t windowSize = uint32_t(std::max(std::min(m_DefragmentWindow, m_MaxSurfels), 1));
+	m_DefragmentKeys = StructuredBuffer::create(m_GetDefragmentKeys, "gKeys", windowSize);
+	m_DefragmentValues = StructuredBuffer::create(m_GetDefragmentKeys, "gValues", windowSize);
+	m_DefragmentRemap = StructuredBuffer::create(m_GetDefragmentKeys, "gRemap", windowSize);
+	m_DefragmentGeometry = StructuredBuffer::create(m_GetDefragmentKeys, "gScratchGeometry", windowSize);
+	m_DefragmentIrradiance = StructuredBuffer::create(m_GetDefragmentKeys, "gScratchIrradiance", windowSize);
+	m_DefragmentEstimator = StructuredBuffer::create(m_GetDefragmentKeys, "gScratchEstimator", windowSize);
+	m_DefragmentState = StructuredBuffer::create(m_GetDefragmentKeys, "gScratchState", windowSize);
+	m_DefragmentReservoirs = StructuredBuffer::create(m_GetDefragmentKeys, "gScratchReservoirs", windowSize);
+	m_DefragmentSurfelsVars->setStructuredBuffer("gKeys", m_DefragmentKeys);
+	m_DefragmentSurfelsVars->setStructuredBuffer("gValues", m_DefragmentValues);
+	m_DefragmentSurfelsVars->setStructuredBuffer("gRemap", m_DefragmentRemap);
+	m_DefragmentSurfelsVars->setStructuredBuffer("gScratchGeometry", m_DefragmentGeometry);
+	m_DefragmentSurfelsVars->setStructuredBuffer("gScratchIrradiance", m_DefragmentIrradiance);
+	m_DefragmentSurfelsVars->setStructuredBuffer("gScratchEstimator", m_DefragmentEstimator);
+	m_DefragmentSurfelsVars->setStructuredBuffer("gScratchState", m_DefragmentState);
+	m_DefragmentSurfelsVars->setStructuredBuffer("gScratchReservoirs", m_DefragmentReservoirs);
+	m_DefragmentCursor = 0;
+}
+
+void GlobalIllumination::DefragmentSurfels(RenderContext* pContext)
+{
+	PROFILE("defragmentSurfels");
+
+	// Runs where the compaction does, the lists hold no evicted surfels. The window is placed from the lagged surfel count,
+	// slots it reaches past the current count are left where they are.
+	const uint32_t windowSize = m_DefragmentKeys->getElementCount();
+	const uint32_t surfelCount = m_LaggedSurfelCount;
+	const uint32_t windowStart = m_DefragmentCursor < surfelCount ? m_DefragmentCursor : 0;
+	const uint32_t windowCount = std::min(windowSize, surfelCount - windowStart);
+	m_DefragmentCursor = windowStart + windowCount >= surfelCount ? 0 : windowStart + std::max(windowSize / 2, 1u);
+	if (windowCount <= 1)
+		return;
+
+	m_DefragmentSurfelsVars["DefragmentState"]["windowStart"] = windowStart;
+	m_DefragmentSurfelsVars["DefragmentState"]["windowCount"] = windowCount;
+	m_DefragmentSurfelsVars->setStructuredBuffer("gIndices", m_SurfelIndices[m_CurrentSurfelIndicesBuffer]);
+	const uint32_t groupCount = (windowCount + 63) / 64;
+
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_DefragmentSurfelsVars);
+	m_ComputeState->setProgram(m_GetDefragmentKeys);
+	pContext->dispatch(groupCount, 1, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+
+	m_Primitives.RadixSort(pContext, m_DefragmentKeys, m_DefragmentValues, windowCount, SURFEL_MORTON_KEY_BITS);
+
+	// The remap passes only cover the list entries and free indices in use, read on the GPU and not from the lagged counts
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_PrepareRemapDispatchVars);
+	m_ComputeState->setProgram(m_PrepareRemapDispatch);
+	pContext->dispatch(1, 1, 1);
+	pContext->popComputeVars();
+
+	pContext->pushComputeVars(m_DefragmentSurfelsVars);
+	m_ComputeState->setProgram(m_MoveDefragmentedSurfels);
+	pContext->dispatch(groupCount, 1, 1);
+
+	// A rebuild lists the moved surfels at their new indices later this frame
+	if (m_WorldStructureBuildMode == WorldStructureBuildMode::Incremental)
+	{
+		m_ComputeState->setProgram(m_RemapDefragmentedIndices);
+		pContext->dispatchIndirect(m_RemapDispatchArgs.get(), 0);
+	}
+
+	m_ComputeState->setProgram(m_RemapDefragmentedFreeIndices);
+	pContext->dispatchIndirect(m_RemapDispatchArgs.get(), sizeof(uint32_t) * 3);
 
 	pContext->popComputeVars();
 	pContext->popComputeState();
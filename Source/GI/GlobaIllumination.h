@@ -3,11 +3,29 @@
 #include <Falcor.h>
 #include <FalcorExperimental.h>
 
+#include "Data/HostDeviceSurfelsData.h"
+#include "GIStatistics.h"
+#include "ParallelPrimitives.h"
+
 using namespace Falcor;
 
 class GlobalIllumination
 {
 public:
+	enum class WorldStructureBuildMode : uint32_t
+	{
+		Incremental = 0, // Splices spawned surfels into and evicted ones out of last frame's lists
+		Rebuild = 1,     // Counting sort of every alive surfel by cell each frame
+	};
+
+	// Size of the GI targets relative to the G-buffer, the values are the shift applied to it
+	enum class GIResolution : uint32_t
+	{
+		Full = 0,
+		Half = 1,
+		Quarter = 2,
+	};
+
 	void Initilize(const uvec2& giMapSize);
 	void RenderUI(Gui* pGui);
 
@@ -17,29 +35,97 @@ public:
 		const Camera* pCamera,
 		const Texture::SharedPtr& pDepthTexture,
 		const Texture::SharedPtr& pNormalTexture,
-		const Texture::SharedPtr& pAlbedoTexture);
+		const Texture::SharedPtr& pAlbedoTexture,
+		const Texture::SharedPtr& pMotionTexture);
+
+	// Per scene surfel cache. While enabled a scene starts from the surfels stored at path
+	// and SaveSurfelCache writes them back when it is unloaded.
+	void LoadSurfelCache(const std::string& path);
+	void SaveSurfelCache(RenderContext* pContext);
+
+	// Counters of the frame kSurfelCountReadbackLatency frames back. The cell and candidate counters stay zero
+	// while their collection is turned off.
+	const GIFrameStatistics& GetStatistics() const { return m_LaggedStatistics; }
+	// While recording every frame read back is appended to the log
+	void SetRecordStatistics(bool recordStatistics) { m_RecordStatistics = recordStatistics; }
+	const GIStatisticsLog& GetStatisticsLog() const { return m_StatisticsLog; }
 
 	Texture::SharedPtr GetSurfelCoverageTexture() { return m_Coverage; }
 	Texture::SharedPtr GetIrradianceTexture() { return m_Irradiance; }
 	Texture::SharedPtr GetDebugTexture() { return m_DebugTexture; }
 private:
 	void ResetGI();
+	void CreateSurfelScratchBuffers();
+	void GrowSurfelStorage(RenderContext* pContext);
+	void CreateResolutionTargets();
 
-	void ExclusiveScan(RenderContext* pContext);
+	void UpdateInvalidationBoxes(const Scene::SharedPtr& pScene);
+	void UpdateLightAliasTable(const Scene::SharedPtr& pScene);
+	void EvictSurfels(RenderContext* pContext);
+	void UpdateWorldStructure(RenderContext* pContext);
+	void RebuildWorldStructure(RenderContext* pContext);
+	void GrowSurfelIndices(RenderContext* pContext, uint32_t requiredCount);
+	void CompactSurfels(RenderContext* pContext);
+	void CreateDefragmentBuffers();
+	void DefragmentSurfels(RenderContext* pContext);
+	uint32_t GetSurfelScanSize() const;
+	StructuredBuffer::SharedPtr CreateSurfelsBuffer(const std::string& name, uint32_t elementCount);
+	void ScheduleSurfelRays(RenderContext* pContext);
+	void ReadbackSurfelCounts(RenderContext* pContext);
+	void BinSurfels(RenderContext* pContext);
+	void CollectStatistics(RenderContext* pContext);
+	void ResolveGI(RenderContext* pContext, const Texture::SharedPtr& pMotionTexture);
+	uint64_t GetGITargetsSize() const;
+	bool ReadSurfelCache();
+	void WriteSurfelCache(RenderContext* pContext);
 
 	// Data Structures
-	StructuredBuffer::SharedPtr m_Surfels;
+	StructuredBuffer::SharedPtr m_SurfelGeometry;
+	StructuredBuffer::SharedPtr m_SurfelIrradiance;
+	StructuredBuffer::SharedPtr m_SurfelEstimator;
+	StructuredBuffer::SharedPtr m_SurfelState;
 	StructuredBuffer::SharedPtr m_SurfelCount;
+	StructuredBuffer::SharedPtr m_FreeSurfelIndices;
 	int32_t m_MaxSurfels;
 
 	// Outputs
 	Texture::SharedPtr m_GIMap;
+	uvec2 m_GIMapSize;
+	GIResolution m_Resolution = GIResolution::Half;
+
+	// Reduced Resolution Resolve
+	ComputeProgram::SharedPtr m_TemporalAccumulate;
+	ComputeVars::SharedPtr m_TemporalAccumulateVars;
+	ComputeProgram::SharedPtr m_UpsampleGI;
+	ComputeVars::SharedPtr m_UpsampleGIVars;
+	Texture::SharedPtr m_IrradianceHistory[2];
+	Texture::SharedPtr m_HistoryGeometry[2];
+	uint32_t m_CurrentHistory = 0;
+	bool m_ClearHistory = true;
+	int32_t m_MaxHistoryLength = 8;
+
+	// Edge-aware a-trous denoiser over the resolved history, guided by the G-buffer normal and distance and the surfel variance
+	ComputeProgram::SharedPtr m_DenoiseGI;
+	ComputeVars::SharedPtr m_DenoiseGIVars;
+	Texture::SharedPtr m_DenoiseTargets[2];
+	int32_t m_DenoiseIterations = 0;
+	float m_DenoiseVarianceSigma = 0.5f;
+	float m_DenoiseNormalPower = 64.0f;
+	float m_DenoiseDistanceSigma = 0.05f;
 
 	// Debug Visualization
 	ComputeProgram::SharedPtr m_SurfelRendering;
 	ComputeVars::SharedPtr m_SurfelRenderingVars;
 	bool m_VisualizeSurfels = false;
 
+	// Screen Tile Binning
+	ComputeProgram::SharedPtr m_BinSurfels;
+	ComputeVars::SharedPtr m_BinSurfelsVars;
+	StructuredBuffer::SharedPtr m_TileSurfels;
+	StructuredBuffer::SharedPtr m_TileSurfelCounts;
+	uvec2 m_TileCount;
+	bool m_BinSurfelsPerTile = true;
+
 	// Utility objects
 	ComputeState::SharedPtr m_ComputeState;
 	ParameterBlock::SharedPtr m_CommonData;
@@ -49,28 +135,124 @@ private:
 	ComputeVars::SharedPtr m_SurfelCoverageVars;
 	ComputeProgram::SharedPtr m_UpdateWorldStructure;
 	ComputeVars::SharedPtr m_UpdateWorldStructureVars;
+	ComputeProgram::SharedPtr m_ClearCellCounts;
+	ComputeProgram::SharedPtr m_CountSurfelCells;
+	ComputeProgram::SharedPtr m_BeginScatter;
+	ComputeProgram::SharedPtr m_ScatterSurfelIndices;
+	ComputeProgram::SharedPtr m_CapCellLists;
+	ComputeVars::SharedPtr m_RebuildWorldStructureVars;
+	WorldStructureBuildMode m_WorldStructureBuildMode = WorldStructureBuildMode::Incremental;
 	ComputeProgram::SharedPtr m_SpawnSurfel;
 	ComputeVars::SharedPtr m_SpawnSurfelVars;
+	ComputeProgram::SharedPtr m_PrepareSpawnSurfel;
+	ComputeVars::SharedPtr m_PrepareSpawnSurfelVars;
 	float m_SpawnChance = 1.0f;
-	bool m_UpdateTime = true;
+	float m_SurfelLodPixelRadius = SURFEL_DEFAULT_LOD_PIXEL_RADIUS;
+	int32_t m_SurfelCellCapacity = SURFEL_DEFAULT_CELL_CAPACITY;
+	uint32_t m_SurfelCellOverflow = SURFEL_CELL_OVERFLOW_REFUSE;
 
 	// Resources
 	Texture::SharedPtr m_Coverage;
 	StructuredBuffer::SharedPtr m_SurfelSpawnCoords;
 	StructuredBuffer::SharedPtr m_NewSurfelCounts;
+	StructuredBuffer::SharedPtr m_ReservedSurfelCount;
 	Buffer::SharedPtr m_NewSurfelCountBuffer;
 	StructuredBuffer::SharedPtr m_WorldStructure;
+	StructuredBuffer::SharedPtr m_WorldStructureKeys;
 	StructuredBuffer::SharedPtr m_SurfelIndices[2];
 	uint32_t m_CurrentSurfelIndicesBuffer = 0;
+	// Set when the index buffers grew past lists that had run over their end, the next frame lists every surfel again
+	bool m_RelistSurfels = false;
+	// Camera cell of the finest clipmap level, every coarser window only scrolls together with it
+	ivec3 m_ClipmapCameraCell = ivec3(0);
+	Buffer::SharedPtr m_SpawnCounts;
+
+	// Surfel counts reach the CPU through a ring of readback buffers so statistics never stall on the GPU
+	static const uint32_t kSurfelCountReadbackLatency = 4;
+	Buffer::SharedPtr m_SurfelCountReadback[kSurfelCountReadbackLatency];
+	uint32_t m_SurfelCountReadbackFrame = 0;
+	uint32_t m_LaggedSurfelCount = 0;
+	uint32_t m_LaggedFreeSurfelCount = 0;
+	uint32_t m_LaggedIndexCount = 0;
+	uint64_t m_FrameIndex = 0;
 	Texture::SharedPtr m_Irradiance;
 
+	// Statistics
+	ComputeProgram::SharedPtr m_CollectCellStatistics;
+	ComputeProgram::SharedPtr m_CollectCandidateStatistics;
+	ComputeVars::SharedPtr m_CollectStatisticsVars;
+	StructuredBuffer::SharedPtr m_Statistics;
+	GIFrameStatistics m_LaggedStatistics;
+	GIStatisticsLog m_StatisticsLog;
+	bool m_CollectStatistics = true;
+	bool m_RecordStatistics = false;
+	std::string m_StatisticsPath = "GIStatistics"; // Dumps add the extension of their format
+
+	// Surfels Recycling
+	ComputeProgram::SharedPtr m_SelectEvictedSurfels;
+	ComputeProgram::SharedPtr m_EvictSurfels;
+	ComputeProgram::SharedPtr m_CountEvictedSurfels;
+	ComputeVars::SharedPtr m_EvictSurfelsVars;
+	StructuredBuffer::SharedPtr m_SurfelEvicted; // Decisions of SelectEvictedSurfels, applied by EvictSurfels
+	StructuredBuffer::SharedPtr m_SurfelCountDeltas;
+	int32_t m_MaxUnseenFrames = 300;
+	int32_t m_MaxSurfelAge = 0;
+	float m_MaxSurfelCoverage = 6.0f;
+
+	// Bounds of every model instance last frame, an instance whose bounds change or whose model animates invalidates
+	// the surfels around where it was and where it is now
+	StructuredBuffer::SharedPtr m_InvalidationBoxes;
+	Scene::SharedPtr m_InvalidationScene;
+	std::vector<BoundingBox> m_InstanceBounds;
+	uint32_t m_InvalidationBoxCount = 0;
+	bool m_InvalidateMovedInstances = true;
+
+	// Shadow rays from surfel ray hits pick their light from the alias table, rebuilt when the light weights change
+	StructuredBuffer::SharedPtr m_LightAliasTable;
+	std::vector<float> m_LightWeights;
+	bool m_SampleLightsByPower = true;
+
+	ComputeProgram::SharedPtr m_MarkAliveSurfels;
+	ComputeProgram::SharedPtr m_FindSurfelHoles;
+	ComputeProgram::SharedPtr m_MoveSurfels;
+	ComputeProgram::SharedPtr m_RemapSurfelIndices;
+	ComputeProgram::SharedPtr m_FinishCompaction;
+	ComputeVars::SharedPtr m_CompactSurfelsVars;
+	StructuredBuffer::SharedPtr m_SurfelAlive;
+	StructuredBuffer::SharedPtr m_ScannedSurfelAlive;
+	StructuredBuffer::SharedPtr m_SurfelRemap;
+	int32_t m_CompactionInterval = 64;
+	uint32_t m_FramesSinceCompaction = 0;
+
+	// Morton order defragmentation, one window of the surfel arrays per frame
+	ComputeProgram::SharedPtr m_GetDefragmentKeys;
+	ComputeProgram::SharedPtr m_MoveDefragmentedSurfels;
+	ComputeProgram::SharedPtr m_RemapDefragmentedIndices;
+	ComputeProgram::SharedPtr m_RemapDefragmentedFreeIndices;
+	ComputeVars::SharedPtr m_DefragmentSurfelsVars;
+	// Separate vars like the spawn dispatch, the arguments can not stay bound for writing while the remap passes read them
+	ComputeProgram::SharedPtr m_PrepareRemapDispatch;
+	ComputeVars::SharedPtr m_PrepareRemapDispatchVars;
+	Buffer::SharedPtr m_RemapDispatchArgs;
+	StructuredBuffer::SharedPtr m_DefragmentKeys;
+	StructuredBuffer::SharedPtr m_DefragmentValues;
+	StructuredBuffer::SharedPtr m_DefragmentRemap;
+	StructuredBuffer::SharedPtr m_DefragmentGeometry;
+	StructuredBuffer::SharedPtr m_DefragmentIrradiance;
+	StructuredBuffer::SharedPtr m_DefragmentEstimator;
+	StructuredBuffer::SharedPtr m_DefragmentState;
+	StructuredBuffer::SharedPtr m_DefragmentReservoirs;
+	int32_t m_DefragmentWindow = SURFEL_DEFAULT_DEFRAGMENT_WINDOW;
+	uint32_t m_DefragmentCursor = 0;
+
+	// Surfel Cache
+	std::string m_SurfelCachePath;
+	bool m_UseSurfelCache = true;
+	bool m_SaveSurfelCacheRequested = false;
+
 	// Exclusive Scan implementation
-	StructuredBuffer::SharedPtr m_ScannedNewSurfelCounts;
-	StructuredBuffer::SharedPtr m_ScanAuxiliaryBuffer[2];
-	ComputeProgram::SharedPtr m_ScanBlocks;
-	ComputeProgram::SharedPtr m_ScanSumOfBlocks;
-	ComputeProgram::SharedPtr m_AddSumToBlocks;
-	ComputeVars::SharedPtr m_ScanVars;
+	StructuredBuffer::SharedPtr m_ScannedSurfelCountDeltas;
+	ParallelPrimitives m_Primitives;
 
 	// RayTracing
 	RtProgram::SharedPtr m_SurfelAccumulateProgram;
@@ -78,13 +260,19 @@ private:
 	RtState::SharedPtr m_RTState;
 	RtScene::SharedPtr m_CachedScene;
 	int32_t m_SurfelAccumulateRayBudget;
+	ComputeProgram::SharedPtr m_ScheduleSurfelRays;
+	ComputeVars::SharedPtr m_ScheduleSurfelRaysVars;
+	StructuredBuffer::SharedPtr m_SurfelRayWeights;
+	StructuredBuffer::SharedPtr m_ScannedSurfelRayWeights;
+	// Accumulation rays go through the surfel reservoirs per the SURFEL_RESAMPLE_* mode. The ray generation shader
+	// merges neighbours from a copy taken before its dispatch, a surfel only writes its own reservoir.
+	StructuredBuffer::SharedPtr m_SurfelReservoirs;
+	StructuredBuffer::SharedPtr m_PreviousSurfelReservoirs;
+	uint32_t m_ResampleMode = SURFEL_DEFAULT_RESAMPLE_MODE;
 
 	// Rendering stuff
 	bool m_UseWeightFunctions = true;
 	bool m_ApplyGI = true;
 
 	Texture::SharedPtr m_DebugTexture;
-	GaussianBlur::UniquePtr m_Blur;
-	bool m_ApplyBlur = false;
-	Fbo::SharedPtr m_BlurFbo;
 };
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "LightSampling.h"
+
+#include <algorithm>
+#include <cmath>
+
+std::vector<LightAliasEntry> BuildLightAliasTable(const std::vector<float>& weights)
+{
+	const uint32_t lightCount = uint32_t(weights.size());
+	std::vector<LightAliasEntry> table(lightCount);
+	double totalWeight = 0.0;
+	for (float weight : weights)
+	{
+		totalWeight += std::isfinite(weight) && weight > 0.0f ? double(weight) : 0.0;
+	}
+
+	// Slots scaled so the average is 1. Slots below it are topped up by one above it, which becomes their alias.
+	std::vector<double> scaled(lightCount);
+	std::vector<uint32_t> small;
+	std::vector<uint32_t> large;
+	for (uint32_t i = 0; i < lightCount; ++i)
+	{
+		const double weight = totalWeight > 0.0 && std::isfinite(weights[i]) && weights[i] > 0.0f ? double(weights[i]) : 0.0;
+		const double pdf = totalWeight > 0.0 ? weight / totalWeight : 1.0 / double(lightCount);
+		table[i].Pdf = float(pdf);
+		table[i].Alias = i;
+		scaled[i] = pdf * double(lightCount);
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		const uint32_t lower = small.back();
+		small.pop_back();
+		const uint32_t upper = large.back();
+		table[lower].Probability = float(std::max(scaled[lower], 0.0));
+		table[lower].Alias = upper;
+
+		scaled[upper] -= 1.0 - scaled[lower];
+		if (scaled[upper] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(upper);
+		}
+	}
+
+	// What is left is 1 up to rounding and keeps its slot
+	for (uint32_t i : small)
+	{
+		table[i].Probability = 1.0f;
+	}
+	for (uint32_t i : large)
+	{
+		table[i].Probability = 1.0f;
+	}
+	return table;
+}
+
+float GetLightSamplingWeight(float power, const glm::vec3& intensity)
+{
+	if (std::isfinite(power) && power > 0.0f)
+		return power;
+
+	const float luminance = glm::dot(intensity, glm::vec3(0.299f, 0.587f, 0.114f));
+	return 4.0f * 3.14159265f * luminance;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <Falcor.h>
+
+#include "Data/HostDeviceSurfelsData.h"
+
+#include <vector>
+
+// Walker's alias table over the scene lights with Vose's construction, so a shadow ray picks a light with one random
+// number and two reads whatever the light count. Light i is picked with probability weights[i] / sum of the weights.
+// Negative and non finite weights count as 0, if no weight is left every light gets the same probability.
+std::vector<LightAliasEntry> BuildLightAliasTable(const std::vector<float>& weights);
+
+// Weight of a light in the alias table, its power when it has a finite one. Falcor's directional lights report no power,
+// they are weighted like a point light of their intensity, whose irradiance 1m away matches theirs on a surface facing them.
+float GetLightSamplingWeight(float power, const glm::vec3& intensity);
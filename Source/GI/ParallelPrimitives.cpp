@@ -0,0 +1,162 @@
+#include "ParallelPrimitives.h"
+
+namespace
+{
+	// Must match ParallelPrimitives.slang
+	const uint32_t SCAN_GROUP_SIZE = 512;
+	const uint32_t SCAN_TILE_SIZE = SCAN_GROUP_SIZE * 2;
+	const uint32_t GROUP_SIZE = 256;
+	const uint32_t RADIX_BITS = 4;
+	const uint32_t RADIX_DIGITS = 1 << RADIX_BITS;
+
+	// Groups loop over tiles, this only bounds how many run at once
+	const uint32_t MAX_GROUP_COUNT = 4096;
+
+	uint32_t DivideRoundUp(uint32_t value, uint32_t divisor)
+	{
+		return (value + divisor - 1) / divisor;
+	}
+}
+
+void ParallelPrimitives::Initilize()
+{
+	m_ClearTileState = ComputeProgram::createFromFile("ParallelPrimitives.slang", "ClearTileState");
+	m_ExclusiveScan = ComputeProgram::createFromFile("ParallelPrimitives.slang", "ExclusiveScan");
+	m_BeginReduce = ComputeProgram::createFromFile("ParallelPrimitives.slang", "BeginReduce");
+	m_Reduce = ComputeProgram::createFromFile("ParallelPrimitives.slang", "Reduce");
+	m_CompactScatter = ComputeProgram::createFromFile("ParallelPrimitives.slang", "CompactScatter");
+	m_RadixCount = ComputeProgram::createFromFile("ParallelPrimitives.slang", "RadixCount");
+	m_RadixScatter = ComputeProgram::createFromFile("ParallelPrimitives.slang", "RadixScatter");
+	m_Vars = ComputeVars::create(m_ExclusiveScan->getReflector());
+	m_ComputeState = ComputeState::create();
+
+	m_TileCounter = StructuredBuffer::create(m_ExclusiveScan, "gTileCounter", 1);
+	m_Vars->setStructuredBuffer("gTileCounter", m_TileCounter);
+}
+
+const StructuredBuffer::SharedPtr& ParallelPrimitives::GetScratch(StructuredBuffer::SharedPtr& pBuffer, uint32_t elementCount)
+{
+	elementCount = std::max(elementCount, 1u);
+	if (!pBuffer || pBuffer->getElementCount() < elementCount)
+	{
+		pBuffer = StructuredBuffer::create(m_ExclusiveScan, "gResult", elementCount);
+	}
+	return pBuffer;
+}
+
+void ParallelPrimitives::SetState(uint32_t elementCount, uint32_t tileCount, uint32_t groupCount)
+{
+	m_Vars["PrimitivesState"]["elementCount"] = elementCount;
+	m_Vars["PrimitivesState"]["tileCount"] = tileCount;
+	m_Vars["PrimitivesState"]["groupCount"] = groupCount;
+}
+
+void ParallelPrimitives::Dispatch(RenderContext* pContext, const ComputeProgram::SharedPtr& pProgram, uint32_t groupCount)
+{
+	m_ComputeState->setProgram(pProgram);
+	pContext->pushComputeState(m_ComputeState);
+	pContext->pushComputeVars(m_Vars);
+	pContext->dispatch(groupCount, 1, 1);
+	pContext->popComputeVars();
+	pContext->popComputeState();
+}
+
+void ParallelPrimitives::ExclusiveScan(RenderContext* pContext, const StructuredBuffer::SharedPtr& pInput, const StructuredBuffer::SharedPtr& pResult, uint32_t elementCount)
+{
+	if (elementCount == 0)
+		return;
+
+	const uint32_t tileCount = DivideRoundUp(elementCount, SCAN_TILE_SIZE);
+	m_Vars->setStructuredBuffer("gTileFlags", GetScratch(m_TileFlags, tileCount));
+	m_Vars->setStructuredBuffer("gTileAggregates", GetScratch(m_TileAggregates, tileCount));
+	m_Vars->setStructuredBuffer("gTilePrefixes", GetScratch(m_TilePrefixes, tileCount));
+	m_Vars->setStructuredBuffer("gInput", pInput);
+	m_Vars->setStructuredBuffer("gResult", pResult);
+
+	const uint32_t groupCount = std::min(tileCount, MAX_GROUP_COUNT);
+	SetState(elementCount, tileCount, groupCount);
+	Dispatch(pContext, m_ClearTileState, DivideRoundUp(tileCount, 64));
+	Dispatch(pContext, m_ExclusiveScan, groupCount);
+}
+
+void ParallelPrimitives::Reduce(RenderContext* pContext, const StructuredBuffer::SharedPtr& pInput, const StructuredBuffer::SharedPtr& pResult, uint32_t elementCount, ReduceOperation operation)
+{
+	const uint32_t groupCount = std::max(std::min(DivideRoundUp(elementCount, GROUP_SIZE), MAX_GROUP_COUNT), 1u);
+	m_Vars->setStructuredBuffer("gInput", pInput);
+	m_Vars->setStructuredBuffer("gResult", pResult);
+	m_Vars["PrimitivesState"]["operation"] = uint32_t(operation);
+	SetState(elementCount, 0, groupCount);
+
+	Dispatch(pContext, m_BeginReduce, 1);
+	if (elementCount > 0)
+	{
+		Dispatch(pContext, m_Reduce, groupCount);
+	}
+}
+
+void ParallelPrimitives::Compact(RenderContext* pContext, const StructuredBuffer::SharedPtr& pInput, const StructuredBuffer::SharedPtr& pFlags,
+	const StructuredBuffer::SharedPtr& pResult, const StructuredBuffer::SharedPtr& pCount, uint32_t elementCount)
+{
+	if (elementCount == 0)
+	{
+		uint32_t count = 0;
+		pCount->setBlob(&count, 0, sizeof(count));
+		return;
+	}
+
+	const StructuredBuffer::SharedPtr& pScannedFlags = GetScratch(m_ScannedFlags, elementCount);
+	ExclusiveScan(pContext, pFlags, pScannedFlags, elementCount);
+
+	const uint32_t groupCount = std::min(DivideRoundUp(elementCount, GROUP_SIZE), MAX_GROUP_COUNT);
+	m_Vars->setStructuredBuffer("gInput", pInput);
+	m_Vars->setStructuredBuffer("gFlags", pFlags);
+	m_Vars->setStructuredBuffer("gScanned", pScannedFlags);
+	m_Vars->setStructuredBuffer("gResult", pResult);
+	m_Vars->setStructuredBuffer("gCount", pCount);
+	SetState(elementCount, 0, groupCount);
+	Dispatch(pContext, m_CompactScatter, groupCount);
+}
+
+void ParallelPrimitives::RadixSort(RenderContext* pContext, const StructuredBuffer::SharedPtr& pKeys, const StructuredBuffer::SharedPtr& pValues, uint32_t elementCount, uint32_t keyBits)
+{
+	if (elementCount <= 1)
+		return;
+
+	const uint32_t tileCount = DivideRoundUp(elementCount, GROUP_SIZE);
+	const uint32_t histogramSize = RADIX_DIGITS * tileCount;
+	const uint32_t groupCount = std::min(tileCount, MAX_GROUP_COUNT);
+	const uint32_t passCount = DivideRoundUp(std::min(std::max(keyBits, 1u), 32u), RADIX_BITS);
+
+	const StructuredBuffer::SharedPtr& pHistograms = GetScratch(m_Histograms, histogramSize);
+	const StructuredBuffer::SharedPtr& pScannedHistograms = GetScratch(m_ScannedHistograms, histogramSize);
+	StructuredBuffer::SharedPtr keys[2] = { pKeys, GetScratch(m_SortKeys, elementCount) };
+	StructuredBuffer::SharedPtr values[2] = { pValues, GetScratch(m_SortValues, elementCount) };
+
+	for (uint32_t pass = 0; pass < passCount; ++pass)
+	{
+		const uint32_t source = pass % 2;
+		m_Vars["PrimitivesState"]["radixShift"] = pass * RADIX_BITS;
+
+		m_Vars->setStructuredBuffer("gInput", keys[source]);
+		m_Vars->setStructuredBuffer("gResult", pHistograms);
+		SetState(elementCount, tileCount, groupCount);
+		Dispatch(pContext, m_RadixCount, groupCount);
+
+		ExclusiveScan(pContext, pHistograms, pScannedHistograms, histogramSize);
+
+		m_Vars->setStructuredBuffer("gInput", keys[source]);
+		m_Vars->setStructuredBuffer("gValues", values[source]);
+		m_Vars->setStructuredBuffer("gScanned", pScannedHistograms);
+		m_Vars->setStructuredBuffer("gResult", keys[1 - source]);
+		m_Vars->setStructuredBuffer("gResultValues", values[1 - source]);
+		SetState(elementCount, tileCount, groupCount);
+		Dispatch(pContext, m_RadixScatter, groupCount);
+	}
+
+	// An odd pass count leaves the sorted data in the scratch buffers
+	if (passCount % 2 == 1)
+	{
+		pContext->copyBufferRegion(pKeys.get(), 0, keys[1].get(), 0, sizeof(uint32_t) * elementCount);
+		pContext->copyBufferRegion(pValues.get(), 0, values[1].get(), 0, sizeof(uint32_t) * elementCount);
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Falcor.h>
+
+using namespace Falcor;
+
+// GPU scan, stream compaction, reduction and radix sort over StructuredBuffer<uint> of any length.
+// Scratch buffers grow on demand and are kept between calls. ParallelPrimitivesCPU is the host twin.
+class ParallelPrimitives
+{
+public:
+	enum class ReduceOperation : uint32_t
+	{
+		Sum = 0,
+		Min = 1,
+		Max = 2,
+	};
+
+	void Initilize();
+
+	// Single pass exclusive scan with decoupled look-back, sums wrap modulo 2^32. pInput and pResult may not alias.
+	void ExclusiveScan(RenderContext* pContext, const StructuredBuffer::SharedPtr& pInput, const StructuredBuffer::SharedPtr& pResult, uint32_t elementCount);
+	// Writes the reduction of pInput to pResult[0]
+	void Reduce(RenderContext* pContext, const StructuredBuffer::SharedPtr& pInput, const StructuredBuffer::SharedPtr& pResult, uint32_t elementCount, ReduceOperation operation);
+	// Packs the elements flagged with 1 to the front of pResult keeping their order, their number goes to pCount[0]. Flags must be 0 or 1.
+	void Compact(RenderContext* pContext, const StructuredBuffer::SharedPtr& pInput, const StructuredBuffer::SharedPtr& pFlags,
+		const StructuredBuffer::SharedPtr& pResult, const StructuredBuffer::SharedPtr& pCount, uint32_t elementCount);
+	// Stable in place key-value sort on the lowest keyBits of the keys
+	void RadixSort(RenderContext* pContext, const StructuredBuffer::SharedPtr& pKeys, const StructuredBuffer::SharedPtr& pValues, uint32_t elementCount, uint32_t keyBits = 32);
+
+private:
+	void SetState(uint32_t elementCount, uint32_t tileCount, uint32_t groupCount);
+	void Dispatch(RenderContext* pContext, const ComputeProgram::SharedPtr& pProgram, uint32_t groupCount);
+	const StructuredBuffer::SharedPtr& GetScratch(StructuredBuffer::SharedPtr& pBuffer, uint32_t elementCount);
+
+	ComputeState::SharedPtr m_ComputeState;
+	ComputeVars::SharedPtr m_Vars;
+
+	ComputeProgram::SharedPtr m_ClearTileState;
+	ComputeProgram::SharedPtr m_ExclusiveScan;
+	ComputeProgram::SharedPtr m_BeginReduce;
+	ComputeProgram::SharedPtr m_Reduce;
+	ComputeProgram::SharedPtr m_CompactScatter;
+	ComputeProgram::SharedPtr m_RadixCount;
+	ComputeProgram::SharedPtr m_RadixScatter;
+
+	// Scan tile status
+	StructuredBuffer::SharedPtr m_TileCounter;
+	StructuredBuffer::SharedPtr m_TileFlags;
+	StructuredBuffer::SharedPtr m_TileAggregates;
+	StructuredBuffer::SharedPtr m_TilePrefixes;
+
+	StructuredBuffer::SharedPtr m_ScannedFlags;
+	StructuredBuffer::SharedPtr m_Histograms;
+	StructuredBuffer::SharedPtr m_ScannedHistograms;
+	StructuredBuffer::SharedPtr m_SortKeys;
+	StructuredBuffer::SharedPtr m_SortValues;
+};
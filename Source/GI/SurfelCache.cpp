@@ -0,0 +1,247 @@
+#include "SurfelCache.h"
+
+#include <Falcor.h>
+
+#include "Data/HostDeviceSurfelsData.h"
+
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace Falcor;
+
+namespace
+{
+	const uint32_t SURFEL_CACHE_MAGIC = 0x43465253; // "SRFC"
+
+	const uint64_t SectionElementSizes[SurfelCache::kSectionCount] =
+	{
+		sizeof(uint4),               // Geometry
+		sizeof(float4),              // Irradiance
+		sizeof(uint3),               // Estimator
+		sizeof(SurfelState),         // State
+		sizeof(uint32_t),            // FreeIndices
+		sizeof(WorldStructureChunk), // WorldStructure
+		sizeof(WorldCellKey),        // WorldStructureKeys
+		sizeof(uint32_t),            // Indices
+	};
+
+	uint32_t ComputeLayoutHash()
+	{
+		// Anything that changes what a stored cell or surfel means invalidates the file
+		const uint32_t values[] =
+		{
+			SURFEL_PACKED_SIZE,
+			uint32_t(SectionElementSizes[0]), uint32_t(SectionElementSizes[1]), uint32_t(SectionElementSizes[2]),
+			uint32_t(SectionElementSizes[3]), uint32_t(SectionElementSizes[5]),
+			SurfelAsUint(WORLD_STRUCTURE_CHUNK_SIZE),
+			SurfelAsUint(SURFEL_RADIUS_SCALE_LOG2_RANGE),
+			WORLD_STRUCTURE_LEVEL_COUNT,
+			uint32_t(WORLD_STRUCTURE_LEVEL_HALF_EXTENT),
+			WORLD_STRUCTURE_TOTAL_SIZE,
+			WORLD_STRUCTURE_MAX_PROBES,
+			WORLD_STRUCTURE_EMPTY_KEY,
+			WORLD_STRUCTURE_RETIRED_KEY,
+			WORLD_STRUCTURE_KEY_COORD_BITS,
+		};
+
+		// FNV-1a
+		uint32_t hash = 2166136261u;
+		for (uint32_t value : values)
+		{
+			for (uint32_t byte = 0; byte < 4; ++byte)
+			{
+				hash ^= (value >> (byte * 8)) & 0xFF;
+				hash *= 16777619u;
+			}
+		}
+		return hash;
+	}
+
+	uint64_t AlignSectionOffset(uint64_t offset)
+	{
+		return (offset + SurfelCache::kSectionAlignment - 1) & ~uint64_t(SurfelCache::kSectionAlignment - 1);
+	}
+}
+
+SurfelCache::Header SurfelCache::CreateHeader(uint32_t surfelCount, uint32_t freeSurfelCount, uint32_t indexCount)
+{
+	Header header = {};
+	header.Magic = SURFEL_CACHE_MAGIC;
+	header.Version = kVersion;
+	header.LayoutHash = ComputeLayoutHash();
+	header.SurfelCount = surfelCount;
+	header.FreeSurfelCount = freeSurfelCount;
+	header.IndexCount = indexCount;
+
+	const uint64_t elementCounts[kSectionCount] =
+	{
+		surfelCount, surfelCount, surfelCount, surfelCount,
+		freeSurfelCount,
+		WORLD_STRUCTURE_TOTAL_SIZE, WORLD_STRUCTURE_TOTAL_SIZE,
+		indexCount,
+	};
+
+	uint64_t offset = AlignSectionOffset(sizeof(Header));
+	for (uint32_t section = 0; section < kSectionCount; ++section)
+	{
+		header.SectionOffsets[section] = offset;
+		header.SectionSizes[section] = elementCounts[section] * SectionElementSizes[section];
+		offset = AlignSectionOffset(offset + header.SectionSizes[section]);
+	}
+	return header;
+}
+
+uint64_t SurfelCache::GetFileSize(const Header& header)
+{
+	return header.SectionOffsets[kSectionCount - 1] + header.SectionSizes[kSectionCount - 1];
+}
+
+bool SurfelCache::Write(const std::string& path, const Header& header, const void* const sectionData[kSectionCount])
+{
+	// Written next to the target and moved over it, a cache cut short by a crash is never picked up
+	const std::string tempPath = path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file)
+		{
+			logWarning("Can't write surfel cache " + path);
+			return false;
+		}
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		uint64_t offset = sizeof(header);
+		const std::vector<char> padding(kSectionAlignment, 0);
+		for (uint32_t section = 0; section < kSectionCount; ++section)
+		{
+			file.write(padding.data(), std::streamsize(header.SectionOffsets[section] - offset));
+			file.write(reinterpret_cast<const char*>(sectionData[section]), std::streamsize(header.SectionSizes[section]));
+			offset = header.SectionOffsets[section] + header.SectionSizes[section];
+		}
+
+		if (!file)
+		{
+			logWarning("Can't write surfel cache " + path);
+			return false;
+		}
+	}
+
+	std::remove(path.c_str());
+	return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+SurfelCache::UniquePtr SurfelCache::Open(const std::string& path)
+{
+	UniquePtr pCache(new SurfelCache());
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return nullptr;
+	}
+	pCache->m_File = file;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < LONGLONG(sizeof(Header)))
+	{
+		return nullptr;
+	}
+	pCache->m_Size = uint64_t(fileSize.QuadPart);
+
+	pCache->m_Mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!pCache->m_Mapping)
+	{
+		return nullptr;
+	}
+	pCache->m_Data = reinterpret_cast<const uint8_t*>(MapViewOfFile(pCache->m_Mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return nullptr;
+	}
+
+	struct stat fileStat;
+	if (fstat(file, &fileStat) != 0 || uint64_t(fileStat.st_size) < sizeof(Header))
+	{
+		close(file);
+		return nullptr;
+	}
+	pCache->m_Size = uint64_t(fileStat.st_size);
+
+	void* data = mmap(nullptr, pCache->m_Size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	pCache->m_Data = data != MAP_FAILED ? reinterpret_cast<const uint8_t*>(data) : nullptr;
+#endif
+	if (!pCache->m_Data)
+	{
+		return nullptr;
+	}
+
+	const Header& header = pCache->GetHeader();
+	if (header.Magic != SURFEL_CACHE_MAGIC || header.Version != kVersion || header.LayoutHash != ComputeLayoutHash())
+	{
+		logWarning("Ignoring surfel cache " + path + ", it was written by another version");
+		return nullptr;
+	}
+
+	// Sections have to sit exactly where a writer with these counts puts them
+	const Header expected = CreateHeader(header.SurfelCount, header.FreeSurfelCount, header.IndexCount);
+	for (uint32_t section = 0; section < kSectionCount; ++section)
+	{
+		if (header.SectionOffsets[section] != expected.SectionOffsets[section] || header.SectionSizes[section] != expected.SectionSizes[section])
+		{
+			logWarning("Ignoring surfel cache " + path + ", the section table is corrupt");
+			return nullptr;
+		}
+	}
+	if (header.FreeSurfelCount > header.SurfelCount)
+	{
+		logWarning("Ignoring surfel cache " + path + ", the surfel counts are inconsistent");
+		return nullptr;
+	}
+	if (GetFileSize(header) > pCache->m_Size)
+	{
+		logWarning("Ignoring surfel cache " + path + ", the file is truncated");
+		return nullptr;
+	}
+
+	return pCache;
+}
+
+SurfelCache::~SurfelCache()
+{
+#ifdef _WIN32
+	if (m_Data)
+	{
+		UnmapViewOfFile(m_Data);
+	}
+	if (m_Mapping)
+	{
+		CloseHandle(m_Mapping);
+	}
+	if (m_File)
+	{
+		CloseHandle(m_File);
+	}
+#else
+	if (m_Data)
+	{
+		munmap(const_cast<uint8_t*>(m_Data), m_Size);
+	}
+#endif
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Versioned snapshot of the surfel storage, the world structure and the estimator state of one scene.
+// Sections hold the raw contents of the Surfels.* buffers, so a mapped file is handed to the upload buffers as is.
+// GlobalIllumination and GlobalIlluminationCPU share the layout and read each other's files.
+class SurfelCache
+{
+public:
+	using UniquePtr = std::unique_ptr<SurfelCache>;
+
+	enum class Section : uint32_t
+	{
+		Geometry = 0,
+		Irradiance,
+		Estimator,
+		State,
+		FreeIndices,
+		WorldStructure,
+		WorldStructureKeys,
+		Indices,
+		Count
+	};
+	static const uint32_t kSectionCount = uint32_t(Section::Count);
+
+	// Bumped on any change to the file or section layouts, files with another version are ignored
+	static const uint32_t kVersion = 4;
+	static const uint32_t kSectionAlignment = 256;
+
+	struct Header
+	{
+		uint32_t Magic;
+		uint32_t Version;
+		uint32_t LayoutHash;      // Packed sizes and world structure constants the sections depend on
+		uint32_t SurfelCount;     // Surfels.Count[SURFEL_COUNT_INDEX]
+		uint32_t FreeSurfelCount; // Surfels.Count[SURFEL_FREE_COUNT_INDEX]
+		uint32_t IndexCount;      // Entries in the Indices section
+		uint64_t SectionOffsets[kSectionCount]; // From the start of the file
+		uint64_t SectionSizes[kSectionCount];
+	};
+
+	// Lays out the sections for the given counts, only the used part of every buffer is stored
+	static Header CreateHeader(uint32_t surfelCount, uint32_t freeSurfelCount, uint32_t indexCount);
+	static uint64_t GetFileSize(const Header& header);
+
+	// Writes the header and every section, sectionData[i] holds SectionSizes[i] bytes
+	static bool Write(const std::string& path, const Header& header, const void* const sectionData[kSectionCount]);
+	// Maps the file for reading. Returns nullptr if it is missing, truncated or was written with another layout.
+	static UniquePtr Open(const std::string& path);
+
+	~SurfelCache();
+	SurfelCache(const SurfelCache&) = delete;
+	SurfelCache& operator=(const SurfelCache&) = delete;
+
+	const Header& GetHeader() const { return *reinterpret_cast<const Header*>(m_Data); }
+	const void* GetSection(Section section) const { return m_Data + GetHeader().SectionOffsets[uint32_t(section)]; }
+	uint64_t GetSectionSize(Section section) const { return GetHeader().SectionSizes[uint32_t(section)]; }
+
+private:
+	SurfelCache() = default;
+
+	const uint8_t* m_Data = nullptr;
+	uint64_t m_Size = 0;
+#ifdef _WIN32
+	void* m_File = nullptr;
+	void* m_Mapping = nullptr;
+#endif
+};
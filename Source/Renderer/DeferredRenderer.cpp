@@ -2,6 +2,8 @@
 
 #include "pix3.h"
 
+#include "GI/CPU/GICPUBenchmark.h"
+
 void BeginMarker(RenderContext* renderContext, const char* name)
 {
 	PIXBeginEvent(renderContext->getLowLevelData()->getCommandList().GetInterfacePtr(), PIX_COLOR(255, 255, 255), name);
@@ -36,6 +38,17 @@ struct MarkerScope
 const std::string DeferredRenderer::skDefaultScene = "Arcade/Arcade.fscene";
 //const std::string DeferredRenderer::skDefaultScene = "G:/Development/Models/MorganMcGuire/CornellBox/falcor_scene.fscene";
 
+// Every scene keeps its surfels in a file next to it
+std::string GetSurfelCachePath(const std::string& filename)
+{
+	std::string fullPath;
+	if (!findFileInDataDirectories(filename, fullPath))
+	{
+		fullPath = filename;
+	}
+	return fullPath + ".surfelcache";
+}
+
 void DeferredRenderer::initDepthPass()
 {
 	mDepthPass.pProgram = GraphicsProgram::createFromFile("DepthPass.ps.slang", "", "main");
@@ -185,6 +198,10 @@ void DeferredRenderer::resetScene()
 
 void DeferredRenderer::loadModel(SampleCallbacks* pSample, const std::string& filename, bool showProgressBar)
 {
+	if (mpSceneRenderer)
+	{
+		mGI.SaveSurfelCache(pSample->getRenderContext());
+	}
 	Mesh::resetGlobalIdCounter();
 	resetScene();
 
@@ -199,10 +216,15 @@ void DeferredRenderer::loadModel(SampleCallbacks* pSample, const std::string& fi
 	RtScene::SharedPtr pScene = RtScene::createFromModel(pModel);
 
 	initScene(pSample, pScene);
+	mGI.LoadSurfelCache(GetSurfelCachePath(filename));
 }
 
 void DeferredRenderer::loadScene(SampleCallbacks* pSample, const std::string& filename, bool showProgressBar)
 {
+	if (mpSceneRenderer)
+	{
+		mGI.SaveSurfelCache(pSample->getRenderContext());
+	}
 	Mesh::resetGlobalIdCounter();
 	resetScene();
 
@@ -219,6 +241,7 @@ void DeferredRenderer::loadScene(SampleCallbacks* pSample, const std::string& fi
 		initScene(pSample, pScene);
 		applyCustomSceneVars(pScene.get(), filename);
 		applyCsSkinningMode();
+		mGI.LoadSurfelCache(GetSurfelCachePath(filename));
 	}
 }
 
@@ -271,6 +294,24 @@ void DeferredRenderer::onLoad(SampleCallbacks* pSample, RenderContext* pRenderCo
 	loadScene(pSample, skDefaultScene, true);
 }
 
+void DeferredRenderer::onShutdown(SampleCallbacks* pSample)
+{
+	if (mpSceneRenderer)
+	{
+		mGI.SaveSurfelCache(pSample->getRenderContext());
+	}
+	if (!mGIStatisticsPath.empty())
+	{
+		mGI.GetStatisticsLog().Write(mGIStatisticsPath);
+	}
+}
+
+void DeferredRenderer::SetGIStatisticsPath(const std::string& path)
+{
+	mGIStatisticsPath = path;
+	mGI.SetRecordStatistics(!path.empty());
+}
+
 void DeferredRenderer::renderSkyBox(RenderContext* pContext)
 {
 	if (mSkyBox.pEffect)
@@ -290,11 +331,7 @@ void DeferredRenderer::beginFrame(RenderContext* pContext, Fbo* pTargetFbo, uint
 	pContext->clearFbo(mpGBufferFbo.get(), glm::vec4(0.7f, 0.7f, 0.7f, 1.0f), 1, 0, FboAttachmentType::All);
 	pContext->clearFbo(mpPostProcessFbo.get(), glm::vec4(), 1, 0, FboAttachmentType::Color);
 
-	if (mAAMode == AAMode::TAA)
-	{
-		glm::vec2 targetResolution = glm::vec2(pTargetFbo->getWidth(), pTargetFbo->getHeight());
-		pContext->clearRtv(mpGBufferFbo->getColorTexture(3)->getRTV().get(), vec4(0));
-	}
+	pContext->clearRtv(mpGBufferFbo->getColorTexture(3)->getRTV().get(), vec4(0));
 }
 
 void DeferredRenderer::endFrame(RenderContext* pContext)
@@ -380,10 +417,10 @@ void DeferredRenderer::gBufferPass(RenderContext* pContext, Fbo* pTargetFbo)
 		mGBufferPass.pVars->setTexture("gVisibilityBuffer", mShadowPass.pVisibilityBuffer);
 	}
 
+	pCB["gRenderTargetDim"] = glm::vec2(pTargetFbo->getWidth(), pTargetFbo->getHeight());
 	if (mAAMode == AAMode::TAA)
 	{
 		pContext->clearFbo(mTAA.getActiveFbo().get(), vec4(0.0, 0.0, 0.0, 0.0), 1, 0, FboAttachmentType::Color);
-		pCB["gRenderTargetDim"] = glm::vec2(pTargetFbo->getWidth(), pTargetFbo->getHeight());
 	}
 
 	if(mControls[EnableTransparency].enabled)
@@ -467,7 +504,8 @@ void DeferredRenderer::runGI(RenderContext* pContext, double currentTime)
 			mpSceneRenderer->getScene()->getActiveCamera().get(),
 			mpGBufferFbo->getDepthStencilTexture(),
 			mpGBufferFbo->getColorTexture(2),
-			mpGBufferFbo->getColorTexture(0))
+			mpGBufferFbo->getColorTexture(0),
+			mpGBufferFbo->getColorTexture(3))
 	);
 }
 
@@ -752,7 +790,20 @@ int main(int argc, char** argv)
 
 	Falcor::ArgList args;
 	args.parseCommandLine(GetCommandLineA());
+
+	// Headless runs of the CPU surfel pipeline, no window or device is created. A failed check fails the process.
+	bool benchmarkPassed = false;
+	if (RunCommandLineBenchmark(args, benchmarkPassed))
+	{
+		return benchmarkPassed ? 0 : 1;
+	}
+
 	DeferredRenderer::UniquePtr pRenderer = std::make_unique<DeferredRenderer>(args.argExists("renderdoc"));
+	auto giStatisticsPath = args.getValues("gistats");
+	if (!giStatisticsPath.empty())
+	{
+		pRenderer->SetGIStatisticsPath(giStatisticsPath[0].asString());
+	}
 
 	SampleConfig config;
 	config.windowDesc.title = "Falcor Deferred Renderer";
@@ -15,6 +15,7 @@ public:
 	DeferredRenderer(bool loadRenderDoc);
 
 	void onLoad(SampleCallbacks* pSample, RenderContext* pRenderContext) override;
+	void onShutdown(SampleCallbacks* pSample) override;
 	void onFrameRender(SampleCallbacks* pSample, RenderContext* pRenderContext, const Fbo::SharedPtr& pTargetFbo) override;
 	void onResizeSwapChain(SampleCallbacks* pSample, uint32_t width, uint32_t height) override;
 	bool onKeyEvent(SampleCallbacks* pSample, const KeyboardEvent& keyEvent) override;
@@ -22,6 +23,9 @@ public:
 	void onGuiRender(SampleCallbacks* pSample, Gui* pGui) override;
 	void onDroppedFile(SampleCallbacks* pSample, const std::string& filename) override;
 
+	// Records the GI statistics of every frame and writes them to path on shutdown, JSON for a .json path and CSV otherwise
+	void SetGIStatisticsPath(const std::string& path);
+
 private:
 	Fbo::SharedPtr mpGBufferFbo;
 	Fbo::SharedPtr mpMainFbo;
@@ -231,6 +235,7 @@ private:
 
 	// GI
 	GlobalIllumination mGI;
+	std::string mGIStatisticsPath;
 
 	float ambientValue;
 };
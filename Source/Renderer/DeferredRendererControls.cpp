@@ -93,14 +93,16 @@ void DeferredRenderer::applyAaMode(SampleCallbacks* pSample)
 	fboDesc.setColorTarget(2, ResourceFormat::RGBA8Unorm);
 	fboDesc.setDepthStencilTarget(ResourceFormat::D32Float);
 
+	// Written in every mode, GI reprojects its history with them
+	mGBufferPass.pProgram->addDefine("_OUTPUT_MOTION_VECTORS");
+	fboDesc.setColorTarget(3, ResourceFormat::RG16Float);
+
 	// Release the TAA FBOs
 	mTAA.resetFbos();
 
 	if (mAAMode == AAMode::TAA)
 	{
 		mGBufferPass.pProgram->removeDefine("INTERPOLATION_MODE");
-		mGBufferPass.pProgram->addDefine("_OUTPUT_MOTION_VECTORS");
-		fboDesc.setColorTarget(3, ResourceFormat::RG16Float);
 
 		Fbo::Desc taaFboDesc;
 		taaFboDesc.setColorTarget(0, ResourceFormat::RGBA8UnormSrgb);
@@ -109,7 +111,6 @@ void DeferredRenderer::applyAaMode(SampleCallbacks* pSample)
 	}
 	else
 	{
-		mGBufferPass.pProgram->removeDefine("_OUTPUT_MOTION_VECTORS");
 		applyLightingProgramControl(SuperSampling);
 		fboDesc.setSampleCount(1);
 		// Disable jitter